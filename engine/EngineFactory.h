@@ -1,12 +1,24 @@
 #pragma once
 
+#include <map>
 #include <memory>
 #include <string>
 
 class ModelEngine;
+
+// 模型条目（config.json 的 models 列表；未配置时为内置的 llama / embedding / dummy）
+struct ModelSpec
+{
+    std::string name;
+    std::string type = "llama"; // llama / embedding / dummy
+    std::string path;           // GGUF 路径
+    bool preload = false;       // 启动时后台加载（DEFAULT_MODEL 总是预加载）
+    // 只对该模型生效的配置覆盖：键为环境变量名（如 LLAMA_N_CTX），未覆盖的仍读环境变量
+    std::map<std::string, std::string> options;
+};
+
 class EngineFactory {
 public:
-    static std::shared_ptr<ModelEngine> Create(const std::string &model_);
-
-    static void ClearCache();
-};
\ No newline at end of file
+    // 按条目构造新引擎（不缓存，加载失败返回空）；缓存与卸载由 ModelRegistry 负责
+    static std::shared_ptr<ModelEngine> Create(const ModelSpec &spec);
+};
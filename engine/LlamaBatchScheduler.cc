@@ -0,0 +1,739 @@
+#include "engine/LlamaBatchScheduler.h"
+#include "engine/LlamaCommon.h"
+#include "engine/LlamaSlotPool.h"
+#include "engine/LlamaPrefixCache.h"
+#include "engine/LlamaSampling.h"
+#include "engine/LlamaDetokenizer.h"
+#include "engine/LlamaContextShift.h"
+#include "engine/LlamaChatTemplate.h"
+#include "engine/LlamaThreadBudget.h"
+#include "engine/LlamaLoraCache.h"
+#include "engine/ModelContext.h"
+#include "serving/core/Session.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <glog/logging.h>
+
+namespace
+{
+void batch_add(llama_batch &batch, llama_token tok, llama_pos pos, llama_seq_id seq_id, bool logits)
+{
+    const int i = batch.n_tokens;
+    batch.token[i] = tok;
+    batch.pos[i] = pos;
+    batch.n_seq_id[i] = 1;
+    batch.seq_id[i][0] = seq_id;
+    batch.logits[i] = logits;
+    batch.n_tokens++;
+}
+} // namespace
+
+// 调度线程内的单个请求状态
+struct LlamaBatchScheduler::Sequence
+{
+    std::shared_ptr<ServingContext> ctx;
+    std::shared_ptr<ModelContext> mc; // 仅 pool 模式：session 的 slot 句柄
+    llama_seq_id seq_id = -1;
+    llama_sampler *sampler = nullptr;
+    llama_sampler *grammar = nullptr;
+    std::string sampler_key;
+    LlamaSamplerCache *samplers = nullptr; // 非空时 sampler 归还给缓存
+    std::unique_ptr<LlamaDetokenizer> detok;
+
+    std::vector<llama_token> prompt; // 待 prefill 的 token
+    size_t n_prompt_done = 0;        // prompt 中已 prefill 的 token 数（分块推进）
+    int n_past_start = 0;            // 本轮开始时的 KV 位置，prefill 未完成就结束时回滚到这里
+    std::vector<llama_token> cache_tokens; // 新序列的完整 prompt，prefill 后收录进前缀缓存
+    bool prefilled = false;
+    llama_token last = 0;            // 上一步采样出、待 decode 的 token
+
+    // LoRA adapter（租约由 ctx->lora_adapter 持有）；lora_key 为空表示基座模型
+    const LlamaLoraCache::Adapter *lora = nullptr;
+    float lora_scale = 1.0f;
+    std::string lora_key;
+    uint64_t last_step = 0;          // 最近一次进入 batch（或加入）时的 step，选组时优先最久没推进的
+
+    int n_past = 0;
+    int n_generated = 0;
+    int max_new_tokens = 512;
+
+    int i_batch = -1;                // 本 step 中用于采样的 logits 下标，-1 表示本 step 不采样
+    int n_batch_tokens = 0;          // 本 step 放进 batch 的 token 数
+    bool done = false;
+
+    ~Sequence()
+    {
+        if (grammar)
+            llama_sampler_free(grammar);
+        if (sampler && samplers)
+            samplers->Release(sampler_key, sampler);
+        else if (sampler)
+            llama_sampler_free(sampler);
+    }
+};
+
+LlamaBatchScheduler::LlamaBatchScheduler(llama_model *model, const Options &opt,
+                                         std::shared_ptr<LlamaSlotPool> pool,
+                                         std::shared_ptr<LlamaSamplerCache> samplers,
+                                         std::shared_ptr<const LlamaPieceTable> pieces,
+                                         std::shared_ptr<const LlamaChatTemplate> chat_tmpl)
+    : model_(model), opt_(opt), pool_(std::move(pool)), samplers_(std::move(samplers)), pieces_(std::move(pieces)),
+      chat_tmpl_(std::move(chat_tmpl))
+{
+    opt_.n_slots = std::max(1, opt_.n_slots);
+    if (opt_.prefill_chunk <= 0 || opt_.prefill_chunk > opt_.n_ctx_per_slot)
+        opt_.prefill_chunk = opt_.n_ctx_per_slot;
+}
+
+LlamaBatchScheduler::~LlamaBatchScheduler()
+{
+    stop_.store(true);
+    cv_.notify_all();
+    if (worker_.joinable())
+        worker_.join();
+
+    if (lctx_ && !pool_)
+        llama_free(lctx_);
+}
+
+bool LlamaBatchScheduler::Start()
+{
+    if (!pieces_)
+        pieces_ = std::make_shared<LlamaPieceTable>(llama_model_get_vocab(model_));
+    if (!chat_tmpl_)
+        chat_tmpl_ = std::make_shared<LlamaChatTemplate>(model_);
+
+    if (pool_)
+    {
+        lctx_ = pool_->context(0);
+        opt_.n_slots = pool_->n_slots_total();
+        opt_.n_ctx_per_slot = pool_->n_ctx_per_seq();
+        opt_.prefill_chunk = std::min(opt_.prefill_chunk, opt_.n_ctx_per_slot);
+        llama_set_abort_callback(lctx_, &LlamaBatchScheduler::AbortCallback, this);
+        worker_ = std::thread([this]
+                              { Loop(); });
+        LOG(INFO) << "[batch] scheduler started on shared kv pool, slots=" << opt_.n_slots;
+        return true;
+    }
+
+    llama_context_params cparams = llama_context_default_params();
+    // 非 unified KV 下 n_ctx 会按 n_seq_max 均分给每个序列
+    cparams.n_ctx = opt_.n_ctx_per_slot * opt_.n_slots;
+    cparams.n_seq_max = opt_.n_slots;
+    // 保证一个 prefill 块 + 所有序列的 decode token 能放进同一个 batch
+    cparams.n_batch = opt_.prefill_chunk + opt_.n_slots;
+    cparams.n_threads = opt_.n_threads;
+    cparams.n_threads_batch = opt_.n_threads_batch;
+    cparams.type_k = opt_.type_k;
+    cparams.type_v = opt_.type_v;
+    cparams.abort_callback = &LlamaBatchScheduler::AbortCallback;
+    cparams.abort_callback_data = this;
+
+    lctx_ = llama_init_from_model(model_, cparams);
+    if (!lctx_)
+        return false;
+
+    free_slots_.clear();
+    for (int i = opt_.n_slots - 1; i >= 0; --i)
+        free_slots_.push_back(i);
+
+    worker_ = std::thread([this]
+                          { Loop(); });
+
+    LOG(INFO) << "[batch] scheduler started slots=" << opt_.n_slots
+              << " n_ctx_per_slot=" << opt_.n_ctx_per_slot
+              << " prefill_chunk=" << opt_.prefill_chunk;
+    return true;
+}
+
+bool LlamaBatchScheduler::Submit(std::shared_ptr<ServingContext> ctx)
+{
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (pending_.size() >= std::max<size_t>(1, opt_.max_pending))
+            return false;
+        pending_.push_back({std::move(ctx), std::chrono::steady_clock::now()});
+    }
+    cv_.notify_one();
+    return true;
+}
+
+bool LlamaBatchScheduler::AcquireSlot(Sequence &seq)
+{
+    if (!pool_)
+    {
+        if (free_slots_.empty())
+            return false;
+        seq.seq_id = free_slots_.back();
+        free_slots_.pop_back();
+        return true;
+    }
+
+    auto &session = seq.ctx->session;
+    if (!session)
+        return false;
+
+    std::shared_ptr<ModelContext> mc;
+    {
+        std::lock_guard<std::mutex> lk(session->mu);
+        if (!session->kv_bytes)
+            session->kv_bytes = session_kv_bytes;
+        // 模型曾被卸载：旧句柄已 Detach，换新的并按 history 重放
+        if (!session->model_ctx || session->model_ctx->detached)
+        {
+            const bool replay = session->model_ctx != nullptr;
+            session->model_ctx = pool_->NewHandle();
+            session->model_ctx->need_replay = replay;
+        }
+        mc = session->model_ctx;
+    }
+
+    // 同 session 已有请求在 batch 里 / 暂无可用 slot：留在队列，下个 step 再试
+    if (!pool_->Checkout(*mc))
+        return false;
+
+    bool shifted = false;
+    if (mc->n_past > opt_.n_ctx_per_slot - opt_.kv_reset_margin && opt_.shift_keep_tokens > 0)
+    {
+        std::lock_guard<std::mutex> lk(session->mu);
+        shifted = ContextShift(*mc, *session, opt_.shift_keep_tokens);
+    }
+    if (!shifted && mc->n_past > opt_.n_ctx_per_slot - opt_.kv_reset_margin)
+    {
+        llama_memory_seq_rm(llama_get_memory(lctx_), mc->seq_id, -1, -1);
+        mc->n_past = 0;
+        mc->need_replay = false;
+    }
+    // 编辑 / 重新生成：这条路径不记录 KV 中的 token，按完整对话重写（开头部分仍可命中前缀缓存）
+    if (seq.ctx->kv_rewind && mc->n_past > 0)
+    {
+        llama_memory_seq_rm(llama_get_memory(lctx_), mc->seq_id, -1, -1);
+        mc->n_past = 0;
+        mc->need_replay = true;
+    }
+    // KV 由另一个 adapter（或基座模型）写入：同样按完整对话重写
+    if (mc->lora_key != seq.lora_key && mc->n_past > 0)
+    {
+        llama_memory_seq_rm(llama_get_memory(lctx_), mc->seq_id, -1, -1);
+        mc->n_past = 0;
+        mc->need_replay = true;
+    }
+    mc->lora_key = seq.lora_key;
+
+    seq.mc = mc;
+    seq.seq_id = mc->seq_id;
+    seq.n_past = mc->n_past;
+    seq.n_past_start = mc->n_past;
+    return true;
+}
+
+bool LlamaBatchScheduler::PrepareSequence(Sequence &seq)
+{
+    auto &ctx = seq.ctx;
+    const llama_vocab *vocab = llama_model_get_vocab(model_);
+
+    // 临时 seq：prefill 完整对话（history + 本轮 messages）
+    // pool 模式：KV 跨轮保留，只 prefill 增量；slot 被回收过则重放完整对话
+    const bool full_prompt = !seq.mc || seq.mc->need_replay;
+
+    std::string prompt;
+    if (ctx->is_chat)
+    {
+        size_t n_history = 0;
+        std::vector<Message> history;
+        if (ctx->session)
+        {
+            std::lock_guard<std::mutex> lk(ctx->session->mu);
+            n_history = ctx->session->history.size();
+            if (full_prompt || !chat_tmpl_->incremental())
+                history = ctx->session->history;
+        }
+
+        std::vector<Message> incoming = ctx->messages;
+        if (full_prompt)
+        {
+            incoming.insert(incoming.begin(), history.begin(), history.end());
+            history.clear();
+            n_history = 0;
+        }
+
+        // KV 末尾是上一轮生成的回复：先补上它的结束标记（属于上一轮）
+        const bool close_reply = n_history > 0 && seq.n_past > 0;
+        std::string err;
+        std::string close_text;
+        if (!chat_tmpl_->Delta(n_history, history, incoming, prompt, err, close_reply, &close_text))
+        {
+            ctx->error_message = "LlamaBatchScheduler: " + err;
+            return false;
+        }
+        if (seq.mc && opt_.shift_keep_tokens > 0)
+        {
+            std::vector<llama_token> close;
+            if (!close_text.empty())
+                tokenize_text(vocab, close_text, close, false);
+            ContextShiftBeginTurn(model_, *seq.mc, seq.n_past + (int)close.size(), n_history, incoming);
+        }
+    }
+    else
+    {
+        prompt = ctx->prompt;
+    }
+
+    if (!tokenize_text(vocab, prompt, seq.prompt, seq.n_past == 0))
+    {
+        ctx->error_message = "LlamaBatchScheduler: tokenize failed";
+        return false;
+    }
+    if (seq.prompt.empty() || seq.n_past + (int)seq.prompt.size() >= opt_.n_ctx_per_slot)
+    {
+        ctx->error_message = "LlamaBatchScheduler: prompt too long, tokens=" + std::to_string(seq.prompt.size());
+        return false;
+    }
+
+    ctx->usage.prompt_tokens += static_cast<int>(seq.prompt.size());
+
+    // 新序列先查前缀缓存：命中部分直接 seq_cp，只 prefill 剩余 token（缓存的是基座模型的 KV，带 adapter 的不用）
+    LlamaPrefixCache *cache = (pool_ && seq.n_past == 0 && seq.lora_key.empty()) ? pool_->prefix_cache(lctx_) : nullptr;
+    if (cache)
+    {
+        seq.cache_tokens = seq.prompt;
+        const int reused = cache->Restore(seq.prompt, seq.seq_id);
+        seq.prompt.erase(seq.prompt.begin(), seq.prompt.begin() + reused);
+        seq.n_past = reused;
+        ctx->usage.cached_tokens += reused;
+    }
+
+    seq.max_new_tokens = resolve_max_new_tokens(*ctx);
+
+    SamplingParams sp;
+    std::string err;
+    if (!parse_sampling_params(ctx->params, sp, err))
+    {
+        ctx->error_message = "LlamaBatchScheduler: " + err;
+        return false;
+    }
+    if (samplers_)
+    {
+        seq.samplers = samplers_.get();
+        seq.sampler_key = sp.Key();
+        seq.sampler = samplers_->Acquire(sp);
+        if (!sp.grammar.empty())
+            seq.grammar = samplers_->AcquireGrammar(sp.grammar);
+    }
+    else
+    {
+        seq.sampler = build_sampler_chain(sp, llama_vocab_n_tokens(vocab));
+    }
+    if (!sp.grammar.empty() && !seq.grammar)
+    {
+        ctx->error_message = "LlamaBatchScheduler: invalid grammar";
+        return false;
+    }
+    seq.detok = std::make_unique<LlamaDetokenizer>(pieces_.get(), ctx->stop);
+    return true;
+}
+
+void LlamaBatchScheduler::FinishSequence(Sequence &seq, FinishReason reason)
+{
+    seq.done = true;
+    // 正常结束：输出 detokenizer 里扣留的尾部（命中 stop 字符串时为空）
+    if (seq.detok && (reason == FinishReason::stop || reason == FinishReason::length))
+    {
+        seq.detok->Flush();
+        if (!seq.detok->text().empty())
+            seq.ctx->EmitDelta(seq.detok->text());
+    }
+    seq.ctx->usage.total_tokens = seq.ctx->usage.prompt_tokens + seq.ctx->usage.completion_tokens;
+    seq.ctx->EmitFinish(reason);
+}
+
+void LlamaBatchScheduler::ReleaseSlot(Sequence &seq)
+{
+    if (seq.seq_id < 0)
+        return;
+
+    if (!pool_)
+    {
+        llama_memory_seq_rm(llama_get_memory(lctx_), seq.seq_id, -1, -1);
+        free_slots_.push_back(seq.seq_id);
+        return;
+    }
+
+    // pool 模式：保留 session 的 KV，只裁掉未确认的尾部（如 decode 失败/中断的残留）；
+    // prefill 没做完（取消/出错）时连同已写入的块一起回滚，KV 与 history 保持一致
+    if (!seq.prefilled)
+        seq.n_past = seq.n_past_start;
+    llama_memory_seq_rm(llama_get_memory(lctx_), seq.seq_id, seq.n_past, -1);
+    seq.mc->n_past = seq.n_past;
+    if (seq.prefilled)
+        seq.mc->need_replay = false;
+    pool_->Checkin(*seq.mc);
+
+    // 一次性 session 不会再回来：放掉句柄，seq 析构时 slot 即归还
+    auto &session = seq.ctx->session;
+    if (session && session->ephemeral)
+    {
+        std::lock_guard<std::mutex> lk(session->mu);
+        session->model_ctx.reset();
+    }
+}
+
+void LlamaBatchScheduler::SelectLoraGroup()
+{
+    bool cur_active = false;
+    const Sequence *oldest = nullptr; // 其它组中最久没有推进的请求
+    for (const auto &seq : active_)
+    {
+        if (seq->done)
+            continue;
+        if (seq->lora_key == cur_lora_)
+            cur_active = true;
+        else if (!oldest || seq->last_step < oldest->last_step)
+            oldest = seq.get();
+    }
+
+    // 没有其它组在等，或当前组还没用完连续 step 配额：不切换
+    if (!oldest || (cur_active && lora_group_steps_ < opt_.lora_switch_steps))
+    {
+        ++lora_group_steps_;
+        return;
+    }
+    ApplyLora(*oldest);
+}
+
+void LlamaBatchScheduler::ApplyLora(const Sequence &seq)
+{
+    const std::string from = cur_lora_;
+    llama_clear_adapter_lora(lctx_);
+    cur_lora_.clear();
+    lora_group_steps_ = 1;
+    lora_switches_.fetch_add(1, std::memory_order_relaxed);
+
+    const std::string key = seq.lora_key;
+    if (seq.lora && (!seq.lora->adapter || llama_set_adapter_lora(lctx_, seq.lora->adapter, seq.lora_scale) != 0))
+    {
+        for (auto &s : active_)
+        {
+            if (s->done || s->lora_key != key)
+                continue;
+            s->ctx->error_message = "LlamaBatchScheduler: failed to apply lora adapter " + s->ctx->lora.name;
+            FinishSequence(*s, FinishReason::error);
+        }
+        return;
+    }
+    cur_lora_ = key;
+
+    LOG(INFO) << "[batch] lora switch from=" << (from.empty() ? "base" : from)
+              << " to=" << (key.empty() ? "base" : key);
+}
+
+void LlamaBatchScheduler::ReleaseIdleLora()
+{
+    if (cur_lora_.empty())
+        return;
+    for (const auto &seq : active_)
+    {
+        if (seq->lora_key == cur_lora_)
+            return;
+    }
+    // 之后只剩基座模型的请求或空闲：摘除，adapter 的租约随请求结束可以被缓存淘汰
+    llama_clear_adapter_lora(lctx_);
+    cur_lora_.clear();
+    lora_group_steps_ = 0;
+    lora_switches_.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool LlamaBatchScheduler::AbortCallback(void *data)
+{
+    // 只有 batch 里的请求全部取消时才中断，否则会拖累同 batch 的其它序列
+    auto *self = static_cast<LlamaBatchScheduler *>(data);
+    if (self->batch_ctxs_.empty())
+        return false;
+    for (const auto *ctx : self->batch_ctxs_)
+    {
+        if (!ctx->cancelled.load(std::memory_order_acquire))
+            return false;
+    }
+    return true;
+}
+
+void LlamaBatchScheduler::AdmitPending()
+{
+    std::deque<Pending> deferred;
+    while (pool_ || !free_slots_.empty())
+    {
+        Pending p;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            if (pending_.empty())
+                break;
+            p = std::move(pending_.front());
+            pending_.pop_front();
+        }
+
+        auto &ctx = p.ctx;
+        if (ctx->finished.load(std::memory_order_acquire))
+            continue;
+        if (ctx->cancelled.load(std::memory_order_acquire))
+        {
+            ctx->EmitFinish(FinishReason::cancelled);
+            continue;
+        }
+
+        const auto wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                 std::chrono::steady_clock::now() - p.enqueued_at)
+                                 .count();
+        if (opt_.max_queue_wait_ms > 0 && wait_ms > opt_.max_queue_wait_ms)
+        {
+            ctx->error_message = "LlamaBatchScheduler: queue wait timeout";
+            ctx->params["error_code"] = "overloaded";
+            ctx->EmitFinish(FinishReason::error);
+            continue;
+        }
+
+        auto seq = std::make_unique<Sequence>();
+        seq->ctx = ctx;
+        seq->lora = static_cast<const LlamaLoraCache::Adapter *>(ctx->lora_adapter.get());
+        if (seq->lora)
+        {
+            seq->lora_scale = ctx->lora.scale;
+            seq->lora_key = ctx->lora.Key();
+        }
+        seq->last_step = step_;
+        if (!AcquireSlot(*seq))
+        {
+            deferred.push_back(std::move(p));
+            continue;
+        }
+
+        if (!PrepareSequence(*seq))
+        {
+            FinishSequence(*seq, FinishReason::error);
+            ReleaseSlot(*seq);
+            continue;
+        }
+
+        LOG(INFO) << "[batch] admit req=" << ctx->request_id
+                  << " seq=" << seq->seq_id
+                  << " n_past=" << seq->n_past
+                  << " prompt_tokens=" << seq->prompt.size()
+                  << " wait_ms=" << wait_ms
+                  << " active=" << active_.size() + 1;
+        active_.push_back(std::move(seq));
+    }
+
+    // 暂时无法加入的请求放回队头，保持 FIFO
+    if (!deferred.empty())
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        pending_.insert(pending_.begin(),
+                        std::make_move_iterator(deferred.begin()),
+                        std::make_move_iterator(deferred.end()));
+    }
+}
+
+void LlamaBatchScheduler::Loop()
+{
+    const int batch_cap = opt_.prefill_chunk + opt_.n_slots;
+    llama_batch batch = llama_batch_init(batch_cap, 0, 1);
+    const llama_vocab *vocab = llama_model_get_vocab(model_);
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lk(mu_);
+            cv_.wait(lk, [&]
+                     { return stop_.load() || !pending_.empty() || !active_.empty(); });
+            if (stop_.load())
+                break;
+        }
+
+        // 1) step 边界：加入新请求
+        AdmitPending();
+
+        // 2) 组 batch：先放 decode 阶段序列的 1 个 token（保证每 step 都出字），
+        //    再把至多 prefill_chunk 个 prefill token 按加入顺序分给待 prefill 的序列；
+        //    只放当前 LoRA adapter 组的序列，其它组的序列本 step 原地等待
+        batch.n_tokens = 0;
+        batch_ctxs_.clear();
+        for (auto &seq : active_)
+        {
+            seq->i_batch = -1;
+            seq->n_batch_tokens = 0;
+
+            if (seq->ctx->cancelled.load(std::memory_order_acquire) ||
+                seq->ctx->finished.load(std::memory_order_acquire))
+            {
+                FinishSequence(*seq, FinishReason::cancelled);
+            }
+        }
+        SelectLoraGroup();
+
+        for (auto &seq : active_)
+        {
+            if (seq->done || seq->lora_key != cur_lora_)
+                continue;
+            if (seq->prefilled)
+            {
+                batch_add(batch, seq->last, seq->n_past, seq->seq_id, true);
+                seq->n_batch_tokens = 1;
+                seq->i_batch = batch.n_tokens - 1;
+                seq->last_step = step_;
+                batch_ctxs_.push_back(seq->ctx.get());
+            }
+        }
+
+        int prefill_budget = opt_.prefill_chunk;
+        for (auto &seq : active_)
+        {
+            if (prefill_budget <= 0)
+                break;
+            if (seq->done || seq->prefilled || seq->lora_key != cur_lora_)
+                continue;
+
+            const int remaining = (int)(seq->prompt.size() - seq->n_prompt_done);
+            const int n = std::min(remaining, prefill_budget);
+            const bool last_chunk = n == remaining;
+            for (int i = 0; i < n; ++i)
+            {
+                batch_add(batch, seq->prompt[seq->n_prompt_done + i], seq->n_past + i, seq->seq_id,
+                          last_chunk && i == n - 1);
+            }
+            seq->n_batch_tokens = n;
+            seq->i_batch = last_chunk ? batch.n_tokens - 1 : -1;
+            seq->last_step = step_;
+            prefill_budget -= n;
+            batch_ctxs_.push_back(seq->ctx.get());
+        }
+
+        // 3) 一次 decode 推进所有序列
+        if (batch.n_tokens > 0)
+        {
+            int rc;
+            {
+                LlamaThreadBudget::Lease lease(lctx_, LlamaThreadBudget::Phase::batch);
+                rc = llama_decode(lctx_, batch);
+                // 共享 KV 已满：淘汰空闲 session 的 KV 后重试
+                while (rc == 1 && pool_ && pool_->EvictOne(lctx_))
+                    rc = llama_decode(lctx_, batch);
+            }
+
+            for (auto &seq : active_)
+            {
+                if (seq->done || seq->n_batch_tokens == 0)
+                    continue;
+
+                auto &ctx = seq->ctx;
+                if (rc == 2)
+                {
+                    // abort callback 中断：batch 内请求均已取消
+                    FinishSequence(*seq, FinishReason::cancelled);
+                    continue;
+                }
+                if (rc != 0)
+                {
+                    ctx->error_message = "LlamaBatchScheduler: llama_decode failed rc=" + std::to_string(rc);
+                    FinishSequence(*seq, FinishReason::error);
+                    continue;
+                }
+
+                seq->n_past += seq->n_batch_tokens;
+                if (!seq->prefilled)
+                {
+                    seq->n_prompt_done += seq->n_batch_tokens;
+                    if (seq->n_prompt_done < seq->prompt.size())
+                        continue; // 还有后续块，本 step 不采样
+
+                    seq->prefilled = true;
+                    seq->prompt.clear();
+                    seq->prompt.shrink_to_fit();
+
+                    if (!seq->cache_tokens.empty())
+                    {
+                        if (auto *cache = pool_->prefix_cache(lctx_))
+                            cache->Insert(seq->cache_tokens, seq->seq_id);
+                        seq->cache_tokens.clear();
+                    }
+                }
+
+                if (ctx->cancelled.load(std::memory_order_acquire))
+                {
+                    FinishSequence(*seq, FinishReason::cancelled);
+                    continue;
+                }
+
+                // 4) 采样 + 输出
+                llama_token next;
+                if (seq->samplers)
+                {
+                    next = seq->samplers->Sample(seq->sampler, seq->grammar, lctx_, seq->i_batch);
+                }
+                else
+                {
+                    next = llama_sampler_sample(seq->sampler, lctx_, seq->i_batch);
+                    llama_sampler_accept(seq->sampler, next);
+                }
+
+                if (llama_vocab_is_eog(vocab, next))
+                {
+                    FinishSequence(*seq, FinishReason::stop);
+                    continue;
+                }
+
+                ctx->usage.completion_tokens += 1;
+                const bool hit_stop = seq->detok->Push(next);
+                if (!seq->detok->text().empty())
+                    ctx->EmitDelta(seq->detok->text());
+                if (hit_stop)
+                {
+                    FinishSequence(*seq, FinishReason::stop);
+                    continue;
+                }
+
+                seq->last = next;
+                seq->n_generated += 1;
+                if (seq->n_generated >= seq->max_new_tokens || seq->n_past + 1 >= opt_.n_ctx_per_slot)
+                {
+                    FinishSequence(*seq, FinishReason::length);
+                    continue;
+                }
+            }
+        }
+
+        // 5) step 边界：结束的序列离开并归还 slot
+        for (auto it = active_.begin(); it != active_.end();)
+        {
+            if ((*it)->done)
+            {
+                ReleaseSlot(**it);
+                it = active_.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+        ReleaseIdleLora();
+        ++step_;
+    }
+
+    llama_batch_free(batch);
+
+    // 退出：未完成的请求统一结束，避免客户端挂死
+    for (auto &seq : active_)
+    {
+        if (!seq->done)
+            FinishSequence(*seq, FinishReason::cancelled);
+        ReleaseSlot(*seq);
+    }
+    active_.clear();
+
+    std::lock_guard<std::mutex> lk(mu_);
+    for (auto &p : pending_)
+    {
+        p.ctx->error_message = "LlamaBatchScheduler: stopped";
+        p.ctx->EmitFinish(FinishReason::error);
+    }
+    pending_.clear();
+}
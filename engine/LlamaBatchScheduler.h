@@ -0,0 +1,119 @@
+#pragma once
+#include "serving/core/ServingContext.h"
+#include "ggml.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct llama_model;
+struct llama_context;
+struct ModelContext;
+class LlamaSlotPool;
+class LlamaSamplerCache;
+class LlamaPieceTable;
+class LlamaChatTemplate;
+
+/**
+ * @brief Continuous batching 调度器（每个模型一个）
+ *
+ * - 独占一个多 seq 的 llama_context，由内部线程单独驱动
+ * - 每个 decode step 把所有活跃请求的下一个 token 拼进同一个 llama_batch（一个请求一个 seq_id）
+ * - 新请求只在 step 边界加入；结束/取消的请求在 step 边界离开，不阻塞其它请求
+ * - 长 prompt 按 prefill_chunk 分块，与其它序列的 decode 交错进行，避免一次大 prefill 卡住所有流；
+ *   batch 内请求全部取消时通过 abort callback 中断正在进行的 decode
+ * - 对外语义与串行 Run 一致：EmitDelta / EmitFinish / cancelled
+ * - 传入 LlamaSlotPool（LLAMA_KV_MODE=shared）时改用池里的共享 context，
+ *   每个 session 固定一个 seq，KV 跨轮保留，只 prefill 增量 prompt；
+ *   否则每个请求占用一个临时 seq，prefill 完整对话，结束即清空
+ * - LoRA adapter 作用于整个 context：活跃请求按 adapter 分组，每个 step 只推进当前组；
+ *   当前组没有活跃请求、或连续 lora_switch_steps 个 step 后仍有其它组在等时，
+ *   切到最久没有推进的那一组（llama_set_adapter_lora，只改 context 的 adapter 表，不动权重）
+ */
+class LlamaBatchScheduler
+{
+public:
+    struct Options
+    {
+        int n_slots = 8;           // 同时在跑的序列数（= n_seq_max）
+        int n_ctx_per_slot = 4096; // 每个序列可用的上下文长度
+        int n_threads = 4;
+        int n_threads_batch = 4;
+        size_t max_pending = 64;   // 等待加入 batch 的请求上限
+        int max_queue_wait_ms = 2000;
+        int kv_reset_margin = 256; // 仅 pool 模式：session 逼近上限时清空其 seq
+        int shift_keep_tokens = 0; // 仅 pool 模式：>0 时先尝试上下文平移，保留 system prompt + 最近这么多 token
+        int prefill_chunk = 512;   // 每个 step 最多放入的 prefill token 数（所有序列合计），<=0 表示不分块
+        ggml_type type_k = GGML_TYPE_F16; // KV cache 类型（非 pool 模式的调度 context）
+        ggml_type type_v = GGML_TYPE_F16;
+        int lora_switch_steps = 16; // 有其它 adapter 组在等时，当前组最多连续推进的 step 数
+    };
+
+    LlamaBatchScheduler(llama_model *model, const Options &opt,
+                        std::shared_ptr<LlamaSlotPool> pool = nullptr,
+                        std::shared_ptr<LlamaSamplerCache> samplers = nullptr,
+                        std::shared_ptr<const LlamaPieceTable> pieces = nullptr,
+                        std::shared_ptr<const LlamaChatTemplate> chat_tmpl = nullptr);
+    ~LlamaBatchScheduler();
+
+    // 创建 context 并启动调度线程
+    bool Start();
+
+    // 入队，立即返回；false 表示队列已满
+    bool Submit(std::shared_ptr<ServingContext> ctx);
+
+    // context 上的 LoRA adapter 切换次数（/metrics）
+    int64_t lora_switches() const { return lora_switches_.load(std::memory_order_relaxed); }
+
+private:
+    struct Sequence;
+
+    struct Pending
+    {
+        std::shared_ptr<ServingContext> ctx;
+        std::chrono::steady_clock::time_point enqueued_at;
+    };
+
+    void Loop();
+    void AdmitPending();
+    bool AcquireSlot(Sequence &seq);
+    bool PrepareSequence(Sequence &seq);
+    void FinishSequence(Sequence &seq, FinishReason reason);
+    void ReleaseSlot(Sequence &seq);
+    // step 开始前选定本 step 推进的 adapter 组，需要时切换 context 上的 adapter
+    void SelectLoraGroup();
+    // 把 seq 所在组的 adapter 应用到 context（基座模型组只清空）；失败时结束该组的请求
+    void ApplyLora(const Sequence &seq);
+    // step 结束后当前组已没有请求：摘除 adapter
+    void ReleaseIdleLora();
+    static bool AbortCallback(void *data);
+
+private:
+    llama_model *model_ = nullptr;
+    llama_context *lctx_ = nullptr; // pool 模式下借用 pool 的 context
+    Options opt_;
+    std::shared_ptr<LlamaSlotPool> pool_;
+    std::shared_ptr<LlamaSamplerCache> samplers_; // 每个请求按采样参数取链，结束归还
+    std::shared_ptr<const LlamaPieceTable> pieces_; // 未传入时 Start 里构建
+    std::shared_ptr<const LlamaChatTemplate> chat_tmpl_; // 同上
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<Pending> pending_;
+    std::atomic<bool> stop_{false};
+    std::thread worker_;
+
+    // 以下只在调度线程访问
+    std::vector<std::unique_ptr<Sequence>> active_;
+    std::vector<int> free_slots_; // 非 pool 模式的临时 seq
+    std::vector<ServingContext *> batch_ctxs_; // 本 step batch 里的请求（abort callback 读取）
+    std::string cur_lora_;                     // context 上当前应用的 adapter（LoraSelection::Key，空为基座模型）
+    int lora_group_steps_ = 0;                 // 当前组已连续推进的 step 数
+    uint64_t step_ = 0;
+    std::atomic<int64_t> lora_switches_{0};
+};
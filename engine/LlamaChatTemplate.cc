@@ -0,0 +1,162 @@
+#include "engine/LlamaChatTemplate.h"
+#include "llama.h"
+
+namespace
+{
+const Message kAnchor{"user", "anchor"};
+
+bool starts_with(const std::string &s, const std::string &prefix)
+{
+    return s.size() >= prefix.size() && s.compare(0, prefix.size(), prefix) == 0;
+}
+} // namespace
+
+bool format_chat(const std::string &tmpl, const std::vector<Message> &msgs, bool add_ass, std::string &out)
+{
+    std::vector<llama_chat_message> chat;
+    chat.reserve(msgs.size());
+    for (const auto &m : msgs)
+        chat.push_back({m.role.c_str(), m.content.c_str()});
+
+    const int32_t len = llama_chat_apply_template(tmpl.c_str(), chat.data(), chat.size(), add_ass, nullptr, 0);
+    if (len < 0)
+        return false;
+    out.resize(len);
+    return llama_chat_apply_template(tmpl.c_str(), chat.data(), chat.size(), add_ass, out.data(), out.size()) == len;
+}
+
+LlamaChatTemplate::LlamaChatTemplate(const llama_model *model)
+    : LlamaChatTemplate(std::string(llama_model_chat_template(model, nullptr) ? llama_model_chat_template(model, nullptr) : ""))
+{
+}
+
+LlamaChatTemplate::LlamaChatTemplate(const std::string &tmpl) : tmpl_(tmpl.empty() ? "chatml" : tmpl)
+{
+    incremental_ = Probe();
+}
+
+bool LlamaChatTemplate::Segment(const Message &m, std::string &out) const
+{
+    std::string both;
+    if (!format_chat(tmpl_, {kAnchor, m}, false, both) || !starts_with(both, anchor_))
+        return false;
+    out.append(both, anchor_.size(), std::string::npos);
+    return true;
+}
+
+bool LlamaChatTemplate::Probe()
+{
+    std::string with_tail;
+    if (!format_chat(tmpl_, {kAnchor}, false, anchor_) || !format_chat(tmpl_, {kAnchor}, true, with_tail) ||
+        !starts_with(with_tail, anchor_))
+    {
+        return false;
+    }
+    generation_tail_ = with_tail.substr(anchor_.size());
+
+    // assistant 片段 = 生成前缀 + 内容 + 结束标记
+    std::string reply;
+    const std::string content = "hi there";
+    if (Segment({"assistant", content}, reply) && starts_with(reply, generation_tail_ + content))
+        assistant_close_ = reply.substr(generation_tail_.size() + content.size());
+
+    // 有 / 无 system 两种开头：逐条拼接的结果必须与整体展开完全一致
+    const std::vector<Message> turns = {
+        {"user", "hello"}, {"assistant", "hi there"}, {"user", "how are you?"}, {"assistant", "fine"}, {"user", "bye"}};
+    std::vector<Message> with_system = {{"system", "you are helpful"}};
+    with_system.insert(with_system.end(), turns.begin(), turns.end());
+
+    const std::vector<Message> *convs[] = {&turns, &with_system};
+    for (const auto *conv : convs)
+    {
+        std::string built;
+        if (!format_chat(tmpl_, {conv->front()}, false, built))
+            return false;
+        for (size_t i = 1; i < conv->size(); ++i)
+        {
+            if (!Segment((*conv)[i], built))
+                return false;
+        }
+
+        std::string full;
+        std::string full_tail;
+        if (!format_chat(tmpl_, *conv, false, full) || !format_chat(tmpl_, *conv, true, full_tail))
+            return false;
+        if (built != full || full_tail != full + generation_tail_)
+            return false;
+    }
+    return true;
+}
+
+bool LlamaChatTemplate::Delta(size_t n_history, const std::vector<Message> &history,
+                              const std::vector<Message> &incoming, std::string &out, std::string &err,
+                              bool close_reply, std::string *close) const
+{
+    out.clear();
+    if (close)
+        close->clear();
+    if (n_history == 0)
+    {
+        if (format_chat(tmpl_, incoming, true, out))
+            return true;
+        err = "chat template apply failed (full)";
+        return false;
+    }
+
+    if (incremental_)
+    {
+        if (close_reply)
+        {
+            out = assistant_close_;
+            if (close)
+                *close = assistant_close_;
+        }
+        for (const auto &m : incoming)
+        {
+            if (!Segment(m, out))
+            {
+                err = "chat template apply failed (segment)";
+                return false;
+            }
+        }
+        out += generation_tail_;
+        return true;
+    }
+
+    // 非增量模板：history 与 history + incoming 各展开一次，取差
+    std::string prev;
+    if (!format_chat(tmpl_, history, false, prev))
+    {
+        err = "chat template apply failed (prev)";
+        return false;
+    }
+    std::vector<Message> full_msgs = history;
+    full_msgs.insert(full_msgs.end(), incoming.begin(), incoming.end());
+    std::string full;
+    if (!format_chat(tmpl_, full_msgs, true, full))
+    {
+        err = "chat template apply failed (full)";
+        return false;
+    }
+    size_t start = prev.size() <= full.size() ? prev.size() : 0;
+
+    // KV 末尾停在上一条回复的内容之后：从该处开始取差，结束标记随增量写入
+    if (close_reply && start > 0 && !history.empty() && history.back().role == "assistant" &&
+        !history.back().content.empty())
+    {
+        const size_t pos = prev.rfind(history.back().content);
+        const size_t reply_end = pos == std::string::npos ? start : pos + history.back().content.size();
+        if (reply_end < start && full.compare(0, reply_end, prev, 0, reply_end) == 0)
+        {
+            // 属于上一轮的部分：prev 在回复之后的内容与 full 的公共前缀
+            size_t n = 0;
+            while (reply_end + n < start && prev[reply_end + n] == full[reply_end + n])
+                ++n;
+            if (close)
+                close->assign(prev, reply_end, n);
+            start = reply_end;
+        }
+    }
+    out.assign(full, start, std::string::npos);
+    return true;
+}
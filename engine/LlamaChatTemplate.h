@@ -0,0 +1,51 @@
+#pragma once
+#include "serving/core/ServingContext.h"
+
+#include <string>
+#include <vector>
+
+struct llama_model;
+
+/**
+ * @brief 增量 chat 模板化
+ *
+ * 多数模板（chatml / llama3 / qwen 等）对第一条之后的每条消息独立展开：
+ *   format(m0..mn) == format(m0) + seg(m1) + ... + seg(mn)，生成前缀 (add_ass) 也是固定的一段。
+ * 构造时用一段探测对话验证模板是否满足这一点；满足时本轮增量 prompt 只需对新消息逐条展开
+ * （每条一次只含 2 条消息的 llama_chat_apply_template），与 history 长度无关，不需要 history 内容。
+ * 不满足（如把 system 并入第一条 user 的模板）时退回对 history 与 history + incoming 各展开一次再取差。
+ */
+class LlamaChatTemplate
+{
+public:
+    explicit LlamaChatTemplate(const llama_model *model);
+    // tmpl 为 llama_chat_apply_template 接受的模板名或 Jinja 源码；空表示 chatml
+    explicit LlamaChatTemplate(const std::string &tmpl);
+
+    bool incremental() const { return incremental_; }
+
+    // assistant 消息展开后跟在内容之后的结束标记（如 chatml 的 "<|im_end|>\n"）；无法确定时为空
+    const std::string &assistant_close() const { return assistant_close_; }
+
+    // 本轮增量 prompt：KV 中已有 n_history 条消息。
+    // incremental() 时只用 n_history；否则 history 必须是这 n_history 条消息本身。
+    // close_reply：KV 末尾是上一轮生成的回复（eog 只采样、没有写入 KV），增量前补上它的结束标记，
+    // 使 KV 与完整展开的对话逐 token 一致；增量模板补 assistant_close()，非增量模板从 history 展开结果中
+    // 最后一条 assistant 内容之后开始取差。close 非空时写入补上的那段文本（属于上一轮，上下文平移按它定轮边界）
+    bool Delta(size_t n_history, const std::vector<Message> &history, const std::vector<Message> &incoming,
+               std::string &out, std::string &err, bool close_reply = false, std::string *close = nullptr) const;
+
+private:
+    // 单条消息（非首条）展开后的文本
+    bool Segment(const Message &m, std::string &out) const;
+    bool Probe();
+
+    std::string tmpl_;
+    bool incremental_ = false;
+    std::string anchor_;          // 锚点消息单独展开的结果
+    std::string generation_tail_; // add_ass=true 追加的 assistant 前缀
+    std::string assistant_close_;
+};
+
+// 完整展开 msgs（add_ass 为是否追加 assistant 前缀）
+bool format_chat(const std::string &tmpl, const std::vector<Message> &msgs, bool add_ass, std::string &out);
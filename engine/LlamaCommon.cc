@@ -0,0 +1,186 @@
+#include "engine/LlamaCommon.h"
+
+#include <algorithm>
+#include <glog/logging.h>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+int parse_positive(const char *v, int def)
+{
+    if (!v || !*v)
+        return def;
+    try
+    {
+        int n = std::stoi(v);
+        return n > 0 ? n : def;
+    }
+    catch (...)
+    {
+        return def;
+    }
+}
+} // namespace
+
+int get_env_int(const char *name, int def)
+{
+    return parse_positive(std::getenv(name), def);
+}
+
+std::string get_env_str(const char *name, const std::string &def)
+{
+    const char *v = std::getenv(name);
+    if (!v || !*v)
+        return def;
+    return std::string(v);
+}
+
+int get_option_int(const std::map<std::string, std::string> &options, const char *name, int def)
+{
+    auto it = options.find(name);
+    if (it != options.end() && !it->second.empty())
+        return parse_positive(it->second.c_str(), def);
+    return get_env_int(name, def);
+}
+
+std::string get_option_str(const std::map<std::string, std::string> &options, const char *name, const std::string &def)
+{
+    auto it = options.find(name);
+    if (it != options.end() && !it->second.empty())
+        return it->second;
+    return get_env_str(name, def);
+}
+
+bool tokenize_text(const llama_vocab *vocab, const std::string &text, std::vector<llama_token> &out, bool add_special)
+{
+    if (!vocab)
+        return false;
+    out.clear();
+    out.resize(text.size() + 16);
+
+    int n = llama_tokenize(
+        vocab,
+        text.c_str(),
+        (int)text.size(),
+        out.data(),
+        (int)out.size(),
+        add_special,
+        true);
+
+    if (n < 0)
+        return false;
+    out.resize(n);
+    return true;
+}
+
+int resolve_max_new_tokens(const ServingContext &ctx)
+{
+    int max_new_tokens = 512;
+    auto it = ctx.params.find("max_tokens");
+    if (it != ctx.params.end())
+    {
+        try
+        {
+            max_new_tokens = std::stoi(it->second);
+        }
+        catch (...)
+        {
+            max_new_tokens = 512;
+        }
+    }
+    else if (const char *env = std::getenv("DEFAULT_MAX_TOKENS"))
+    {
+        try
+        {
+            max_new_tokens = std::stoi(env);
+        }
+        catch (...)
+        {
+            max_new_tokens = 512;
+        }
+    }
+    if (max_new_tokens <= 0)
+        max_new_tokens = 1;
+    return max_new_tokens;
+}
+
+namespace
+{
+ggml_type parse_cache_type(const char *name, const std::string &v)
+{
+    static const std::pair<const char *, ggml_type> kTypes[] = {
+        {"f16", GGML_TYPE_F16},   {"bf16", GGML_TYPE_BF16}, {"f32", GGML_TYPE_F32},   {"q8_0", GGML_TYPE_Q8_0},
+        {"q5_1", GGML_TYPE_Q5_1}, {"q5_0", GGML_TYPE_Q5_0}, {"q4_1", GGML_TYPE_Q4_1}, {"q4_0", GGML_TYPE_Q4_0},
+    };
+    for (const auto &t : kTypes)
+    {
+        if (v == t.first)
+            return t.second;
+    }
+    LOG(WARNING) << "[llama] unknown " << name << "=" << v << ", use f16";
+    return GGML_TYPE_F16;
+}
+} // namespace
+
+ggml_type kv_cache_type(const std::map<std::string, std::string> &options, const char *name)
+{
+    return parse_cache_type(name, get_option_str(options, name, "f16"));
+}
+
+size_t kv_bytes_per_token(const llama_model *model, ggml_type type_k, ggml_type type_v)
+{
+    const int64_t n_layer = llama_model_n_layer(model);
+    const int64_t n_head = llama_model_n_head(model);
+    const int64_t n_head_kv = llama_model_n_head_kv(model);
+    if (n_head <= 0)
+        return 0;
+    const int64_t n_embd_head = llama_model_n_embd(model) / n_head;
+    const int64_t n_embd_kv = n_embd_head * n_head_kv;
+    // 量化类型按块存储（q8_0 每 32 个元素 34 字节），ggml_row_size 给出一行的实际字节数
+    return static_cast<size_t>(n_layer) * (ggml_row_size(type_k, n_embd_kv) + ggml_row_size(type_v, n_embd_kv));
+}
+
+llama_model_params model_load_params(const std::map<std::string, std::string> &options)
+{
+    llama_model_params mparams = llama_model_default_params();
+    if (get_option_int(options, "LLAMA_NO_MMAP", 0) > 0)
+        mparams.use_mmap = false;
+    if (get_option_int(options, "LLAMA_MLOCK", 0) > 0)
+        mparams.use_mlock = true;
+    return mparams;
+}
+
+size_t prefetch_file(const std::string &path)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size <= 0)
+    {
+        ::close(fd);
+        return 0;
+    }
+    const size_t size = static_cast<size_t>(st.st_size);
+
+    // 分块 readahead：每块读完才返回，整体是一次顺序大块读盘；不支持时退回异步的 FADV_WILLNEED
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    constexpr size_t kChunk = 64u << 20;
+    size_t done = 0;
+    while (done < size)
+    {
+        const size_t n = std::min(kChunk, size - done);
+        if (::readahead(fd, static_cast<off_t>(done), n) != 0)
+        {
+            ::posix_fadvise(fd, static_cast<off_t>(done), 0, POSIX_FADV_WILLNEED);
+            break;
+        }
+        done += n;
+    }
+    ::close(fd);
+    return size;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "serving/core/ServingContext.h"
+#include "llama.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// llama 引擎的公共工具函数（串行 Run 与 continuous batching 共用）
+
+// 读取正整数环境变量，非法/缺省时返回 def
+int get_env_int(const char *name, int def);
+
+// 读取字符串环境变量，缺省时返回 def
+std::string get_env_str(const char *name, const std::string &def);
+
+// 模型级配置：先查 options（ModelRegistry 中该模型条目的覆盖项，键为环境变量名），再查环境变量
+int get_option_int(const std::map<std::string, std::string> &options, const char *name, int def);
+std::string get_option_str(const std::map<std::string, std::string> &options, const char *name, const std::string &def);
+
+// 将字符串 tokenize 成 llama_token
+bool tokenize_text(const llama_vocab *vocab, const std::string &text,
+                   std::vector<llama_token> &out, bool add_special);
+
+// 本次请求的生成上限：params["max_tokens"] > DEFAULT_MAX_TOKENS > 512
+int resolve_max_new_tokens(const ServingContext &ctx);
+
+// KV cache 元素类型（name 为 LLAMA_CACHE_TYPE_K / LLAMA_CACHE_TYPE_V）：
+// f16（默认）/ bf16 / f32 / q8_0 / q5_1 / q5_0 / q4_1 / q4_0，非法值按 f16
+ggml_type kv_cache_type(const std::map<std::string, std::string> &options, const char *name);
+
+// 单个 token 在 KV cache 中占用的字节数（K + V，按类型的块大小计算）
+size_t kv_bytes_per_token(const llama_model *model, ggml_type type_k = GGML_TYPE_F16, ggml_type type_v = GGML_TYPE_F16);
+
+// 模型加载参数：LLAMA_NO_MMAP=1 整体读入内存而不是 mmap；LLAMA_MLOCK=1 锁定权重页，不被换出 / 回收
+llama_model_params model_load_params(const std::map<std::string, std::string> &options);
+
+// 把文件顺序预读进 page cache（LLAMA_MMAP_PREFETCH=1）：mmap 加载与首批请求不再逐页缺页读盘；
+// 返回预读的字节数，失败返回 0
+size_t prefetch_file(const std::string &path);
@@ -0,0 +1,124 @@
+#include "engine/LlamaContextPool.h"
+#include "engine/ModelContext.h"
+#include "llama.h"
+
+#include <chrono>
+#include <glog/logging.h>
+
+LlamaContextPool::LlamaContextPool(Factory factory, size_t size, size_t kv_bytes_per_ctx)
+    : factory_(std::move(factory)), size_(size), kv_bytes_per_ctx_(kv_bytes_per_ctx)
+{
+    stats_.size = size_;
+}
+
+LlamaContextPool::~LlamaContextPool()
+{
+    // 借出的句柄此前已 Detach（on_release 已清掉），这里统一释放
+    for (auto *ctx : all_)
+        llama_free(ctx);
+    all_.clear();
+    idle_.clear();
+}
+
+llama_context *LlamaContextPool::Create()
+{
+    const auto t0 = std::chrono::steady_clock::now();
+    llama_context *ctx = factory_();
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    if (!ctx)
+        return nullptr;
+
+    std::lock_guard<std::mutex> lk(mu_);
+    all_.insert(ctx);
+    stats_.created++;
+    stats_.create_ms_total += ms;
+    return ctx;
+}
+
+size_t LlamaContextPool::Prewarm()
+{
+    size_t n = 0;
+    for (; n < size_; ++n)
+    {
+        llama_context *ctx = Create();
+        if (!ctx)
+        {
+            LOG(WARNING) << "[ctx-pool] prewarm stopped: context init failed after " << n;
+            break;
+        }
+        std::lock_guard<std::mutex> lk(mu_);
+        idle_.push_back(ctx);
+    }
+    return n;
+}
+
+std::shared_ptr<ModelContext> LlamaContextPool::Acquire()
+{
+    llama_context *ctx = nullptr;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (!idle_.empty())
+        {
+            ctx = idle_.back();
+            idle_.pop_back();
+            stats_.hits++;
+        }
+        else
+        {
+            stats_.misses++;
+        }
+    }
+    if (!ctx)
+        ctx = Create();
+    if (!ctx)
+        return nullptr;
+
+    auto mc = std::make_shared<ModelContext>();
+    mc->ctx = ctx;
+    std::weak_ptr<LlamaContextPool> weak = shared_from_this();
+    mc->on_release = [weak](ModelContext &self)
+    {
+        if (auto pool = weak.lock())
+            pool->Release(self);
+    };
+    return mc;
+}
+
+void LlamaContextPool::Release(ModelContext &mc)
+{
+    llama_context *ctx = mc.ctx;
+    if (!ctx)
+        return;
+
+    // 句柄析构时已没有请求在用这个 context：锁外清空 KV（只重置 cell 元数据，不释放缓冲区）
+    llama_memory_clear(llama_get_memory(ctx), true);
+    llama_set_abort_callback(ctx, nullptr, nullptr);
+
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (idle_.size() < size_)
+        {
+            idle_.push_back(ctx);
+            stats_.returned++;
+            return;
+        }
+        all_.erase(ctx);
+        stats_.discarded++;
+    }
+    llama_free(ctx);
+}
+
+size_t LlamaContextPool::IdleBytes() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return idle_.size() * kv_bytes_per_ctx_;
+}
+
+LlamaContextPool::Stats LlamaContextPool::GetStats() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    Stats st = stats_;
+    st.idle = idle_.size();
+    st.in_use = all_.size() - idle_.size();
+    return st;
+}
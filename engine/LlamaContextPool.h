@@ -0,0 +1,68 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+struct llama_context;
+struct ModelContext;
+
+/**
+ * @brief 预创建的独占 llama_context 池（LLAMA_KV_MODE=per_session + serial，LLAMA_CONTEXT_POOL > 0）
+ *
+ * - 引擎启动时预先创建 size 个 context；session 需要 context 时从池里取，池空才现建
+ * - 句柄（ModelContext）析构时 context 清空 KV（llama_memory_clear）放回池中，超过 size 的直接释放
+ * - 一次性 session 在响应结束时就释放句柄，context 立刻可以给下一个请求用
+ * - 池持有它创建的所有 context（含借出的）：模型卸载时句柄只 Detach，context 随池一起释放
+ */
+class LlamaContextPool : public std::enable_shared_from_this<LlamaContextPool>
+{
+public:
+    using Factory = std::function<llama_context *()>;
+
+    struct Stats
+    {
+        size_t size = 0;
+        size_t idle = 0;
+        size_t in_use = 0;
+        int64_t hits = 0;      // 取到预创建 / 归还的 context
+        int64_t misses = 0;    // 池空，现建
+        int64_t returned = 0;  // 清空后放回
+        int64_t discarded = 0; // 池已满，释放
+        int64_t created = 0;
+        double create_ms_total = 0;
+    };
+
+    LlamaContextPool(Factory factory, size_t size, size_t kv_bytes_per_ctx);
+    ~LlamaContextPool();
+
+    LlamaContextPool(const LlamaContextPool &) = delete;
+    LlamaContextPool &operator=(const LlamaContextPool &) = delete;
+
+    // 预先创建 size 个 context；返回实际创建的个数
+    size_t Prewarm();
+
+    // 借出一个空 KV 的 context，包成句柄（析构即归还）；创建失败返回空
+    std::shared_ptr<ModelContext> Acquire();
+
+    // 池中空闲 context 预分配的 KV 字节数（借出的计在各句柄的 kv_bytes 里）
+    size_t IdleBytes() const;
+
+    Stats GetStats() const;
+
+private:
+    llama_context *Create();
+    void Release(ModelContext &mc);
+
+private:
+    Factory factory_;
+    size_t size_ = 0;
+    size_t kv_bytes_per_ctx_ = 0;
+
+    mutable std::mutex mu_;
+    std::vector<llama_context *> idle_;
+    std::unordered_set<llama_context *> all_;
+    Stats stats_;
+};
@@ -0,0 +1,122 @@
+#include "engine/LlamaContextShift.h"
+#include "engine/LlamaCommon.h"
+#include "engine/LlamaChatTemplate.h"
+#include "engine/ModelContext.h"
+#include "serving/core/Session.h"
+#include "llama.h"
+
+#include <glog/logging.h>
+
+namespace
+{
+// system 消息（add_ass=false）模板化后的 token 数（含 BOS），失败返回 -1
+int system_prompt_tokens(const llama_model *model, const std::vector<Message> &sys)
+{
+    const char *tmpl = llama_model_chat_template(model, nullptr);
+    std::string text;
+    if (!format_chat(tmpl ? tmpl : "chatml", sys, false, text))
+        return -1;
+
+    std::vector<llama_token> toks;
+    if (!tokenize_text(llama_model_get_vocab(model), text, toks, true))
+        return -1;
+    return static_cast<int>(toks.size());
+}
+} // namespace
+
+void ContextShiftBeginTurn(const llama_model *model, ModelContext &mc, int n_past_start,
+                           size_t n_history, const std::vector<Message> &incoming)
+{
+    if (n_past_start == 0)
+    {
+        mc.turns.clear();
+        mc.n_keep = -1;
+        mc.n_keep_msgs = 0;
+
+        // 只有 KV 从对话开头写入时，才能确定 system prompt 的边界
+        if (n_history == 0)
+        {
+            std::vector<Message> sys;
+            for (const auto &m : incoming)
+            {
+                if (m.role != "system")
+                    break;
+                sys.push_back(m);
+            }
+            mc.n_keep = sys.empty() ? 0 : system_prompt_tokens(model, sys);
+            mc.n_keep_msgs = sys.size();
+        }
+    }
+
+    // 上一轮被取消 / 出错回滚时留下的记录
+    while (!mc.turns.empty() && mc.turns.back().first >= n_past_start)
+        mc.turns.pop_back();
+    mc.turns.emplace_back(n_past_start, n_history);
+}
+
+void ContextShiftTruncate(ModelContext &mc)
+{
+    while (!mc.turns.empty() && mc.turns.back().first >= mc.n_past)
+        mc.turns.pop_back();
+    // system prompt 本身被改过：边界未知，不再平移，直到 KV 从头重写
+    if (mc.n_keep > mc.n_past || mc.turns.empty())
+        mc.n_keep = -1;
+}
+
+bool ContextShift(ModelContext &mc, Session &s, int keep_tokens)
+{
+    llama_memory_t mem = llama_get_memory(mc.ctx);
+    if (mc.n_keep < 0 || mc.turns.empty() || !mem || !llama_memory_can_shift(mem))
+        return false;
+
+    // 找第一个“从它开始到末尾不超过 keep_tokens”的轮次边界，丢弃 [n_keep, 该边界)
+    size_t cut = 0;
+    for (size_t i = 0; i < mc.turns.size(); ++i)
+    {
+        if (mc.turns[i].first > mc.n_keep && mc.turns[i].first >= mc.n_past - keep_tokens)
+        {
+            cut = i;
+            break;
+        }
+    }
+    if (cut == 0)
+        return false;
+
+    const int p0 = mc.n_keep;
+    const int p1 = mc.turns[cut].first;
+    const size_t m0 = mc.n_keep_msgs;
+    const size_t m1 = mc.turns[cut].second;
+    if (m1 <= m0 || m1 > s.history.size())
+        return false;
+
+    const int n_discard = p1 - p0;
+    llama_memory_seq_rm(mem, mc.seq_id, p0, p1);
+    llama_memory_seq_add(mem, mc.seq_id, p1, -1, -n_discard);
+    if (mc.tokens.size() == static_cast<size_t>(mc.n_past))
+        mc.tokens.erase(mc.tokens.begin() + p0, mc.tokens.begin() + p1);
+    else
+        mc.tokens.clear();
+    mc.n_past -= n_discard;
+
+    // 轮次记录：丢弃区间之前只剩第一轮（system prompt 所在），之后的整体前移
+    std::vector<std::pair<int, size_t>> turns;
+    turns.push_back(mc.turns.front());
+    for (size_t i = cut; i < mc.turns.size(); ++i)
+        turns.emplace_back(mc.turns[i].first - n_discard, mc.turns[i].second - (m1 - m0));
+    mc.turns = std::move(turns);
+
+    s.history.erase(s.history.begin() + m0, s.history.begin() + m1);
+    s.shift_head = m0;
+    s.n_shifted += m1 - m0;
+
+    // 草稿 KV 没有同步平移：等目标 KV 从头重写后再启用草稿模型
+    if (mc.draft_ctx)
+        mc.draft_n_past = -1;
+
+    LOG(INFO) << "[llama] context shift session=" << s.session_id
+              << " keep=" << p0
+              << " discard_tokens=" << n_discard
+              << " discard_msgs=" << (m1 - m0)
+              << " n_past=" << mc.n_past;
+    return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "serving/core/ServingContext.h"
+
+#include <vector>
+
+struct llama_model;
+struct ModelContext;
+struct Session;
+
+/**
+ * @brief 上下文平移（LLAMA_KV_OVERFLOW=shift）
+ *
+ * session 的 KV 逼近 n_ctx 时，不再整体重建，而是保留 system prompt 与最近的若干轮，
+ * 用 llama_memory_seq_rm 去掉中间部分、llama_memory_seq_add 把后面的位置前移（RoPE shift），
+ * 并同步删掉 Session::history 里对应的消息，KV 与 history 始终一一对应。
+ *
+ * - 以“轮”为单位丢弃：每轮开始时由 ContextShiftBeginTurn 记录该轮的 KV 起点与当时 history 的消息数
+ * - 被丢弃的消息记在 Session::shift_head / n_shifted，Gateway 比对客户端 messages 时跳过这段
+ * - 模型不支持平移（如 M-RoPE）、KV 不是从头按对话写入（如换入恢复）或最近一轮本身就超过保留长度时，
+ *   返回 false，由调用方退回原来的整体重建
+ */
+
+// 本轮 prompt 写入 KV 前调用：KV 中已有 n_history 条消息，incoming 为本轮展开的消息
+void ContextShiftBeginTurn(const llama_model *model, ModelContext &mc, int n_past_start,
+                           size_t n_history, const std::vector<Message> &incoming);
+
+// KV 被截到 mc.n_past（编辑 / 重新生成时的公共前缀）后调用：丢掉截断点之后的轮次记录
+void ContextShiftTruncate(ModelContext &mc);
+
+// 平移 mc 所在 seq，使 KV 只剩 system prompt + 不超过 keep_tokens 的最近几轮；调用方持有 s.mu
+bool ContextShift(ModelContext &mc, Session &s, int keep_tokens);
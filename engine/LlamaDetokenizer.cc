@@ -0,0 +1,238 @@
+#include "engine/LlamaDetokenizer.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <deque>
+
+namespace
+{
+constexpr const char *kUtf8Replacement = "\xEF\xBF\xBD";
+
+// 以 c 开头的 UTF-8 序列长度，非法首字节返回 0
+int utf8_len(unsigned char c)
+{
+    if (c < 0x80)
+        return 1;
+    if (c >= 0xC2 && c <= 0xDF)
+        return 2;
+    if (c >= 0xE0 && c <= 0xEF)
+        return 3;
+    if (c >= 0xF0 && c <= 0xF4)
+        return 4;
+    return 0;
+}
+} // namespace
+
+LlamaPieceTable::LlamaPieceTable(const llama_vocab *vocab)
+{
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    offsets_.reserve(static_cast<size_t>(n_vocab) + 1);
+    bytes_.reserve(static_cast<size_t>(n_vocab) * 8);
+
+    std::vector<char> buf(256);
+    for (int32_t tok = 0; tok < n_vocab; ++tok)
+    {
+        offsets_.push_back(static_cast<uint32_t>(bytes_.size()));
+        int n = llama_token_to_piece(vocab, tok, buf.data(), (int)buf.size(), 0, false);
+        if (n < 0)
+        {
+            buf.resize(-n);
+            n = llama_token_to_piece(vocab, tok, buf.data(), (int)buf.size(), 0, false);
+        }
+        if (n > 0)
+            bytes_.insert(bytes_.end(), buf.data(), buf.data() + n);
+    }
+    offsets_.push_back(static_cast<uint32_t>(bytes_.size()));
+    bytes_.shrink_to_fit();
+}
+
+LlamaPieceTable::LlamaPieceTable(const std::vector<std::string> &pieces)
+{
+    offsets_.reserve(pieces.size() + 1);
+    for (const auto &p : pieces)
+    {
+        offsets_.push_back(static_cast<uint32_t>(bytes_.size()));
+        bytes_.insert(bytes_.end(), p.begin(), p.end());
+    }
+    offsets_.push_back(static_cast<uint32_t>(bytes_.size()));
+}
+
+LlamaStopMatcher::LlamaStopMatcher(const std::vector<std::string> &stops)
+{
+    // 字母表压缩：stop 里出现过的字节各占一类，其余字节都是第 0 类
+    for (const auto &s : stops)
+    {
+        for (unsigned char c : s)
+        {
+            if (cls_[c] == 0)
+                cls_[c] = static_cast<uint16_t>(++n_classes_);
+        }
+    }
+    if (n_classes_ == 0)
+        return;
+    n_classes_ += 1;
+
+    // 1) trie
+    next_.assign(n_classes_, -1);
+    match_.assign(1, 0);
+    depth_.assign(1, 0);
+    for (const auto &s : stops)
+    {
+        if (s.empty())
+            continue;
+        int st = 0;
+        for (unsigned char c : s)
+        {
+            int32_t &nx = next_[st * n_classes_ + cls_[c]];
+            if (nx < 0)
+            {
+                nx = static_cast<int32_t>(match_.size());
+                next_.resize(next_.size() + n_classes_, -1);
+                match_.push_back(0);
+                depth_.push_back(depth_[st] + 1);
+            }
+            st = next_[st * n_classes_ + cls_[c]];
+        }
+        match_[st] = static_cast<int32_t>(s.size());
+    }
+
+    // 2) BFS 计算 fail，并把缺失的转移补成 fail 状态的转移（稠密 DFA）
+    std::vector<int32_t> fail(match_.size(), 0);
+    std::deque<int32_t> q;
+    for (int c = 0; c < n_classes_; ++c)
+    {
+        int32_t &nx = next_[c];
+        if (nx < 0)
+            nx = 0;
+        else
+            q.push_back(nx);
+    }
+    while (!q.empty())
+    {
+        const int32_t st = q.front();
+        q.pop_front();
+        // 后缀上结束的 stop 也在这里结束：取最长的一个
+        match_[st] = std::max(match_[st], match_[fail[st]]);
+        for (int c = 0; c < n_classes_; ++c)
+        {
+            int32_t &nx = next_[st * n_classes_ + c];
+            const int32_t via_fail = next_[fail[st] * n_classes_ + c];
+            if (nx < 0)
+            {
+                nx = via_fail;
+            }
+            else
+            {
+                fail[nx] = via_fail;
+                q.push_back(nx);
+            }
+        }
+    }
+}
+
+LlamaDetokenizer::LlamaDetokenizer(const LlamaPieceTable *pieces, const std::vector<std::string> &stops)
+    : pieces_(pieces), stop_(stops)
+{
+    size_t max_stop = 0;
+    for (const auto &s : stops)
+        max_stop = std::max(max_stop, s.size());
+    buf_.reserve(256 + max_stop);
+    out_.reserve(256 + max_stop);
+}
+
+bool LlamaDetokenizer::Push(int32_t tok)
+{
+    out_.clear();
+    if (stopped_)
+        return true;
+    if (tok < 0 || tok >= pieces_->n_vocab())
+        return false;
+
+    const size_t base = buf_.size();
+    buf_.append(pieces_->data(tok), pieces_->size(tok));
+
+    if (stop_.empty())
+    {
+        buf_.erase(0, Drain(buf_.size(), false));
+        return false;
+    }
+
+    for (size_t i = base; i < buf_.size(); ++i)
+    {
+        const int len = stop_.Feed(static_cast<unsigned char>(buf_[i]));
+        if (len > 0)
+        {
+            // stop 的全部字节都还在缓冲里（此前一直按 depth 扣留）：只输出它之前的部分
+            Drain(i + 1 - static_cast<size_t>(len), true);
+            buf_.clear();
+            stopped_ = true;
+            return true;
+        }
+    }
+
+    // 末尾 depth 个字节可能是某个 stop 的开头，先扣住
+    const size_t hold = static_cast<size_t>(stop_.depth());
+    buf_.erase(0, Drain(buf_.size() - hold, false));
+    return false;
+}
+
+void LlamaDetokenizer::Flush()
+{
+    out_.clear();
+    if (stopped_)
+        return;
+    Drain(buf_.size(), true);
+    buf_.clear();
+}
+
+size_t LlamaDetokenizer::Drain(size_t end, bool flush)
+{
+    size_t i = 0;
+    while (i < end)
+    {
+        const unsigned char c = static_cast<unsigned char>(buf_[i]);
+        if (c < 0x80)
+        {
+            out_.push_back(static_cast<char>(c));
+            ++i;
+            continue;
+        }
+
+        const int need = utf8_len(c);
+        if (need == 0)
+        {
+            out_.append(kUtf8Replacement);
+            ++i;
+            continue;
+        }
+
+        // 序列不完整：等下一个 token 补齐（结束时替换）
+        if (i + need > end)
+        {
+            if (!flush)
+                return i;
+            out_.append(kUtf8Replacement);
+            return end;
+        }
+
+        bool valid = true;
+        for (int k = 1; k < need; ++k)
+        {
+            if ((static_cast<unsigned char>(buf_[i + k]) & 0xC0) != 0x80)
+            {
+                valid = false;
+                break;
+            }
+        }
+        if (!valid)
+        {
+            out_.append(kUtf8Replacement);
+            ++i;
+            continue;
+        }
+
+        out_.append(buf_, i, need);
+        i += need;
+    }
+    return i;
+}
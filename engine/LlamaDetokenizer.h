@@ -0,0 +1,95 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct llama_vocab;
+
+/**
+ * @brief 整个词表的 token -> piece 表（模型加载时构建一次，只读，可跨线程共享）
+ *
+ * 所有 piece 连续存放在一块内存里，offsets[tok]..offsets[tok+1] 为该 token 的字节；
+ * 与 token_to_piece(vocab, tok) 结果一致（special=false：控制 token 为空串）。
+ */
+class LlamaPieceTable
+{
+public:
+    explicit LlamaPieceTable(const llama_vocab *vocab);
+    // 直接给定每个 token 的 piece（不需要模型，测试用）
+    explicit LlamaPieceTable(const std::vector<std::string> &pieces);
+
+    const char *data(int32_t tok) const { return bytes_.data() + offsets_[tok]; }
+    size_t size(int32_t tok) const { return offsets_[tok + 1] - offsets_[tok]; }
+    int32_t n_vocab() const { return static_cast<int32_t>(offsets_.size()) - 1; }
+    size_t bytes() const { return bytes_.size() + offsets_.size() * sizeof(uint32_t); }
+
+private:
+    std::vector<char> bytes_;
+    std::vector<uint32_t> offsets_;
+};
+
+/**
+ * @brief 多个 stop 字符串的 Aho-Corasick 自动机（按字节匹配）
+ *
+ * 构建时把 goto / fail 展开成稠密转移表，字母表压缩为 stop 字符串里出现过的字节 + “其它”，
+ * 每输入一个字节只查一次表。depth() 为当前状态对应的最长“stop 前缀”长度，
+ * 即流末尾还可能成为 stop 一部分的字节数。
+ */
+class LlamaStopMatcher
+{
+public:
+    explicit LlamaStopMatcher(const std::vector<std::string> &stops);
+
+    bool empty() const { return n_classes_ == 0; }
+
+    void Reset() { state_ = 0; }
+
+    // 输入一个字节；有 stop 字符串在此结束时返回其长度，否则返回 0
+    int Feed(unsigned char c)
+    {
+        state_ = next_[state_ * n_classes_ + cls_[c]];
+        return match_[state_];
+    }
+
+    int depth() const { return depth_[state_]; }
+
+private:
+    int n_classes_ = 0;
+    int state_ = 0;
+    uint16_t cls_[256] = {};
+    std::vector<int32_t> next_;  // [state * n_classes + class]
+    std::vector<int32_t> match_; // 在该状态结束的最长 stop 长度（0 表示无）
+    std::vector<int32_t> depth_;
+};
+
+/**
+ * @brief 单个请求的流式 detokenizer
+ *
+ * - Push(tok) 从 LlamaPieceTable 取 piece 追加到内部缓冲，只输出完整的 UTF-8 序列（非法字节替换为 U+FFFD）
+ * - 配置了 stop 字符串时，缓冲末尾可能构成 stop 前缀的字节暂不输出；stop 跨 token 完成的那一步
+ *   只输出 stop 之前的文本并返回 true，调用方据此以 stop 结束生成（stop 本身不输出）
+ * - Flush() 在生成结束时输出剩余字节（不完整的 UTF-8 尾部替换为 U+FFFD）
+ * - 输出缓冲与内部缓冲预留容量、就地复用：逐 token 路径不分配内存
+ */
+class LlamaDetokenizer
+{
+public:
+    LlamaDetokenizer(const LlamaPieceTable *pieces, const std::vector<std::string> &stops);
+
+    // 返回 true 表示命中 stop；本步可输出的文本在 text()
+    bool Push(int32_t tok);
+    void Flush();
+
+    const std::string &text() const { return out_; }
+    bool stopped() const { return stopped_; }
+
+private:
+    // 把 buf_[0, end) 中完整的 UTF-8 序列写入 out_，返回消耗的字节数
+    size_t Drain(size_t end, bool flush);
+
+    const LlamaPieceTable *pieces_;
+    LlamaStopMatcher stop_;
+    std::string buf_; // 尚未输出的字节
+    std::string out_; // 本步输出
+    bool stopped_ = false;
+};
@@ -0,0 +1,310 @@
+#include "engine/LlamaEmbeddingEngine.h"
+#include "engine/LlamaCommon.h"
+#include "engine/LlamaThreadBudget.h"
+#include "llama.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace
+{
+enum llama_pooling_type parse_pooling(const std::string &s)
+{
+    if (s == "cls")
+        return LLAMA_POOLING_TYPE_CLS;
+    if (s == "last")
+        return LLAMA_POOLING_TYPE_LAST;
+    if (s == "mean")
+        return LLAMA_POOLING_TYPE_MEAN;
+    // 使用模型 GGUF 里声明的池化方式
+    return LLAMA_POOLING_TYPE_UNSPECIFIED;
+}
+} // namespace
+
+LlamaEmbeddingEngine::LlamaEmbeddingEngine(const std::string &model_path, const std::map<std::string, std::string> &options)
+{
+    llama_backend_init();
+
+    if (get_option_int(options, "LLAMA_MMAP_PREFETCH", 0) > 0)
+        prefetch_file(model_path);
+    model_ = llama_model_load_from_file(model_path.c_str(), model_load_params(options));
+    if (!model_)
+    {
+        LOG(ERROR) << "[embd] failed to load model: " << model_path;
+        return;
+    }
+
+    n_batch_ = get_option_int(options, "LLAMA_EMBEDDING_N_BATCH", 2048);
+    n_seq_max_ = get_option_int(options, "LLAMA_EMBEDDING_BATCH_SEQS", 32);
+    max_pending_ = static_cast<size_t>(get_option_int(options, "MAX_MODEL_QUEUE", 64));
+    n_embd_ = llama_model_n_embd(model_);
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.embeddings = true;
+    cparams.pooling_type = parse_pooling(get_option_str(options, "LLAMA_EMBEDDING_POOLING", "mean"));
+    cparams.n_ctx = n_batch_;
+    // 非因果模型要求一个 seq 的全部 token 在同一个 ubatch 里
+    cparams.n_batch = n_batch_;
+    cparams.n_ubatch = n_batch_;
+    cparams.n_seq_max = n_seq_max_;
+    cparams.kv_unified = true; // 各输入长度不一，按实际 token 共用 n_ctx
+    cparams.n_threads = get_option_int(options, "LLAMA_N_THREADS", 4);
+    cparams.n_threads_batch = get_option_int(options, "LLAMA_N_THREADS_BATCH", 4);
+
+    lctx_ = llama_init_from_model(model_, cparams);
+    if (!lctx_)
+    {
+        LOG(ERROR) << "[embd] failed to create embedding context";
+        llama_model_free(model_);
+        model_ = nullptr;
+        return;
+    }
+
+    if (llama_pooling_type(lctx_) == LLAMA_POOLING_TYPE_NONE)
+        LOG(WARNING) << "[embd] model has no pooling, set LLAMA_EMBEDDING_POOLING=mean|cls|last";
+
+    worker_ = std::thread([this]
+                          { Loop(); });
+
+    LOG(INFO) << "[embd] engine started model=" << model_path
+              << " n_embd=" << n_embd_
+              << " n_batch=" << n_batch_
+              << " batch_seqs=" << n_seq_max_;
+}
+
+LlamaEmbeddingEngine::~LlamaEmbeddingEngine()
+{
+    stop_.store(true);
+    cv_.notify_all();
+    if (worker_.joinable())
+        worker_.join();
+
+    // 队列里剩下的请求直接结束
+    for (auto &req : pending_)
+        Fail(*req, FinishReason::error, "LlamaEmbeddingEngine: shutting down");
+
+    if (lctx_)
+        llama_free(lctx_);
+    if (model_)
+        llama_model_free(model_);
+    llama_backend_free();
+}
+
+size_t LlamaEmbeddingEngine::ResidentBytes() const
+{
+    return model_ ? static_cast<size_t>(llama_model_size(model_)) + kv_bytes_per_token(model_) * n_batch_ : 0;
+}
+
+void LlamaEmbeddingEngine::Run(std::shared_ptr<ServingContext> ctx)
+{
+    if (!ctx)
+        return;
+
+    auto req = std::make_shared<Request>();
+    req->ctx = ctx;
+    if (ctx->inputs.empty())
+    {
+        Fail(*req, FinishReason::error, "LlamaEmbeddingEngine: empty input");
+        return;
+    }
+
+    // tokenize 在调用线程上做，调度线程只负责拼 batch 与 decode
+    const llama_vocab *vocab = llama_model_get_vocab(model_);
+    req->tokens.resize(ctx->inputs.size());
+    for (size_t i = 0; i < ctx->inputs.size(); ++i)
+    {
+        auto &toks = req->tokens[i];
+        if (!tokenize_text(vocab, ctx->inputs[i], toks, true) || toks.empty())
+        {
+            Fail(*req, FinishReason::error, "LlamaEmbeddingEngine: tokenize failed, input=" + std::to_string(i));
+            return;
+        }
+        if ((int)toks.size() > n_batch_)
+        {
+            Fail(*req, FinishReason::error, "LlamaEmbeddingEngine: input " + std::to_string(i) + " too long, tokens=" +
+                                                std::to_string(toks.size()) + " max=" + std::to_string(n_batch_));
+            return;
+        }
+        ctx->usage.prompt_tokens += static_cast<int>(toks.size());
+    }
+    ctx->embeddings.assign(ctx->inputs.size(), {});
+
+    bool queued = false;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (pending_.size() < std::max<size_t>(1, max_pending_))
+        {
+            pending_.push_back(req);
+            queued = true;
+        }
+    }
+    if (!queued)
+    {
+        ctx->params["error_code"] = "overloaded";
+        Fail(*req, FinishReason::error, "LlamaEmbeddingEngine: queue full, model=" + ctx->model);
+        return;
+    }
+    cv_.notify_one();
+}
+
+void LlamaEmbeddingEngine::Loop()
+{
+    while (!stop_.load())
+    {
+        {
+            std::unique_lock<std::mutex> lk(mu_);
+            cv_.wait(lk, [&]
+                     { return stop_.load() || !pending_.empty(); });
+            if (stop_.load())
+                return;
+        }
+
+        // 上一个 batch 运行期间到达的请求在这里一起合并
+        const auto items = CollectBatch();
+        if (!items.empty())
+            RunBatch(items);
+    }
+}
+
+std::vector<LlamaEmbeddingEngine::Item> LlamaEmbeddingEngine::CollectBatch()
+{
+    std::vector<Item> items;
+    std::vector<std::shared_ptr<Request>> cancelled;
+    int n_tokens = 0;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        bool full = false;
+        while (!pending_.empty() && !full)
+        {
+            auto req = pending_.front();
+            if (req->next == 0 && req->ctx->cancelled.load(std::memory_order_acquire))
+            {
+                pending_.pop_front();
+                cancelled.push_back(std::move(req));
+                continue;
+            }
+
+            while (req->next < req->tokens.size())
+            {
+                const int n = static_cast<int>(req->tokens[req->next].size());
+                if ((int)items.size() >= n_seq_max_ || n_tokens + n > n_batch_)
+                {
+                    full = true;
+                    break;
+                }
+                items.push_back({req, req->next});
+                n_tokens += n;
+                ++req->next;
+            }
+            // 该请求的输入都已放进 batch：出队，结果回来后结束
+            if (!full)
+                pending_.pop_front();
+        }
+    }
+
+    // EmitFinish 不放在锁内
+    for (auto &req : cancelled)
+        Fail(*req, FinishReason::cancelled, "");
+    return items;
+}
+
+void LlamaEmbeddingEngine::RunBatch(const std::vector<Item> &items)
+{
+    const auto t0 = std::chrono::steady_clock::now();
+
+    int n_tokens = 0;
+    for (const auto &it : items)
+        n_tokens += static_cast<int>(it.req->tokens[it.index].size());
+
+    llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+    for (size_t s = 0; s < items.size(); ++s)
+    {
+        const auto &toks = items[s].req->tokens[items[s].index];
+        for (size_t j = 0; j < toks.size(); ++j)
+        {
+            const int i = batch.n_tokens++;
+            batch.token[i] = toks[j];
+            batch.pos[i] = static_cast<llama_pos>(j);
+            batch.n_seq_id[i] = 1;
+            batch.seq_id[i][0] = static_cast<llama_seq_id>(s);
+            batch.logits[i] = true;
+        }
+    }
+
+    // 每个 batch 独立：先清掉上一批的 KV（纯 encoder 模型没有 memory）
+    if (llama_memory_t mem = llama_get_memory(lctx_))
+        llama_memory_clear(mem, true);
+
+    const bool encoder_only = llama_model_has_encoder(model_) && !llama_model_has_decoder(model_);
+    int rc;
+    {
+        LlamaThreadBudget::Lease lease(lctx_, LlamaThreadBudget::Phase::embed);
+        rc = encoder_only ? llama_encode(lctx_, batch) : llama_decode(lctx_, batch);
+    }
+    llama_batch_free(batch);
+
+    for (size_t s = 0; s < items.size(); ++s)
+    {
+        Request &req = *items[s].req;
+        if (req.failed)
+            continue;
+
+        const float *embd = rc == 0 ? llama_get_embeddings_seq(lctx_, static_cast<llama_seq_id>(s)) : nullptr;
+        if (!embd)
+        {
+            Fail(req, FinishReason::error, rc != 0 ? "LlamaEmbeddingEngine: llama_decode failed, rc=" + std::to_string(rc)
+                                                   : "LlamaEmbeddingEngine: no pooled embedding");
+            continue;
+        }
+
+        // L2 归一化（与 OpenAI embeddings 一致，可直接点积算余弦相似度）
+        double norm = 0;
+        for (int k = 0; k < n_embd_; ++k)
+            norm += static_cast<double>(embd[k]) * embd[k];
+        const float scale = norm > 0 ? static_cast<float>(1.0 / std::sqrt(norm)) : 0.0f;
+
+        auto &out = req.ctx->embeddings[items[s].index];
+        out.resize(n_embd_);
+        for (int k = 0; k < n_embd_; ++k)
+            out[k] = embd[k] * scale;
+
+        if (++req.done == req.tokens.size())
+        {
+            req.ctx->usage.total_tokens = req.ctx->usage.prompt_tokens;
+            req.ctx->EmitFinish(FinishReason::stop);
+        }
+    }
+
+    const auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+    batches_.fetch_add(1, std::memory_order_relaxed);
+    inputs_.fetch_add(static_cast<int64_t>(items.size()), std::memory_order_relaxed);
+    tokens_.fetch_add(n_tokens, std::memory_order_relaxed);
+    batch_us_.fetch_add(us, std::memory_order_relaxed);
+}
+
+void LlamaEmbeddingEngine::Fail(Request &req, FinishReason reason, const std::string &msg)
+{
+    if (req.failed)
+        return;
+    req.failed = true;
+    // 跨 batch 的请求剩余输入不再处理
+    req.next = req.tokens.size();
+    if (!msg.empty())
+        req.ctx->error_message = msg;
+    req.ctx->usage.total_tokens = req.ctx->usage.prompt_tokens;
+    req.ctx->EmitFinish(reason);
+}
+
+void LlamaEmbeddingEngine::CollectMetrics(std::map<std::string, double> &out) const
+{
+    const int64_t batches = batches_.load(std::memory_order_relaxed);
+    const int64_t inputs = inputs_.load(std::memory_order_relaxed);
+    out["embedding_batches_total"] = static_cast<double>(batches);
+    out["embedding_inputs_total"] = static_cast<double>(inputs);
+    out["embedding_tokens_total"] = static_cast<double>(tokens_.load(std::memory_order_relaxed));
+    out["embedding_batch_ms_total"] = batch_us_.load(std::memory_order_relaxed) / 1000.0;
+    out["embedding_inputs_per_batch"] = batches > 0 ? static_cast<double>(inputs) / batches : 0.0;
+}
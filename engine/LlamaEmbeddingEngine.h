@@ -0,0 +1,84 @@
+#pragma once
+#include "serving/core/ServingContext.h"
+#include "serving/core/ModelEngine.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct llama_model;
+struct llama_context;
+
+/**
+ * @brief Embedding 模式的 llama 引擎（/v1/embeddings）
+ *
+ * - Run 在调用线程上 tokenize 后入队，立即返回（IsAsync）
+ * - 内部线程把并发请求的输入合并进同一个 llama_batch：每个输入一个 seq_id，
+ *   受 n_seq_max（LLAMA_EMBEDDING_BATCH_SEQS）与 n_batch（LLAMA_EMBEDDING_N_BATCH）限制；
+ *   一个请求的多个输入可以跨 batch
+ * - 由 llama.cpp 按 pooling_type（mean / cls / last）在 seq 内池化，结果做 L2 归一化
+ * - 每个 batch 之间清空 KV，请求之间互不影响
+ */
+class LlamaEmbeddingEngine final : public ModelEngine
+{
+public:
+    // options：只对本模型生效的配置覆盖（键为环境变量名）
+    explicit LlamaEmbeddingEngine(const std::string &model_path, const std::map<std::string, std::string> &options = {});
+    ~LlamaEmbeddingEngine() override;
+
+    // 模型与 context 是否创建成功
+    bool loaded() const { return lctx_ != nullptr; }
+
+    void Run(std::shared_ptr<ServingContext> ctx) override;
+    bool IsAsync() const override { return true; }
+    void CollectMetrics(std::map<std::string, double> &out) const override;
+    size_t ResidentBytes() const override;
+
+private:
+    struct Request
+    {
+        std::shared_ptr<ServingContext> ctx;
+        std::vector<std::vector<int32_t>> tokens; // 每个输入的 token
+        size_t next = 0;                          // 下一个待放入 batch 的输入
+        size_t done = 0;                          // 已得到结果的输入数
+        bool failed = false;
+    };
+
+    // batch 中的一个输入：所属请求 + 输入下标
+    struct Item
+    {
+        std::shared_ptr<Request> req;
+        size_t index;
+    };
+
+    void Loop();
+    std::vector<Item> CollectBatch();
+    void RunBatch(const std::vector<Item> &items);
+    void Fail(Request &req, FinishReason reason, const std::string &msg);
+
+private:
+    llama_model *model_ = nullptr;
+    llama_context *lctx_ = nullptr;
+    int n_batch_ = 2048;
+    int n_seq_max_ = 32;
+    int n_embd_ = 0;
+    size_t max_pending_ = 64;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<std::shared_ptr<Request>> pending_;
+    std::atomic<bool> stop_{false};
+    std::thread worker_;
+
+    std::atomic<int64_t> batches_{0};
+    std::atomic<int64_t> inputs_{0};
+    std::atomic<int64_t> tokens_{0};
+    std::atomic<int64_t> batch_us_{0};
+};
@@ -2,32 +2,31 @@
 #include "serving/core/ServingContext.h"
 #include "serving/core/Session.h"
 #include "engine/ModelContext.h"
+#include "engine/LlamaCommon.h"
+#include "engine/LlamaBatchScheduler.h"
+#include "engine/LlamaSlotPool.h"
+#include "engine/LlamaContextPool.h"
+#include "engine/LlamaPrefixCache.h"
+#include "engine/LlamaKvSwap.h"
+#include "engine/LlamaSpeculative.h"
+#include "engine/LlamaNgramLookup.h"
+#include "engine/LlamaSampling.h"
+#include "engine/LlamaDetokenizer.h"
+#include "engine/LlamaContextShift.h"
+#include "engine/LlamaChatTemplate.h"
+#include "engine/LlamaThreadBudget.h"
+#include "engine/LlamaMultimodal.h"
+#include "engine/LlamaImageStage.h"
+#include "engine/LlamaLoraCache.h"
 #include "llama.h"
 
-#include <cassert>
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <vector>
 #include <string>
 #include <cstring>
-#include <cstdlib>
-
-namespace
-{
-int get_env_int(const char *name, int def)
-{
-    const char *v = std::getenv(name);
-    if (!v || !*v)
-        return def;
-    try
-    {
-        int n = std::stoi(v);
-        return n > 0 ? n : def;
-    }
-    catch (...)
-    {
-        return def;
-    }
-}
-} // namespace
+#include <shared_mutex>
 
 // 把 token decode 到 llama_context（prefill/append 都走它）
 static bool decode_tokens(llama_context *lctx,
@@ -43,196 +42,539 @@ static bool decode_tokens(llama_context *lctx,
     return llama_decode(lctx, batch) == 0;
 }
 
-// 将字符串 tokenize 成 llama_token
-static bool tokenize_text(const llama_vocab *vocab, const std::string &text, std::vector<llama_token> &out, bool add_special)
+// KV 续写 decode：pos 必须从 n_past 开始递增；返回 llama_decode 的返回码
+static int decode_tokens(llama_context *lctx,
+                         const llama_token *toks,
+                         int n,
+                         int n_past,
+                         int seq_id,
+                         LlamaThreadBudget::Phase phase,
+                         bool all_logits = false)
 {
-    if (!vocab)
-        return false;
-    out.clear();
-    out.resize(text.size() + 16);
-
-    int n = llama_tokenize(
-        vocab,
-        text.c_str(),
-        (int)text.size(),
-        out.data(),
-        (int)out.size(),
-        add_special,
-        true);
-
-    if (n < 0)
-        return false;
-    out.resize(n);
-    return true;
+    if (!lctx || n <= 0)
+        return 0;
+
+    llama_batch batch = llama_batch_init(n, 0, 1);
+    batch.n_tokens = n;
+
+    for (int i = 0; i < n; ++i)
+    {
+        batch.token[i] = toks[i];
+        batch.pos[i] = n_past + i;
+
+        batch.n_seq_id[i] = 1;
+        batch.seq_id[i][0] = seq_id;
+
+        // 通常只需要最后一个 token 的 logits 用于采样；投机校验需要每个位置
+        batch.logits[i] = all_logits || (i == n - 1);
+    }
+
+    int rc;
+    {
+        LlamaThreadBudget::Lease lease(lctx, phase);
+        rc = llama_decode(lctx, batch);
+    }
+    llama_batch_free(batch);
+    return rc;
+}
+
+// 请求是否允许投机解码：params["speculative"] 缺省为允许
+static bool speculative_requested(const ServingContext &ctx)
+{
+    auto it = ctx.params.find("speculative");
+    return it == ctx.params.end() || (it->second != "false" && it->second != "0");
+}
+
+// prefill 期间的 abort callback：请求取消即中断 llama_decode
+static bool abort_if_cancelled(void *data)
+{
+    return static_cast<ServingContext *>(data)->cancelled.load(std::memory_order_acquire);
 }
 
-// 使用 llama_chat_apply_template 生成“本轮增量 prompt”
-// 逻辑参考 llama.cpp/examples/simple-chat：用历史长度裁剪出 delta
-static bool build_chat_delta_prompt(
-    const llama_model *model,
-    const std::vector<Message> &history,
-    const std::vector<Message> &incoming,
-    std::string &out_prompt,
-    std::string &err)
+// Session 析构钩子与引擎析构之间的闸门
+struct KvSwapGate
+{
+    std::shared_mutex mu;
+    std::shared_ptr<LlamaKvSwap> swap; // 引擎析构时在独占锁下置空
+};
+
+// Session 析构时把它独占 context 里的 KV 换出（此时已没有请求在用这个 context）；
+// 全程持 gate 共享锁：引擎析构要等它结束才能 Detach / 释放 context
+static void swap_out_session(const std::shared_ptr<KvSwapGate> &gate, Session &s, int min_tokens)
 {
-    const char *tmpl = llama_model_chat_template(model, nullptr);
-    if (!tmpl)
-        tmpl = "chatml";
+    std::shared_lock<std::shared_mutex> lk(gate->mu);
+    const auto &swap = gate->swap;
+    const auto &mc = s.model_ctx;
+    // 平移过的 session：history 与客户端 messages 不再是前缀关系，换入时对不上；
+    // 带 LoRA adapter 写入的 KV 换入时无法确认 adapter 是否一致，不换出
+    if (!swap || s.closed || s.ephemeral || s.history.empty() || s.n_shifted > 0 || !mc || !mc->ctx ||
+        mc->n_past < min_tokens || !mc->lora_key.empty())
+        return;
 
-    std::vector<llama_chat_message> full_msgs;
-    full_msgs.reserve(history.size() + incoming.size());
-    for (const auto &m : history)
+    LlamaKvSwap::Entry e;
+    e.data.resize(llama_state_seq_get_size(mc->ctx, mc->seq_id));
+    if (e.data.empty() || llama_state_seq_get_data(mc->ctx, e.data.data(), e.data.size(), mc->seq_id) != e.data.size())
+        return;
+
+    e.history = s.history;
+    e.n_past = mc->n_past;
+    const size_t bytes = e.data.size();
+    swap->Put(s.session_id, std::move(e));
+
+    LOG(INFO) << "[kv-swap] swap out session=" << s.session_id
+              << " tokens=" << mc->n_past << " bytes=" << bytes;
+}
+
+LlamaEngine::LlamaEngine(const std::string &model_path, std::map<std::string, std::string> options)
+    : model_path_(model_path), options_(std::move(options))
+{
+    using Clock = std::chrono::steady_clock;
+    auto ms_since = [](Clock::time_point t0)
+    { return std::chrono::duration<double, std::milli>(Clock::now() - t0).count(); };
+
+    llama_backend_init();
+
+    // 启动阶段计时：prefetch（可选）-> 加载权重 -> 初始化 context / 调度 -> warm-up
+    auto t0 = Clock::now();
+    if (OptInt("LLAMA_MMAP_PREFETCH", 0) > 0)
     {
-        full_msgs.push_back({m.role.c_str(), m.content.c_str()});
+        const size_t bytes = prefetch_file(model_path);
+        startup_.prefetch_ms = ms_since(t0);
+        LOG(INFO) << "[llama] prefetch model=" << model_path << " mb=" << (bytes >> 20)
+                  << " ms=" << startup_.prefetch_ms;
     }
-    for (const auto &m : incoming)
+
+    t0 = Clock::now();
+    model_ = llama_model_load_from_file(model_path.c_str(), model_load_params(options_));
+    startup_.load_ms = ms_since(t0);
+    if (!model_)
     {
-        full_msgs.push_back({m.role.c_str(), m.content.c_str()});
+        LOG(ERROR) << "[llama] failed to load model: " << model_path;
+        return;
     }
 
-    int32_t prev_len = 0;
-    if (!history.empty())
+    t0 = Clock::now();
+
+    // KV cache 类型（量化 KV 时每 token 字节数按块大小计算）
+    kv_type_k_ = kv_cache_type(options_, "LLAMA_CACHE_TYPE_K");
+    kv_type_v_ = kv_cache_type(options_, "LLAMA_CACHE_TYPE_V");
+    kv_token_bytes_ = kv_bytes_per_token(model_, kv_type_k_, kv_type_v_);
+    LOG(INFO) << "[llama] kv cache type_k=" << ggml_type_name(kv_type_k_) << " type_v=" << ggml_type_name(kv_type_v_)
+              << " bytes_per_token=" << kv_token_bytes_;
+
+    // LoRA adapter 与基座共用权重，按需加载；缓存按 GGUF 文件大小计（0 不限制）
+    lora_ = std::make_shared<LlamaLoraCache>(model_, static_cast<size_t>(OptInt("LLAMA_LORA_CACHE_MB", 1024)) << 20);
+
+    samplers_ = std::make_shared<LlamaSamplerCache>(llama_model_get_vocab(model_),
+                                                    static_cast<size_t>(OptInt("LLAMA_SAMPLER_CACHE_SIZE", 64)),
+                                                    static_cast<size_t>(OptInt("LLAMA_GRAMMAR_CACHE_SIZE", 32)));
+    pieces_ = std::make_shared<LlamaPieceTable>(llama_model_get_vocab(model_));
+    chat_tmpl_ = std::make_shared<LlamaChatTemplate>(model_);
+    LOG(INFO) << "[llama] chat template incremental=" << (chat_tmpl_->incremental() ? "yes" : "no");
+    LOG(INFO) << "[llama] piece table n_vocab=" << pieces_->n_vocab() << " bytes=" << pieces_->bytes();
+
+    // 调度模式：serial（默认，按模型串行 Run）/ continuous（continuous batching）
+    const std::string mode = OptStr("LLAMA_SCHEDULER", "serial");
+    prefill_chunk_ = OptInt("LLAMA_PREFILL_CHUNK", 512);
+    max_n_ = std::max(1, OptInt("LLAMA_MAX_N", 1));
+
+    // KV 模式：per_session（默认，每个 Session 一个 context）/ shared（共享 context + seq slot）
+    if (OptStr("LLAMA_KV_MODE", "per_session") == "shared")
     {
-        std::vector<llama_chat_message> prev_msgs;
-        prev_msgs.reserve(history.size());
-        for (const auto &m : history)
+        LlamaSlotPool::Options popt;
+        // continuous 模式下调度线程只驱动一个 context
+        popt.n_contexts = mode == "continuous" ? 1 : OptInt("LLAMA_SHARED_CONTEXTS", 1);
+        popt.n_slots = OptInt("LLAMA_SHARED_SLOTS", 32);
+        popt.n_ctx = OptInt("LLAMA_SHARED_N_CTX", 16384);
+        popt.n_ctx_per_seq = OptInt("LLAMA_N_CTX", 4096);
+        popt.n_batch = popt.n_ctx_per_seq + popt.n_slots;
+        popt.n_threads = OptInt("LLAMA_N_THREADS", 4);
+        popt.n_threads_batch = OptInt("LLAMA_N_THREADS_BATCH", 4);
+        popt.prefix_cache_tokens = OptInt("LLAMA_PREFIX_CACHE_TOKENS", 0);
+        popt.prefix_cache_seqs = OptInt("LLAMA_PREFIX_CACHE_SEQS", 8);
+        popt.prefix_cache_min_tokens = OptInt("LLAMA_PREFIX_CACHE_MIN_TOKENS", 32);
+        popt.type_k = kv_type_k_;
+        popt.type_v = kv_type_v_;
+        popt.kv_token_bytes = kv_token_bytes_;
+
+        pool_ = std::make_shared<LlamaSlotPool>(model_, popt);
+        if (!pool_->Init())
         {
-            prev_msgs.push_back({m.role.c_str(), m.content.c_str()});
+            LOG(ERROR) << "[llama] shared kv pool init failed, fallback to per_session";
+            pool_.reset();
         }
-        prev_len = llama_chat_apply_template(tmpl, prev_msgs.data(), prev_msgs.size(), false, nullptr, 0);
-        if (prev_len < 0)
+        else
         {
-            err = "chat template apply failed (prev)";
-            return false;
+            fixed_kv_bytes_ = kv_token_bytes_ * popt.n_contexts * popt.n_ctx;
         }
     }
 
-    int32_t new_len = llama_chat_apply_template(tmpl, full_msgs.data(), full_msgs.size(), true, nullptr, 0);
-    if (new_len < 0)
+    // KV 溢出策略：reset（默认，整体重建）/ shift（保留 system prompt + 最近若干轮）
+    if (OptStr("LLAMA_KV_OVERFLOW", "reset") == "shift")
     {
-        err = "chat template apply failed (full)";
-        return false;
+        const int n_ctx = pool_ ? pool_->n_ctx_per_seq() : OptInt("LLAMA_N_CTX", 4096);
+        shift_keep_tokens_ = std::min(OptInt("LLAMA_SHIFT_KEEP_TOKENS", n_ctx / 2),
+                                      n_ctx - OptInt("KV_RESET_MARGIN", 256));
     }
 
-    std::string formatted;
-    formatted.resize(new_len);
-    int32_t res = llama_chat_apply_template(tmpl, full_msgs.data(), full_msgs.size(), true, formatted.data(), formatted.size());
-    if (res < 0)
+    if (mode == "continuous")
     {
-        err = "chat template apply failed (format)";
-        return false;
-    }
+        LlamaBatchScheduler::Options opt;
+        opt.n_slots = OptInt("LLAMA_BATCH_SLOTS", 8);
+        opt.n_ctx_per_slot = OptInt("LLAMA_N_CTX", 4096);
+        opt.n_threads = OptInt("LLAMA_N_THREADS", 4);
+        opt.n_threads_batch = OptInt("LLAMA_N_THREADS_BATCH", 4);
+        opt.max_pending = static_cast<size_t>(OptInt("MAX_MODEL_QUEUE", 64));
+        opt.max_queue_wait_ms = OptInt("MAX_QUEUE_WAIT_MS", 2000);
+        opt.kv_reset_margin = OptInt("KV_RESET_MARGIN", 256);
+        opt.prefill_chunk = prefill_chunk_;
+        opt.shift_keep_tokens = shift_keep_tokens_;
+        opt.type_k = kv_type_k_;
+        opt.type_v = kv_type_v_;
+        opt.lora_switch_steps = OptInt("LLAMA_LORA_SWITCH_STEPS", 16);
 
-    if (prev_len < 0)
-        prev_len = 0;
-    if (prev_len > res)
-        prev_len = 0;
-
-    out_prompt.assign(formatted.data() + prev_len, formatted.data() + res);
-    return true;
-}
-
-// token -> piece（detokenize）
-static std::string token_to_piece(const llama_vocab *vocab, llama_token tok)
-{
-    std::string s;
-    s.resize(64);
-
-    int n = llama_token_to_piece(vocab, tok, s.data(), (int)s.size(), 0, false);
-    if (n < 0)
-        return "";
+        scheduler_ = std::make_unique<LlamaBatchScheduler>(model_, opt, pool_, samplers_, pieces_, chat_tmpl_);
+        if (!scheduler_->Start())
+        {
+            LOG(ERROR) << "[llama] continuous scheduler start failed, fallback to serial";
+            scheduler_.reset();
+        }
+        else if (!pool_)
+        {
+            fixed_kv_bytes_ = kv_token_bytes_ * opt.n_slots * opt.n_ctx_per_slot;
+        }
+    }
 
-    if (n > (int)s.size())
+    // KV 换出只用于 per_session + serial：Session 析构时可以安全读取它独占的 context；
+    // shared 模式的 context 由引擎线程持续使用，continuous 非共享模式则没有 session 级 KV
+    const size_t swap_ram = static_cast<size_t>(OptInt("LLAMA_KV_SWAP_RAM_MB", 0)) << 20;
+    const std::string swap_dir = OptStr("LLAMA_KV_SWAP_DIR", "");
+    if ((swap_ram > 0 || !swap_dir.empty()) && !pool_ && !scheduler_)
     {
-        s.resize(n);
-        n = llama_token_to_piece(vocab, tok, s.data(), (int)s.size(), 0, false);
-        if (n < 0)
-            return "";
+        LlamaKvSwap::Options sopt;
+        sopt.ram_bytes = swap_ram;
+        sopt.disk_dir = swap_dir;
+        sopt.disk_bytes = static_cast<size_t>(OptInt("LLAMA_KV_SWAP_DISK_MB", 4096)) << 20;
+        sopt.file_prefix = "kv-" + std::to_string(std::hash<std::string>{}(model_path));
+        swap_ = std::make_shared<LlamaKvSwap>(sopt);
+        swap_gate_ = std::make_shared<KvSwapGate>();
+        swap_gate_->swap = swap_;
+        swap_min_tokens_ = OptInt("LLAMA_KV_SWAP_MIN_TOKENS", 128);
+    }
+    else if (swap_ram > 0 || !swap_dir.empty())
+    {
+        LOG(WARNING) << "[llama] kv swap requires LLAMA_KV_MODE=per_session and LLAMA_SCHEDULER=serial, disabled";
     }
-    s.resize(n);
-    return s;
-}
 
-// KV 续写 decode：pos 必须从 n_past 开始递增
-static bool decode_tokens(llama_context *lctx,
-                          const std::vector<llama_token> &toks,
-                          int n_past)
-{
-    if (!lctx || toks.empty())
-        return true;
+    // 投机解码：草稿模型按 session 维护 KV，只在串行 Run 中使用
+    const std::string draft_path = OptStr("LLAMA_DRAFT_MODEL_PATH", "");
+    if (!draft_path.empty() && scheduler_)
+    {
+        LOG(WARNING) << "[llama] speculative decoding requires LLAMA_SCHEDULER=serial, draft model ignored";
+    }
+    else if (!draft_path.empty())
+    {
+        LlamaSpeculative::Options sopt;
+        sopt.draft_path = draft_path;
+        sopt.n_ctx = OptInt("LLAMA_N_CTX", 4096);
+        sopt.n_batch = prefill_chunk_;
+        sopt.n_threads = OptInt("LLAMA_N_THREADS", 4);
+        sopt.n_threads_batch = OptInt("LLAMA_N_THREADS_BATCH", 4);
+        sopt.n_min = OptInt("LLAMA_DRAFT_N_MIN", 2);
+        sopt.n_max = OptInt("LLAMA_DRAFT_N_MAX", 8);
+        sopt.type_k = kv_type_k_;
+        sopt.type_v = kv_type_v_;
 
-    llama_batch batch = llama_batch_init((int)toks.size(), 0, 1);
-    batch.n_tokens = (int)toks.size();
+        spec_ = std::make_unique<LlamaSpeculative>(model_, sopt);
+        if (!spec_->Init())
+            spec_.reset();
+    }
 
-    for (int i = 0; i < (int)toks.size(); ++i)
+    // n-gram lookup：无需第二个模型，用 session 自己的 prompt / 历史做草稿
+    const int lookup_n_draft = OptInt("LLAMA_LOOKUP_N_DRAFT", 0);
+    if (lookup_n_draft > 0 && scheduler_)
     {
-        batch.token[i] = toks[i];
-        batch.pos[i] = n_past + i;
-
-        batch.n_seq_id[i] = 1;
-        batch.seq_id[i][0] = 0;
+        LOG(WARNING) << "[llama] prompt lookup requires LLAMA_SCHEDULER=serial, disabled";
+    }
+    else if (lookup_n_draft > 0)
+    {
+        lookup_n_draft_ = lookup_n_draft;
+        lookup_ngram_min_ = OptInt("LLAMA_LOOKUP_NGRAM_MIN", 2);
+        lookup_ngram_max_ = OptInt("LLAMA_LOOKUP_NGRAM_MAX", 4);
+    }
 
-        // 只需要最后一个 token 的 logits 用于采样
-        batch.logits[i] = (i == (int)toks.size() - 1);
+    // 图片输入：LLAMA_MMPROJ_PATH 指向与模型配套的视觉投影 gguf（mmproj），CPU 上编码
+    const std::string mmproj_path = OptStr("LLAMA_MMPROJ_PATH", "");
+    if (!mmproj_path.empty() && scheduler_)
+    {
+        LOG(WARNING) << "[llama] image input requires LLAMA_SCHEDULER=serial, mmproj ignored";
     }
+    else if (!mmproj_path.empty())
+    {
+        LlamaMultimodal::Options mopt;
+        mopt.mmproj_path = mmproj_path;
+        mopt.n_threads = OptInt("LLAMA_MMPROJ_THREADS", OptInt("LLAMA_N_THREADS", 4));
+        mopt.cache_bytes = static_cast<size_t>(OptInt("LLAMA_IMAGE_CACHE_MB", 256)) << 20;
+        mopt.n_batch = prefill_chunk_;
 
-    const int rc = llama_decode(lctx, batch);
-    llama_batch_free(batch);
-    return rc == 0;
-}
+        mm_ = std::make_unique<LlamaMultimodal>(model_, mopt);
+        if (!mm_->Init())
+        {
+            mm_.reset();
+        }
+        else
+        {
+            LlamaImageStage::Options iopt;
+            iopt.n_workers = OptInt("LLAMA_IMAGE_WORKERS", 2);
+            iopt.max_queue = static_cast<size_t>(OptInt("LLAMA_IMAGE_QUEUE", 64));
+            image_stage_ = std::make_unique<LlamaImageStage>(iopt);
+        }
+    }
 
+    // 独占 context 池：启动时预创建，session 借用、结束清空归还，省掉每个新 session 的 llama_init_from_model
+    const int ctx_pool_size = OptInt("LLAMA_CONTEXT_POOL", 0);
+    if (ctx_pool_size > 0 && (pool_ || scheduler_))
+    {
+        LOG(WARNING) << "[llama] context pool requires LLAMA_KV_MODE=per_session and LLAMA_SCHEDULER=serial, disabled";
+    }
+    else if (ctx_pool_size > 0)
+    {
+        ctx_pool_ = std::make_shared<LlamaContextPool>([this] { return NewLlamaContext(); },
+                                                       static_cast<size_t>(ctx_pool_size),
+                                                       kv_token_bytes_ * OptInt("LLAMA_N_CTX", 4096));
+        const size_t n = ctx_pool_->Prewarm();
+        const auto st = ctx_pool_->GetStats();
+        LOG(INFO) << "[ctx-pool] prewarm model=" << model_path << " contexts=" << n
+                  << " create_ms_avg=" << (st.created > 0 ? st.create_ms_total / st.created : 0);
+    }
+    startup_.init_ms = ms_since(t0);
 
-LlamaEngine::LlamaEngine(const std::string &model_path): model_path_(model_path)
-{
-    llama_backend_init();
+    if (OptInt("LLAMA_NO_WARMUP", 0) <= 0)
+    {
+        t0 = Clock::now();
+        WarmUp();
+        startup_.warmup_ms = ms_since(t0);
+    }
 
-    llama_model_params mparams = llama_model_default_params();
-    model_ = llama_model_load_from_file(model_path.c_str(), mparams);
-    assert(model_ && "failed to load llama model");
+    LOG(INFO) << "[llama] startup model=" << model_path
+              << " prefetch_ms=" << startup_.prefetch_ms
+              << " load_ms=" << startup_.load_ms
+              << " init_ms=" << startup_.init_ms
+              << " warmup_ms=" << startup_.warmup_ms;
 }
 
 LlamaEngine::~LlamaEngine()
 {
+    // 先关闭换出闸门：等正在读 context 的析构钩子结束，之后析构的 Session 不再换出
+    if (swap_gate_)
+    {
+        std::unique_lock<std::shared_mutex> lk(swap_gate_->mu);
+        swap_gate_->swap.reset();
+    }
+    swap_.reset();
+    // 再停调度线程，释放共享 context（都基于 model_）
+    scheduler_.reset();
+    // 模型卸载时 session 仍可能持有本引擎创建的 context：先释放，下次按 history 重放
+    {
+        std::lock_guard<std::mutex> lk(live_mu_);
+        for (auto &weak : live_)
+        {
+            if (auto mc = weak.lock())
+                mc->Detach();
+        }
+        live_.clear();
+    }
+    if (pool_)
+        pool_->DetachHandles();
+    // 借出的 context 已随句柄 Detach 解除关联，由池统一释放
+    ctx_pool_.reset();
+    // 图片阶段的任务用 mm_：先停线程
+    image_stage_.reset();
+    mm_.reset();
+    spec_.reset();
+    pool_.reset();
+    samplers_.reset();
+    // adapter 在所有 context 释放之后、模型释放之前释放
+    lora_.reset();
     if (model_)
         llama_model_free(model_);
     llama_backend_free();
 }
 
-std::shared_ptr<ModelContext> LlamaEngine::CreateNewContext()
+llama_context *LlamaEngine::NewLlamaContext()
 {
-    auto mc = std::make_shared<ModelContext>();
-
     llama_context_params cparams = llama_context_default_params();
-    cparams.n_ctx = get_env_int("LLAMA_N_CTX", 4096);
-    cparams.n_threads = get_env_int("LLAMA_N_THREADS", 4);
-    cparams.n_threads_batch = get_env_int("LLAMA_N_THREADS_BATCH", 4);
+    cparams.n_ctx = OptInt("LLAMA_N_CTX", 4096);
+    cparams.n_threads = OptInt("LLAMA_N_THREADS", 4);
+    cparams.n_threads_batch = OptInt("LLAMA_N_THREADS_BATCH", 4);
+    cparams.type_k = kv_type_k_;
+    cparams.type_v = kv_type_v_;
+    // n > 1 的候选 fork 到 seq 1..max_n_-1；unified KV 让各 seq 共用 n_ctx 个 cell（prompt 只占一份）。
+    // 缺省 LLAMA_MAX_N=1 时保持单 seq、非 unified 的 context，不为用不到的候选付出代价
+    if (max_n_ > 1)
+    {
+        cparams.n_seq_max = max_n_;
+        cparams.kv_unified = true;
+    }
 
     // llama_init_from_model
-    mc->ctx = llama_init_from_model(model_, cparams);
-    if (!mc->ctx)
-        return nullptr;
+    return llama_init_from_model(model_, cparams);
+}
+
+std::shared_ptr<ModelContext> LlamaEngine::CreateNewContext()
+{
+    std::shared_ptr<ModelContext> mc;
+    if (ctx_pool_)
+    {
+        mc = ctx_pool_->Acquire();
+        if (!mc)
+            return nullptr;
+    }
+    else
+    {
+        mc = std::make_shared<ModelContext>();
+        mc->ctx = NewLlamaContext();
+        if (!mc->ctx)
+            return nullptr;
+    }
+    // KV 按 n_ctx 整块预分配
+    mc->kv_bytes.store(kv_token_bytes_ * llama_n_ctx(mc->ctx), std::memory_order_relaxed);
 
-    // sampler：先用 greedy（稳定）
-    mc->sampler = llama_sampler_init_greedy();
+    // sampler 按请求参数在 RunSerial 中绑定
     mc->n_past = 0;
     mc->initialized = true;
+
+    std::lock_guard<std::mutex> lk(live_mu_);
+    live_.erase(std::remove_if(live_.begin(), live_.end(),
+                               [](const std::weak_ptr<ModelContext> &w) { return w.expired(); }),
+                live_.end());
+    live_.push_back(mc);
     return mc;
 }
 
+void LlamaEngine::WarmUp()
+{
+    // 临时 context 上各跑一次多 token（prefill）与单 token（decode）的 llama_decode：
+    // mmap 的权重页全部读入、后端完成初始化，这部分延迟不落在首个请求上
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = 256;
+    cparams.n_batch = 256;
+    cparams.type_k = kv_type_k_;
+    cparams.type_v = kv_type_v_;
+    cparams.n_threads = OptInt("LLAMA_N_THREADS", 4);
+    cparams.n_threads_batch = OptInt("LLAMA_N_THREADS_BATCH", 4);
+    llama_context *lctx = llama_init_from_model(model_, cparams);
+    if (!lctx)
+    {
+        // 量化的 V cache 需要 flash attention，后端不支持时 context 创建失败
+        LOG(WARNING) << "[llama] warmup skipped: context init failed (type_k=" << ggml_type_name(kv_type_k_)
+                     << " type_v=" << ggml_type_name(kv_type_v_) << ")";
+        return;
+    }
+
+    const llama_vocab *vocab = llama_model_get_vocab(model_);
+    llama_token tok = llama_vocab_bos(vocab);
+    if (tok == LLAMA_TOKEN_NULL)
+        tok = llama_vocab_eos(vocab);
+    const llama_token toks[2] = {tok, tok};
+
+    const bool ok = decode_tokens(lctx, toks, 2, 0, 0, LlamaThreadBudget::Phase::prefill) == 0 &&
+                    decode_tokens(lctx, toks, 1, 2, 0, LlamaThreadBudget::Phase::decode) == 0;
+    llama_synchronize(lctx);
+    llama_free(lctx);
+    if (!ok)
+        LOG(WARNING) << "[llama] warmup decode failed";
+}
+
+int LlamaEngine::OptInt(const char *name, int def) const
+{
+    return get_option_int(options_, name, def);
+}
+
+std::string LlamaEngine::OptStr(const char *name, const std::string &def) const
+{
+    return get_option_str(options_, name, def);
+}
+
+size_t LlamaEngine::ResidentBytes() const
+{
+    if (!model_)
+        return 0;
+    size_t bytes = static_cast<size_t>(llama_model_size(model_)) + fixed_kv_bytes_;
+    if (spec_)
+        bytes += spec_->ResidentBytes();
+    if (ctx_pool_)
+        bytes += ctx_pool_->IdleBytes();
+    if (mm_)
+        bytes += mm_->CacheBytes();
+    if (lora_)
+        bytes += lora_->Bytes();
+
+    // 独占模式：每个存活的 session context 预分配的 KV（含草稿 context）
+    std::lock_guard<std::mutex> lk(live_mu_);
+    for (const auto &weak : live_)
+    {
+        if (auto mc = weak.lock())
+            bytes += mc->kv_bytes.load(std::memory_order_relaxed);
+    }
+    return bytes;
+}
+
 std::shared_ptr<ModelContext> LlamaEngine::EnsureContext(const std::shared_ptr<Session> &s)
 {
     std::lock_guard<std::mutex> lk(s->mu);
+    if (!s->kv_bytes)
+        s->kv_bytes = session_kv_bytes;
+
+    if (pool_)
+    {
+        if (!s->model_ctx || s->model_ctx->detached)
+        {
+            const bool replay = s->model_ctx != nullptr;
+            s->model_ctx = pool_->NewHandle();
+            s->model_ctx->need_replay = replay;
+        }
+
+        auto mc = s->model_ctx;
+        if (!pool_->Checkout(*mc))
+            return nullptr;
+
+        // 溢出保护：单个 session 太接近上限就平移（LLAMA_KV_OVERFLOW=shift），不行再清空它的 seq
+        const int margin = OptInt("KV_RESET_MARGIN", 256);
+        if (mc->n_past > pool_->n_ctx_per_seq() - margin &&
+            !(shift_keep_tokens_ > 0 && ContextShift(*mc, *s, shift_keep_tokens_)))
+        {
+            llama_memory_seq_rm(llama_get_memory(mc->ctx), mc->seq_id, -1, -1);
+            mc->n_past = 0;
+            mc->tokens.clear();
+            mc->need_replay = false;
+        }
+        return mc;
+    }
+
+    if (swap_gate_ && !s->on_destroy)
+    {
+        auto gate = swap_gate_;
+        const int min_tokens = swap_min_tokens_;
+        s->on_destroy = [gate, min_tokens](Session &sess)
+        { swap_out_session(gate, sess, min_tokens); };
+    }
 
-    if (!s->model_ctx)
+    // 模型曾被卸载：旧 context 已释放，新建后按 history 重放
+    if (!s->model_ctx || s->model_ctx->detached)
     {
+        const bool replay = s->model_ctx != nullptr;
         s->model_ctx = CreateNewContext();
+        if (s->model_ctx)
+            s->model_ctx->need_replay = replay;
         return s->model_ctx;
     }
 
-    // 溢出保护：太接近 n_ctx 就重建
+    // 溢出保护：太接近 n_ctx 就平移（LLAMA_KV_OVERFLOW=shift），不行再重建
     const int n_ctx = llama_n_ctx(s->model_ctx->ctx);
-    const int margin = get_env_int("KV_RESET_MARGIN", 256);
-    if (s->model_ctx->n_past > n_ctx - margin)
+    const int margin = OptInt("KV_RESET_MARGIN", 256);
+    if (s->model_ctx->n_past > n_ctx - margin &&
+        !(shift_keep_tokens_ > 0 && ContextShift(*s->model_ctx, *s, shift_keep_tokens_)))
     {
         s->model_ctx.reset();
         s->model_ctx = CreateNewContext();
@@ -241,11 +583,420 @@ std::shared_ptr<ModelContext> LlamaEngine::EnsureContext(const std::shared_ptr<S
     return s->model_ctx;
 }
 
+bool LlamaEngine::RestoreSwapped(ServingContext &ctx, ModelContext &mc)
+{
+    const auto t0 = std::chrono::steady_clock::now();
+    const std::string &sid = ctx.session->session_id;
+
+    LlamaKvSwap::Entry e;
+    const LlamaKvSwap::Tier tier = swap_->Take(sid, e);
+    if (tier == LlamaKvSwap::Tier::none)
+        return false;
+
+    // 客户端带来的完整 messages 必须以换出时的 history 为前缀（且有新消息），KV 才对得上
+    bool match = e.history.size() < ctx.messages.size() &&
+                 e.n_past <= (int)llama_n_ctx(mc.ctx) - OptInt("KV_RESET_MARGIN", 256);
+    for (size_t i = 0; match && i < e.history.size(); ++i)
+    {
+        match = e.history[i].role == ctx.messages[i].role && e.history[i].content == ctx.messages[i].content;
+    }
+
+    if (!match || llama_state_seq_set_data(mc.ctx, e.data.data(), e.data.size(), mc.seq_id) == 0)
+    {
+        llama_memory_seq_rm(llama_get_memory(mc.ctx), mc.seq_id, -1, -1);
+        swap_->RecordRestore(tier, 0, 0, false);
+        LOG(INFO) << "[kv-swap] discard session=" << sid << " reason=" << (match ? "set_data failed" : "history mismatch");
+        return false;
+    }
+
+    mc.n_past = e.n_past;
+    mc.tokens.clear(); // 换出时没有保存 token，不能按 token 复用
+    ctx.messages.erase(ctx.messages.begin(), ctx.messages.begin() + e.history.size());
+    {
+        std::lock_guard<std::mutex> lk(ctx.session->mu);
+        ctx.session->history = std::move(e.history);
+    }
+
+    const double restore_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    swap_->RecordRestore(tier, mc.n_past, restore_ms, true);
+
+    // 与按历史吞吐估算的重新 prefill 耗时对比，便于调整 RAM/磁盘预算
+    const int64_t pt = prefill_tokens_.load(std::memory_order_relaxed);
+    const double est_prefill_ms = pt > 0 ? mc.n_past * (prefill_us_.load(std::memory_order_relaxed) / 1000.0) / pt : -1;
+    LOG(INFO) << "[kv-swap] restore session=" << sid
+              << " tier=" << (tier == LlamaKvSwap::Tier::disk ? "disk" : "ram")
+              << " tokens=" << mc.n_past
+              << " bytes=" << e.data.size()
+              << " restore_ms=" << restore_ms
+              << " est_prefill_ms=" << est_prefill_ms;
+    return true;
+}
+
+int LlamaEngine::RewindKv(ModelContext &mc, std::vector<int32_t> &toks)
+{
+    // 至少留最后一个 prompt token 重新 decode：生成需要它的 logits
+    size_t keep = 0;
+    if (mc.tokens.size() == static_cast<size_t>(mc.n_past) && !toks.empty())
+    {
+        const size_t limit = std::min(mc.tokens.size(), toks.size() - 1);
+        while (keep < limit && mc.tokens[keep] == toks[keep])
+            ++keep;
+    }
+
+    const int n_old = mc.n_past;
+    llama_memory_seq_rm(llama_get_memory(mc.ctx), mc.seq_id, static_cast<int>(keep), -1);
+    mc.n_past = static_cast<int>(keep);
+    mc.tokens.resize(keep);
+    toks.erase(toks.begin(), toks.begin() + keep);
+
+    // 草稿 KV 与目标 KV 逐 token 对齐，一起截断
+    if (mc.draft_ctx && mc.draft_n_past >= mc.n_past)
+    {
+        llama_memory_seq_rm(llama_get_memory(mc.draft_ctx), 0, mc.n_past, -1);
+        mc.draft_n_past = mc.n_past;
+    }
+    if (mc.lookup)
+    {
+        mc.lookup->Clear();
+        mc.lookup->Append(mc.tokens.data(), mc.n_past);
+    }
+
+    kv_rewinds_.fetch_add(1, std::memory_order_relaxed);
+    kv_rewind_reused_.fetch_add(mc.n_past, std::memory_order_relaxed);
+    LOG(INFO) << "[llama] kv rewind seq=" << mc.seq_id
+              << " kv_tokens=" << n_old
+              << " reused=" << mc.n_past
+              << " prefill=" << toks.size();
+    return mc.n_past;
+}
+
+void LlamaEngine::CollectMetrics(std::map<std::string, double> &out) const
+{
+    out["prefill_tokens_total"] = static_cast<double>(prefill_tokens_.load(std::memory_order_relaxed));
+    out["prefill_ms_total"] = prefill_us_.load(std::memory_order_relaxed) / 1000.0;
+
+    const auto sst = samplers_->GetStats();
+    out["sampler_cache_hits_total"] = static_cast<double>(sst.hits);
+    out["sampler_builds_total"] = static_cast<double>(sst.builds);
+    out["sampler_cache_idle"] = static_cast<double>(sst.idle);
+    out["grammar_compiles_total"] = static_cast<double>(sst.grammar_compiles);
+    out["grammar_cache_hits_total"] = static_cast<double>(sst.grammar_hits);
+    out["grammar_tokens_total"] = static_cast<double>(sst.grammar_tokens);
+    out["grammar_resamples_total"] = static_cast<double>(sst.grammar_resamples);
+    out["grammar_eval_ms_total"] = sst.grammar_ms;
+    out["kv_rewinds_total"] = static_cast<double>(kv_rewinds_.load(std::memory_order_relaxed));
+    out["kv_rewind_reused_tokens_total"] = static_cast<double>(kv_rewind_reused_.load(std::memory_order_relaxed));
+    out["decode_tokens_total"] = static_cast<double>(decode_tokens_.load(std::memory_order_relaxed));
+    out["decode_ms_total"] = decode_us_.load(std::memory_order_relaxed) / 1000.0;
+    out["multi_choice_requests_total"] = static_cast<double>(multi_choice_requests_.load(std::memory_order_relaxed));
+    out["multi_choice_tokens_total"] = static_cast<double>(multi_choice_tokens_.load(std::memory_order_relaxed));
+    out["kv_bytes_per_token"] = static_cast<double>(kv_token_bytes_);
+    out["startup_prefetch_ms"] = startup_.prefetch_ms;
+    out["startup_load_ms"] = startup_.load_ms;
+    out["startup_init_ms"] = startup_.init_ms;
+    out["startup_warmup_ms"] = startup_.warmup_ms;
+
+    if (ctx_pool_)
+    {
+        // saved_ms：命中次数 × 平均创建耗时，即省掉的 llama_init_from_model 时间
+        const auto cst = ctx_pool_->GetStats();
+        const double create_ms_avg = cst.created > 0 ? cst.create_ms_total / cst.created : 0;
+        const int64_t acquires = cst.hits + cst.misses;
+        out["context_pool_size"] = static_cast<double>(cst.size);
+        out["context_pool_idle"] = static_cast<double>(cst.idle);
+        out["context_pool_in_use"] = static_cast<double>(cst.in_use);
+        out["context_pool_hits_total"] = static_cast<double>(cst.hits);
+        out["context_pool_misses_total"] = static_cast<double>(cst.misses);
+        out["context_pool_hit_rate"] = acquires > 0 ? static_cast<double>(cst.hits) / acquires : 0;
+        out["context_pool_returned_total"] = static_cast<double>(cst.returned);
+        out["context_pool_discarded_total"] = static_cast<double>(cst.discarded);
+        out["context_pool_create_ms_avg"] = create_ms_avg;
+        out["context_pool_saved_ms_total"] = create_ms_avg * cst.hits;
+    }
+
+    if (mm_)
+    {
+        const auto mst = mm_->GetStats();
+        out["image_inputs_total"] = static_cast<double>(mst.images);
+        out["image_tokens_total"] = static_cast<double>(mst.image_tokens);
+        out["image_encodes_total"] = static_cast<double>(mst.encodes);
+        out["image_encode_ms_total"] = mst.encode_ms;
+        out["image_cache_hits_total"] = static_cast<double>(mst.cache_hits);
+        out["image_cache_hit_rate"] = mst.images > 0 ? static_cast<double>(mst.cache_hits) / mst.images : 0.0;
+        out["image_cache_entries"] = static_cast<double>(mst.cache_entries);
+        out["image_cache_bytes"] = static_cast<double>(mst.cache_bytes);
+        out["image_cache_evictions_total"] = static_cast<double>(mst.cache_evictions);
+
+        const auto ist = image_stage_->GetStats();
+        out["image_stage_workers"] = static_cast<double>(ist.workers);
+        out["image_stage_queue_depth"] = static_cast<double>(ist.queued);
+        out["image_stage_queue_depth_max"] = static_cast<double>(ist.queued_max);
+        out["image_stage_running"] = static_cast<double>(ist.running);
+        out["image_stage_jobs_total"] = static_cast<double>(ist.completed);
+        out["image_stage_rejected_total"] = static_cast<double>(ist.rejected);
+        out["image_stage_wait_ms_total"] = ist.wait_ms_total;
+        out["image_stage_wait_ms_max"] = ist.wait_ms_max;
+        out["image_stage_run_ms_total"] = ist.run_ms_total;
+        out["image_stage_run_ms_max"] = ist.run_ms_max;
+        out["image_stage_latency_ms_avg"] =
+            ist.completed > 0 ? (ist.wait_ms_total + ist.run_ms_total) / ist.completed : 0.0;
+    }
+
+    const auto lst = lora_ ? lora_->GetStats() : LlamaLoraCache::Stats{};
+    if (lst.loads + lst.load_failures > 0)
+    {
+        out["lora_requests_total"] = static_cast<double>(lora_requests_.load(std::memory_order_relaxed));
+        out["lora_adapters_loaded"] = static_cast<double>(lst.entries);
+        out["lora_cache_bytes"] = static_cast<double>(lst.bytes);
+        out["lora_cache_budget_bytes"] = static_cast<double>(lst.budget_bytes);
+        out["lora_cache_hits_total"] = static_cast<double>(lst.hits);
+        out["lora_loads_total"] = static_cast<double>(lst.loads);
+        out["lora_load_failures_total"] = static_cast<double>(lst.load_failures);
+        out["lora_load_ms_total"] = lst.load_ms_total;
+        out["lora_evictions_total"] = static_cast<double>(lst.evictions);
+        out["lora_kv_resets_total"] = static_cast<double>(lora_kv_resets_.load(std::memory_order_relaxed));
+        if (scheduler_)
+            out["lora_switches_total"] = static_cast<double>(scheduler_->lora_switches());
+    }
+
+    if (lookup_n_draft_ > 0)
+    {
+        const int64_t proposed = lookup_proposed_.load(std::memory_order_relaxed);
+        const int64_t accepted = lookup_accepted_.load(std::memory_order_relaxed);
+        out["lookup_steps_total"] = static_cast<double>(lookup_steps_.load(std::memory_order_relaxed));
+        out["lookup_proposed_tokens_total"] = static_cast<double>(proposed);
+        out["lookup_accepted_tokens_total"] = static_cast<double>(accepted);
+        out["lookup_acceptance_rate"] = proposed > 0 ? static_cast<double>(accepted) / proposed : 0.0;
+    }
+
+    if (spec_)
+    {
+        const auto st = spec_->GetStats();
+        out["spec_steps_total"] = static_cast<double>(st.steps);
+        out["spec_drafted_tokens_total"] = static_cast<double>(st.drafted);
+        out["spec_accepted_tokens_total"] = static_cast<double>(st.accepted);
+        out["spec_acceptance_rate"] = st.drafted > 0 ? static_cast<double>(st.accepted) / st.drafted : 0.0;
+    }
+
+    if (swap_)
+    {
+        const auto st = swap_->GetStats();
+        out["kv_swap_out_total"] = static_cast<double>(st.swap_out);
+        out["kv_swap_out_bytes_total"] = static_cast<double>(st.swap_out_bytes);
+        out["kv_swap_dropped_total"] = static_cast<double>(st.dropped);
+        out["kv_swap_ram_entries"] = static_cast<double>(st.ram_entries);
+        out["kv_swap_ram_bytes"] = static_cast<double>(st.ram_bytes);
+        out["kv_swap_disk_entries"] = static_cast<double>(st.disk_entries);
+        out["kv_swap_disk_bytes"] = static_cast<double>(st.disk_bytes);
+        out["kv_swap_restore_ram_total"] = static_cast<double>(st.restore_ram);
+        out["kv_swap_restore_disk_total"] = static_cast<double>(st.restore_disk);
+        out["kv_swap_restore_discard_total"] = static_cast<double>(st.restore_discard);
+        out["kv_swap_restored_tokens_total"] = static_cast<double>(st.restored_tokens);
+        out["kv_swap_restore_ms_total"] = st.restore_ms;
+    }
+
+    if (!pool_)
+        return;
+
+    LlamaPrefixCache::Stats total;
+    for (const auto &cache : pool_->prefix_caches())
+    {
+        const auto st = cache->GetStats();
+        total.hits += st.hits;
+        total.misses += st.misses;
+        total.saved_tokens += st.saved_tokens;
+        total.tokens += st.tokens;
+        total.entries += st.entries;
+        total.evictions += st.evictions;
+    }
+    if (pool_->prefix_caches().empty())
+        return;
+
+    out["prefix_cache_hits_total"] = static_cast<double>(total.hits);
+    out["prefix_cache_misses_total"] = static_cast<double>(total.misses);
+    out["prefix_cache_saved_tokens_total"] = static_cast<double>(total.saved_tokens);
+    out["prefix_cache_evictions_total"] = static_cast<double>(total.evictions);
+    out["prefix_cache_entries"] = static_cast<double>(total.entries);
+    out["prefix_cache_tokens"] = static_cast<double>(total.tokens);
+    out["prefix_cache_bytes"] = static_cast<double>(total.tokens) * static_cast<double>(kv_token_bytes_);
+}
+
+int LlamaEngine::DecodeTokens(ModelContext &mc, const llama_token *toks, int n, LlamaThreadBudget::Phase phase,
+                              bool all_logits)
+{
+    while (true)
+    {
+        const int rc = decode_tokens(mc.ctx, toks, n, mc.n_past, mc.seq_id, phase, all_logits);
+        // 共享 KV 已满：淘汰最久未用的空闲 session 后重试
+        if (rc == 1 && pool_ && pool_->EvictOne(mc.ctx))
+            continue;
+        return rc;
+    }
+}
+
+int LlamaEngine::DecodeGenerated(ModelContext &mc, const llama_token *toks, int n, bool all_logits)
+{
+    const auto t0 = std::chrono::steady_clock::now();
+    const int rc = DecodeTokens(mc, toks, n, LlamaThreadBudget::Phase::decode, all_logits);
+    decode_tokens_.fetch_add(n, std::memory_order_relaxed);
+    decode_us_.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::steady_clock::now() - t0)
+                             .count(),
+                         std::memory_order_relaxed);
+    return rc;
+}
+
+int LlamaEngine::PrefillTokens(ModelContext &mc, const std::vector<llama_token> &toks, size_t offset, ServingContext &ctx)
+{
+    // 只在本次 prefill 期间挂 abort callback，结束即摘除，避免持有已结束请求的指针
+    struct AbortGuard
+    {
+        llama_context *lctx;
+        ~AbortGuard() { llama_set_abort_callback(lctx, nullptr, nullptr); }
+    } guard{mc.ctx};
+    llama_set_abort_callback(mc.ctx, &abort_if_cancelled, &ctx);
+
+    const size_t chunk = static_cast<size_t>(prefill_chunk_);
+    for (size_t i = offset; i < toks.size(); i += chunk)
+    {
+        if (ctx.cancelled.load(std::memory_order_acquire))
+            return 2;
+
+        const int n = static_cast<int>(std::min(chunk, toks.size() - i));
+        const int rc = DecodeTokens(mc, toks.data() + i, n, LlamaThreadBudget::Phase::prefill);
+        if (rc != 0)
+            return rc;
+        mc.n_past += n;
+    }
+    return 0;
+}
+
+bool LlamaEngine::Prepare(const std::shared_ptr<ServingContext> &ctx, std::function<void()> ready)
+{
+    // LoRA adapter：在执行线程上加载（首次）或命中缓存，模型队列 / 调度线程里只需 llama_set_adapter_lora
+    if (ctx && !ctx->lora.empty() && !ctx->lora_adapter)
+    {
+        std::string err;
+        ctx->lora_adapter = lora_->Acquire(ctx->lora.path, err);
+        if (!ctx->lora_adapter)
+        {
+            ctx->error_message = "LlamaEngine: " + err;
+            ctx->params["error_code"] = "invalid_request";
+            ctx->EmitFinish(FinishReason::error);
+            return true;
+        }
+        lora_requests_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (!image_stage_ || !ctx || !ctx->is_chat)
+        return false;
+
+    // 只准备本次请求带来的图片；按 history 重放的图片在 Prefill 中查缓存（未命中时现场编码）
+    std::vector<const ImageInput *> images;
+    for (const auto &m : ctx->messages)
+    {
+        for (const auto &img : m.images)
+            images.push_back(&img);
+    }
+    if (images.empty())
+        return false;
+
+    // ctx->messages 在请求结束前不变，images 指向其中的元素
+    const bool ok = image_stage_->Submit([this, ctx, images = std::move(images), ready = std::move(ready)]
+    {
+        for (const ImageInput *img : images)
+        {
+            if (ctx->cancelled.load(std::memory_order_acquire))
+            {
+                ctx->EmitFinish(FinishReason::cancelled);
+                return;
+            }
+            if (ctx->prepared_images.count(img->id))
+                continue;
+
+            bool hit = false;
+            bool invalid = false;
+            double ms = 0;
+            std::string err;
+            auto p = mm_->Prepare(*img, hit, ms, err, invalid);
+            if (!p)
+            {
+                ctx->error_message = "LlamaEngine: " + err;
+                if (invalid)
+                    ctx->params["error_code"] = "invalid_request";
+                ctx->EmitFinish(FinishReason::error);
+                return;
+            }
+            ctx->prepared_images.emplace(img->id, std::move(p));
+            ctx->usage.image_cache_hits += hit ? 1 : 0;
+            ctx->usage.image_encode_ms += ms;
+        }
+        ready();
+    });
+    if (!ok)
+    {
+        ctx->error_message = "LlamaEngine: image stage queue full, model=" + ctx->model;
+        ctx->params["error_code"] = "overloaded";
+        ctx->EmitFinish(FinishReason::error);
+    }
+    return true;
+}
+
+void LlamaEngine::Run(std::shared_ptr<ServingContext> ctx)
+{
+    if (!scheduler_)
+    {
+        RunSerial(std::move(ctx));
+        return;
+    }
+
+    if (!ctx)
+        return;
+
+    if (ctx->n > 1)
+    {
+        ctx->error_message = "LlamaEngine: n > 1 requires LLAMA_SCHEDULER=serial, model=" + ctx->model;
+        ctx->params["error_code"] = "invalid_request";
+        ctx->usage.total_tokens = ctx->usage.prompt_tokens + ctx->usage.completion_tokens;
+        ctx->EmitFinish(FinishReason::error);
+        return;
+    }
+
+    for (const auto &m : ctx->messages)
+    {
+        if (m.images.empty())
+            continue;
+        ctx->error_message = "LlamaEngine: image input requires LLAMA_SCHEDULER=serial, model=" + ctx->model;
+        ctx->params["error_code"] = "invalid_request";
+        ctx->usage.total_tokens = ctx->usage.prompt_tokens + ctx->usage.completion_tokens;
+        ctx->EmitFinish(FinishReason::error);
+        return;
+    }
+
+    if (!ctx->lora.empty() && !ctx->lora_adapter)
+    {
+        ctx->error_message = "LlamaEngine: lora adapter not prepared, model=" + ctx->model;
+        ctx->usage.total_tokens = ctx->usage.prompt_tokens + ctx->usage.completion_tokens;
+        ctx->EmitFinish(FinishReason::error);
+        return;
+    }
+
+    // continuous：入队即返回，由调度线程 EmitDelta/EmitFinish
+    if (!scheduler_->Submit(ctx))
+    {
+        ctx->error_message = "LlamaEngine: batch queue full, model=" + ctx->model;
+        ctx->params["error_code"] = "overloaded";
+        ctx->usage.total_tokens = ctx->usage.prompt_tokens + ctx->usage.completion_tokens;
+        ctx->EmitFinish(FinishReason::error);
+    }
+}
+
 // ============================================================
 // Session 级 KV Cache 的 Run（C-4）
 // - 多轮：只 prefill 本轮增量 messages + "assistant:"
-// - KV 通过 mc->n_past 续写void LlamaEngine::Run(std::shared_ptr<ServingContext> ctx)
-void LlamaEngine::Run(std::shared_ptr<ServingContext> ctx)
+// - KV 通过 mc->n_past 续写
+// ============================================================
+void LlamaEngine::RunSerial(std::shared_ptr<ServingContext> ctx)
 {
     if (!ctx || !ctx->session)
     {
@@ -271,10 +1022,68 @@ void LlamaEngine::Run(std::shared_ptr<ServingContext> ctx)
         return;
     }
 
+    SamplingParams sparams;
+    std::string sampling_err;
+    if (!parse_sampling_params(ctx->params, sparams, sampling_err))
+    {
+        ctx->error_message = "LlamaEngine: " + sampling_err;
+        finalize_usage();
+        ctx->EmitFinish(FinishReason::error);
+        return;
+    }
+
+    // n > 1 需要 session context 预留的 seq（共享 KV 模式下 seq 即 slot，不支持）
+    if (ctx->n > 1 && (pool_ || ctx->n > max_n_))
+    {
+        ctx->error_message = pool_ ? "LlamaEngine: n > 1 requires LLAMA_KV_MODE=per_session"
+                                   : "LlamaEngine: n exceeds LLAMA_MAX_N=" + std::to_string(max_n_);
+        ctx->params["error_code"] = "invalid_request";
+        finalize_usage();
+        ctx->EmitFinish(FinishReason::error);
+        return;
+    }
+
     auto mc = EnsureContext(ctx->session);
-    if (!mc || !mc->ctx || !mc->sampler)
+    if (!mc || !mc->ctx)
+    {
+        ctx->error_message = pool_ ? "LlamaEngine: no free kv slot" : "LlamaEngine: failed to create session ModelContext";
+        if (pool_)
+            ctx->params["error_code"] = "overloaded";
+        finalize_usage();
+        ctx->EmitFinish(FinishReason::error);
+        return;
+    }
+
+    // 共享模式：请求结束（任意返回路径）归还 slot，使其可被淘汰
+    struct SlotCheckin
+    {
+        LlamaSlotPool *pool;
+        ModelContext *mc;
+        ~SlotCheckin()
+        {
+            if (pool)
+                pool->Checkin(*mc);
+        }
+    } slot_checkin{pool_.get(), mc.get()};
+
+    // 一次性 session 不会再回来：请求结束即放掉它的 context（归还 context 池 / 共享 slot），
+    // 而不是等 SessionManager 超时回收。在 slot_checkin 之前析构，mc 仍由本函数持有到最后
+    struct EphemeralRelease
+    {
+        Session *s;
+        ~EphemeralRelease()
+        {
+            if (!s->ephemeral)
+                return;
+            std::lock_guard<std::mutex> lk(s->mu);
+            s->model_ctx.reset();
+        }
+    } ephemeral_release{ctx->session.get()};
+
+    // 采样链：参数集与 session 上一轮相同则 reset 复用，否则从缓存换一条
+    if (!samplers_->Bind(*mc, sparams))
     {
-        ctx->error_message = "LlamaEngine: failed to create session ModelContext";
+        ctx->error_message = "LlamaEngine: invalid grammar";
         finalize_usage();
         ctx->EmitFinish(FinishReason::error);
         return;
@@ -289,18 +1098,95 @@ void LlamaEngine::Run(std::shared_ptr<ServingContext> ctx)
         return;
     }
 
+    // LoRA adapter：只在本请求期间应用到 context（任意返回路径都在归还 slot 之前摘除）。
+    // KV 依赖写入时的 adapter：与 session 上一轮不同则清空，按 history 整段重写
+    const std::string lora_key = ctx->lora.Key();
+    if (mc->lora_key != lora_key)
+    {
+        if (mc->n_past > 0)
+        {
+            llama_memory_seq_rm(llama_get_memory(mc->ctx), mc->seq_id, -1, -1);
+            mc->n_past = 0;
+            mc->tokens.clear();
+            mc->need_replay = true;
+            if (mc->draft_ctx && mc->draft_n_past > 0)
+            {
+                llama_memory_seq_rm(llama_get_memory(mc->draft_ctx), 0, -1, -1);
+                mc->draft_n_past = 0;
+            }
+            if (mc->lookup)
+                mc->lookup->Clear();
+            lora_kv_resets_.fetch_add(1, std::memory_order_relaxed);
+        }
+        mc->lora_key = lora_key;
+    }
+
+    struct LoraGuard
+    {
+        llama_context *lctx = nullptr;
+        ~LoraGuard()
+        {
+            if (lctx)
+                llama_clear_adapter_lora(lctx);
+        }
+    } lora_guard;
+    if (!ctx->lora.empty())
+    {
+        const auto *adapter = static_cast<const LlamaLoraCache::Adapter *>(ctx->lora_adapter.get());
+        if (adapter && adapter->adapter)
+        {
+            llama_clear_adapter_lora(mc->ctx);
+            if (llama_set_adapter_lora(mc->ctx, adapter->adapter, ctx->lora.scale) == 0)
+                lora_guard.lctx = mc->ctx;
+        }
+        if (!lora_guard.lctx)
+        {
+            ctx->error_message = "LlamaEngine: failed to apply lora adapter " + ctx->lora.name;
+            finalize_usage();
+            ctx->EmitFinish(FinishReason::error);
+            return;
+        }
+    }
+
+    // 被淘汰过的 session 回来：优先恢复换出的 KV，而不是整段重新 prefill（换出的 KV 都是基座模型写入的）
+    if (swap_ && ctx->is_chat && mc->n_past == 0 && ctx->lora.empty())
+        RestoreSwapped(*ctx, *mc);
+
+    // 编辑 / 重新生成：history 已被截到与客户端的公共前缀，按完整对话重写并与 KV 逐 token 对齐。
+    // 成功 prefill 之前中断时 need_replay 保持为 true，下一轮同样处理
+    if (ctx->is_chat && ctx->kv_rewind)
+        mc->need_replay = true;
+
     // 1) build delta prompt
     std::string prompt;
+    const bool full_prompt = ctx->is_chat && mc->need_replay;
+    size_t n_history = 0;
+    std::vector<Message> incoming;
+    std::string close_text; // 补上的上一条回复的结束标记（上下文平移的轮边界在它之后）
     if (ctx->is_chat)
     {
+        // 增量模板只需要 history 条数；完整重写或非增量模板才复制 history
         std::vector<Message> history_copy;
         {
             std::lock_guard<std::mutex> lk(ctx->session->mu);
-            history_copy = ctx->session->history;
+            n_history = ctx->session->history.size();
+            if (full_prompt || !chat_tmpl_->incremental())
+                history_copy = ctx->session->history;
         }
 
+        // slot 被回收过 / 编辑或重新生成：按完整对话重写
+        incoming = ctx->messages;
+        if (full_prompt)
+        {
+            incoming.insert(incoming.begin(), history_copy.begin(), history_copy.end());
+            history_copy.clear();
+            n_history = 0;
+        }
+
+        // KV 末尾是上一轮生成的回复：先补上它的结束标记
+        const bool close_reply = n_history > 0 && mc->n_past > 0;
         std::string err;
-        if (!build_chat_delta_prompt(model_, history_copy, ctx->messages, prompt, err))
+        if (!chat_tmpl_->Delta(n_history, history_copy, incoming, prompt, err, close_reply, &close_text))
         {
             ctx->error_message = "LlamaEngine: " + err;
             finalize_usage();
@@ -313,6 +1199,23 @@ void LlamaEngine::Run(std::shared_ptr<ServingContext> ctx)
         prompt = ctx->prompt;
     }
 
+    // 本次 prompt 里的图片（完整重写时含 history 中的图片），与 prompt 中的标记按顺序对应
+    std::vector<const ImageInput *> images;
+    for (const auto &m : incoming)
+    {
+        for (const auto &img : m.images)
+            images.push_back(&img);
+    }
+    const bool multimodal = !images.empty();
+    if (multimodal && !mm_)
+    {
+        ctx->error_message = "LlamaEngine: model has no image input (LLAMA_MMPROJ_PATH not set), model=" + ctx->model;
+        ctx->params["error_code"] = "invalid_request";
+        finalize_usage();
+        ctx->EmitFinish(FinishReason::error);
+        return;
+    }
+
     // 取消点：tokenize 之前
     if (ctx->cancelled.load(std::memory_order_acquire))
     {
@@ -321,10 +1224,10 @@ void LlamaEngine::Run(std::shared_ptr<ServingContext> ctx)
         return;
     }
 
-    // 2) tokenize
+    // 2) tokenize（带图片时由 mtmd 在 prefill 中切块，toks 为空）
     std::vector<llama_token> toks;
-    const bool add_special = (mc->n_past == 0);
-    if (!tokenize_text(vocab, prompt, toks, add_special))
+    const bool add_special = (mc->n_past == 0 || full_prompt);
+    if (!multimodal && !tokenize_text(vocab, prompt, toks, add_special))
     {
         ctx->error_message = "LlamaEngine: tokenize failed";
         finalize_usage();
@@ -332,8 +1235,35 @@ void LlamaEngine::Run(std::shared_ptr<ServingContext> ctx)
         return;
     }
 
-    // prompt tokens（本次 delta prompt）
-    ctx->usage.prompt_tokens += static_cast<int>(toks.size());
+    // 完整 prompt 而 KV 非空：只保留 KV 与它的公共前缀
+    const int n_prompt = static_cast<int>(toks.size());
+    const bool rewound = full_prompt && mc->n_past > 0;
+    if (rewound)
+        ctx->usage.cached_tokens += RewindKv(*mc, toks);
+
+    // 记录本轮的 KV 起点，供上下文平移按轮丢弃（补上的结束标记属于上一轮）；
+    // 图片 token 的位置由 mtmd 计算（M-RoPE 为二维位置），不参与平移，直到 KV 从头重写
+    if (multimodal && shift_keep_tokens_ > 0)
+    {
+        mc->n_keep = -1;
+    }
+    else if (ctx->is_chat && shift_keep_tokens_ > 0)
+    {
+        if (rewound && mc->n_past > 0)
+        {
+            ContextShiftTruncate(*mc);
+        }
+        else
+        {
+            std::vector<llama_token> close;
+            if (!close_text.empty())
+                tokenize_text(vocab, close_text, close, false);
+            ContextShiftBeginTurn(model_, *mc, mc->n_past + (int)close.size(), n_history, incoming);
+        }
+    }
+
+    // prompt tokens（本次 delta prompt，含复用 KV 的公共前缀）
+    ctx->usage.prompt_tokens += n_prompt;
 
     // 取消点：prefill 之前
     if (ctx->cancelled.load(std::memory_order_acquire))
@@ -343,15 +1273,99 @@ void LlamaEngine::Run(std::shared_ptr<ServingContext> ctx)
         return;
     }
 
-    // 3) prefill/append -> KV
-    if (!decode_tokens(mc->ctx, toks, mc->n_past))
+    // 3) prefill/append -> KV（按 LLAMA_PREFILL_CHUNK 分块，取消可中断）
+    const int n_past_start = mc->n_past;
+
+    // 新序列先查前缀缓存：命中部分直接 seq_cp，只 prefill 剩余 token
+    // 前缀缓存里是基座模型的 KV：带 LoRA adapter 的请求不查也不收录
+    LlamaPrefixCache *prefix_cache =
+        (pool_ && mc->n_past == 0 && !multimodal && ctx->lora.empty()) ? pool_->prefix_cache(mc->ctx) : nullptr;
+    int reused = 0;
+    if (prefix_cache)
+        reused = prefix_cache->Restore(toks, mc->seq_id);
+    mc->n_past += reused;
+    ctx->usage.cached_tokens += reused;
+
+    const auto prefill_start = std::chrono::steady_clock::now();
+    int prefill_rc = 0;
+    int n_prefilled = static_cast<int>(toks.size()) - reused;
+    if (multimodal)
     {
-        ctx->error_message = "LlamaEngine: llama_decode failed (prefill)";
+        // 文本块走 PrefillTokens（分块、可取消），图片块注入缓存 / 现算的 embedding
+        LlamaMultimodal::Result mres;
+        std::string err;
+        bool invalid = false;
+        prefill_rc = mm_->Prefill(
+            *mc, prompt, add_special, images, ctx->prepared_images, ctx->cancelled,
+            [&](const std::vector<int32_t> &t) { return PrefillTokens(*mc, t, 0, *ctx); },
+            mres, err, invalid);
+        ctx->prepared_images.clear();
+        ctx->usage.prompt_tokens += mres.n_tokens;
+        ctx->usage.images += mres.images;
+        ctx->usage.image_tokens += mres.image_tokens;
+        ctx->usage.image_cache_hits += mres.cache_hits;
+        ctx->usage.image_encode_ms += mres.encode_ms;
+        n_prefilled = mres.n_tokens;
+        if (prefill_rc != 0 && prefill_rc != 2)
+        {
+            llama_memory_seq_rm(llama_get_memory(mc->ctx), mc->seq_id, n_past_start, -1);
+            mc->n_past = n_past_start;
+            ctx->error_message = "LlamaEngine: " + err;
+            if (invalid)
+                ctx->params["error_code"] = "invalid_request";
+            finalize_usage();
+            ctx->EmitFinish(FinishReason::error);
+            return;
+        }
+    }
+    else
+    {
+        prefill_rc = PrefillTokens(*mc, toks, static_cast<size_t>(reused), *ctx);
+    }
+    if (prefill_rc != 0)
+    {
+        // 回滚本轮已写入的块，KV 与 history 保持一致
+        llama_memory_seq_rm(llama_get_memory(mc->ctx), mc->seq_id, n_past_start, -1);
+        mc->n_past = n_past_start;
         finalize_usage();
+        if (prefill_rc == 2)
+        {
+            ctx->EmitFinish(FinishReason::cancelled);
+            return;
+        }
+        ctx->error_message = "LlamaEngine: llama_decode failed (prefill)";
         ctx->EmitFinish(FinishReason::error);
         return;
     }
-    mc->n_past += (int)toks.size();
+    prefill_tokens_.fetch_add(n_prefilled, std::memory_order_relaxed);
+    prefill_us_.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(
+                              std::chrono::steady_clock::now() - prefill_start)
+                              .count(),
+                          std::memory_order_relaxed);
+    mc->need_replay = false;
+
+    // KV 逐位置的 token：从头写入时重建，否则在已知内容后追加；含图片时内容不再按 token 可知
+    if (multimodal)
+        mc->tokens.clear();
+    else if (n_past_start == 0)
+        mc->tokens.assign(toks.begin(), toks.end());
+    else if (mc->tokens.size() == static_cast<size_t>(n_past_start))
+        mc->tokens.insert(mc->tokens.end(), toks.begin(), toks.end());
+    else
+        mc->tokens.clear();
+
+    if (prefix_cache)
+        prefix_cache->Insert(toks, mc->seq_id);
+
+    // n-gram lookup 索引：KV 从头写入时重建，否则追加本轮 prompt
+    if (lookup_n_draft_ > 0)
+    {
+        if (!mc->lookup)
+            mc->lookup = std::make_unique<LlamaNgramLookup>(lookup_ngram_min_, lookup_ngram_max_);
+        if (n_past_start == 0)
+            mc->lookup->Clear();
+        mc->lookup->Append(toks.data(), (int)toks.size());
+    }
 
     // 取消点：prefill 之后
     if (ctx->cancelled.load(std::memory_order_acquire))
@@ -362,35 +1376,50 @@ void LlamaEngine::Run(std::shared_ptr<ServingContext> ctx)
     }
 
     // 4) generate
-    int max_new_tokens = 512;
-    auto it = ctx->params.find("max_tokens");
-    if (it != ctx->params.end())
+    const int max_new_tokens = resolve_max_new_tokens(*ctx);
+
+    // 投机解码：草稿 KV 先跟上本轮 prompt；对不齐（如 KV 由换入恢复）则退回 n-gram lookup / 普通解码
+    // n > 1 不走投机解码（草稿 KV 下一轮 SyncPrompt 时重新对齐）
+    const bool spec_allowed = ctx->n == 1 && speculative_requested(*ctx);
+    // 草稿模型看不到图片：含图片的 KV 与草稿 KV 无法对齐，直到目标 KV 从头重写
+    if (multimodal && mc->draft_ctx)
+        mc->draft_n_past = -1;
+    const bool use_draft = spec_allowed && spec_ && !multimodal && spec_->SyncPrompt(*mc, toks, n_past_start);
+    const bool use_lookup = spec_allowed && !use_draft && lookup_n_draft_ > 0;
+
+    LOG(INFO) << "[llama] req=" << ctx->request_id
+              << " max_new_tokens=" << max_new_tokens
+              << " n=" << ctx->n
+              << " sampling=" << (sparams.greedy() ? "greedy" : "stochastic")
+              << " speculative=" << (use_draft ? "draft" : use_lookup ? "lookup" : "off");
+
+    // 增量 detokenize：只输出完整 UTF-8，stop 字符串跨 token 匹配
+    LlamaDetokenizer detok(pieces_.get(), ctx->stop);
+    auto flush_text = [&]
     {
-        try
-        {
-            max_new_tokens = std::stoi(it->second);
-        }
-        catch (...)
-        {
-            max_new_tokens = 512;
-        }
+        detok.Flush();
+        if (!detok.text().empty())
+            ctx->EmitDelta(detok.text());
+    };
+
+    if (ctx->n > 1)
+    {
+        const FinishReason reason = GenerateChoices(*ctx, *mc, sparams, max_new_tokens);
+        finalize_usage();
+        ctx->EmitFinish(reason);
+        return;
     }
-    else if (const char *env = std::getenv("DEFAULT_MAX_TOKENS"))
+
+    if (use_draft || use_lookup)
     {
-        try
-        {
-            max_new_tokens = std::stoi(env);
-        }
-        catch (...)
-        {
-            max_new_tokens = 512;
-        }
+        const FinishReason reason = GenerateSpeculative(*ctx, *mc, detok, max_new_tokens, use_draft);
+        if (reason == FinishReason::stop || reason == FinishReason::length)
+            flush_text(); // 命中 stop 字符串时 Flush 不再输出
+        finalize_usage();
+        ctx->EmitFinish(reason);
+        return;
     }
-    if (max_new_tokens <= 0)
-        max_new_tokens = 1;
 
-    LOG(INFO) << "[llama] req=" << ctx->request_id
-              << " max_new_tokens=" << max_new_tokens;
     for (int step = 0; step < max_new_tokens; ++step)
     {
         if (ctx->cancelled.load(std::memory_order_acquire))
@@ -400,11 +1429,11 @@ void LlamaEngine::Run(std::shared_ptr<ServingContext> ctx)
             return;
         }
 
-        llama_token next = llama_sampler_sample(mc->sampler, mc->ctx, -1);
-        llama_sampler_accept(mc->sampler, next);
+        llama_token next = samplers_->Sample(mc->sampler, mc->grammar, mc->ctx, -1);
 
         if (llama_vocab_is_eog(vocab, next))
         {
+            flush_text();
             finalize_usage();
             ctx->EmitFinish(FinishReason::stop);
             return;
@@ -417,8 +1446,7 @@ void LlamaEngine::Run(std::shared_ptr<ServingContext> ctx)
             return;
         }
 
-        std::vector<llama_token> one{next};
-        if (!decode_tokens(mc->ctx, one, mc->n_past))
+        if (DecodeGenerated(*mc, &next, 1) != 0)
         {
             ctx->error_message = "LlamaEngine: llama_decode failed (decode)";
             finalize_usage();
@@ -426,6 +1454,9 @@ void LlamaEngine::Run(std::shared_ptr<ServingContext> ctx)
             return;
         }
         mc->n_past += 1;
+        mc->tokens.push_back(next);
+        if (mc->lookup)
+            mc->lookup->Append(next);
 
         // completion tokens（成功 decode 的 token）
         ctx->usage.completion_tokens += 1;
@@ -437,11 +1468,346 @@ void LlamaEngine::Run(std::shared_ptr<ServingContext> ctx)
             return;
         }
 
-        std::string piece = token_to_piece(vocab, next);
-        if (!piece.empty() && !ctx->cancelled.load(std::memory_order_acquire))
-            ctx->EmitDelta(piece);
+        // stop 字符串完成：只输出它之前的文本（stop 所在 token 已写入 KV，下一轮按 history 对齐）
+        const bool hit_stop = detok.Push(next);
+        if (!detok.text().empty() && !ctx->cancelled.load(std::memory_order_acquire))
+            ctx->EmitDelta(detok.text());
+        if (hit_stop)
+        {
+            finalize_usage();
+            ctx->EmitFinish(FinishReason::stop);
+            return;
+        }
     }
 
+    flush_text();
     finalize_usage();
     ctx->EmitFinish(FinishReason::length);
 }
+
+FinishReason LlamaEngine::GenerateSpeculative(ServingContext &ctx, ModelContext &mc, LlamaDetokenizer &detok,
+                                              int max_new_tokens, bool use_draft)
+{
+    const llama_vocab *vocab = llama_model_get_vocab(model_);
+    llama_memory_t mem = llama_get_memory(mc.ctx);
+    const int n_ctx = pool_ ? pool_->n_ctx_per_seq() : (int)llama_n_ctx(mc.ctx);
+
+    // tail：本轮生成写入目标 KV 的 token（草稿 KV 落后时据此补齐）
+    const int tail_start = mc.n_past;
+    std::vector<llama_token> tail;
+    int n_emitted = 0;
+    int n_drafted = 0;
+    int n_accepted = 0;
+
+    auto emit = [&](llama_token tok)
+    {
+        ctx.usage.completion_tokens += 1;
+        n_emitted += 1;
+        mc.tokens.push_back(tok);
+        if (mc.lookup)
+            mc.lookup->Append(tok);
+        // 返回 true 表示命中 stop 字符串
+        const bool hit_stop = detok.Push(tok);
+        if (!detok.text().empty() && !ctx.cancelled.load(std::memory_order_acquire))
+            ctx.EmitDelta(detok.text());
+        return hit_stop;
+    };
+
+    const FinishReason reason = [&]() -> FinishReason
+    {
+        // last：已采样、尚未写入目标 KV 的 token
+        llama_token last = samplers_->Sample(mc.sampler, mc.grammar, mc.ctx, -1);
+
+        while (true)
+        {
+            if (ctx.cancelled.load(std::memory_order_acquire))
+                return FinishReason::cancelled;
+            if (llama_vocab_is_eog(vocab, last))
+                return FinishReason::stop;
+
+            // 1) 草拟
+            //    草稿模型：草稿 KV 落后的 token + last 一起写入，再贪心续写 k 个
+            //    n-gram lookup：用末尾 n-gram + last 在已有 token 里查后续
+            const int room = std::min(max_new_tokens - n_emitted - 1, n_ctx - mc.n_past - 2);
+            std::vector<llama_token> drafts;
+            if (use_draft)
+            {
+                const int n_draft = std::min(spec_->k(mc), room);
+                if (n_draft > 0 && mc.draft_n_past >= tail_start)
+                {
+                    std::vector<llama_token> pending(tail.begin() + (mc.draft_n_past - tail_start), tail.end());
+                    pending.push_back(last);
+                    drafts = spec_->Draft(mc, pending, n_draft);
+                }
+            }
+            else if (room > 0)
+            {
+                drafts = mc.lookup->Propose(last, std::min(lookup_n_draft_, room));
+            }
+
+            // 2) 校验：目标模型一次 decode [last, d1..dm]，每个位置都输出 logits
+            std::vector<llama_token> verify;
+            verify.reserve(drafts.size() + 1);
+            verify.push_back(last);
+            verify.insert(verify.end(), drafts.begin(), drafts.end());
+            if (DecodeGenerated(mc, verify.data(), (int)verify.size(), true) != 0)
+            {
+                llama_memory_seq_rm(mem, mc.seq_id, mc.n_past, -1);
+                ctx.error_message = "LlamaEngine: llama_decode failed (speculative)";
+                return FinishReason::error;
+            }
+
+            // 3) 逐位置用采样链采样：与草稿一致则接受，第一个不一致的位置给出下一个 last
+            //    每个输出 token 都是目标分布在已接受前缀上的一次采样，非 greedy 时同样无偏，只是接受率更低
+            int accepted = 0;
+            llama_token next = last;
+            for (int i = 0; i <= (int)drafts.size(); ++i)
+            {
+                next = samplers_->Sample(mc.sampler, mc.grammar, mc.ctx, i);
+                if (i < (int)drafts.size() && next == drafts[i])
+                {
+                    ++accepted;
+                    continue;
+                }
+                break;
+            }
+            if (use_draft && !drafts.empty())
+                spec_->Record(mc, (int)drafts.size(), accepted);
+            if (!use_draft && !drafts.empty())
+            {
+                lookup_steps_.fetch_add(1, std::memory_order_relaxed);
+                lookup_proposed_.fetch_add((int64_t)drafts.size(), std::memory_order_relaxed);
+                lookup_accepted_.fetch_add(accepted, std::memory_order_relaxed);
+            }
+            n_drafted += (int)drafts.size();
+            n_accepted += accepted;
+            ctx.usage.speculative_proposed += (int)drafts.size();
+            ctx.usage.speculative_accepted += accepted;
+
+            // 4) 输出 last 与被接受的草稿（都已在目标 KV 中）；遇到 eog / 上限即停
+            bool done = false;
+            FinishReason r = FinishReason::length;
+            mc.n_past += 1;
+            tail.push_back(last);
+            if (emit(last))
+            {
+                r = FinishReason::stop;
+                done = true;
+            }
+            done = done || n_emitted >= max_new_tokens;
+            for (int i = 0; !done && i < accepted; ++i)
+            {
+                if (llama_vocab_is_eog(vocab, drafts[i]))
+                {
+                    r = FinishReason::stop;
+                    done = true;
+                    break;
+                }
+                mc.n_past += 1;
+                tail.push_back(drafts[i]);
+                if (emit(drafts[i]))
+                {
+                    r = FinishReason::stop;
+                    done = true;
+                    break;
+                }
+                done = n_emitted >= max_new_tokens;
+            }
+
+            // 被拒绝 / 未输出的草稿从两边 KV 里去掉
+            llama_memory_seq_rm(mem, mc.seq_id, mc.n_past, -1);
+            if (use_draft && mc.draft_n_past > mc.n_past)
+                spec_->Align(mc, tail, tail_start);
+
+            if (done)
+                return r;
+            last = next;
+        }
+    }();
+
+    // 草稿 KV 对齐到目标 KV，下一轮可以继续投机
+    if (use_draft)
+        spec_->Align(mc, tail, tail_start);
+
+    LOG(INFO) << "[spec] req=" << ctx.request_id
+              << " mode=" << (use_draft ? "draft" : "lookup")
+              << " emitted=" << n_emitted
+              << " drafted=" << n_drafted
+              << " accepted=" << n_accepted;
+    return reason;
+}
+
+FinishReason LlamaEngine::GenerateChoices(ServingContext &ctx, ModelContext &mc, const SamplingParams &sparams,
+                                          int max_new_tokens)
+{
+    const llama_vocab *vocab = llama_model_get_vocab(model_);
+    llama_memory_t mem = llama_get_memory(mc.ctx);
+    const int n = ctx.n;
+    const int base = mc.n_past;
+
+    // prompt 的 cell 各候选共用，生成的 token 各占一份：n 个候选平分剩余空间
+    max_new_tokens = std::min(max_new_tokens, ((int)llama_n_ctx(mc.ctx) - base) / n);
+
+    struct Choice
+    {
+        llama_sampler *chain = nullptr;
+        llama_sampler *grammar = nullptr;
+        std::string key; // 非空表示链从缓存取得，结束时归还
+        std::unique_ptr<LlamaDetokenizer> detok;
+        int32_t idx = -1; // 下一次采样用的 logits 位置（首步为 prompt 最后一个 token）
+        bool done = false;
+    };
+    std::vector<Choice> cs(n);
+    ctx.choices.assign(n, ServingContext::Choice{});
+
+    // choice 0 用 session 上绑定的链（采样状态随 session 延续），其余各取一条；
+    // 显式 seed 时候选 i 用 seed + i，结果可复现且互不相同
+    for (int i = 0; i < n; ++i)
+    {
+        cs[i].detok = std::make_unique<LlamaDetokenizer>(pieces_.get(), ctx.stop);
+        if (i == 0)
+        {
+            cs[i].chain = mc.sampler;
+            cs[i].grammar = mc.grammar;
+            continue;
+        }
+        SamplingParams p = sparams;
+        if (p.seed != 0xFFFFFFFF)
+            p.seed += static_cast<uint32_t>(i);
+        cs[i].key = p.Key();
+        cs[i].chain = samplers_->Acquire(p);
+        if (!p.grammar.empty())
+            cs[i].grammar = samplers_->AcquireGrammar(p.grammar);
+        llama_memory_seq_cp(mem, mc.seq_id, mc.seq_id + i, -1, -1);
+    }
+
+    auto flush = [&](int i)
+    {
+        cs[i].detok->Flush();
+        if (!cs[i].detok->text().empty())
+            ctx.EmitChoiceDelta(i, cs[i].detok->text());
+    };
+    int n_active = n;
+    auto finish = [&](int i, FinishReason r)
+    {
+        cs[i].done = true;
+        --n_active;
+        ctx.EmitChoiceFinish(i, r);
+    };
+
+    llama_batch batch = llama_batch_init(n, 0, 1);
+    std::vector<llama_token> next(n);
+    FinishReason reason = FinishReason::stop;
+    int n_generated = 0;
+    int step = 0;
+    for (; n_active > 0; ++step)
+    {
+        if (ctx.cancelled.load(std::memory_order_acquire))
+        {
+            reason = FinishReason::cancelled;
+            break;
+        }
+        if (step >= max_new_tokens)
+        {
+            for (int i = 0; i < n; ++i)
+            {
+                if (cs[i].done)
+                    continue;
+                flush(i);
+                finish(i, FinishReason::length);
+            }
+            break;
+        }
+
+        // 1) 各候选在自己上一步的 logits 上采样；采到 eog 的候选结束（eog 不写入 KV）
+        batch.n_tokens = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            next[i] = LLAMA_TOKEN_NULL;
+            if (cs[i].done)
+                continue;
+            const llama_token tok = samplers_->Sample(cs[i].chain, cs[i].grammar, mc.ctx, cs[i].idx);
+            if (llama_vocab_is_eog(vocab, tok))
+            {
+                flush(i);
+                finish(i, FinishReason::stop);
+                continue;
+            }
+            next[i] = tok;
+            cs[i].idx = batch.n_tokens++;
+            batch.token[cs[i].idx] = tok;
+            batch.pos[cs[i].idx] = base + step;
+            batch.n_seq_id[cs[i].idx] = 1;
+            batch.seq_id[cs[i].idx][0] = mc.seq_id + i;
+            batch.logits[cs[i].idx] = true;
+        }
+        if (batch.n_tokens == 0)
+            break;
+
+        // 2) 所有未结束候选的 token 一次 decode
+        const auto t0 = std::chrono::steady_clock::now();
+        int rc;
+        {
+            LlamaThreadBudget::Lease lease(mc.ctx, LlamaThreadBudget::Phase::decode);
+            rc = llama_decode(mc.ctx, batch);
+        }
+        decode_tokens_.fetch_add(batch.n_tokens, std::memory_order_relaxed);
+        decode_us_.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(
+                                 std::chrono::steady_clock::now() - t0)
+                                 .count(),
+                             std::memory_order_relaxed);
+        if (rc != 0)
+        {
+            llama_memory_seq_rm(mem, mc.seq_id, mc.n_past, -1);
+            ctx.error_message = "LlamaEngine: llama_decode failed (choices)";
+            reason = FinishReason::error;
+            break;
+        }
+
+        // 3) 逐候选输出；choice 0 的 token 同时记入 session 的 KV 状态
+        for (int i = 0; i < n; ++i)
+        {
+            if (next[i] == LLAMA_TOKEN_NULL)
+                continue;
+            ctx.usage.completion_tokens += 1;
+            n_generated += 1;
+            if (i == 0)
+            {
+                mc.n_past += 1;
+                mc.tokens.push_back(next[i]);
+                if (mc.lookup)
+                    mc.lookup->Append(next[i]);
+            }
+
+            // stop 字符串完成：只输出它之前的文本
+            const bool hit_stop = cs[i].detok->Push(next[i]);
+            if (!cs[i].detok->text().empty() && !ctx.cancelled.load(std::memory_order_acquire))
+                ctx.EmitChoiceDelta(i, cs[i].detok->text());
+            if (hit_stop)
+                finish(i, FinishReason::stop);
+        }
+    }
+    llama_batch_free(batch);
+
+    // 只保留 choice 0 的序列作为 session KV；其余候选的 cell 与采样链释放
+    for (int i = 1; i < n; ++i)
+    {
+        llama_memory_seq_rm(mem, mc.seq_id + i, -1, -1);
+        samplers_->Release(cs[i].key, cs[i].chain);
+        if (cs[i].grammar)
+            llama_sampler_free(cs[i].grammar);
+    }
+
+    multi_choice_requests_.fetch_add(1, std::memory_order_relaxed);
+    multi_choice_tokens_.fetch_add(n_generated, std::memory_order_relaxed);
+
+    // 正常结束时整个请求的结束原因取 choice 0（决定是否写入 history）
+    if (n_active == 0)
+        reason = ctx.choices[0].finish_reason;
+
+    LOG(INFO) << "[llama] choices req=" << ctx.request_id
+              << " n=" << n
+              << " steps=" << step
+              << " tokens=" << n_generated;
+    return reason;
+}
@@ -1,31 +1,194 @@
 #pragma once
 #include "serving/core/ServingContext.h"
 #include "serving/core/ModelEngine.h"
+#include "engine/LlamaThreadBudget.h"
+#include "ggml.h"
 
+#include <atomic>
+#include <map>
+#include <mutex>
 #include <string>
 #include <memory>
+#include <vector>
+#include <cstdint>
 
 struct Session;      
 struct ModelContext; 
+class LlamaBatchScheduler;
+class LlamaSlotPool;
+class LlamaContextPool;
+class LlamaKvSwap;
+struct KvSwapGate;
+class LlamaSpeculative;
+class LlamaMultimodal;
+class LlamaImageStage;
+class LlamaLoraCache;
+class LlamaSamplerCache;
+class LlamaPieceTable;
+class LlamaDetokenizer;
+class LlamaChatTemplate;
+struct SamplingParams;
 
 struct llama_model;
-// struct llama_context;
+struct llama_context;
 // struct llama_sampler;
 
 class LlamaEngine final : public ModelEngine {
 public:
-    explicit LlamaEngine(const std::string& model_path);
+    // options：只对本模型生效的配置覆盖（键为环境变量名），未覆盖的仍读环境变量
+    explicit LlamaEngine(const std::string& model_path, std::map<std::string, std::string> options = {});
     ~LlamaEngine() override;
 
+    // 模型文件是否加载成功
+    bool loaded() const { return model_ != nullptr; }
+
     void Run(std::shared_ptr<ServingContext> ctx) override;
+    bool IsAsync() const override { return scheduler_ != nullptr; }
+    // 带图片的请求：先在图片阶段（LlamaImageStage）解码 + 编码，完成后才进入模型队列
+    bool Prepare(const std::shared_ptr<ServingContext> &ctx, std::function<void()> ready) override;
+    void CollectMetrics(std::map<std::string, double> &out) const override;
+    size_t ResidentBytes() const override;
 
 private:
+    void RunSerial(std::shared_ptr<ServingContext> ctx);
+
+    int OptInt(const char *name, int def) const;
+    std::string OptStr(const char *name, const std::string &def) const;
+
     std::string model_path_;
+    std::map<std::string, std::string> options_;
 
     llama_model *model_ = nullptr;
     // llama_context *ctx_ = nullptr;
     // llama_sampler *sampler_ = nullptr;
 
+    // LLAMA_SCHEDULER=continuous 时启用；为空则走串行 Run
+    std::unique_ptr<LlamaBatchScheduler> scheduler_;
+
+    // LLAMA_KV_MODE=shared 时启用：共享 context + per-session seq slot
+    std::shared_ptr<LlamaSlotPool> pool_;
+
+    // 按参数集缓存的采样链（串行 Run 与 continuous 调度共用）
+    std::shared_ptr<LlamaSamplerCache> samplers_;
+
+    // 整个词表的 piece 表（模型加载时构建，每个请求的 LlamaDetokenizer 共用）
+    std::shared_ptr<const LlamaPieceTable> pieces_;
+
+    // chat 模板（加载时探测能否逐条增量展开）
+    std::shared_ptr<const LlamaChatTemplate> chat_tmpl_;
+
+    // 单次 llama_decode 的最大 prefill token 数（LLAMA_PREFILL_CHUNK）
+    int prefill_chunk_ = 512;
+
+    // LLAMA_DRAFT_MODEL_PATH 设置时启用（仅串行模式）：草稿模型投机解码
+    std::unique_ptr<LlamaSpeculative> spec_;
+
+    // LLAMA_MMPROJ_PATH 设置时启用（仅串行模式）：图片输入与按内容缓存的图片 embedding
+    std::unique_ptr<LlamaMultimodal> mm_;
+    // 与 mm_ 一同启用：图片准备阶段的独立线程池（LLAMA_IMAGE_WORKERS / LLAMA_IMAGE_QUEUE）
+    std::unique_ptr<LlamaImageStage> image_stage_;
+
+    // LoRA adapter 缓存（LLAMA_LORA_CACHE_MB）：请求在准备阶段按路径加载 / 命中，串行 Run 与 continuous 调度只做应用
+    std::shared_ptr<LlamaLoraCache> lora_;
+    std::atomic<int64_t> lora_requests_{0};
+    std::atomic<int64_t> lora_kv_resets_{0}; // session 换了 adapter，KV 整段重写的次数
+
+    // LLAMA_LOOKUP_N_DRAFT > 0 时启用（仅串行模式）：n-gram prompt lookup 投机解码
+    int lookup_n_draft_ = 0;
+    int lookup_ngram_min_ = 2;
+    int lookup_ngram_max_ = 4;
+    std::atomic<int64_t> lookup_steps_{0};
+    std::atomic<int64_t> lookup_proposed_{0};
+    std::atomic<int64_t> lookup_accepted_{0};
+
+    // 单个请求的最大候选数（LLAMA_MAX_N，仅串行 + per_session）：session context 按它设 n_seq_max
+    int max_n_ = 1;
+    std::atomic<int64_t> multi_choice_requests_{0};
+    std::atomic<int64_t> multi_choice_tokens_{0};
+
+    // 构造各阶段耗时（/metrics 的 startup_*_ms）
+    struct StartupTimes
+    {
+        double prefetch_ms = 0;
+        double load_ms = 0;
+        double init_ms = 0;
+        double warmup_ms = 0;
+    };
+    StartupTimes startup_;
+
+    // KV cache 类型（LLAMA_CACHE_TYPE_K / V）与对应的每 token 字节数
+    ggml_type kv_type_k_ = GGML_TYPE_F16;
+    ggml_type kv_type_v_ = GGML_TYPE_F16;
+    size_t kv_token_bytes_ = 0;
+
+    // 共享 context / continuous 调度预分配的 KV 字节数（ResidentBytes 用）
+    size_t fixed_kv_bytes_ = 0;
+
+    // LLAMA_CONTEXT_POOL > 0 时启用（仅 per_session + 串行）：预创建的独占 context，session 借用、用完清空归还
+    std::shared_ptr<LlamaContextPool> ctx_pool_;
+
+    // 独占模式下本引擎创建的 session context：卸载模型时逐个 Detach
+    mutable std::mutex live_mu_;
+    std::vector<std::weak_ptr<ModelContext>> live_;
+
+    // LLAMA_KV_OVERFLOW=shift：逼近 n_ctx 时保留 system prompt + 最近这么多 token，0 表示整体重建
+    int shift_keep_tokens_ = 0;
+
+    // LLAMA_KV_SWAP_RAM_MB / LLAMA_KV_SWAP_DIR 任一设置时启用：淘汰的 session KV 换出，回来时恢复
+    std::shared_ptr<LlamaKvSwap> swap_;
+    int swap_min_tokens_ = 0;
+    // Session 析构钩子经由它访问 swap：钩子读 context 期间持共享锁，引擎析构先独占关闭它再释放 context
+    std::shared_ptr<KvSwapGate> swap_gate_;
+
+    // prefill 耗时统计：用于估算“重新 prefill”的代价，与 swap 恢复耗时对比
+    std::atomic<int64_t> prefill_tokens_{0};
+    std::atomic<int64_t> prefill_us_{0};
+
+    // 编辑 / 重新生成（串行模式）：按 token 公共前缀截断 KV 的次数与复用的 token 数
+    std::atomic<int64_t> kv_rewinds_{0};
+    std::atomic<int64_t> kv_rewind_reused_{0};
+
+    // 生成阶段 decode 耗时（串行模式），用于看文法约束（grammar_eval_ms_total）占解码时间的比例
+    std::atomic<int64_t> decode_tokens_{0};
+    std::atomic<int64_t> decode_us_{0};
+
+    // 首个请求前跑一次 prefill + decode（LLAMA_NO_WARMUP=1 关闭）
+    void WarmUp();
+
     std::shared_ptr<ModelContext> EnsureContext(const std::shared_ptr<Session> &s);
+    // session 的独占 context：启用 context 池时从池中借，否则现建
     std::shared_ptr<ModelContext> CreateNewContext();
-};
\ No newline at end of file
+    // 按 LLAMA_N_CTX / KV 类型 / LLAMA_MAX_N 新建一个 llama_context
+    llama_context *NewLlamaContext();
+
+    // 新 context 上尝试恢复换出的 KV；成功时裁剪 ctx.messages 为增量并回填 session history
+    bool RestoreSwapped(ServingContext &ctx, ModelContext &mc);
+
+    // 完整 prompt 写入非空 KV 前调用：KV 截到与 toks 的最长公共前缀（mc.tokens 未知时截到 0），
+    // toks 去掉这段前缀；返回复用的 token 数
+    int RewindKv(ModelContext &mc, std::vector<int32_t> &toks);
+
+    // decode 到 mc 的 seq 上（不推进 n_past）；共享 KV 满时先淘汰空闲 slot 再重试
+    // all_logits=false 时只输出最后一个 token 的 logits
+    // 返回 llama_decode 的返回码：0 成功，2 被 abort callback 中断
+    int DecodeTokens(ModelContext &mc, const int32_t *toks, int n, LlamaThreadBudget::Phase phase,
+                     bool all_logits = false);
+
+    // 生成阶段的 DecodeTokens，额外累计 decode 耗时
+    int DecodeGenerated(ModelContext &mc, const int32_t *toks, int n, bool all_logits = false);
+
+    // 投机解码生成：草稿模型（use_draft）或 n-gram lookup 草拟、目标模型 batch 校验；
+    // 每个位置都用本请求的采样链采样，输出与逐 token 解码同分布（greedy 时完全一致）
+    FinishReason GenerateSpeculative(ServingContext &ctx, ModelContext &mc, LlamaDetokenizer &detok,
+                                     int max_new_tokens, bool use_draft);
+
+    // n > 1：prompt 已 prefill 到 seq 0，复制到 seq 1..n-1（unified KV 只共享 cell，不复制数据），
+    // 每步把所有未结束候选的 token 放进同一个 batch decode；各候选用自己的采样链与 detokenizer。
+    // 结束后只保留 seq 0（choice 0）作为 session 的 KV。返回整个请求的结束原因
+    FinishReason GenerateChoices(ServingContext &ctx, ModelContext &mc, const SamplingParams &sparams,
+                                 int max_new_tokens);
+
+    // 从 toks[offset] 起按 prefill_chunk_ 分块 prefill，逐块推进 mc.n_past；
+    // ctx 取消时在块间退出或经 abort callback 中断当前块，返回 2
+    int PrefillTokens(ModelContext &mc, const std::vector<int32_t> &toks, size_t offset, ServingContext &ctx);
+};
@@ -0,0 +1,88 @@
+#include "engine/LlamaImageStage.h"
+
+#include <algorithm>
+
+LlamaImageStage::LlamaImageStage(Options opt)
+    : opt_(opt)
+{
+    opt_.n_workers = std::max(1, opt_.n_workers);
+    opt_.max_queue = std::max<size_t>(1, opt_.max_queue);
+    stats_.workers = opt_.n_workers;
+
+    workers_.reserve(opt_.n_workers);
+    for (int i = 0; i < opt_.n_workers; ++i)
+        workers_.emplace_back([this] { WorkerLoop(); });
+}
+
+LlamaImageStage::~LlamaImageStage()
+{
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto &t : workers_)
+    {
+        if (t.joinable())
+            t.join();
+    }
+}
+
+bool LlamaImageStage::Submit(Job job)
+{
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (stop_ || q_.size() >= opt_.max_queue)
+        {
+            stats_.rejected++;
+            return false;
+        }
+        q_.push_back(Task{std::move(job), Clock::now()});
+        stats_.submitted++;
+        stats_.queued_max = std::max(stats_.queued_max, q_.size());
+    }
+    cv_.notify_one();
+    return true;
+}
+
+void LlamaImageStage::WorkerLoop()
+{
+    while (true)
+    {
+        Task task;
+        Clock::time_point started_at;
+        {
+            std::unique_lock<std::mutex> lk(mu_);
+            cv_.wait(lk, [&] { return stop_ || !q_.empty(); });
+            if (stop_)
+                return;
+            task = std::move(q_.front());
+            q_.pop_front();
+
+            started_at = Clock::now();
+            const double wait_ms = std::chrono::duration<double, std::milli>(started_at - task.enqueued_at).count();
+            stats_.wait_ms_total += wait_ms;
+            stats_.wait_ms_max = std::max(stats_.wait_ms_max, wait_ms);
+            stats_.running++;
+        }
+
+        task.job();
+        // 任务可能持有请求 / 模型租约：在锁外、计数之前释放
+        task.job = nullptr;
+
+        const double run_ms = std::chrono::duration<double, std::milli>(Clock::now() - started_at).count();
+        std::lock_guard<std::mutex> lk(mu_);
+        stats_.running--;
+        stats_.completed++;
+        stats_.run_ms_total += run_ms;
+        stats_.run_ms_max = std::max(stats_.run_ms_max, run_ms);
+    }
+}
+
+LlamaImageStage::Stats LlamaImageStage::GetStats() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    Stats st = stats_;
+    st.queued = q_.size();
+    return st;
+}
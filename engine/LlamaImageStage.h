@@ -0,0 +1,78 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief 图片准备阶段：独立的有界线程池（图片解码 + 缩放 / 归一化 + 视觉编码）
+ *
+ * - 视觉编码比一步 decode 重得多，放在模型队列里执行会卡住该模型所有正在出字的流；
+ *   带图片的请求先在这里准备好 embedding，完成后才进入模型队列 / 引擎调度
+ * - 队列有上限（max_queue），满了直接拒绝（overloaded），与模型队列的背压一致
+ * - 只负责排队、执行与统计，任务内容由调用方决定（不依赖 llama / mtmd，可单独用合成任务测试）
+ */
+class LlamaImageStage
+{
+public:
+    struct Options
+    {
+        int n_workers = 2;
+        size_t max_queue = 64;
+    };
+
+    struct Stats
+    {
+        int workers = 0;
+        size_t queued = 0;  // 当前排队的任务数
+        size_t running = 0; // 当前执行中的任务数
+        size_t queued_max = 0;
+        int64_t submitted = 0;
+        int64_t completed = 0;
+        int64_t rejected = 0;
+        double wait_ms_total = 0; // 入队到开始执行
+        double wait_ms_max = 0;
+        double run_ms_total = 0;
+        double run_ms_max = 0;
+    };
+
+    using Job = std::function<void()>;
+
+    explicit LlamaImageStage(Options opt);
+    // 停止并等待执行中的任务结束；仍在排队的任务直接丢弃
+    ~LlamaImageStage();
+
+    LlamaImageStage(const LlamaImageStage &) = delete;
+    LlamaImageStage &operator=(const LlamaImageStage &) = delete;
+
+    // 入队；队列已满返回 false
+    bool Submit(Job job);
+
+    Stats GetStats() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Task
+    {
+        Job job;
+        Clock::time_point enqueued_at;
+    };
+
+    void WorkerLoop();
+
+private:
+    Options opt_;
+
+    mutable std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<Task> q_;
+    bool stop_ = false;
+    Stats stats_; // mu_
+
+    std::vector<std::thread> workers_;
+};
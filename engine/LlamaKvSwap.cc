@@ -0,0 +1,270 @@
+#include "engine/LlamaKvSwap.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <system_error>
+
+namespace fs = std::filesystem;
+
+LlamaKvSwap::LlamaKvSwap(const Options &opt)
+    : opt_(opt)
+{
+    if (opt_.disk_dir.empty())
+        return;
+
+    std::error_code ec;
+    fs::create_directories(opt_.disk_dir, ec);
+    if (ec)
+    {
+        LOG(ERROR) << "[kv-swap] create dir failed, disk tier disabled: " << opt_.disk_dir
+                   << " err=" << ec.message();
+        opt_.disk_dir.clear();
+        return;
+    }
+
+    // 上次进程遗留的文件：索引只在内存里，已无法使用
+    for (const auto &ent : fs::directory_iterator(opt_.disk_dir, ec))
+    {
+        const std::string name = ent.path().filename().string();
+        if (name.rfind(opt_.file_prefix, 0) == 0 && ent.path().extension() == ".kv")
+            fs::remove(ent.path(), ec);
+    }
+}
+
+LlamaKvSwap::~LlamaKvSwap()
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    std::error_code ec;
+    for (const auto &kv : slots_)
+    {
+        if (!kv.second.path.empty())
+            fs::remove(kv.second.path, ec);
+    }
+}
+
+void LlamaKvSwap::Put(const std::string &session_id, Entry &&e)
+{
+    DiskWork work;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+
+        auto old = slots_.find(session_id);
+        if (old != slots_.end())
+            EraseLocked(old, work);
+
+        const size_t bytes = e.data.size();
+        if (bytes == 0 || bytes > std::max(opt_.ram_bytes, opt_.disk_dir.empty() ? 0 : opt_.disk_bytes))
+        {
+            stats_.dropped++;
+        }
+        else
+        {
+            lru_.push_front(session_id);
+            Slot &slot = slots_[session_id];
+            slot.history = std::move(e.history);
+            slot.n_past = e.n_past;
+            slot.data = std::move(e.data);
+            slot.bytes = bytes;
+            slot.lru_it = lru_.begin();
+
+            stats_.swap_out++;
+            stats_.swap_out_bytes += static_cast<int64_t>(bytes);
+            stats_.ram_entries++;
+            stats_.ram_bytes += static_cast<int64_t>(bytes);
+
+            EnforceBudgetLocked(work);
+        }
+    }
+    RunDiskWork(work);
+}
+
+LlamaKvSwap::Tier LlamaKvSwap::Take(const std::string &session_id, Entry &out)
+{
+    std::string path;
+    std::shared_ptr<const std::vector<uint8_t>> writing;
+    size_t bytes = 0;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+
+        auto it = slots_.find(session_id);
+        if (it == slots_.end())
+            return Tier::none;
+
+        // 摘出索引后条目只属于本次调用，读盘不再需要锁
+        Slot &slot = it->second;
+        out.history = std::move(slot.history);
+        out.n_past = slot.n_past;
+        out.data = std::move(slot.data);
+        writing = std::move(slot.writing);
+        bytes = slot.bytes;
+        path = DetachLocked(it);
+    }
+    if (path.empty())
+        return Tier::ram;
+
+    std::error_code ec;
+    if (writing)
+    {
+        // 还在写盘：直接用内存里的数据，写完确认时发现条目已被取走，由写盘方删除文件
+        out.data = *writing;
+        return Tier::disk;
+    }
+
+    std::ifstream in(path, std::ios::binary);
+    out.data.resize(bytes);
+    const bool ok = static_cast<bool>(in.read(reinterpret_cast<char *>(out.data.data()), static_cast<std::streamsize>(bytes)));
+    in.close();
+    fs::remove(path, ec);
+    if (!ok)
+    {
+        LOG(ERROR) << "[kv-swap] read failed: " << path;
+        out = Entry();
+        return Tier::none;
+    }
+    return Tier::disk;
+}
+
+void LlamaKvSwap::RecordRestore(Tier tier, int tokens, double ms, bool ok)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    if (!ok)
+    {
+        stats_.restore_discard++;
+        return;
+    }
+    if (tier == Tier::disk)
+        stats_.restore_disk++;
+    else
+        stats_.restore_ram++;
+    stats_.restored_tokens += tokens;
+    stats_.restore_ms += ms;
+}
+
+LlamaKvSwap::Stats LlamaKvSwap::GetStats() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return stats_;
+}
+
+std::string LlamaKvSwap::DetachLocked(std::unordered_map<std::string, Slot>::iterator it)
+{
+    Slot &slot = it->second;
+    std::string path = std::move(slot.path);
+    if (!path.empty())
+    {
+        stats_.disk_entries--;
+        stats_.disk_bytes -= static_cast<int64_t>(slot.bytes);
+    }
+    else
+    {
+        stats_.ram_entries--;
+        stats_.ram_bytes -= static_cast<int64_t>(slot.bytes);
+    }
+    lru_.erase(slot.lru_it);
+    slots_.erase(it);
+    return path;
+}
+
+void LlamaKvSwap::EraseLocked(std::unordered_map<std::string, Slot>::iterator it, DiskWork &work)
+{
+    std::string path = DetachLocked(it);
+    if (!path.empty())
+        work.removes.push_back(std::move(path));
+}
+
+void LlamaKvSwap::DemoteLocked(const std::string &session_id, Slot &slot, DiskWork &work)
+{
+    // 先记入磁盘层（预算按写盘成功计），数据交给锁外写盘
+    slot.path = opt_.disk_dir + "/" + opt_.file_prefix + "-" + std::to_string(next_file_id_++) + ".kv";
+    slot.writing = std::make_shared<const std::vector<uint8_t>>(std::move(slot.data));
+    slot.data.clear();
+    work.writes.push_back({session_id, slot.path, slot.writing});
+
+    stats_.ram_entries--;
+    stats_.ram_bytes -= static_cast<int64_t>(slot.bytes);
+    stats_.disk_entries++;
+    stats_.disk_bytes += static_cast<int64_t>(slot.bytes);
+}
+
+void LlamaKvSwap::EnforceBudgetLocked(DiskWork &work)
+{
+    // lit 指向“已处理区间”的起点，cur 为其前一个（更旧）条目；只擦除 cur，lit 保持有效
+    // RAM 层：从最旧的开始降级到磁盘；没有磁盘层则直接丢弃
+    for (auto lit = lru_.end(); lit != lru_.begin() && static_cast<size_t>(stats_.ram_bytes) > opt_.ram_bytes;)
+    {
+        auto cur = std::prev(lit);
+        auto it = slots_.find(*cur);
+        if (!it->second.path.empty())
+        {
+            lit = cur;
+            continue;
+        }
+        if (!opt_.disk_dir.empty())
+        {
+            DemoteLocked(it->first, it->second, work);
+            lit = cur;
+            continue;
+        }
+        stats_.dropped++;
+        EraseLocked(it, work);
+    }
+
+    // 磁盘层：超预算删最旧的文件（正在写的文件由写盘方确认时删除）
+    for (auto lit = lru_.end(); lit != lru_.begin() && static_cast<size_t>(stats_.disk_bytes) > opt_.disk_bytes;)
+    {
+        auto cur = std::prev(lit);
+        auto it = slots_.find(*cur);
+        if (it->second.path.empty())
+        {
+            lit = cur;
+            continue;
+        }
+        stats_.dropped++;
+        if (it->second.writing)
+            DetachLocked(it);
+        else
+            EraseLocked(it, work);
+    }
+}
+
+void LlamaKvSwap::RunDiskWork(DiskWork &work)
+{
+    std::error_code ec;
+    for (const auto &w : work.writes)
+    {
+        std::ofstream out(w.path, std::ios::binary | std::ios::trunc);
+        bool ok = out.write(reinterpret_cast<const char *>(w.data->data()), static_cast<std::streamsize>(w.data->size())) &&
+                  out.flush();
+        out.close();
+        if (!ok)
+            LOG(ERROR) << "[kv-swap] write failed: " << w.path;
+
+        // 回到锁内确认：条目仍是这次降级的那个才发布，否则（已被取走 / 覆盖 / 淘汰）文件作废
+        bool keep = false;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            auto it = slots_.find(w.session_id);
+            if (it != slots_.end() && it->second.writing == w.data)
+            {
+                if (ok)
+                {
+                    it->second.writing.reset();
+                    keep = true;
+                }
+                else
+                {
+                    stats_.dropped++;
+                    DetachLocked(it);
+                }
+            }
+        }
+        if (!keep)
+            fs::remove(w.path, ec);
+    }
+    for (const auto &path : work.removes)
+        fs::remove(path, ec);
+}
@@ -0,0 +1,125 @@
+#pragma once
+#include "serving/core/ServingContext.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief 空闲 Session 的 KV 换出存储（两级：RAM -> 磁盘）
+ *
+ * - Session 被 SessionManager 淘汰 / GC 时，引擎把它的 seq 状态（llama_state_seq_get_data）
+ *   连同当时的 history 放进来，下次同一 session_id 回来时取出恢复，省掉整段重新 prefill
+ * - RAM 超预算时把最久未用的条目降级写盘；磁盘超预算时删除最久未用的文件
+ * - 条目只能被 Take 一次（取出即删除）
+ *
+ * 线程安全：所有接口加锁，但磁盘读写与删除都在锁外进行：
+ * 降级时在锁内为条目分配文件并记入磁盘层，锁外写盘后再回到锁内确认（期间条目被取走 / 淘汰则删掉写出的文件）；
+ * Take 在锁内把条目摘出索引，锁外读盘（仍在写盘的条目直接取内存里的数据）。
+ */
+class LlamaKvSwap
+{
+public:
+    struct Options
+    {
+        size_t ram_bytes = 0;      // RAM 层预算，0 表示不使用 RAM 层（直接写盘）
+        std::string disk_dir;      // 磁盘层目录，空表示不使用磁盘层
+        size_t disk_bytes = 0;     // 磁盘层预算
+        std::string file_prefix;   // 磁盘文件名前缀（区分不同模型）
+    };
+
+    struct Entry
+    {
+        std::vector<Message> history; // 换出时 session 的 history，与 KV 一一对应
+        int n_past = 0;
+        std::vector<uint8_t> data;    // llama_state_seq_get_data 的结果
+    };
+
+    enum class Tier
+    {
+        none,
+        ram,
+        disk
+    };
+
+    struct Stats
+    {
+        int64_t swap_out = 0;         // 换出次数
+        int64_t swap_out_bytes = 0;
+        int64_t dropped = 0;          // 超预算被直接丢弃的条目数
+        int64_t ram_entries = 0;
+        int64_t ram_bytes = 0;
+        int64_t disk_entries = 0;
+        int64_t disk_bytes = 0;
+        int64_t restore_ram = 0;      // 从 RAM 层恢复次数
+        int64_t restore_disk = 0;     // 从磁盘层恢复次数
+        int64_t restore_discard = 0;  // 取到但因 history 不匹配 / 恢复失败而丢弃
+        int64_t restored_tokens = 0;
+        double restore_ms = 0;        // 恢复总耗时（含读盘 + set_data）
+    };
+
+    explicit LlamaKvSwap(const Options &opt);
+    ~LlamaKvSwap();
+
+    bool enabled() const { return opt_.ram_bytes > 0 || !opt_.disk_dir.empty(); }
+
+    // 换出：同一 session 已有条目时覆盖
+    void Put(const std::string &session_id, Entry &&e);
+
+    // 取出并删除；未找到（或读盘失败）返回 Tier::none
+    Tier Take(const std::string &session_id, Entry &out);
+
+    // 引擎恢复完成后回报结果（ok=false 表示条目被丢弃）
+    void RecordRestore(Tier tier, int tokens, double ms, bool ok);
+
+    Stats GetStats() const;
+
+private:
+    struct Slot
+    {
+        std::vector<Message> history;
+        int n_past = 0;
+        std::vector<uint8_t> data; // RAM 层数据；在磁盘层时为空
+        std::string path;          // 磁盘层文件（写盘中即已分配）；在 RAM 层时为空
+        std::shared_ptr<const std::vector<uint8_t>> writing; // 正在锁外写盘的数据，写完置空
+        size_t bytes = 0;
+        std::list<std::string>::iterator lru_it;
+    };
+
+    // 锁外的磁盘操作：降级写盘与待删除的文件
+    struct DiskWork
+    {
+        struct Write
+        {
+            std::string session_id;
+            std::string path;
+            std::shared_ptr<const std::vector<uint8_t>> data;
+        };
+        std::vector<Write> writes;
+        std::vector<std::string> removes;
+    };
+
+    // 从索引摘除并更新统计，返回其磁盘文件（不删除，RAM 层为空串）
+    std::string DetachLocked(std::unordered_map<std::string, Slot>::iterator it);
+    // 摘除并把磁盘文件记入 work.removes
+    void EraseLocked(std::unordered_map<std::string, Slot>::iterator it, DiskWork &work);
+    void DemoteLocked(const std::string &session_id, Slot &slot, DiskWork &work);
+    void EnforceBudgetLocked(DiskWork &work);
+    // 不持锁：执行写盘（完成后回到锁内确认）与删除
+    void RunDiskWork(DiskWork &work);
+
+private:
+    Options opt_;
+
+    mutable std::mutex mu_;
+    std::unordered_map<std::string, Slot> slots_;
+    std::list<std::string> lru_; // front = 最近换出
+    uint64_t next_file_id_ = 0;
+    Stats stats_;
+};
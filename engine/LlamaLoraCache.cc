@@ -0,0 +1,138 @@
+#include "engine/LlamaLoraCache.h"
+#include "llama.h"
+
+#include <chrono>
+#include <filesystem>
+#include <glog/logging.h>
+
+LlamaLoraCache::LlamaLoraCache(llama_model *model, size_t budget_bytes)
+    : model_(model), budget_(budget_bytes)
+{
+    stats_.budget_bytes = budget_;
+}
+
+LlamaLoraCache::~LlamaLoraCache()
+{
+    // 引擎卸载时已没有请求在用（模型租约），迟到的租约只剩一个不再使用的指针
+    for (auto &e : lru_)
+    {
+        if (e->adapter)
+            llama_adapter_lora_free(e->adapter);
+        e->adapter = nullptr;
+    }
+    lru_.clear();
+    index_.clear();
+}
+
+LlamaLoraCache::Lease LlamaLoraCache::Acquire(const std::string &path, std::string &err)
+{
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = index_.find(path);
+        if (it != index_.end())
+        {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            stats_.hits++;
+            return *it->second;
+        }
+    }
+
+    // 加载在 mu_ 之外（/metrics 不被阻塞），load_mu_ 保证同一 adapter 只加载一次
+    std::lock_guard<std::mutex> load_lk(load_mu_);
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = index_.find(path);
+        if (it != index_.end())
+        {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            stats_.hits++;
+            return *it->second;
+        }
+    }
+
+    // 内存按 GGUF 文件大小计（adapter 张量与文件基本一一对应）
+    std::error_code ec;
+    const auto file_bytes = std::filesystem::file_size(path, ec);
+    if (ec)
+    {
+        err = "lora adapter not found: " + path;
+        std::lock_guard<std::mutex> lk(mu_);
+        stats_.load_failures++;
+        return nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        EvictLocked(static_cast<size_t>(file_bytes));
+    }
+
+    const auto t0 = std::chrono::steady_clock::now();
+    llama_adapter_lora *adapter = llama_adapter_lora_init(model_, path.c_str());
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+    std::lock_guard<std::mutex> lk(mu_);
+    if (!adapter)
+    {
+        // 常见原因：adapter 与基座模型的结构 / 张量形状不匹配
+        err = "failed to load lora adapter: " + path;
+        stats_.load_failures++;
+        LOG(ERROR) << "[lora] load failed path=" << path;
+        return nullptr;
+    }
+
+    auto e = std::make_shared<Adapter>();
+    e->adapter = adapter;
+    e->path = path;
+    e->bytes = static_cast<size_t>(file_bytes);
+    lru_.push_front(e);
+    index_[path] = lru_.begin();
+    stats_.entries = lru_.size();
+    stats_.bytes += e->bytes;
+    stats_.loads++;
+    stats_.load_ms_total += ms;
+    LOG(INFO) << "[lora] loaded path=" << path << " mb=" << (e->bytes >> 20) << " ms=" << ms
+              << " cache_mb=" << (stats_.bytes >> 20);
+    return e;
+}
+
+void LlamaLoraCache::EvictLocked(size_t incoming)
+{
+    if (budget_ == 0)
+        return;
+
+    auto it = lru_.end();
+    while (stats_.bytes + incoming > budget_ && it != lru_.begin())
+    {
+        --it;
+        // 仍有请求持有租约（或已应用在 context 上）：跳过
+        if (it->use_count() > 1)
+            continue;
+
+        Entry e = *it;
+        index_.erase(e->path);
+        it = lru_.erase(it);
+        llama_adapter_lora_free(e->adapter);
+        e->adapter = nullptr;
+        stats_.bytes -= e->bytes;
+        stats_.entries = lru_.size();
+        stats_.evictions++;
+        LOG(INFO) << "[lora] evicted path=" << e->path << " mb=" << (e->bytes >> 20);
+    }
+    if (stats_.bytes + incoming > budget_)
+    {
+        LOG(WARNING) << "[lora] over cache budget: cache_mb=" << (stats_.bytes >> 20)
+                     << " incoming_mb=" << (incoming >> 20) << " budget_mb=" << (budget_ >> 20)
+                     << ", all adapters in use";
+    }
+}
+
+size_t LlamaLoraCache::Bytes() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return stats_.bytes;
+}
+
+LlamaLoraCache::Stats LlamaLoraCache::GetStats() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return stats_;
+}
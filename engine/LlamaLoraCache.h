@@ -0,0 +1,70 @@
+#pragma once
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+struct llama_model;
+struct llama_adapter_lora;
+
+/**
+ * @brief 每个模型的 LoRA adapter 缓存（llama_adapter_lora_init 加载，基座权重只有一份）
+ *
+ * - 按 GGUF 路径加载一次，之后的请求只拿引用（租约）；切换 adapter 只是 llama_set_adapter_lora，不动基座权重
+ * - 按 GGUF 文件大小计内存，超过 LLAMA_LORA_CACHE_MB 时按 LRU 释放没有租约的 adapter；
+ *   都在使用中时照常加载并告警
+ * - llama_adapter_lora 由缓存持有：租约只保证使用期间不被释放，缓存析构（引擎卸载、模型释放之前）时全部释放
+ */
+class LlamaLoraCache
+{
+public:
+    struct Adapter
+    {
+        llama_adapter_lora *adapter = nullptr;
+        std::string path;
+        size_t bytes = 0;
+    };
+    using Lease = std::shared_ptr<const Adapter>;
+
+    struct Stats
+    {
+        size_t entries = 0;
+        size_t bytes = 0;
+        size_t budget_bytes = 0;
+        int64_t hits = 0;
+        int64_t loads = 0;
+        int64_t load_failures = 0;
+        int64_t evictions = 0;
+        double load_ms_total = 0;
+    };
+
+    LlamaLoraCache(llama_model *model, size_t budget_bytes);
+    ~LlamaLoraCache();
+
+    LlamaLoraCache(const LlamaLoraCache &) = delete;
+    LlamaLoraCache &operator=(const LlamaLoraCache &) = delete;
+
+    // 取 path 对应的 adapter（未加载则在调用线程上加载）；加载失败返回空，err 说明原因
+    Lease Acquire(const std::string &path, std::string &err);
+
+    size_t Bytes() const;
+    Stats GetStats() const;
+
+private:
+    using Entry = std::shared_ptr<Adapter>;
+
+    // 释放最久未用且没有租约的 adapter，直到加上 incoming 字节后不超预算（调用方持有 mu_）
+    void EvictLocked(size_t incoming);
+
+private:
+    llama_model *model_ = nullptr;
+    size_t budget_ = 0;
+
+    std::mutex load_mu_; // 串行加载，同一 adapter 并发请求只加载一次
+    mutable std::mutex mu_;
+    std::list<Entry> lru_; // 头部最近使用
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+    Stats stats_;
+};
@@ -0,0 +1,402 @@
+#include "engine/LlamaMultimodal.h"
+#include "engine/LlamaCommon.h"
+#include "engine/LlamaThreadBudget.h"
+#include "engine/ModelContext.h"
+#include "llama.h"
+#include "mtmd.h"
+#include "mtmd-helper.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <glog/logging.h>
+
+namespace
+{
+    struct ChunksGuard
+    {
+        mtmd_input_chunks *p = mtmd_input_chunks_init();
+        ~ChunksGuard() { mtmd_input_chunks_free(p); }
+    };
+} // namespace
+
+LlamaMultimodal::LlamaMultimodal(llama_model *model, Options opt)
+    : model_(model), opt_(std::move(opt))
+{
+}
+
+LlamaMultimodal::~LlamaMultimodal()
+{
+    if (mtmd_)
+        mtmd_free(mtmd_);
+}
+
+bool LlamaMultimodal::Init()
+{
+    mtmd_context_params params = mtmd_context_params_default();
+    params.use_gpu = false;
+    params.print_timings = false;
+    params.n_threads = opt_.n_threads;
+    params.media_marker = kMediaMarker;
+
+    mtmd_ = mtmd_init_from_file(opt_.mmproj_path.c_str(), model_, params);
+    if (!mtmd_)
+    {
+        LOG(ERROR) << "[mtmd] load mmproj failed: " << opt_.mmproj_path;
+        return false;
+    }
+    if (!mtmd_support_vision(mtmd_))
+    {
+        LOG(ERROR) << "[mtmd] mmproj has no vision encoder: " << opt_.mmproj_path;
+        mtmd_free(mtmd_);
+        mtmd_ = nullptr;
+        return false;
+    }
+    n_embd_ = llama_model_n_embd(model_);
+    use_mrope_ = mtmd_decode_use_mrope(mtmd_);
+    non_causal_ = mtmd_decode_use_non_causal(mtmd_);
+
+    LOG(INFO) << "[mtmd] loaded mmproj=" << opt_.mmproj_path
+              << " n_threads=" << opt_.n_threads
+              << " mrope=" << (use_mrope_ ? 1 : 0)
+              << " cache_mb=" << (opt_.cache_bytes >> 20);
+    return true;
+}
+
+std::shared_ptr<const LlamaMultimodal::Prepared> LlamaMultimodal::Prepare(const ImageInput &img, bool &hit,
+                                                                          double &encode_ms, std::string &err,
+                                                                          bool &invalid)
+{
+    hit = false;
+    encode_ms = 0;
+    invalid = false;
+    const bool cacheable = opt_.cache_bytes > 0;
+    if (cacheable)
+    {
+        if (auto p = CacheGet(img.id))
+        {
+            hit = true;
+            return p;
+        }
+    }
+
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // 图片字节 -> bitmap（png / jpeg 等解码），不占编码锁，多个图片阶段 worker 可并行
+    mtmd_bitmap *bmp = mtmd_helper_bitmap_init_from_buf(
+        mtmd_, reinterpret_cast<const unsigned char *>(img.bytes()), img.size);
+    if (!bmp)
+    {
+        err = "cannot decode image " + img.id;
+        invalid = true;
+        return nullptr;
+    }
+    struct BitmapGuard
+    {
+        mtmd_bitmap *p;
+        ~BitmapGuard() { mtmd_bitmap_free(p); }
+    } bmp_guard{bmp};
+    mtmd_bitmap_set_id(bmp, img.id.c_str());
+
+    auto p = std::make_shared<Prepared>();
+    {
+        std::lock_guard<std::mutex> lk(encode_mu_);
+        // 等锁期间其它请求可能刚编码过同一张图
+        if (cacheable)
+        {
+            if (auto cached = CacheGet(img.id))
+            {
+                hit = true;
+                return cached;
+            }
+        }
+
+        // 单个标记切块：缩放 / 归一化在这里完成，得到 [起始标记][图片（或多个切片）][结束标记]
+        ChunksGuard chunks;
+        mtmd_input_text text;
+        text.text = kMediaMarker;
+        text.add_special = false;
+        text.parse_special = true;
+        const mtmd_bitmap *bitmaps[1] = {bmp};
+        if (mtmd_tokenize(mtmd_, chunks.p, &text, bitmaps, 1) != 0)
+        {
+            err = "image preprocessing failed " + img.id;
+            invalid = true;
+            return nullptr;
+        }
+
+        const size_t n_chunks = mtmd_input_chunks_size(chunks.p);
+        for (size_t i = 0; i < n_chunks; ++i)
+        {
+            const mtmd_input_chunk *chunk = mtmd_input_chunks_get(chunks.p, i);
+            Prepared::Segment seg;
+            const auto type = mtmd_input_chunk_get_type(chunk);
+            if (type == MTMD_INPUT_CHUNK_TYPE_TEXT)
+            {
+                size_t n = 0;
+                const llama_token *toks = mtmd_input_chunk_get_tokens_text(chunk, &n);
+                seg.tokens.assign(toks, toks + n);
+                p->bytes += n * sizeof(int32_t);
+            }
+            else if (type == MTMD_INPUT_CHUNK_TYPE_IMAGE)
+            {
+                if (mtmd_encode_chunk(mtmd_, chunk) != 0)
+                {
+                    err = "image encode failed " + img.id;
+                    return nullptr;
+                }
+                const mtmd_image_tokens *it = mtmd_input_chunk_get_tokens_image(chunk);
+                seg.n_tokens = static_cast<int>(mtmd_input_chunk_get_n_tokens(chunk));
+                seg.nx = static_cast<int>(mtmd_image_tokens_get_nx(it));
+                seg.ny = static_cast<int>(mtmd_image_tokens_get_ny(it));
+                seg.n_pos = static_cast<int>(mtmd_input_chunk_get_n_pos(chunk));
+                const float *out = mtmd_get_output_embd(mtmd_);
+                seg.embd.assign(out, out + static_cast<size_t>(seg.n_tokens) * n_embd_);
+                p->image_tokens += seg.n_tokens;
+                p->bytes += seg.embd.size() * sizeof(float);
+            }
+            else
+            {
+                err = "only image input is supported";
+                invalid = true;
+                return nullptr;
+            }
+            p->segments.push_back(std::move(seg));
+        }
+    }
+    encode_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+    {
+        std::lock_guard<std::mutex> lk(cache_mu_);
+        stats_.encodes++;
+        stats_.encode_ms += encode_ms;
+    }
+    if (cacheable)
+        CachePut(img.id, p);
+    return p;
+}
+
+int LlamaMultimodal::Prefill(ModelContext &mc, const std::string &prompt, bool add_special,
+                             const std::vector<const ImageInput *> &images, const PreparedMap &prepared,
+                             const std::atomic<bool> &cancelled, const TextPrefill &prefill_text, Result &res,
+                             std::string &err, bool &invalid)
+{
+    invalid = false;
+
+    // prompt 按图片标记切开：texts.size() == images.size() + 1
+    std::vector<std::string> texts;
+    const size_t marker_len = std::strlen(kMediaMarker);
+    size_t pos = 0;
+    for (size_t next; (next = prompt.find(kMediaMarker, pos)) != std::string::npos; pos = next + marker_len)
+        texts.push_back(prompt.substr(pos, next - pos));
+    texts.push_back(prompt.substr(pos));
+    if (texts.size() != images.size() + 1)
+    {
+        err = "number of images does not match image markers in the prompt";
+        invalid = true;
+        return -1;
+    }
+
+    // 相邻的文本（含图片起止标记）合并成一次 prefill，遇到图片块前写入
+    const llama_vocab *vocab = llama_model_get_vocab(model_);
+    std::vector<int32_t> pending;
+    auto append_text = [&](const std::string &text, bool special)
+    {
+        if (text.empty() && !special)
+            return true;
+        std::vector<int32_t> toks;
+        if (!tokenize_text(vocab, text, toks, special))
+            return false;
+        pending.insert(pending.end(), toks.begin(), toks.end());
+        return true;
+    };
+    auto flush = [&]
+    {
+        if (pending.empty())
+            return 0;
+        const int rc = prefill_text(pending);
+        if (rc == 0)
+            res.n_tokens += static_cast<int>(pending.size());
+        pending.clear();
+        return rc;
+    };
+
+    for (size_t i = 0; i <= images.size(); ++i)
+    {
+        if (!append_text(texts[i], add_special && i == 0))
+        {
+            err = "tokenize failed";
+            return -1;
+        }
+        if (i == images.size())
+            break;
+
+        const ImageInput &img = *images[i];
+        std::shared_ptr<const Prepared> p;
+        auto it = prepared.find(img.id);
+        if (it != prepared.end())
+        {
+            p = std::static_pointer_cast<const Prepared>(it->second);
+        }
+        else
+        {
+            bool hit = false;
+            double ms = 0;
+            p = Prepare(img, hit, ms, err, invalid);
+            if (!p)
+                return -1;
+            res.cache_hits += hit ? 1 : 0;
+            res.encode_ms += ms;
+        }
+
+        for (const auto &seg : p->segments)
+        {
+            if (seg.embd.empty())
+            {
+                pending.insert(pending.end(), seg.tokens.begin(), seg.tokens.end());
+                continue;
+            }
+            const int rc = flush();
+            if (rc != 0)
+                return rc;
+            const int drc = DecodeImage(mc, seg, cancelled);
+            if (drc != 0)
+            {
+                err = "image embedding decode failed";
+                return drc;
+            }
+            res.n_tokens += seg.n_tokens;
+        }
+        res.images += 1;
+        res.image_tokens += p->image_tokens;
+    }
+
+    const int rc = flush();
+    if (rc != 0)
+        return rc;
+
+    std::lock_guard<std::mutex> lk(cache_mu_);
+    stats_.images += res.images;
+    stats_.image_tokens += res.image_tokens;
+    return 0;
+}
+
+int LlamaMultimodal::DecodeImage(ModelContext &mc, const Prepared::Segment &seg, const std::atomic<bool> &cancelled)
+{
+    const int n = seg.n_tokens;
+
+    // 位置：M-RoPE 每个 token 4 维（t, y, x, 0），整张图共用同一个 t；否则逐 token 递增
+    const int n_pos_per_embd = use_mrope_ ? 4 : 1;
+    std::vector<llama_pos> pos(static_cast<size_t>(n) * n_pos_per_embd);
+    if (use_mrope_)
+    {
+        for (int y = 0; y < seg.ny; ++y)
+        {
+            for (int x = 0; x < seg.nx; ++x)
+            {
+                const int i = y * seg.nx + x;
+                if (i >= n)
+                    break;
+                pos[i] = mc.n_past;
+                pos[i + n] = mc.n_past + y;
+                pos[i + 2 * n] = mc.n_past + x;
+                pos[i + 3 * n] = 0;
+            }
+        }
+    }
+    else
+    {
+        for (int i = 0; i < n; ++i)
+            pos[i] = mc.n_past + i;
+    }
+
+    // 非因果注意力（如 Gemma 3）：一张图内部互相可见，必须在同一次 decode 中
+    const int n_batch = non_causal_ ? n : std::max(1, opt_.n_batch);
+    if (non_causal_)
+        llama_set_causal_attn(mc.ctx, false);
+
+    std::vector<llama_pos> batch_pos;
+    std::vector<int32_t> n_seq_id(n_batch, 1);
+    llama_seq_id seq_id = mc.seq_id;
+    std::vector<llama_seq_id *> seq_ids(n_batch, &seq_id);
+    std::vector<int8_t> logits(n_batch, 0);
+
+    int rc = 0;
+    for (int off = 0; off < n && rc == 0; off += n_batch)
+    {
+        if (cancelled.load(std::memory_order_acquire))
+        {
+            rc = 2;
+            break;
+        }
+        const int cnt = std::min(n_batch, n - off);
+        batch_pos.resize(static_cast<size_t>(cnt) * n_pos_per_embd);
+        for (int d = 0; d < n_pos_per_embd; ++d)
+            std::copy_n(pos.begin() + d * n + off, cnt, batch_pos.begin() + d * cnt);
+
+        llama_batch batch{};
+        batch.n_tokens = cnt;
+        batch.embd = const_cast<float *>(seg.embd.data()) + static_cast<size_t>(off) * n_embd_;
+        batch.pos = batch_pos.data();
+        batch.n_seq_id = n_seq_id.data();
+        batch.seq_id = seq_ids.data();
+        batch.logits = logits.data();
+
+        LlamaThreadBudget::Lease lease(mc.ctx, LlamaThreadBudget::Phase::prefill);
+        rc = llama_decode(mc.ctx, batch);
+    }
+
+    if (non_causal_)
+        llama_set_causal_attn(mc.ctx, true);
+    if (rc == 0)
+        mc.n_past += seg.n_pos;
+    return rc;
+}
+
+std::shared_ptr<const LlamaMultimodal::Prepared> LlamaMultimodal::CacheGet(const std::string &id)
+{
+    std::lock_guard<std::mutex> lk(cache_mu_);
+    auto it = cache_.find(id);
+    if (it == cache_.end())
+        return nullptr;
+    lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+    stats_.cache_hits++;
+    return it->second.prepared;
+}
+
+void LlamaMultimodal::CachePut(const std::string &id, std::shared_ptr<const Prepared> p)
+{
+    if (p->bytes > opt_.cache_bytes)
+        return;
+
+    std::lock_guard<std::mutex> lk(cache_mu_);
+    if (cache_.count(id))
+        return;
+    lru_.push_front(id);
+    cache_bytes_ += p->bytes;
+    cache_[id] = CacheEntry{std::move(p), lru_.begin()};
+
+    while (cache_bytes_ > opt_.cache_bytes && !lru_.empty())
+    {
+        auto victim = cache_.find(lru_.back());
+        cache_bytes_ -= victim->second.prepared->bytes;
+        cache_.erase(victim);
+        lru_.pop_back();
+        stats_.cache_evictions++;
+    }
+}
+
+LlamaMultimodal::Stats LlamaMultimodal::GetStats() const
+{
+    std::lock_guard<std::mutex> lk(cache_mu_);
+    Stats st = stats_;
+    st.cache_entries = cache_.size();
+    st.cache_bytes = cache_bytes_;
+    return st;
+}
+
+size_t LlamaMultimodal::CacheBytes() const
+{
+    std::lock_guard<std::mutex> lk(cache_mu_);
+    return cache_bytes_;
+}
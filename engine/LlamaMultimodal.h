@@ -0,0 +1,138 @@
+#pragma once
+#include "serving/core/ServingContext.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct llama_model;
+struct mtmd_context;
+struct ModelContext;
+
+/**
+ * @brief 图片输入（llama.cpp mtmd + 视觉投影 mmproj，CPU）与按内容缓存的图片 embedding
+ *
+ * - Prepare：单张图片解码 + 缩放 / 归一化 + 视觉编码，得到该图片在 prompt 中的输入
+ *   （图片起止标记等文本 token + 图片 embedding）；由图片阶段（LlamaImageStage）在进入模型队列前调用
+ * - Prefill：prompt 按 kMediaMarker 切开，文本交给调用方 prefill（与纯文本请求同一路径：分块、取消、线程预算），
+ *   每个标记处写入对应图片准备好的输入；没有提前准备的图片（如按 history 重放）在这里查缓存或现场编码
+ * - 准备好的输入以 ImageInput::id（内容哈希）为键做 LRU 缓存（LLAMA_IMAGE_CACHE_MB）：
+ *   多轮对话每轮带回同一张图、编辑 / 重放、不同请求发同一张图时不再解码和跑视觉编码器
+ * - 视觉编码器的输出缓冲在 mtmd_context 里，切块与编码串行（encode_mu_）；图片解码可并行
+ */
+class LlamaMultimodal
+{
+public:
+    struct Options
+    {
+        std::string mmproj_path;
+        int n_threads = 4;        // 视觉编码器线程数
+        size_t cache_bytes = 0;   // 图片输入缓存上限，0 表示不缓存
+        int n_batch = 512;        // 图片 embedding 写入 KV 时单次 llama_decode 的 token 数
+    };
+
+    struct Stats
+    {
+        int64_t images = 0;
+        int64_t cache_hits = 0;
+        int64_t encodes = 0;
+        double encode_ms = 0;
+        int64_t image_tokens = 0;
+        size_t cache_entries = 0;
+        size_t cache_bytes = 0;
+        int64_t cache_evictions = 0;
+    };
+
+    // 一张图片准备好的输入：mtmd 对单个图片标记切出的块，按顺序写入 KV
+    struct Prepared
+    {
+        struct Segment
+        {
+            std::vector<int32_t> tokens; // 文本块（图片起止标记、切片分隔符等）
+            std::vector<float> embd;     // 图片块：n_tokens × n_embd
+            int n_tokens = 0;
+            int nx = 0;                  // 图片块的 patch 网格（M-RoPE 的二维位置）
+            int ny = 0;
+            int n_pos = 0;               // 图片块占用的 KV 位置数（M-RoPE 时小于 n_tokens）
+        };
+        std::vector<Segment> segments;
+        int image_tokens = 0;
+        size_t bytes = 0;
+    };
+
+    // 请求上提前准备好的图片（ServingContext::prepared_images，值为 Prepared）
+    using PreparedMap = std::unordered_map<std::string, std::shared_ptr<const void>>;
+
+    // 一次 Prefill 的结果（写入 ServingContext::usage）；cache_hits / encode_ms 只含 Prefill 内现场准备的图片
+    struct Result
+    {
+        int n_tokens = 0;       // 文本 + 图片 token
+        int image_tokens = 0;
+        int images = 0;
+        int cache_hits = 0;
+        double encode_ms = 0;
+    };
+
+    // 文本块的 prefill：写入 mc 的 KV 并推进 mc.n_past；返回 llama_decode 风格的返回码（2 为取消）
+    using TextPrefill = std::function<int(const std::vector<int32_t> &toks)>;
+
+    LlamaMultimodal(llama_model *model, Options opt);
+    ~LlamaMultimodal();
+
+    LlamaMultimodal(const LlamaMultimodal &) = delete;
+    LlamaMultimodal &operator=(const LlamaMultimodal &) = delete;
+
+    bool Init();
+
+    // 准备一张图片（先查缓存）；可在多个线程并发调用。hit 表示命中缓存，encode_ms 为解码 + 预处理 + 编码耗时。
+    // 失败返回空（err 说明原因；图片无法解码时 invalid=true）
+    std::shared_ptr<const Prepared> Prepare(const ImageInput &img, bool &hit, double &encode_ms, std::string &err,
+                                            bool &invalid);
+
+    // 从 mc.n_past 起写入带图片标记的 prompt；images 与 prompt 中的标记一一对应。
+    // 返回 0 成功，2 取消，其它为失败（err 说明原因；标记与图片数不符 / 图片无法解码时 invalid=true）
+    int Prefill(ModelContext &mc, const std::string &prompt, bool add_special,
+                const std::vector<const ImageInput *> &images, const PreparedMap &prepared,
+                const std::atomic<bool> &cancelled, const TextPrefill &prefill_text, Result &res, std::string &err,
+                bool &invalid);
+
+    Stats GetStats() const;
+    size_t CacheBytes() const;
+
+private:
+    // 图片 embedding 按 n_batch 分批写入 KV（非因果注意力的模型整张图一次写入），推进 mc.n_past
+    int DecodeImage(ModelContext &mc, const Prepared::Segment &seg, const std::atomic<bool> &cancelled);
+
+    std::shared_ptr<const Prepared> CacheGet(const std::string &id);
+    void CachePut(const std::string &id, std::shared_ptr<const Prepared> p);
+
+private:
+    llama_model *model_ = nullptr;
+    Options opt_;
+    int n_embd_ = 0;
+    bool use_mrope_ = false;
+    bool non_causal_ = false;
+    mtmd_context *mtmd_ = nullptr;
+
+    // 切块（含预处理）与视觉编码 + 读输出缓冲串行
+    std::mutex encode_mu_;
+
+    // 准备好的输入 LRU：front 最近使用
+    mutable std::mutex cache_mu_;
+    std::list<std::string> lru_;
+    struct CacheEntry
+    {
+        std::shared_ptr<const Prepared> prepared;
+        std::list<std::string>::iterator lru_it;
+    };
+    std::unordered_map<std::string, CacheEntry> cache_;
+    size_t cache_bytes_ = 0;
+
+    Stats stats_; // cache_mu_
+};
@@ -0,0 +1,72 @@
+#include "engine/LlamaNgramLookup.h"
+
+#include <algorithm>
+
+LlamaNgramLookup::LlamaNgramLookup(int n_min, int n_max)
+    : n_min_(std::max(1, n_min)), n_max_(std::max(std::max(1, n_min), n_max))
+{
+    index_.resize(n_max_ - n_min_ + 1);
+}
+
+void LlamaNgramLookup::Clear()
+{
+    tokens_.clear();
+    for (auto &m : index_)
+        m.clear();
+}
+
+void LlamaNgramLookup::Append(const int32_t *toks, int n)
+{
+    for (int j = 0; j < n; ++j)
+    {
+        tokens_.push_back(toks[j]);
+        const int i = (int)tokens_.size() - 1;
+
+        // 以 i 结尾之前的每个 n-gram 现在都有了后继 token（位置 i）
+        for (int len = n_min_; len <= n_max_ && len <= i; ++len)
+            index_[len - n_min_][Hash(tokens_.data() + i - len, len)] = i;
+    }
+}
+
+std::vector<int32_t> LlamaNgramLookup::Propose(int32_t last, int k) const
+{
+    std::vector<int32_t> out;
+    if (k <= 0)
+        return out;
+
+    // 查询 key：已记录 token 的末尾 n-1 个 + last
+    const int n_hist = std::min<int>(n_max_ - 1, (int)tokens_.size());
+    std::vector<int32_t> q(tokens_.end() - n_hist, tokens_.end());
+    q.push_back(last);
+
+    for (int len = std::min<int>(n_max_, (int)q.size()); len >= n_min_; --len)
+    {
+        const int32_t *key = q.data() + q.size() - len;
+        const auto &m = index_[len - n_min_];
+        auto it = m.find(Hash(key, len));
+        if (it == m.end())
+            continue;
+
+        // 哈希可能冲突：核对原文
+        const int pos = it->second;
+        if (!std::equal(key, key + len, tokens_.begin() + (pos - len)))
+            continue;
+
+        const int end = std::min<int>(pos + k, (int)tokens_.size());
+        out.assign(tokens_.begin() + pos, tokens_.begin() + end);
+        return out;
+    }
+    return out;
+}
+
+uint64_t LlamaNgramLookup::Hash(const int32_t *toks, int n) const
+{
+    // FNV-1a，按 token 混入；长度也混进去，区分不同 n
+    uint64_t h = 1469598103934665603ull ^ static_cast<uint64_t>(n);
+    for (int i = 0; i < n; ++i)
+    {
+        h ^= static_cast<uint32_t>(toks[i]);
+        h *= 1099511628211ull;
+    }
+    return h;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Prompt lookup（n-gram）投机草稿：不需要第二个模型
+ *
+ * - 按 session 记录已写入 KV 的 token（prompt + 历史输出），并为每个 n-gram
+ *   （n ∈ [n_min, n_max]）记录它最近一次出现后紧跟的位置
+ * - 生成时用“末尾 n 个 token + last”查表，命中则把原文后续的 token 作为草稿，
+ *   交给目标模型一次 batch decode 校验；优先用更长的 n-gram
+ * - 代码修改、文档改写等输出大段复制输入的场景接受率很高
+ *
+ * 非线程安全：与 ModelContext 一样只在驱动该 session 的线程上使用。
+ */
+class LlamaNgramLookup
+{
+public:
+    LlamaNgramLookup(int n_min, int n_max);
+
+    void Clear();
+
+    // 追加已写入 KV 的 token，并更新 n-gram 索引
+    void Append(const int32_t *toks, int n);
+    void Append(int32_t tok) { Append(&tok, 1); }
+
+    // 以“已记录 token 的末尾 + last”为 key 查找，返回至多 k 个后续 token（未命中返回空）
+    std::vector<int32_t> Propose(int32_t last, int k) const;
+
+    size_t size() const { return tokens_.size(); }
+
+private:
+    uint64_t Hash(const int32_t *toks, int n) const;
+
+private:
+    int n_min_;
+    int n_max_;
+    std::vector<int32_t> tokens_;
+    // index_[n - n_min_]：n-gram 哈希 -> 该 n-gram 最近一次出现后下一个 token 的位置
+    std::vector<std::unordered_map<uint64_t, int32_t>> index_;
+};
@@ -0,0 +1,200 @@
+#include "engine/LlamaPrefixCache.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <utility>
+
+LlamaPrefixCache::LlamaPrefixCache(llama_context *ctx, const Options &opt)
+    : LlamaPrefixCache(SeqOps{[ctx](int src, int dst, int n)
+                              { llama_memory_seq_cp(llama_get_memory(ctx), src, dst, 0, n); },
+                              [ctx](int seq)
+                              { llama_memory_seq_rm(llama_get_memory(ctx), seq, -1, -1); }},
+                       opt)
+{
+}
+
+LlamaPrefixCache::LlamaPrefixCache(SeqOps ops, const Options &opt)
+    : ops_(std::move(ops)), opt_(opt)
+{
+    for (int i = opt_.n_seqs - 1; i >= 0; --i)
+        free_seqs_.push_back(opt_.first_seq + i);
+}
+
+LlamaPrefixCache::~LlamaPrefixCache() = default;
+
+int LlamaPrefixCache::Restore(const std::vector<int32_t> &toks, int dst_seq)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+
+    int seq = -1;
+    int n = MatchLocked(toks, seq);
+    n = std::min<int>(n, (int)toks.size() - 1);
+    if (seq < 0 || n < opt_.min_tokens)
+    {
+        stats_.misses++;
+        return 0;
+    }
+
+    ops_.copy(seq, dst_seq, n);
+    entries_[seq].last_used = Clock::now();
+
+    stats_.hits++;
+    stats_.saved_tokens += n;
+    return n;
+}
+
+void LlamaPrefixCache::Insert(const std::vector<int32_t> &toks, int src_seq)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+
+    const int n = (int)toks.size();
+    if (n < opt_.min_tokens || n > opt_.max_tokens)
+        return;
+
+    int seq = -1;
+    int matched = MatchLocked(toks, seq);
+    if (matched >= n)
+        return; // 已完整缓存
+
+    // 预算 / seq 不够：LRU 淘汰（可能改变树结构，淘汰后重新匹配）
+    while ((stats_.tokens + (n - matched) > opt_.max_tokens || free_seqs_.empty()) && EvictLruLocked())
+        matched = MatchLocked(toks, seq);
+    if (stats_.tokens + (n - matched) > opt_.max_tokens || free_seqs_.empty())
+        return;
+
+    const int new_seq = free_seqs_.back();
+    free_seqs_.pop_back();
+    ops_.copy(src_seq, new_seq, n);
+    entries_[new_seq] = Entry{n, Clock::now()};
+
+    // 沿树走到分叉点，必要时拆分边，再挂上新叶子
+    Node *node = &root_;
+    int pos = 0;
+    while (pos < n)
+    {
+        auto it = node->children.find(toks[pos]);
+        if (it == node->children.end())
+        {
+            auto leaf = std::make_unique<Node>();
+            leaf->edge.assign(toks.begin() + pos, toks.end());
+            leaf->seq = new_seq;
+            stats_.tokens += n - pos;
+            node->children.emplace(toks[pos], std::move(leaf));
+            break;
+        }
+
+        Node *child = it->second.get();
+        size_t k = 0;
+        while (k < child->edge.size() && pos + (int)k < n && child->edge[k] == toks[pos + k])
+            ++k;
+
+        if (k < child->edge.size())
+        {
+            // 拆分：parent -> mid(edge[0,k)) -> child(edge[k,...))
+            auto mid = std::make_unique<Node>();
+            mid->edge.assign(child->edge.begin(), child->edge.begin() + k);
+            mid->seq = child->seq;
+
+            std::unique_ptr<Node> old = std::move(it->second);
+            old->edge.erase(old->edge.begin(), old->edge.begin() + k);
+            const int32_t key = old->edge.front();
+            mid->children.emplace(key, std::move(old));
+
+            Node *mid_raw = mid.get();
+            it->second = std::move(mid);
+            child = mid_raw;
+        }
+
+        pos += (int)k;
+        node = child;
+    }
+
+    stats_.entries = (int64_t)entries_.size();
+}
+
+bool LlamaPrefixCache::EvictOne()
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return EvictLruLocked();
+}
+
+LlamaPrefixCache::Stats LlamaPrefixCache::GetStats() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return stats_;
+}
+
+int LlamaPrefixCache::MatchLocked(const std::vector<int32_t> &toks, int &seq) const
+{
+    const Node *node = &root_;
+    int pos = 0;
+    seq = -1;
+
+    while (pos < (int)toks.size())
+    {
+        auto it = node->children.find(toks[pos]);
+        if (it == node->children.end())
+            break;
+
+        const Node *child = it->second.get();
+        size_t k = 0;
+        while (k < child->edge.size() && pos + (int)k < (int)toks.size() && child->edge[k] == toks[pos + k])
+            ++k;
+
+        pos += (int)k;
+        seq = child->seq;
+        if (k < child->edge.size())
+            break;
+        node = child;
+    }
+    return pos;
+}
+
+bool LlamaPrefixCache::EvictLruLocked()
+{
+    if (entries_.empty())
+        return false;
+
+    auto victim = entries_.begin();
+    for (auto it = entries_.begin(); it != entries_.end(); ++it)
+    {
+        if (it->second.last_used < victim->second.last_used)
+            victim = it;
+    }
+    EvictSeqLocked(victim->first);
+    return true;
+}
+
+void LlamaPrefixCache::EvictSeqLocked(int seq)
+{
+    ops_.remove(seq);
+    entries_.erase(seq);
+    free_seqs_.push_back(seq);
+    PruneLocked(root_, seq);
+
+    stats_.evictions++;
+    stats_.entries = (int64_t)entries_.size();
+}
+
+void LlamaPrefixCache::PruneLocked(Node &node, int victim)
+{
+    for (auto it = node.children.begin(); it != node.children.end();)
+    {
+        Node &child = *it->second;
+        PruneLocked(child, victim);
+        // 子树里已没有其它前缀覆盖它：整段删除
+        if (child.seq == victim)
+        {
+            stats_.tokens -= (int64_t)child.edge.size();
+            it = node.children.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    // 后代的缓存前缀一定覆盖本节点路径，改挂过去
+    if (node.seq == victim && !node.children.empty())
+        node.seq = node.children.begin()->second->seq;
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+struct llama_context;
+
+/**
+ * @brief token 级 radix tree 前缀 KV 缓存（绑定一个共享 llama_context）
+ *
+ * - 每条缓存前缀占用 context 里一个专用 seq（不与 session slot 冲突）
+ * - 新序列命中时用 llama_memory_seq_cp 把最长匹配前缀拷到自己的 seq，只 prefill 剩余部分
+ *   （unified KV 下 seq_cp 只是给 cell 加 seq 标记，不复制 KV 数据）
+ * - 树上 token 总数受 max_tokens 约束，超出时按 LRU 淘汰整条前缀
+ *
+ * 线程约束：Restore / Insert / EvictOne 只能在驱动该 context 的线程调用；
+ * GetStats 可在任意线程调用。
+ */
+class LlamaPrefixCache
+{
+public:
+    struct Options
+    {
+        int first_seq = 0;     // 缓存专用 seq 区间 [first_seq, first_seq + n_seqs)
+        int n_seqs = 8;
+        int max_tokens = 8192; // 树上 token 总预算
+        int min_tokens = 32;   // 命中长度 / 收录长度下限，过短的前缀不值得拷贝
+    };
+
+    struct Stats
+    {
+        int64_t hits = 0;
+        int64_t misses = 0;
+        int64_t saved_tokens = 0; // 命中省掉的 prefill token 数
+        int64_t tokens = 0;       // 当前缓存的 token 数
+        int64_t entries = 0;
+        int64_t evictions = 0;
+    };
+
+    // 缓存 seq 上的 KV 操作：copy 把 src 的 [0, n) 拷到 dst，remove 清空 seq
+    struct SeqOps
+    {
+        std::function<void(int src, int dst, int n)> copy;
+        std::function<void(int seq)> remove;
+    };
+
+    // 作用于 ctx 的 llama_memory_seq_cp / llama_memory_seq_rm
+    LlamaPrefixCache(llama_context *ctx, const Options &opt);
+    // 自定义 seq 操作（不需要模型，测试用）
+    LlamaPrefixCache(SeqOps ops, const Options &opt);
+    ~LlamaPrefixCache();
+
+    // 新序列：把 toks 的最长缓存前缀拷到 dst_seq，返回拷贝的 token 数（0 表示未命中）
+    // 至少留 1 个 token 给调用方 prefill，用于产生 logits
+    int Restore(const std::vector<int32_t> &toks, int dst_seq);
+
+    // prefill 完成后：把 src_seq 上 toks 对应的 [0, n) 收录进缓存
+    void Insert(const std::vector<int32_t> &toks, int src_seq);
+
+    // KV 紧张时淘汰最久未用的一条前缀；无可淘汰返回 false
+    bool EvictOne();
+
+    Stats GetStats() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Node
+    {
+        std::vector<int32_t> edge; // 从父节点到本节点的 token 段
+        std::unordered_map<int32_t, std::unique_ptr<Node>> children;
+        int seq = -1;              // 任意一条覆盖“根 -> 本节点”路径的缓存 seq
+    };
+
+    struct Entry
+    {
+        int len = 0;
+        Clock::time_point last_used{};
+    };
+
+    int MatchLocked(const std::vector<int32_t> &toks, int &seq) const;
+    void EvictSeqLocked(int seq);
+    bool EvictLruLocked();
+    void PruneLocked(Node &node, int victim);
+
+private:
+    SeqOps ops_;
+    Options opt_;
+
+    mutable std::mutex mu_;
+    Node root_;
+    std::unordered_map<int, Entry> entries_; // seq -> entry
+    std::vector<int> free_seqs_;
+    Stats stats_;
+};
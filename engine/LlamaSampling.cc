@@ -0,0 +1,375 @@
+#include "engine/LlamaSampling.h"
+#include "engine/ModelContext.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <sstream>
+
+namespace
+{
+bool parse_float(const std::unordered_map<std::string, std::string> &params, const char *name,
+                 float lo, float hi, float &out, std::string &err)
+{
+    auto it = params.find(name);
+    if (it == params.end())
+        return true;
+    try
+    {
+        size_t pos = 0;
+        const float v = std::stof(it->second, &pos);
+        if (pos == it->second.size() && v >= lo && v <= hi)
+        {
+            out = v;
+            return true;
+        }
+    }
+    catch (...)
+    {
+    }
+    err = std::string("invalid ") + name + ": " + it->second;
+    return false;
+}
+
+void append_float(std::string &s, float v)
+{
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.6g,", v);
+    s += buf;
+}
+} // namespace
+
+std::string SamplingParams::Key() const
+{
+    // greedy 时 top_p / min_p / temperature / seed 都不参与采样，归一化以提高复用率
+    std::string key = greedy() ? "g," : "s,";
+    if (!greedy())
+    {
+        append_float(key, temperature);
+        append_float(key, top_p);
+        key += std::to_string(top_k) + ",";
+        append_float(key, min_p);
+        key += std::to_string(seed) + ",";
+    }
+    if (has_penalties())
+    {
+        key += "p" + std::to_string(penalty_last_n) + ",";
+        append_float(key, repeat_penalty);
+        append_float(key, presence_penalty);
+        append_float(key, frequency_penalty);
+    }
+    for (const auto &b : logit_bias)
+    {
+        key += "b" + std::to_string(b.first) + ":";
+        append_float(key, b.second);
+    }
+    return key;
+}
+
+bool parse_sampling_params(const std::unordered_map<std::string, std::string> &params,
+                           SamplingParams &out, std::string &err)
+{
+    out = SamplingParams{};
+    if (!parse_float(params, "temperature", 0.0f, 2.0f, out.temperature, err) ||
+        !parse_float(params, "top_p", 0.0f, 1.0f, out.top_p, err) ||
+        !parse_float(params, "min_p", 0.0f, 1.0f, out.min_p, err) ||
+        !parse_float(params, "repeat_penalty", 0.0f, 10.0f, out.repeat_penalty, err) ||
+        !parse_float(params, "presence_penalty", -2.0f, 2.0f, out.presence_penalty, err) ||
+        !parse_float(params, "frequency_penalty", -2.0f, 2.0f, out.frequency_penalty, err))
+    {
+        return false;
+    }
+
+    try
+    {
+        auto it = params.find("top_k");
+        if (it != params.end())
+            out.top_k = std::max(0, std::stoi(it->second));
+        it = params.find("seed");
+        if (it != params.end())
+            out.seed = static_cast<uint32_t>(std::stoull(it->second));
+    }
+    catch (...)
+    {
+        err = "invalid top_k/seed";
+        return false;
+    }
+
+    auto it = params.find("logit_bias");
+    if (it != params.end() && !it->second.empty())
+    {
+        // "id:bias,id:bias"
+        std::stringstream ss(it->second);
+        std::string item;
+        while (std::getline(ss, item, ','))
+        {
+            const size_t colon = item.find(':');
+            try
+            {
+                if (colon == std::string::npos)
+                    throw 0;
+                const int id = std::stoi(item.substr(0, colon));
+                const float bias = std::stof(item.substr(colon + 1));
+                if (id < 0 || bias < -100.0f || bias > 100.0f)
+                    throw 0;
+                out.logit_bias.emplace_back(id, bias);
+            }
+            catch (...)
+            {
+                err = "invalid logit_bias entry: " + item;
+                return false;
+            }
+        }
+        std::sort(out.logit_bias.begin(), out.logit_bias.end());
+    }
+
+    it = params.find("grammar");
+    if (it != params.end())
+        out.grammar = it->second;
+    return true;
+}
+
+llama_sampler *build_sampler_chain(const SamplingParams &p, int32_t n_vocab)
+{
+    llama_sampler_chain_params cparams = llama_sampler_chain_default_params();
+    cparams.no_perf = true;
+    llama_sampler *chain = llama_sampler_chain_init(cparams);
+
+    if (!p.logit_bias.empty())
+    {
+        std::vector<llama_logit_bias> biases;
+        biases.reserve(p.logit_bias.size());
+        for (const auto &b : p.logit_bias)
+        {
+            if (b.first < n_vocab)
+                biases.push_back({b.first, b.second});
+        }
+        if (!biases.empty())
+        {
+            llama_sampler_chain_add(chain, llama_sampler_init_logit_bias(n_vocab, (int32_t)biases.size(), biases.data()));
+        }
+    }
+
+    if (p.has_penalties())
+    {
+        llama_sampler_chain_add(chain, llama_sampler_init_penalties(p.penalty_last_n, p.repeat_penalty,
+                                                                    p.frequency_penalty, p.presence_penalty));
+    }
+
+    if (p.greedy())
+    {
+        llama_sampler_chain_add(chain, llama_sampler_init_greedy());
+        return chain;
+    }
+
+    if (p.top_k > 0)
+        llama_sampler_chain_add(chain, llama_sampler_init_top_k(p.top_k));
+    if (p.top_p < 1.0f)
+        llama_sampler_chain_add(chain, llama_sampler_init_top_p(p.top_p, 1));
+    if (p.min_p > 0.0f)
+        llama_sampler_chain_add(chain, llama_sampler_init_min_p(p.min_p, 1));
+    llama_sampler_chain_add(chain, llama_sampler_init_temp(p.temperature));
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(p.seed));
+    return chain;
+}
+
+LlamaSamplerCache::LlamaSamplerCache(const llama_vocab *vocab, size_t max_idle, size_t max_grammars)
+    : vocab_(vocab), n_vocab_(llama_vocab_n_tokens(vocab)), max_idle_(max_idle), max_grammars_(std::max<size_t>(1, max_grammars))
+{
+}
+
+LlamaSamplerCache::~LlamaSamplerCache()
+{
+    for (auto &kv : idle_)
+    {
+        for (auto *smpl : kv.second)
+            llama_sampler_free(smpl);
+    }
+    for (auto &g : grammars_)
+        llama_sampler_free(g.proto);
+}
+
+llama_sampler *LlamaSamplerCache::Acquire(const SamplingParams &p)
+{
+    const std::string key = p.Key();
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = idle_.find(key);
+        if (it != idle_.end() && !it->second.empty())
+        {
+            llama_sampler *smpl = it->second.back();
+            it->second.pop_back();
+            if (it->second.empty())
+                idle_.erase(it);
+            --n_idle_;
+            ++hits_;
+            llama_sampler_reset(smpl);
+            return smpl;
+        }
+        ++builds_;
+    }
+    return build_sampler_chain(p, n_vocab_);
+}
+
+void LlamaSamplerCache::Release(const std::string &key, llama_sampler *smpl)
+{
+    if (!smpl)
+        return;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (n_idle_ < max_idle_)
+        {
+            idle_[key].push_back(smpl);
+            ++n_idle_;
+            return;
+        }
+    }
+    llama_sampler_free(smpl);
+}
+
+llama_sampler *LlamaSamplerCache::AcquireGrammar(const std::string &gbnf)
+{
+    const size_t h = std::hash<std::string>{}(gbnf);
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = grammar_index_.find(h);
+        if (it != grammar_index_.end() && it->second->gbnf == gbnf)
+        {
+            grammars_.splice(grammars_.begin(), grammars_, it->second);
+            ++grammar_hits_;
+            return llama_sampler_clone(it->second->proto);
+        }
+    }
+
+    // 编译在锁外进行：大文法解析可能要几毫秒
+    llama_sampler *proto = llama_sampler_init_grammar(vocab_, gbnf.c_str(), "root");
+    if (!proto)
+        return nullptr;
+    llama_sampler *smpl = llama_sampler_clone(proto);
+
+    std::lock_guard<std::mutex> lk(mu_);
+    ++grammar_compiles_;
+    auto it = grammar_index_.find(h);
+    if (it != grammar_index_.end())
+    {
+        // 并发编译了同一份文法，或哈希冲突：保留新编译的
+        llama_sampler_free(it->second->proto);
+        grammars_.erase(it->second);
+        grammar_index_.erase(it);
+    }
+    grammars_.push_front(Grammar{gbnf, proto});
+    grammar_index_[h] = grammars_.begin();
+
+    while (grammars_.size() > max_grammars_)
+    {
+        grammar_index_.erase(std::hash<std::string>{}(grammars_.back().gbnf));
+        llama_sampler_free(grammars_.back().proto);
+        grammars_.pop_back();
+    }
+    return smpl;
+}
+
+bool LlamaSamplerCache::Bind(ModelContext &mc, const SamplingParams &p)
+{
+    // 文法每个请求从初始状态开始：从编译缓存 clone（reset 会重新解析文本，反而更慢）
+    if (mc.grammar)
+    {
+        llama_sampler_free(mc.grammar);
+        mc.grammar = nullptr;
+    }
+    if (!p.grammar.empty())
+    {
+        mc.grammar = AcquireGrammar(p.grammar);
+        if (!mc.grammar)
+            return false;
+    }
+
+    std::string key = p.Key();
+    if (mc.sampler && mc.sampler_key == key)
+    {
+        llama_sampler_reset(mc.sampler);
+        std::lock_guard<std::mutex> lk(mu_);
+        ++hits_;
+        return true;
+    }
+
+    if (mc.sampler)
+        Release(mc.sampler_key, mc.sampler);
+    mc.sampler = Acquire(p);
+    mc.sampler_key = std::move(key);
+    return mc.sampler != nullptr;
+}
+
+llama_token LlamaSamplerCache::Sample(llama_sampler *chain, llama_sampler *grammar, llama_context *lctx, int32_t idx)
+{
+    if (!grammar)
+    {
+        const llama_token tok = llama_sampler_sample(chain, lctx, idx);
+        llama_sampler_accept(chain, tok);
+        return tok;
+    }
+
+    using clock = std::chrono::steady_clock;
+    clock::duration grammar_time{};
+
+    const float *logits = llama_get_logits_ith(lctx, idx);
+    thread_local std::vector<llama_token_data> cur;
+    cur.resize(n_vocab_);
+    auto fill = [&]
+    {
+        for (int32_t i = 0; i < n_vocab_; ++i)
+            cur[i] = llama_token_data{i, logits[i], 0.0f};
+        return llama_token_data_array{cur.data(), cur.size(), -1, false};
+    };
+
+    // 1) 无约束采样，只用文法校验选中的这一个 token
+    llama_token_data_array arr = fill();
+    llama_sampler_apply(chain, &arr);
+    llama_token tok = arr.data[arr.selected].id;
+
+    auto t0 = clock::now();
+    llama_token_data single{tok, 1.0f, 0.0f};
+    llama_token_data_array one{&single, 1, -1, false};
+    llama_sampler_apply(grammar, &one);
+    grammar_time += clock::now() - t0;
+
+    // 2) 不合法：整表施加文法约束后重新采样
+    if (std::isinf(single.logit) && single.logit < 0)
+    {
+        arr = fill();
+        t0 = clock::now();
+        llama_sampler_apply(grammar, &arr);
+        grammar_time += clock::now() - t0;
+        llama_sampler_apply(chain, &arr);
+        tok = arr.data[arr.selected].id;
+        grammar_resamples_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    t0 = clock::now();
+    llama_sampler_accept(grammar, tok);
+    grammar_time += clock::now() - t0;
+    llama_sampler_accept(chain, tok);
+
+    grammar_tokens_.fetch_add(1, std::memory_order_relaxed);
+    grammar_us_.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(grammar_time).count(),
+                          std::memory_order_relaxed);
+    return tok;
+}
+
+LlamaSamplerCache::Stats LlamaSamplerCache::GetStats() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    Stats st;
+    st.hits = hits_;
+    st.builds = builds_;
+    st.idle = n_idle_;
+    st.grammar_compiles = grammar_compiles_;
+    st.grammar_hits = grammar_hits_;
+    st.grammar_tokens = grammar_tokens_.load(std::memory_order_relaxed);
+    st.grammar_resamples = grammar_resamples_.load(std::memory_order_relaxed);
+    st.grammar_ms = grammar_us_.load(std::memory_order_relaxed) / 1000.0;
+    return st;
+}
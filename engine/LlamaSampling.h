@@ -0,0 +1,131 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct llama_sampler;
+struct llama_context;
+struct llama_vocab;
+struct ModelContext;
+
+/**
+ * @brief 一次请求的采样参数（OpenAI 参数集，由 HttpGateway 校验后写入 ServingContext::params）
+ *
+ * 未传 temperature 时保持 greedy（与引入采样链之前的行为一致）；temperature <= 0 或 top_k == 1 也按 greedy。
+ */
+struct SamplingParams
+{
+    float temperature = 0.0f;
+    float top_p = 1.0f;          // 1 表示不启用
+    int top_k = 0;               // 0 表示不启用
+    float min_p = 0.0f;          // 0 表示不启用
+    float repeat_penalty = 1.0f; // 1 表示不启用
+    float presence_penalty = 0.0f;
+    float frequency_penalty = 0.0f;
+    int penalty_last_n = 64;     // 惩罚项统计最近多少个 token
+    uint32_t seed = 0xFFFFFFFF;  // LLAMA_DEFAULT_SEED：每次 reset 取随机种子
+    std::vector<std::pair<int32_t, float>> logit_bias; // 按 token id 升序
+    std::string grammar;         // GBNF（response_format / grammar），空表示不约束；不进入采样链，单独维护
+
+    bool greedy() const { return temperature <= 0.0f || top_k == 1; }
+    bool has_penalties() const
+    {
+        return repeat_penalty != 1.0f || presence_penalty != 0.0f || frequency_penalty != 0.0f;
+    }
+
+    // 参数集的规范化字符串：相同 key 的采样链可以互相复用
+    std::string Key() const;
+};
+
+// 从 ServingContext::params 解析（temperature / top_p / top_k / min_p / repeat_penalty /
+// presence_penalty / frequency_penalty / seed / logit_bias="id:bias,id:bias" / grammar）；非法值返回 false
+bool parse_sampling_params(const std::unordered_map<std::string, std::string> &params,
+                           SamplingParams &out, std::string &err);
+
+// 按参数构建 llama_sampler_chain：
+// logit_bias -> penalties -> (greedy | top_k -> top_p -> min_p -> temp -> dist)
+// logit_bias 放在最前：此时候选数组仍按 token id 排列，只按下标改 n_bias 个 logit，不扫描整个词表
+llama_sampler *build_sampler_chain(const SamplingParams &p, int32_t n_vocab);
+
+/**
+ * @brief 按参数集缓存空闲的采样链，避免每个请求重新构建；同时缓存编译好的文法
+ *
+ * - Acquire 优先取同 key 的空闲链（llama_sampler_reset 清空惩罚历史、按 seed 重置 RNG），否则新建
+ * - Release 归还；空闲链总数超过 max_idle 时直接释放
+ * - Bind 用于 session：参数集不变时直接 reset 复用 ModelContext 上的链，变化时换一条
+ * - 文法：按 GBNF 文本哈希缓存编译好的 grammar sampler 原型（LRU，至多 max_grammars 个），
+ *   每个请求 clone 一份（clone 只复制规则与解析栈，不重新解析文本）
+ * - Sample：带文法时先无约束采样，只校验选中的 token，不合法才对整个词表施加约束后重采样
+ *
+ * 线程安全。ModelContext 析构时直接释放它持有的链与文法，不经过缓存。
+ */
+class LlamaSamplerCache
+{
+public:
+    struct Stats
+    {
+        int64_t hits = 0;   // 复用缓存 / session 上已有的链
+        int64_t builds = 0; // 新建
+        size_t idle = 0;
+
+        int64_t grammar_compiles = 0;  // 文法编译次数（缓存未命中）
+        int64_t grammar_hits = 0;      // 命中编译缓存
+        int64_t grammar_tokens = 0;    // 带文法约束采样的 token 数
+        int64_t grammar_resamples = 0; // 无约束结果不合法、整表约束后重采样的次数
+        double grammar_ms = 0;         // 文法校验 / 约束 / accept 的累计耗时
+    };
+
+    LlamaSamplerCache(const llama_vocab *vocab, size_t max_idle = 64, size_t max_grammars = 32);
+    ~LlamaSamplerCache();
+
+    LlamaSamplerCache(const LlamaSamplerCache &) = delete;
+    LlamaSamplerCache &operator=(const LlamaSamplerCache &) = delete;
+
+    llama_sampler *Acquire(const SamplingParams &p);
+    void Release(const std::string &key, llama_sampler *smpl);
+
+    // 编译（或从缓存 clone）一个 grammar sampler；GBNF 非法时返回 nullptr
+    llama_sampler *AcquireGrammar(const std::string &gbnf);
+
+    // 让 mc.sampler / mc.grammar 对应参数集 p（mc.sampler_key 记录当前 key）；文法非法时返回 false
+    bool Bind(ModelContext &mc, const SamplingParams &p);
+
+    // 在 lctx 第 idx 个 logits 上采样一个 token 并 accept 到 chain（及 grammar）
+    int32_t Sample(llama_sampler *chain, llama_sampler *grammar, llama_context *lctx, int32_t idx);
+
+    Stats GetStats() const;
+
+private:
+    struct Grammar
+    {
+        std::string gbnf;
+        llama_sampler *proto = nullptr;
+    };
+
+    const llama_vocab *vocab_;
+    int32_t n_vocab_;
+    size_t max_idle_;
+    size_t max_grammars_;
+
+    mutable std::mutex mu_;
+    std::unordered_map<std::string, std::vector<llama_sampler *>> idle_;
+    size_t n_idle_ = 0;
+    int64_t hits_ = 0;
+    int64_t builds_ = 0;
+
+    // 编译缓存：最近使用的在前
+    std::list<Grammar> grammars_;
+    std::unordered_map<size_t, std::list<Grammar>::iterator> grammar_index_;
+    int64_t grammar_compiles_ = 0;
+    int64_t grammar_hits_ = 0;
+
+    std::atomic<int64_t> grammar_tokens_{0};
+    std::atomic<int64_t> grammar_resamples_{0};
+    std::atomic<int64_t> grammar_us_{0};
+};
@@ -0,0 +1,271 @@
+#include "engine/LlamaSlotPool.h"
+#include "engine/ModelContext.h"
+#include "engine/LlamaPrefixCache.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <glog/logging.h>
+
+LlamaSlotPool::LlamaSlotPool(llama_model *model, const Options &opt)
+    : model_(model), opt_(opt)
+{
+    opt_.n_contexts = std::max(1, opt_.n_contexts);
+    opt_.n_slots = std::max(1, opt_.n_slots);
+    opt_.n_ctx_per_seq = std::min(opt_.n_ctx_per_seq, opt_.n_ctx);
+}
+
+LlamaSlotPool::~LlamaSlotPool()
+{
+    prefix_caches_.clear();
+    for (auto *c : contexts_)
+        llama_free(c);
+    contexts_.clear();
+}
+
+bool LlamaSlotPool::Init()
+{
+    for (int i = 0; i < opt_.n_contexts; ++i)
+    {
+        llama_context_params cparams = llama_context_default_params();
+        cparams.n_ctx = opt_.n_ctx;
+        // 前缀缓存的 seq 排在 session slot 之后
+        const int n_cache_seqs = opt_.prefix_cache_tokens > 0 ? opt_.prefix_cache_seqs : 0;
+        cparams.n_seq_max = opt_.n_slots + n_cache_seqs;
+        cparams.kv_unified = true; // 所有 seq 共用 KV 池，按实际 token 占用
+        cparams.n_batch = opt_.n_batch;
+        cparams.n_threads = opt_.n_threads;
+        cparams.n_threads_batch = opt_.n_threads_batch;
+        cparams.type_k = opt_.type_k;
+        cparams.type_v = opt_.type_v;
+
+        llama_context *c = llama_init_from_model(model_, cparams);
+        if (!c)
+        {
+            LOG(ERROR) << "[slot-pool] llama_init_from_model failed, ctx=" << i;
+            return false;
+        }
+        contexts_.push_back(c);
+
+        if (n_cache_seqs > 0)
+        {
+            LlamaPrefixCache::Options copt;
+            copt.first_seq = opt_.n_slots;
+            copt.n_seqs = n_cache_seqs;
+            copt.max_tokens = opt_.prefix_cache_tokens;
+            copt.min_tokens = opt_.prefix_cache_min_tokens;
+            prefix_caches_.push_back(std::make_unique<LlamaPrefixCache>(c, copt));
+        }
+
+        for (int s = 0; s < opt_.n_slots; ++s)
+        {
+            Slot slot;
+            slot.ctx_idx = i;
+            slot.seq_id = s;
+            slots_.push_back(slot);
+        }
+    }
+
+    LOG(INFO) << "[slot-pool] contexts=" << opt_.n_contexts
+              << " slots_per_ctx=" << opt_.n_slots
+              << " n_ctx=" << opt_.n_ctx
+              << " n_ctx_per_seq=" << opt_.n_ctx_per_seq
+              << " prefix_cache_tokens=" << opt_.prefix_cache_tokens;
+    return true;
+}
+
+std::shared_ptr<ModelContext> LlamaSlotPool::NewHandle()
+{
+    auto mc = std::make_shared<ModelContext>();
+    mc->initialized = true;
+
+    std::weak_ptr<LlamaSlotPool> weak = shared_from_this();
+    mc->on_release = [weak](ModelContext &self)
+    {
+        if (auto pool = weak.lock())
+            pool->Release(self);
+    };
+
+    std::lock_guard<std::mutex> lk(mu_);
+    handles_.erase(std::remove_if(handles_.begin(), handles_.end(),
+                                  [](const std::weak_ptr<ModelContext> &w) { return w.expired(); }),
+                   handles_.end());
+    handles_.push_back(mc);
+    return mc;
+}
+
+void LlamaSlotPool::DetachHandles()
+{
+    std::vector<std::shared_ptr<ModelContext>> alive;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        for (auto &weak : handles_)
+        {
+            if (auto mc = weak.lock())
+                alive.push_back(std::move(mc));
+        }
+        handles_.clear();
+        for (auto &slot : slots_)
+        {
+            slot.owner = nullptr;
+            slot.busy = false;
+            slot.dirty = true;
+        }
+    }
+    // 锁外 Detach：句柄的 on_release 已被清掉，不会回调 Release
+    for (auto &mc : alive)
+        mc->Detach();
+}
+
+bool LlamaSlotPool::Checkout(ModelContext &mc)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+
+    if (mc.slot >= 0 && slots_[mc.slot].owner == &mc)
+    {
+        // 同一 session 已有请求在跑（batch 模式下可能发生），让调用方稍后重试
+        if (slots_[mc.slot].busy)
+            return false;
+        slots_[mc.slot].busy = true;
+        return true;
+    }
+
+    const int idx = PickSlotLocked();
+    if (idx < 0)
+        return false;
+
+    Slot &slot = slots_[idx];
+    if (slot.owner)
+        DetachOwnerLocked(slot);
+    if (slot.dirty)
+        ClearSlotLocked(slot);
+
+    slot.owner = &mc;
+    slot.busy = true;
+    slot.last_used = Clock::now();
+
+    // 之前有 KV 而 slot 已被回收：需要重放 history（上次重放未完成时保持）
+    mc.need_replay = mc.need_replay || mc.n_past > 0;
+    mc.n_past = 0;
+    mc.tokens.clear();
+    mc.slot = idx;
+    mc.seq_id = slot.seq_id;
+    mc.ctx = contexts_[slot.ctx_idx];
+    return true;
+}
+
+void LlamaSlotPool::Checkin(ModelContext &mc)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    if (mc.slot < 0 || slots_[mc.slot].owner != &mc)
+        return;
+    slots_[mc.slot].busy = false;
+    slots_[mc.slot].last_used = Clock::now();
+    mc.kv_bytes.store(opt_.kv_token_bytes * static_cast<size_t>(std::max(mc.n_past, 0)), std::memory_order_relaxed);
+}
+
+bool LlamaSlotPool::EvictOne(llama_context *ctx)
+{
+    // 前缀缓存可以随时重建，优先于 session 的 KV 淘汰
+    if (auto *cache = prefix_cache(ctx))
+    {
+        if (cache->EvictOne())
+            return true;
+    }
+
+    std::lock_guard<std::mutex> lk(mu_);
+
+    int victim = -1;
+    for (int i = 0; i < (int)slots_.size(); ++i)
+    {
+        const Slot &s = slots_[i];
+        if (contexts_[s.ctx_idx] != ctx || s.busy)
+            continue;
+        if (!s.owner && !s.dirty)
+            continue; // 空 slot，没有 KV 可释放
+        if (victim < 0 || s.last_used < slots_[victim].last_used)
+            victim = i;
+    }
+    if (victim < 0)
+        return false;
+
+    Slot &slot = slots_[victim];
+    LOG(INFO) << "[slot-pool] kv full, evict slot=" << victim << " seq=" << slot.seq_id;
+    if (slot.owner)
+        DetachOwnerLocked(slot);
+    ClearSlotLocked(slot);
+    return true;
+}
+
+LlamaPrefixCache *LlamaSlotPool::prefix_cache(llama_context *ctx) const
+{
+    for (size_t i = 0; i < prefix_caches_.size() && i < contexts_.size(); ++i)
+    {
+        if (contexts_[i] == ctx)
+            return prefix_caches_[i].get();
+    }
+    return nullptr;
+}
+
+void LlamaSlotPool::Release(ModelContext &mc)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    if (mc.slot < 0 || slots_[mc.slot].owner != &mc)
+        return;
+
+    // 任意线程都可能走到这里（session GC），只登记，seq_rm 延迟到下次分配
+    Slot &slot = slots_[mc.slot];
+    slot.owner = nullptr;
+    slot.busy = false;
+    slot.dirty = true;
+    mc.slot = -1;
+}
+
+void LlamaSlotPool::ClearSlotLocked(Slot &slot)
+{
+    llama_memory_seq_rm(llama_get_memory(contexts_[slot.ctx_idx]), slot.seq_id, -1, -1);
+    slot.dirty = false;
+}
+
+void LlamaSlotPool::DetachOwnerLocked(Slot &slot)
+{
+    // owner 空闲（非 busy）时才会被淘汰，此时不会有线程在读写它
+    slot.owner->slot = -1;
+    slot.owner->kv_bytes.store(0, std::memory_order_relaxed);
+    slot.owner = nullptr;
+    slot.busy = false;
+    slot.dirty = true;
+}
+
+int LlamaSlotPool::PickSlotLocked()
+{
+    // 1) 优先空 slot：选占用最少的 context，摊开 KV 压力
+    std::vector<int> used(contexts_.size(), 0);
+    for (const auto &s : slots_)
+    {
+        if (s.owner)
+            used[s.ctx_idx]++;
+    }
+
+    int best = -1;
+    for (int i = 0; i < (int)slots_.size(); ++i)
+    {
+        const Slot &s = slots_[i];
+        if (s.owner)
+            continue;
+        if (best < 0 || used[s.ctx_idx] < used[slots_[best].ctx_idx])
+            best = i;
+    }
+    if (best >= 0)
+        return best;
+
+    // 2) 没有空 slot：LRU 淘汰空闲 session
+    for (int i = 0; i < (int)slots_.size(); ++i)
+    {
+        const Slot &s = slots_[i];
+        if (s.busy)
+            continue;
+        if (best < 0 || s.last_used < slots_[best].last_used)
+            best = i;
+    }
+    return best;
+}
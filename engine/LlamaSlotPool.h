@@ -0,0 +1,108 @@
+#pragma once
+#include "ggml.h"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct llama_model;
+struct llama_context;
+struct ModelContext;
+class LlamaPrefixCache;
+
+/**
+ * @brief 共享 llama_context + per-session seq slot（LLAMA_KV_MODE=shared）
+ *
+ * - 每个模型持有一个（或少量）大 context，KV 为 unified：所有 seq 共用同一块 KV，
+ *   内存随实际占用的 token 数增长，而不是 session 数 × n_ctx
+ * - Session 的 ModelContext 只是一个 slot 句柄（seq_id + n_past）
+ * - slot 的分配 / LRU 淘汰 / 复用都在这里完成
+ *
+ * 线程约束：Checkout / Checkin / EvictOne 只能在驱动 context 的线程上调用
+ * （串行 Run 或 batch 调度线程）；句柄析构可以在任意线程，只做登记，
+ * 真正的 seq_rm 延迟到 slot 下次被分配时执行。
+ */
+class LlamaSlotPool : public std::enable_shared_from_this<LlamaSlotPool>
+{
+public:
+    struct Options
+    {
+        int n_contexts = 1;        // 共享 context 个数
+        int n_slots = 32;          // 每个 context 的 seq 数
+        int n_ctx = 16384;         // 每个 context 的 KV token 总量（所有 slot 共享）
+        int n_ctx_per_seq = 4096;  // 单个 session 可用的上限
+        int n_batch = 2048;
+        int n_threads = 4;
+        int n_threads_batch = 4;
+
+        // 前缀 KV 缓存（每个 context 一份）；prefix_cache_tokens = 0 表示关闭
+        int prefix_cache_tokens = 0;
+        int prefix_cache_seqs = 8;
+        int prefix_cache_min_tokens = 32;
+
+        // KV cache 类型与对应的每 token 字节数（session 的 kv_bytes 统计用）
+        ggml_type type_k = GGML_TYPE_F16;
+        ggml_type type_v = GGML_TYPE_F16;
+        size_t kv_token_bytes = 0;
+    };
+
+    LlamaSlotPool(llama_model *model, const Options &opt);
+    ~LlamaSlotPool();
+
+    bool Init();
+
+    // 为 session 创建 slot 句柄（此时不占 slot，Checkout 时才分配）
+    std::shared_ptr<ModelContext> NewHandle();
+
+    // 模型卸载前调用：所有仍存活的句柄 Detach（不再归还 slot），session 之后按 history 重放
+    void DetachHandles();
+
+    // 请求开始：确保句柄持有 slot 并标记 busy
+    // slot 曾被回收则重新分配：n_past 归零、need_replay 置位
+    // 无可用 slot，或该句柄已被另一个请求占用时返回 false
+    bool Checkout(ModelContext &mc);
+
+    // 请求结束：slot 转为空闲，可被 LRU 淘汰；按 n_past 更新句柄的 kv_bytes
+    void Checkin(ModelContext &mc);
+
+    // KV 已满（llama_decode 返回 1）：先淘汰 ctx 上最久未用的前缀缓存，
+    // 再淘汰最久未用的空闲 slot；无可淘汰返回 false
+    bool EvictOne(llama_context *ctx);
+
+    // ctx 对应的前缀缓存；未开启返回 nullptr
+    LlamaPrefixCache *prefix_cache(llama_context *ctx) const;
+    const std::vector<std::unique_ptr<LlamaPrefixCache>> &prefix_caches() const { return prefix_caches_; }
+
+    int n_ctx_per_seq() const { return opt_.n_ctx_per_seq; }
+    int n_slots_total() const { return static_cast<int>(slots_.size()); }
+    llama_context *context(int i) const { return contexts_[i]; }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Slot
+    {
+        int ctx_idx = 0;
+        int seq_id = 0;
+        ModelContext *owner = nullptr;
+        bool busy = false;
+        bool dirty = false; // 还残留上一个 owner 的 KV
+        Clock::time_point last_used{};
+    };
+
+    void Release(ModelContext &mc);
+    void ClearSlotLocked(Slot &slot);
+    void DetachOwnerLocked(Slot &slot);
+    int PickSlotLocked();
+
+private:
+    llama_model *model_ = nullptr;
+    Options opt_;
+
+    std::mutex mu_;
+    std::vector<llama_context *> contexts_;
+    std::vector<Slot> slots_;
+    std::vector<std::unique_ptr<LlamaPrefixCache>> prefix_caches_; // 与 contexts_ 一一对应
+    std::vector<std::weak_ptr<ModelContext>> handles_;              // NewHandle 发出的句柄
+};
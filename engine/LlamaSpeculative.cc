@@ -0,0 +1,219 @@
+#include "engine/LlamaSpeculative.h"
+#include "engine/ModelContext.h"
+#include "engine/LlamaCommon.h"
+#include "engine/LlamaThreadBudget.h"
+#include "llama.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+LlamaSpeculative::LlamaSpeculative(const llama_model *target, const Options &opt)
+    : target_(target), opt_(opt)
+{
+    opt_.n_min = std::max(1, opt_.n_min);
+    opt_.n_max = std::max(opt_.n_min, opt_.n_max);
+}
+
+LlamaSpeculative::~LlamaSpeculative()
+{
+    if (draft_)
+        llama_model_free(draft_);
+}
+
+bool LlamaSpeculative::Init()
+{
+    llama_model_params mparams = llama_model_default_params();
+    draft_ = llama_model_load_from_file(opt_.draft_path.c_str(), mparams);
+    if (!draft_)
+    {
+        LOG(ERROR) << "[spec] failed to load draft model: " << opt_.draft_path;
+        return false;
+    }
+
+    // 草稿 token 直接交给目标模型校验，两边词表必须一致（参考 llama.cpp speculative 的兼容性检查）
+    const llama_vocab *tv = llama_model_get_vocab(target_);
+    const llama_vocab *dv = llama_model_get_vocab(draft_);
+    const int n_diff = std::abs(llama_vocab_n_tokens(tv) - llama_vocab_n_tokens(dv));
+    if (llama_vocab_type(tv) != llama_vocab_type(dv) || n_diff > 128 ||
+        llama_vocab_bos(tv) != llama_vocab_bos(dv) || llama_vocab_eos(tv) != llama_vocab_eos(dv))
+    {
+        LOG(ERROR) << "[spec] draft vocab incompatible with target, n_vocab diff=" << n_diff;
+        llama_model_free(draft_);
+        draft_ = nullptr;
+        return false;
+    }
+
+    LOG(INFO) << "[spec] draft model loaded: " << opt_.draft_path
+              << " k=[" << opt_.n_min << "," << opt_.n_max << "]";
+    return true;
+}
+
+bool LlamaSpeculative::EnsureContext(ModelContext &mc)
+{
+    if (mc.draft_ctx)
+        return true;
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = opt_.n_ctx;
+    cparams.n_batch = std::max(opt_.n_batch, opt_.n_max + 1);
+    cparams.n_threads = opt_.n_threads;
+    cparams.n_threads_batch = opt_.n_threads_batch;
+    cparams.type_k = opt_.type_k;
+    cparams.type_v = opt_.type_v;
+
+    mc.draft_ctx = llama_init_from_model(draft_, cparams);
+    mc.draft_n_past = 0;
+    mc.draft_k = (opt_.n_min + opt_.n_max) / 2;
+    if (!mc.draft_ctx)
+        return false;
+    // 草稿 KV 同样按 n_ctx 预分配，计入该 session 的 KV 占用
+    mc.kv_bytes.fetch_add(kv_bytes_per_token(draft_, opt_.type_k, opt_.type_v) * llama_n_ctx(mc.draft_ctx),
+                          std::memory_order_relaxed);
+    return true;
+}
+
+bool LlamaSpeculative::DecodeDraft(ModelContext &mc, const int32_t *toks, int n)
+{
+    if (n <= 0)
+        return true;
+
+    llama_batch batch = llama_batch_init(n, 0, 1);
+    batch.n_tokens = n;
+    for (int i = 0; i < n; ++i)
+    {
+        batch.token[i] = toks[i];
+        batch.pos[i] = mc.draft_n_past + i;
+        batch.n_seq_id[i] = 1;
+        batch.seq_id[i][0] = 0;
+        batch.logits[i] = (i == n - 1);
+    }
+
+    int rc;
+    {
+        LlamaThreadBudget::Lease lease(mc.draft_ctx, LlamaThreadBudget::Phase::draft);
+        rc = llama_decode(mc.draft_ctx, batch);
+    }
+    llama_batch_free(batch);
+    if (rc != 0)
+        return false;
+
+    mc.draft_n_past += n;
+    return true;
+}
+
+bool LlamaSpeculative::SyncPrompt(ModelContext &mc, const std::vector<int32_t> &toks, int n_past_start)
+{
+    if (!EnsureContext(mc))
+        return false;
+
+    if (mc.draft_n_past != n_past_start)
+    {
+        // 目标 KV 是从头写的：草稿 KV 跟着重来；否则两边已无法逐 token 对齐
+        if (n_past_start != 0)
+            return false;
+        llama_memory_seq_rm(llama_get_memory(mc.draft_ctx), 0, -1, -1);
+        mc.draft_n_past = 0;
+    }
+
+    const size_t chunk = static_cast<size_t>(std::max(1, opt_.n_batch));
+    for (size_t i = 0; i < toks.size(); i += chunk)
+    {
+        const int n = static_cast<int>(std::min(chunk, toks.size() - i));
+        if (!DecodeDraft(mc, toks.data() + i, n))
+        {
+            mc.draft_n_past = -1;
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<int32_t> LlamaSpeculative::Draft(ModelContext &mc, const std::vector<int32_t> &pending, int n)
+{
+    std::vector<int32_t> out;
+    if (n <= 0 || mc.draft_n_past < 0)
+        return out;
+    if (!DecodeDraft(mc, pending.data(), (int)pending.size()))
+    {
+        mc.draft_n_past = -1;
+        return out;
+    }
+
+    const llama_vocab *vocab = llama_model_get_vocab(draft_);
+    // 只在两边都有的 token 里取 argmax
+    const int n_vocab = std::min(llama_vocab_n_tokens(vocab), llama_vocab_n_tokens(llama_model_get_vocab(target_)));
+
+    out.reserve(n);
+    for (int i = 0; i < n; ++i)
+    {
+        const float *logits = llama_get_logits_ith(mc.draft_ctx, -1);
+        const int32_t tok = static_cast<int32_t>(std::max_element(logits, logits + n_vocab) - logits);
+        out.push_back(tok);
+
+        // 最后一个草稿 token 不必写入草稿 KV：被接受时由 Align / 下一轮 pending 补上
+        if (i + 1 == n || llama_vocab_is_eog(vocab, tok))
+            break;
+        if (!DecodeDraft(mc, &tok, 1))
+            break;
+    }
+    return out;
+}
+
+void LlamaSpeculative::Align(ModelContext &mc, const std::vector<int32_t> &tail, int tail_start)
+{
+    if (!mc.draft_ctx || mc.draft_n_past < 0)
+        return;
+
+    if (mc.draft_n_past > mc.n_past)
+    {
+        llama_memory_seq_rm(llama_get_memory(mc.draft_ctx), 0, mc.n_past, -1);
+        mc.draft_n_past = mc.n_past;
+        return;
+    }
+
+    if (mc.draft_n_past < mc.n_past)
+    {
+        const int off = mc.draft_n_past - tail_start;
+        if (off < 0 || mc.n_past - tail_start > (int)tail.size() ||
+            !DecodeDraft(mc, tail.data() + off, mc.n_past - mc.draft_n_past))
+        {
+            mc.draft_n_past = -1;
+        }
+    }
+}
+
+void LlamaSpeculative::Record(ModelContext &mc, int drafted, int accepted)
+{
+    steps_.fetch_add(1, std::memory_order_relaxed);
+    drafted_.fetch_add(drafted, std::memory_order_relaxed);
+    accepted_.fetch_add(accepted, std::memory_order_relaxed);
+
+    if (drafted <= 0)
+        return;
+    // 全部接受：下次多猜一个；接受不到一半：少猜一个
+    if (accepted == drafted)
+        mc.draft_k = std::min(k(mc) + 1, opt_.n_max);
+    else if (accepted * 2 < drafted)
+        mc.draft_k = std::max(k(mc) - 1, opt_.n_min);
+}
+
+int LlamaSpeculative::k(const ModelContext &mc) const
+{
+    return std::clamp(mc.draft_k, opt_.n_min, opt_.n_max);
+}
+
+LlamaSpeculative::Stats LlamaSpeculative::GetStats() const
+{
+    Stats st;
+    st.steps = steps_.load(std::memory_order_relaxed);
+    st.drafted = drafted_.load(std::memory_order_relaxed);
+    st.accepted = accepted_.load(std::memory_order_relaxed);
+    return st;
+}
+
+size_t LlamaSpeculative::ResidentBytes() const
+{
+    return draft_ ? static_cast<size_t>(llama_model_size(draft_)) : 0;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include "ggml.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct llama_model;
+struct llama_context;
+struct ModelContext;
+
+/**
+ * @brief 投机解码的草稿模型（LLAMA_DRAFT_MODEL_PATH）
+ *
+ * - 草稿模型与目标模型共享词表，每个 session 在 ModelContext::draft_ctx 上维护一份草稿 KV，
+ *   与目标 KV 逐 token 对齐（draft_n_past 记录草稿 KV 位置）
+ * - 每步由草稿模型贪心续写 k 个 token，目标模型一次 batch decode 校验，接受最长匹配前缀；
+ *   k 按接受率在 [n_min, n_max] 间自适应（按 session 记在 ModelContext::draft_k）
+ * - 目标端按请求的采样链逐位置采样并与草稿比对：greedy 时输出与逐 token 解码完全一致，
+ *   随机采样时输出分布不变（接受率随 temperature 升高而下降）
+ *
+ * 线程约束：除 GetStats / ResidentBytes 外，只能在驱动该 session 的线程上调用。
+ */
+class LlamaSpeculative
+{
+public:
+    struct Options
+    {
+        std::string draft_path;
+        int n_ctx = 4096;   // 草稿 context 长度，与目标单 session 上限一致
+        int n_batch = 512;  // 草稿 prefill 分块大小
+        int n_threads = 4;
+        int n_threads_batch = 4;
+        int n_min = 2;      // 自适应 k 的范围
+        int n_max = 8;
+        ggml_type type_k = GGML_TYPE_F16; // 草稿 KV 类型，与目标模型一致
+        ggml_type type_v = GGML_TYPE_F16;
+    };
+
+    struct Stats
+    {
+        int64_t steps = 0;    // 校验次数（目标 batch decode 次数）
+        int64_t drafted = 0;  // 草拟 token 数
+        int64_t accepted = 0; // 被目标接受的草稿 token 数
+    };
+
+    LlamaSpeculative(const llama_model *target, const Options &opt);
+    ~LlamaSpeculative();
+
+    // 加载草稿模型并检查与目标模型词表兼容
+    bool Init();
+
+    // 本轮 prompt 已写入目标 KV（起点 n_past_start）后调用：把同样的 token 写入草稿 KV。
+    // 草稿 KV 与目标 KV 无法对齐（如目标 KV 由换入恢复）时返回 false，本轮不投机
+    bool SyncPrompt(ModelContext &mc, const std::vector<int32_t> &toks, int n_past_start);
+
+    // 把 pending（目标 KV 已有、草稿 KV 尚缺的 token，末尾为待校验的 last）写入草稿 KV，
+    // 再贪心续写至多 n 个草稿 token；失败时返回空
+    std::vector<int32_t> Draft(ModelContext &mc, const std::vector<int32_t> &pending, int n);
+
+    // 目标 KV 回退 / 前进后让草稿 KV 对齐到 mc.n_past；tail 为目标 KV 从 tail_start 起的 token
+    void Align(ModelContext &mc, const std::vector<int32_t> &tail, int tail_start);
+
+    // 一次校验的结果：记录统计并按接受率调整该 session 的 k
+    void Record(ModelContext &mc, int drafted, int accepted);
+
+    int k(const ModelContext &mc) const;
+
+    Stats GetStats() const;
+
+    // 草稿模型权重占用的字节数
+    size_t ResidentBytes() const;
+
+private:
+    bool EnsureContext(ModelContext &mc);
+    bool DecodeDraft(ModelContext &mc, const int32_t *toks, int n);
+
+private:
+    const llama_model *target_ = nullptr;
+    llama_model *draft_ = nullptr;
+    Options opt_;
+
+    std::atomic<int64_t> steps_{0};
+    std::atomic<int64_t> drafted_{0};
+    std::atomic<int64_t> accepted_{0};
+};
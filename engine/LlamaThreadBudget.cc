@@ -0,0 +1,305 @@
+#include "engine/LlamaThreadBudget.h"
+#include "engine/LlamaCommon.h"
+#include "llama.h"
+#include "ggml-cpu.h"
+
+#include <algorithm>
+#include <cstring>
+#include <glog/logging.h>
+#include <sstream>
+#include <thread>
+
+namespace
+{
+// "0-7,16,18-19" -> {0..7, 16, 18, 19}；非法片段忽略
+std::vector<int> parse_cpu_set(const std::string &spec)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(spec);
+    std::string part;
+    while (std::getline(ss, part, ','))
+    {
+        try
+        {
+            const size_t dash = part.find('-');
+            const int lo = std::stoi(part.substr(0, dash));
+            const int hi = dash == std::string::npos ? lo : std::stoi(part.substr(dash + 1));
+            for (int c = lo; c <= hi && c < GGML_MAX_N_THREADS; ++c)
+            {
+                if (c >= 0 && std::find(cpus.begin(), cpus.end(), c) == cpus.end())
+                    cpus.push_back(c);
+            }
+        }
+        catch (...)
+        {
+            LOG(WARNING) << "[threads] bad LLAMA_CPU_SET entry: " << part;
+        }
+    }
+    return cpus;
+}
+
+double ms_between(std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b)
+{
+    return std::chrono::duration<double, std::milli>(b - a).count();
+}
+} // namespace
+
+LlamaThreadBudget::Lease::Lease(llama_context *lctx, Phase phase)
+    : lctx_(lctx), phase_(phase)
+{
+    auto &tb = LlamaThreadBudget::Instance();
+    if (!lctx_ || !tb.enabled())
+        return;
+
+    block_ = tb.Acquire(lctx_, phase_, width_);
+    start_ = std::chrono::steady_clock::now();
+}
+
+LlamaThreadBudget::Lease::~Lease()
+{
+    if (block_ < 0)
+        return;
+    // 摘除后 context 不再引用 threadpool，下次 decode 再按当时的并发挂上
+    llama_detach_threadpool(lctx_);
+    LlamaThreadBudget::Instance().Release(block_, phase_, start_);
+}
+
+LlamaThreadBudget &LlamaThreadBudget::Instance()
+{
+    static LlamaThreadBudget budget;
+    return budget;
+}
+
+const char *LlamaThreadBudget::PhaseName(Phase phase)
+{
+    switch (phase)
+    {
+    case Phase::prefill:
+        return "prefill";
+    case Phase::decode:
+        return "decode";
+    case Phase::batch:
+        return "batch";
+    case Phase::draft:
+        return "draft";
+    case Phase::embed:
+        return "embed";
+    default:
+        return "unknown";
+    }
+}
+
+LlamaThreadBudget::LlamaThreadBudget()
+{
+    int budget = get_env_int("LLAMA_THREAD_BUDGET", 0);
+    cpu_set_ = get_env_str("LLAMA_CPU_SET", "");
+    if (!cpu_set_.empty())
+    {
+        cpus_ = parse_cpu_set(cpu_set_);
+        if (cpus_.empty())
+        {
+            LOG(WARNING) << "[threads] LLAMA_CPU_SET=" << cpu_set_ << " has no valid cpu, thread budget disabled";
+            return;
+        }
+        if (budget <= 0 || budget > static_cast<int>(cpus_.size()))
+            budget = static_cast<int>(cpus_.size());
+        cpus_.resize(budget);
+        pinned_ = true;
+    }
+    else if (budget > 0)
+    {
+        // 不绑核：只限制总线程数，由内核调度
+        for (int i = 0; i < budget; ++i)
+            cpus_.push_back(i);
+    }
+    if (budget <= 0)
+        return;
+
+    const int hw = static_cast<int>(std::thread::hardware_concurrency());
+    if (hw > 0 && budget > hw)
+        LOG(WARNING) << "[threads] LLAMA_THREAD_BUDGET=" << budget << " exceeds hardware threads " << hw;
+
+    budget_ = std::min(budget, GGML_MAX_N_THREADS);
+    min_threads_ = std::min(get_env_int("LLAMA_MIN_THREADS", 1), budget_);
+    poll_ = std::min(get_env_int("LLAMA_THREADPOOL_POLL", 0), 100);
+
+    // 第 k 层把预算二分成 2^k 块（块 i 为 [i*B/2^k, (i+1)*B/2^k)，子块恰好拼成父块），最小块不少于 min_threads_
+    for (levels_ = 0; levels_ < 16; ++levels_)
+    {
+        const int n = 1 << levels_;
+        if (budget_ / n < min_threads_)
+            break;
+        for (int i = 0; i < n; ++i)
+        {
+            Block b;
+            b.level = levels_;
+            b.begin = i * budget_ / n;
+            b.end = (i + 1) * budget_ / n;
+            blocks_.push_back(b);
+        }
+    }
+
+    busy_.assign(budget_, false);
+    start_ = Clock::now();
+
+    LOG(INFO) << "[threads] budget=" << budget_
+              << " cpu_set=" << (pinned_ ? cpu_set_ : "unpinned")
+              << " min_threads=" << min_threads_
+              << " levels=" << levels_
+              << " poll=" << poll_;
+}
+
+LlamaThreadBudget::~LlamaThreadBudget()
+{
+    for (auto &b : blocks_)
+    {
+        if (b.pool)
+            ggml_threadpool_free(b.pool);
+        b.pool = nullptr;
+    }
+}
+
+bool LlamaThreadBudget::FreeLocked(const Block &b) const
+{
+    for (int i = b.begin; i < b.end; ++i)
+    {
+        if (busy_[i])
+            return false;
+    }
+    return true;
+}
+
+int LlamaThreadBudget::PickLocked(int level) const
+{
+    const int first = (1 << level) - 1;
+    for (int i = first; i < first + (1 << level); ++i)
+    {
+        if (FreeLocked(blocks_[i]))
+            return i;
+    }
+    return -1;
+}
+
+ggml_threadpool *LlamaThreadBudget::PoolLocked(Block &b)
+{
+    if (b.pool)
+        return b.pool;
+
+    const int width = b.end - b.begin;
+    ggml_threadpool_params params = ggml_threadpool_params_default(width);
+    if (pinned_)
+    {
+        std::memset(params.cpumask, 0, sizeof(params.cpumask));
+        for (int i = b.begin; i < b.end; ++i)
+            params.cpumask[cpus_[i]] = true;
+        // 每个线程固定在块内的一个核上
+        params.strict_cpu = true;
+    }
+    // 各层的块共享同一批核：空闲线程不轮询，直接睡眠
+    params.poll = static_cast<uint32_t>(poll_);
+
+    b.pool = ggml_threadpool_new(&params);
+    if (!b.pool)
+    {
+        LOG(ERROR) << "[threads] ggml_threadpool_new failed width=" << width;
+        return nullptr;
+    }
+    ++pools_;
+    return b.pool;
+}
+
+int LlamaThreadBudget::Acquire(llama_context *lctx, Phase phase, int &width)
+{
+    const auto t0 = Clock::now();
+    std::unique_lock<std::mutex> lk(mu_);
+
+    // 并发度：最近 kActiveWindow 内 decode 过的 context 数（串行 Run 的各 session 在 decode 之间
+    // 还要采样 / 输出，只数正在 decode 的会低估）
+    recent_[lctx] = t0;
+    for (auto it = recent_.begin(); it != recent_.end();)
+    {
+        if (t0 - it->second > kActiveWindow)
+            it = recent_.erase(it);
+        else
+            ++it;
+    }
+
+    int idx = -1;
+    bool waited = false;
+    while (true)
+    {
+        active_ = std::max<int>(1, static_cast<int>(recent_.size()));
+        int level = 0;
+        while ((1 << level) < active_ && level + 1 < levels_)
+            ++level;
+        // 目标大小的块都被占用时退而求其次用更小的块；一块都没有再等
+        for (int l = level; l < levels_ && idx < 0; ++l)
+            idx = PickLocked(l);
+        if (idx >= 0)
+            break;
+        waited = true;
+        cv_.wait(lk);
+    }
+
+    Block &b = blocks_[idx];
+    if (!PoolLocked(b))
+    {
+        width = 0;
+        return -1;
+    }
+    for (int i = b.begin; i < b.end; ++i)
+        busy_[i] = true;
+    width = b.end - b.begin;
+    cores_busy_ += width;
+
+    auto &ps = phases_[static_cast<int>(phase)];
+    ps.calls++;
+    ps.threads_total += width;
+    ps.min_threads = ps.min_threads == 0 ? width : std::min<int64_t>(ps.min_threads, width);
+    ps.max_threads = std::max<int64_t>(ps.max_threads, width);
+    if (waited)
+    {
+        waits_++;
+        ps.wait_ms += ms_between(t0, Clock::now());
+    }
+
+    llama_attach_threadpool(lctx, b.pool, b.pool);
+    llama_set_n_threads(lctx, width, width);
+    return idx;
+}
+
+void LlamaThreadBudget::Release(int block, Phase phase, Clock::time_point start)
+{
+    const double ms = ms_between(start, Clock::now());
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        const Block &b = blocks_[block];
+        const int width = b.end - b.begin;
+        for (int i = b.begin; i < b.end; ++i)
+            busy_[i] = false;
+        cores_busy_ -= width;
+        core_ms_ += ms * width;
+        phases_[static_cast<int>(phase)].busy_ms += ms;
+    }
+    cv_.notify_all();
+}
+
+LlamaThreadBudget::Stats LlamaThreadBudget::GetStats() const
+{
+    Stats st;
+    std::lock_guard<std::mutex> lk(mu_);
+    st.enabled = enabled();
+    if (!st.enabled)
+        return st;
+    st.budget = budget_;
+    st.cpu_set = pinned_ ? cpu_set_ : "";
+    st.pools = pools_;
+    st.cores_busy = cores_busy_;
+    st.active = active_;
+    st.waits = waits_;
+    const double wall = ms_between(start_, Clock::now());
+    st.utilization = wall > 0 ? core_ms_ / (wall * budget_) : 0;
+    for (int i = 0; i < static_cast<int>(Phase::count); ++i)
+        st.phases[i] = phases_[i];
+    return st;
+}
@@ -0,0 +1,134 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct llama_context;
+struct ggml_threadpool;
+
+/**
+ * @brief 进程级 CPU 线程预算：所有 llama context 的 decode 共用一组 ggml threadpool
+ *
+ * - LLAMA_THREAD_BUDGET > 0 或配置了 LLAMA_CPU_SET 时启用；否则各 context 照旧用 LLAMA_N_THREADS
+ * - 预算内的 CPU（LLAMA_CPU_SET，缺省为 0..budget-1）按二分切成若干块，每块一个绑核的 ggml threadpool；
+ *   同一 CPU 同一时刻只属于一个 decode，不会再有 session 数 × LLAMA_N_THREADS 的超订
+ * - 每次 decode 前按当前并发（最近 kActiveWindow 内 decode 过的 context 数）选块大小：
+ *   单个请求独占全部核，并发上升时每个 context 的线程数随之减半，直到 LLAMA_MIN_THREADS；
+ *   没有空闲块时等待其它 decode 结束
+ * - Lease 在 decode 前挂上 threadpool 并设置线程数，析构时摘除；未启用时 Lease 不做任何事
+ */
+class LlamaThreadBudget
+{
+public:
+    enum class Phase
+    {
+        prefill = 0, // 串行 Run 的 prompt prefill
+        decode,      // 串行 Run 的逐 token decode（含 n > 1 候选、投机校验）
+        batch,       // continuous batching 的混合 batch
+        draft,       // 投机解码的草稿模型
+        embed,       // embedding
+        count
+    };
+
+    struct PhaseStats
+    {
+        int64_t calls = 0;
+        int64_t threads_total = 0; // 各次 decode 的线程数之和（除以 calls 为平均线程数）
+        int64_t min_threads = 0;
+        int64_t max_threads = 0;
+        double busy_ms = 0;
+        double wait_ms = 0;
+    };
+
+    struct Stats
+    {
+        bool enabled = false;
+        int budget = 0;
+        std::string cpu_set;
+        int pools = 0;        // 已创建的 threadpool 数
+        int cores_busy = 0;   // 当前正在 decode 的核数
+        int active = 0;       // 最近一次分配时的并发 context 数
+        int64_t waits = 0;    // 因没有空闲核而等待的次数
+        double utilization = 0; // 启用以来 decode 占用的核·时间 / (budget × 墙钟时间)
+        PhaseStats phases[static_cast<int>(Phase::count)];
+    };
+
+    class Lease
+    {
+    public:
+        Lease(llama_context *lctx, Phase phase);
+        ~Lease();
+
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+
+        // 本次 decode 使用的线程数；未启用时为 0
+        int threads() const { return width_; }
+
+    private:
+        llama_context *lctx_ = nullptr;
+        Phase phase_ = Phase::decode;
+        int block_ = -1;
+        int width_ = 0;
+        std::chrono::steady_clock::time_point start_{};
+    };
+
+    static LlamaThreadBudget &Instance();
+
+    bool enabled() const { return budget_ > 0; }
+    int budget() const { return budget_; }
+
+    Stats GetStats() const;
+
+    static const char *PhaseName(Phase phase);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Block
+    {
+        int level = 0;
+        int begin = 0; // cpus_ 下标区间 [begin, end)
+        int end = 0;
+        ggml_threadpool *pool = nullptr; // 首次使用时创建
+    };
+
+    LlamaThreadBudget();
+    ~LlamaThreadBudget();
+
+    // 等待并占用一块 CPU，返回块下标；width 为其线程数
+    int Acquire(llama_context *lctx, Phase phase, int &width);
+    void Release(int block, Phase phase, Clock::time_point start);
+
+    bool FreeLocked(const Block &b) const;
+    int PickLocked(int level) const;
+    ggml_threadpool *PoolLocked(Block &b);
+
+private:
+    static constexpr std::chrono::milliseconds kActiveWindow{100};
+
+    int budget_ = 0;
+    int min_threads_ = 1;
+    int poll_ = 0;
+    bool pinned_ = false;
+    std::string cpu_set_;
+    std::vector<int> cpus_;    // 预算内的 CPU 编号
+    std::vector<Block> blocks_; // 按层排列：第 k 层 2^k 块
+    int levels_ = 0;
+
+    mutable std::mutex mu_;
+    std::condition_variable cv_;
+    std::vector<bool> busy_; // 按 cpus_ 下标
+    std::map<llama_context *, Clock::time_point> recent_;
+    int active_ = 0;
+    int cores_busy_ = 0;
+    int pools_ = 0;
+    int64_t waits_ = 0;
+    double core_ms_ = 0;
+    Clock::time_point start_{};
+    PhaseStats phases_[static_cast<int>(Phase::count)];
+};
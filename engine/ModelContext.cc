@@ -1,6 +1,10 @@
 #include "engine/ModelContext.h"
+#include "engine/LlamaNgramLookup.h"
+#include "serving/core/Session.h"
 #include "llama.h"
 
+ModelContext::ModelContext() = default;
+
 ModelContext::~ModelContext()
 {
     if (sampler)
@@ -8,9 +12,60 @@ ModelContext::~ModelContext()
         llama_sampler_free(sampler);
         sampler = nullptr;
     }
+    if (grammar)
+    {
+        llama_sampler_free(grammar);
+        grammar = nullptr;
+    }
+    if (draft_ctx)
+    {
+        llama_free(draft_ctx);
+        draft_ctx = nullptr;
+    }
+    if (on_release)
+    {
+        // 共享 context / 池化 context 由所属 pool 持有，这里只归还
+        on_release(*this);
+        ctx = nullptr;
+        return;
+    }
     if (ctx)
     {
         llama_free(ctx);
         ctx = nullptr;
     }
 }
+
+void ModelContext::Detach()
+{
+    if (sampler)
+        llama_sampler_free(sampler);
+    if (grammar)
+        llama_sampler_free(grammar);
+    if (draft_ctx)
+        llama_free(draft_ctx);
+    if (ctx && !on_release)
+        llama_free(ctx);
+
+    ctx = nullptr;
+    sampler = nullptr;
+    grammar = nullptr;
+    draft_ctx = nullptr;
+    on_release = nullptr;
+    sampler_key.clear();
+    slot = -1;
+    n_past = 0;
+    tokens.clear();
+    turns.clear();
+    n_keep = -1;
+    n_keep_msgs = 0;
+    draft_n_past = 0;
+    lookup.reset();
+    kv_bytes.store(0, std::memory_order_relaxed);
+    detached = true;
+}
+
+size_t session_kv_bytes(const Session &s)
+{
+    return s.model_ctx ? s.model_ctx->kv_bytes.load(std::memory_order_relaxed) : 0;
+}
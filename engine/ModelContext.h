@@ -1,9 +1,16 @@
 #pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 // llama forward declarations（只在 engine 层）
 struct llama_context;
 struct llama_sampler;
+class LlamaNgramLookup;
 
 // Session 级模型运行状态（KV Cache 所在）
 // 引擎私有，不属于 serving/core
@@ -11,16 +18,66 @@ struct ModelContext
 {
     llama_context *ctx = nullptr;
     llama_sampler *sampler = nullptr;
+    // sampler 对应的采样参数集（SamplingParams::Key），相同参数的请求直接 reset 复用
+    std::string sampler_key;
+    // response_format / grammar 约束（每个请求从编译缓存 clone），空表示不约束
+    llama_sampler *grammar = nullptr;
 
     // KV 当前位置（已写入的 token 数）
     int n_past = 0;
-    
+    // KV 中逐位置的 token（serial 路径维护），编辑 / 重新生成时据此找与新 prompt 的最长公共前缀；
+    // size() != n_past 表示内容未知（如换入恢复、continuous 调度），不能按 token 复用
+    std::vector<int32_t> tokens;
+
+    // KV 写入时应用的 LoRA adapter（LoraSelection::Key，空为基座模型）：与本次请求不同则 KV 整段重写
+    std::string lora_key;
+
     // 是否已经完成首轮 prefill
     bool initialized = false;
 
-    ModelContext() = default;
+    // ===== 上下文平移（LLAMA_KV_OVERFLOW=shift）=====
+    // 每轮开始时的 KV 位置与当时 history 的消息数，平移按轮对齐
+    std::vector<std::pair<int, size_t>> turns;
+    // system prompt 占用的 token 数（含 BOS），平移时保留；-1 表示边界未知，不能平移
+    int n_keep = -1;
+    size_t n_keep_msgs = 0;
+
+    // ===== 共享 context 模式（LLAMA_KV_MODE=shared）=====
+    // ctx 为借用的共享 context，本 session 的 KV 位于其中 seq_id 序列上；独占模式 seq_id 恒为 0
+    int seq_id = 0;
+    // LlamaSlotPool 内部 slot 下标，-1 表示当前未持有 slot
+    int slot = -1;
+    // slot 曾被回收（KV 已丢失）：下次需要按 history 重新 prefill
+    bool need_replay = false;
+    // 非空表示这是 slot 句柄或借自 LlamaContextPool 的 context：析构时归还，而不是 llama_free
+    std::function<void(ModelContext &)> on_release;
+
+    // ===== 投机解码（LLAMA_DRAFT_MODEL_PATH）=====
+    // 本 session 独占的草稿 context（seq 0），KV 与目标 KV 逐 token 对齐
+    llama_context *draft_ctx = nullptr;
+    // 草稿 KV 位置；-1 表示已无法与目标 KV 对齐，直到目标 KV 从头重写
+    int draft_n_past = 0;
+    // 自适应的草拟长度
+    int draft_k = 0;
+    // n-gram lookup（LLAMA_LOOKUP_N_DRAFT）：本 session 写入 KV 的 token 及其 n-gram 索引
+    std::unique_ptr<LlamaNgramLookup> lookup;
+
+    // 本 session 占用的 KV 字节数：独占 context 为按 n_ctx 预分配的整块（含草稿 context），
+    // 共享 slot 为已写入的 token 数 × 每 token 字节数（请求结束归还 slot 时更新）；SessionManager 按它做字节预算
+    std::atomic<size_t> kv_bytes{0};
+
+    // 所属引擎已卸载：llama 资源已释放，session 下次请求时换新的 context 并按 history 重放
+    bool detached = false;
+
+    ModelContext(); // lookup 为不完整类型，构造/析构都放在 .cc
+    // 引擎卸载前调用：释放 context / 草稿 context / 采样链，共享 / 池化 context 只解除关联（随所属 pool 释放）
+    void Detach();
     ModelContext(const ModelContext &) = delete;
     ModelContext &operator=(const ModelContext &) = delete;
 
     ~ModelContext(); // 在 .cc 中 free llama_context / sampler
 };
+
+struct Session;
+// Session::kv_bytes 的实现：读取 session 当前 ModelContext 的 kv_bytes（调用方持有 s.mu）
+size_t session_kv_bytes(const Session &s);
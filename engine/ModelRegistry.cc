@@ -0,0 +1,632 @@
+#include "engine/ModelRegistry.h"
+#include "serving/core/ModelEngine.h"
+#include "utils/json.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <glog/logging.h>
+#include <thread>
+
+using json = nlohmann::json;
+
+namespace
+{
+const char *GetEnvOrDefault(const char *name, const char *fallback)
+{
+    const char *val = std::getenv(name);
+    return (val && *val) ? val : fallback;
+}
+
+double ms_since(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// MODELS：[{"name": "...", "type": "llama", "path": "...gguf", "preload": true, "llama_n_ctx": 8192, ...}]
+// name / type / path / preload 之外的键与 config.json 顶层同名，转成大写即环境变量名，只对该模型生效
+std::vector<ModelSpec> parse_models(const char *text)
+{
+    std::vector<ModelSpec> out;
+    json arr;
+    try
+    {
+        arr = json::parse(text);
+    }
+    catch (const std::exception &e)
+    {
+        LOG(ERROR) << "[registry] MODELS parse failed: " << e.what();
+        return out;
+    }
+    if (!arr.is_array())
+        return out;
+
+    for (const auto &item : arr)
+    {
+        if (!item.is_object() || !item.contains("name") || !item["name"].is_string())
+            continue;
+        ModelSpec spec;
+        for (auto it = item.begin(); it != item.end(); ++it)
+        {
+            if (it.key() == "preload")
+            {
+                spec.preload = it.value().is_boolean() ? it.value().get<bool>() : false;
+                continue;
+            }
+
+            std::string v;
+            if (it.value().is_string())
+                v = it.value().get<std::string>();
+            else if (it.value().is_number_integer())
+                v = std::to_string(it.value().get<int64_t>());
+            else
+                continue;
+
+            if (it.key() == "name")
+                spec.name = v;
+            else if (it.key() == "type")
+                spec.type = v;
+            else if (it.key() == "path")
+                spec.path = v;
+            else
+            {
+                std::string env = it.key();
+                std::transform(env.begin(), env.end(), env.begin(),
+                               [](unsigned char c) { return static_cast<char>(std::toupper(c)); });
+                spec.options[env] = v;
+            }
+        }
+        if (!spec.name.empty())
+            out.push_back(std::move(spec));
+    }
+    return out;
+}
+
+// LORA_ADAPTERS：[{"name": "customer-a", "model": "qwen-1.5b", "path": "...gguf", "scale": 1.0}]，model 缺省为 DEFAULT_MODEL
+std::vector<ModelRegistry::AdapterSpec> parse_adapters(const char *text)
+{
+    std::vector<ModelRegistry::AdapterSpec> out;
+    json arr;
+    try
+    {
+        arr = json::parse(text);
+    }
+    catch (const std::exception &e)
+    {
+        LOG(ERROR) << "[registry] LORA_ADAPTERS parse failed: " << e.what();
+        return out;
+    }
+    if (!arr.is_array())
+        return out;
+
+    for (const auto &item : arr)
+    {
+        if (!item.is_object() || !item.contains("name") || !item["name"].is_string() ||
+            !item.contains("path") || !item["path"].is_string())
+        {
+            LOG(ERROR) << "[registry] LORA_ADAPTERS entry needs name and path: " << item.dump();
+            continue;
+        }
+        ModelRegistry::AdapterSpec spec;
+        spec.name = item["name"].get<std::string>();
+        spec.path = item["path"].get<std::string>();
+        spec.model = item.contains("model") && item["model"].is_string() ? item["model"].get<std::string>()
+                                                                          : GetEnvOrDefault("DEFAULT_MODEL", "llama");
+        if (item.contains("scale") && item["scale"].is_number())
+            spec.scale = item["scale"].get<float>();
+        out.push_back(std::move(spec));
+    }
+    return out;
+}
+
+// 加载前的内存估算：GGUF 文件大小
+size_t estimate_bytes(const ModelSpec &spec)
+{
+    std::error_code ec;
+    const auto n = spec.path.empty() ? 0 : std::filesystem::file_size(spec.path, ec);
+    return ec ? 0 : static_cast<size_t>(n);
+}
+} // namespace
+
+ModelRegistry &ModelRegistry::Instance()
+{
+    static ModelRegistry registry;
+    return registry;
+}
+
+ModelRegistry::ModelRegistry()
+{
+    budget_ = static_cast<size_t>(std::max(0L, std::atol(GetEnvOrDefault("MODEL_RAM_BUDGET_MB", "0")))) << 20;
+    retry_after_ = std::chrono::seconds(std::max(0L, std::atol(GetEnvOrDefault("MODEL_LOAD_RETRY_SEC", "30"))));
+
+    std::vector<ModelSpec> specs;
+    if (const char *models = std::getenv("MODELS"); models && *models)
+        specs = parse_models(models);
+
+    if (specs.empty())
+    {
+        ModelSpec llama;
+        llama.name = "llama";
+        llama.path = GetEnvOrDefault(
+            "LLAMA_MODEL_PATH",
+            "/home/dongsong/workspace/llm_MultimodalServer/llm_MultimodalServer/models/qwen2.5-1.5b/qwen2.5-1.5b-instruct-q4_0.gguf");
+        specs.push_back(llama);
+
+        // embedding 模式引擎：模型名由 EMBEDDING_MODEL 指定，未配置 LLAMA_EMBEDDING_MODEL_PATH 时不可用
+        const char *embd_path = GetEnvOrDefault("LLAMA_EMBEDDING_MODEL_PATH", "");
+        if (*embd_path)
+        {
+            ModelSpec embd;
+            embd.name = GetEnvOrDefault("EMBEDDING_MODEL", "embedding");
+            embd.type = "embedding";
+            embd.path = embd_path;
+            specs.push_back(embd);
+        }
+    }
+
+    for (auto &spec : specs)
+    {
+        LOG(INFO) << "[registry] model=" << spec.name << " type=" << spec.type << " path=" << spec.path
+                  << " preload=" << spec.preload << " overrides=" << spec.options.size();
+        entries_[spec.name].spec = std::move(spec);
+    }
+    if (!entries_.count("dummy"))
+    {
+        entries_["dummy"].spec.name = "dummy";
+        entries_["dummy"].spec.type = "dummy";
+    }
+    LOG(INFO) << "[registry] models=" << entries_.size() << " ram_budget_mb=" << (budget_ >> 20);
+
+    if (const char *adapters = std::getenv("LORA_ADAPTERS"); adapters && *adapters)
+    {
+        for (const auto &spec : parse_adapters(adapters))
+        {
+            std::string err;
+            if (!RegisterAdapter(spec, err))
+                LOG(ERROR) << "[registry] lora adapter " << spec.name << " skipped: " << err;
+        }
+    }
+}
+
+bool ModelRegistry::Contains(const std::string &model) const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return entries_.count(model) > 0;
+}
+
+bool ModelRegistry::RegisterAdapter(const AdapterSpec &spec, std::string &err)
+{
+    if (spec.name.empty() || spec.name.find(':') != std::string::npos)
+    {
+        err = "adapter name must be non-empty and must not contain ':'";
+        return false;
+    }
+    if (!std::isfinite(spec.scale))
+    {
+        err = "adapter scale must be a finite number";
+        return false;
+    }
+    std::error_code ec;
+    if (spec.path.empty() || !std::filesystem::is_regular_file(spec.path, ec))
+    {
+        err = "adapter file not found: " + spec.path;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lk(mu_);
+    if (entries_.count(spec.name))
+    {
+        err = "adapter name conflicts with a model: " + spec.name;
+        return false;
+    }
+    auto it = entries_.find(spec.model);
+    if (it == entries_.end())
+    {
+        err = "base model not found: " + spec.model;
+        return false;
+    }
+    if (it->second.spec.type != "llama")
+    {
+        err = "base model does not support lora adapters: " + spec.model;
+        return false;
+    }
+
+    const bool replaced = adapters_.count(spec.name) > 0;
+    adapters_[spec.name] = spec;
+    LOG(INFO) << "[registry] lora adapter " << (replaced ? "replaced" : "registered") << " name=" << spec.name
+              << " model=" << spec.model << " path=" << spec.path << " scale=" << spec.scale;
+    return true;
+}
+
+bool ModelRegistry::FindAdapter(const std::string &name, AdapterSpec &out) const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = adapters_.find(name);
+    if (it == adapters_.end())
+        return false;
+    out = it->second;
+    return true;
+}
+
+std::vector<ModelRegistry::AdapterSpec> ModelRegistry::ListAdapters() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    std::vector<AdapterSpec> out;
+    out.reserve(adapters_.size());
+    for (const auto &kv : adapters_)
+        out.push_back(kv.second);
+    return out;
+}
+
+void ModelRegistry::Resolve(const std::string &requested, std::string &model, std::string &adapter) const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    model = requested;
+    adapter.clear();
+    if (entries_.count(requested))
+        return;
+
+    auto it = adapters_.find(requested);
+    if (it != adapters_.end())
+    {
+        model = it->second.model;
+        adapter = requested;
+        return;
+    }
+
+    const size_t colon = requested.rfind(':');
+    if (colon != std::string::npos && entries_.count(requested.substr(0, colon)))
+    {
+        model = requested.substr(0, colon);
+        adapter = requested.substr(colon + 1);
+    }
+}
+
+void ModelRegistry::StartPreload()
+{
+    const std::string default_model = GetEnvOrDefault("DEFAULT_MODEL", "llama");
+    std::vector<std::string> names;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        preload_start_ = Clock::now();
+        for (auto &kv : entries_)
+        {
+            if (!kv.second.spec.preload && kv.first != default_model)
+                continue;
+            kv.second.preloading = true;
+            names.push_back(kv.first);
+        }
+        preload_pending_ = static_cast<int>(names.size());
+        if (names.empty())
+            ready_ms_ = 0;
+    }
+
+    // 每个模型一个线程：权重读盘 / 反量化 / warm-up 彼此独立，并行后总耗时约等于最慢的一个
+    std::lock_guard<std::mutex> lk(mu_);
+    for (const auto &name : names)
+    {
+        LOG(INFO) << "[registry] preload start model=" << name;
+        entries_[name].load_queued = true;
+        LoadInBackgroundLocked(name);
+    }
+}
+
+void ModelRegistry::LoadInBackgroundLocked(const std::string &name)
+{
+    std::thread([this, name]
+                {
+                    const auto t0 = Clock::now();
+                    const bool ok = Acquire(name) != nullptr; // 租约随即释放，模型保持常驻
+                    const double ms = ms_since(t0);
+
+                    std::lock_guard<std::mutex> lk(mu_);
+                    Entry &e = entries_[name];
+                    e.load_queued = false;
+                    if (!e.preloading)
+                    {
+                        LOG(INFO) << "[registry] background load " << (ok ? "done" : "failed") << " model=" << name
+                                  << " ms=" << ms;
+                        return;
+                    }
+                    e.preloading = false;
+                    if (--preload_pending_ == 0)
+                        ready_ms_ = ms_since(preload_start_);
+                    LOG(INFO) << "[registry] preload " << (ok ? "done" : "failed") << " model=" << name
+                              << " ms=" << ms << " pending=" << preload_pending_; })
+        .detach();
+}
+
+bool ModelRegistry::FailedLocked(const Entry &e, std::string *load_error) const
+{
+    if (e.stats.load_error.empty() || e.load_queued || e.loading || Clock::now() >= e.retry_at)
+        return false;
+    if (load_error)
+        *load_error = e.stats.load_error;
+    return true;
+}
+
+void ModelRegistry::QueueLoadLocked(Entry &e)
+{
+    // 失败后退避：每个请求都重新读一遍 GGUF 没有意义，也会堆积后台线程
+    if (e.load_queued || e.loading || FailedLocked(e, nullptr))
+        return;
+    e.load_queued = true;
+    LOG(INFO) << "[registry] background load start model=" << e.spec.name
+              << (e.unloading ? " (after unload)" : "");
+    LoadInBackgroundLocked(e.spec.name);
+}
+
+bool ModelRegistry::Ready(const std::string &model) const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    if (model.empty())
+        return preload_pending_ == 0;
+    auto it = entries_.find(model);
+    if (it == entries_.end())
+        return true;
+    const Entry &e = it->second;
+    return !e.preloading && !e.load_queued && !e.loading && !e.unloading;
+}
+
+std::shared_ptr<ModelEngine> ModelRegistry::TryAcquire(const std::string &model, std::string *load_error)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = entries_.find(model);
+    if (it == entries_.end())
+        return nullptr;
+    Entry &e = it->second;
+    if (e.engine && !e.unloading)
+        return MakeLeaseLocked(e);
+    QueueLoadLocked(e);
+    FailedLocked(e, load_error);
+    return nullptr;
+}
+
+bool ModelRegistry::EnsureLoaded(const std::string &model, std::string *load_error)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = entries_.find(model);
+    if (it == entries_.end())
+        return false;
+    Entry &e = it->second;
+    if (e.engine && !e.unloading)
+        return true;
+    QueueLoadLocked(e);
+    FailedLocked(e, load_error);
+    return false;
+}
+
+double ModelRegistry::ready_ms() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return ready_ms_;
+}
+
+std::shared_ptr<ModelEngine> ModelRegistry::Acquire(const std::string &model)
+{
+    std::unique_lock<std::mutex> lk(mu_);
+    auto it = entries_.find(model);
+    if (it == entries_.end())
+        return nullptr;
+    Entry &e = it->second;
+
+    // 同一模型正在加载 / 卸载：等它完成
+    cv_.wait(lk, [&e] { return !e.loading && !e.unloading; });
+    if (e.engine)
+        return MakeLeaseLocked(e);
+    // 刚失败过（仍在退避期内，且不是已排队的后台重试本身）：不再重复加载
+    if (FailedLocked(e, nullptr))
+        return nullptr;
+
+    e.loading = true;
+
+    // 先按文件大小腾出预算，避免加载期间峰值超出；估算值在加载期间计入常驻，并行加载的模型互相可见
+    e.stats.resident_bytes = estimate_bytes(e.spec);
+    std::vector<Entry *> victims;
+    PickVictimsLocked(&e, victims);
+    lk.unlock();
+    Unload(victims);
+
+    const auto t0 = Clock::now();
+    auto engine = EngineFactory::Create(e.spec);
+    const double load_ms = ms_since(t0);
+    const size_t resident = engine ? engine->ResidentBytes() : 0;
+
+    lk.lock();
+    e.loading = false;
+    cv_.notify_all();
+    if (!engine)
+    {
+        std::error_code ec;
+        e.stats.resident_bytes = 0;
+        e.stats.load_failures += 1;
+        e.stats.load_error = (!e.spec.path.empty() && !std::filesystem::exists(e.spec.path, ec))
+                                 ? "model file not found: " + e.spec.path
+                                 : "failed to load model " + model + " (" + e.spec.path + "), see server log";
+        e.retry_at = Clock::now() + retry_after_;
+        LOG(ERROR) << "[registry] load failed model=" << model << " path=" << e.spec.path
+                   << " retry_after_sec=" << retry_after_.count();
+        return nullptr;
+    }
+
+    e.engine = std::move(engine);
+    e.stats.load_error.clear();
+    e.stats.loaded = true;
+    e.stats.resident_bytes = resident;
+    e.stats.loads += 1;
+    e.stats.last_load_ms = load_ms;
+    e.stats.load_ms_total += load_ms;
+    auto lease = MakeLeaseLocked(e);
+
+    // 按实际常驻字节数再检查一次
+    victims.clear();
+    PickVictimsLocked(&e, victims);
+    const size_t total = ResidentLocked();
+    lk.unlock();
+
+    LOG(INFO) << "[registry] loaded model=" << model
+              << " load_ms=" << load_ms
+              << " resident_mb=" << (resident >> 20)
+              << " total_mb=" << (total >> 20);
+    Unload(victims);
+    return lease;
+}
+
+std::shared_ptr<ModelEngine> ModelRegistry::MakeLeaseLocked(Entry &e, bool observe)
+{
+    // 租约：持有引擎引用，析构时先放掉引用再减 in_flight，保证卸载时注册表持有最后一个引用
+    struct Lease
+    {
+        ModelRegistry *registry;
+        Entry *entry;
+        bool observe;
+        std::shared_ptr<ModelEngine> engine;
+        ~Lease()
+        {
+            engine.reset();
+            registry->Release(*entry, observe);
+        }
+    };
+
+    e.in_flight += 1;
+    if (!observe)
+        e.last_used = Clock::now();
+    std::shared_ptr<Lease> lease(new Lease{this, &e, observe, e.engine});
+    return std::shared_ptr<ModelEngine>(lease, lease->engine.get());
+}
+
+void ModelRegistry::Release(Entry &e, bool observe)
+{
+    std::vector<Entry *> victims;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        e.in_flight -= 1;
+        // 指标采集只是观察：不算使用，也不在采集线程上卸载模型
+        if (observe)
+            return;
+        e.last_used = Clock::now();
+        // 常驻随 session context 增长：归还时也检查预算（只卸载其它模型，避免单个超预算的模型反复重载）
+        if (budget_ > 0 && e.in_flight == 0)
+            PickVictimsLocked(&e, victims);
+    }
+    Unload(victims);
+}
+
+size_t ModelRegistry::ResidentLocked() const
+{
+    size_t total = 0;
+    for (const auto &kv : entries_)
+        total += kv.second.stats.resident_bytes;
+    return total;
+}
+
+void ModelRegistry::PickVictimsLocked(const Entry *keep, std::vector<Entry *> &victims)
+{
+    if (budget_ == 0)
+        return;
+
+    for (auto &kv : entries_)
+    {
+        Entry &e = kv.second;
+        if (e.engine && !e.unloading)
+            e.stats.resident_bytes = e.engine->ResidentBytes();
+    }
+
+    size_t total = ResidentLocked();
+    while (total > budget_)
+    {
+        Entry *lru = nullptr;
+        for (auto &kv : entries_)
+        {
+            Entry &e = kv.second;
+            if (&e == keep || !e.engine || e.unloading || e.loading || e.in_flight > 0)
+                continue;
+            if (!lru || e.last_used < lru->last_used)
+                lru = &e;
+        }
+        if (!lru)
+        {
+            LOG(WARNING) << "[registry] over ram budget: resident_mb=" << (total >> 20)
+                         << " budget_mb=" << (budget_ >> 20) << ", no idle model to unload";
+            return;
+        }
+        lru->unloading = true;
+        total -= lru->stats.resident_bytes;
+        victims.push_back(lru);
+    }
+}
+
+void ModelRegistry::Unload(std::vector<Entry *> &victims)
+{
+    for (Entry *e : victims)
+    {
+        std::shared_ptr<ModelEngine> engine;
+        size_t freed = 0;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            engine = std::move(e->engine);
+            freed = e->stats.resident_bytes;
+        }
+
+        const auto t0 = Clock::now();
+        engine.reset();
+        const double unload_ms = ms_since(t0);
+
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            e->unloading = false;
+            e->stats.loaded = false;
+            e->stats.resident_bytes = 0;
+            e->stats.unloads += 1;
+            e->stats.last_unload_ms = unload_ms;
+            e->stats.unload_ms_total += unload_ms;
+        }
+        cv_.notify_all();
+        LOG(INFO) << "[registry] unloaded model=" << e->spec.name
+                  << " unload_ms=" << unload_ms
+                  << " freed_mb=" << (freed >> 20);
+    }
+    victims.clear();
+}
+
+std::map<std::string, std::shared_ptr<ModelEngine>> ModelRegistry::Loaded()
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    std::map<std::string, std::shared_ptr<ModelEngine>> out;
+    for (auto &kv : entries_)
+    {
+        if (kv.second.engine && !kv.second.unloading)
+            out[kv.first] = MakeLeaseLocked(kv.second, true);
+    }
+    return out;
+}
+
+std::map<std::string, ModelRegistry::Stats> ModelRegistry::GetStats() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    std::map<std::string, Stats> out;
+    for (const auto &kv : entries_)
+    {
+        const Entry &e = kv.second;
+        Stats st = e.stats;
+        st.in_flight = e.in_flight;
+        if (e.engine && !e.unloading)
+            st.state = "ready";
+        else if (e.preloading || e.load_queued || e.loading || e.unloading)
+            st.state = "loading";
+        else if (FailedLocked(e, nullptr))
+            st.state = "failed";
+        else
+            st.state = "unloaded";
+        out[kv.first] = st;
+    }
+    return out;
+}
+
+size_t ModelRegistry::resident_bytes() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return ResidentLocked();
+}
@@ -0,0 +1,146 @@
+#pragma once
+#include "engine/EngineFactory.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class ModelEngine;
+
+/**
+ * @brief 模型注册表：多模型按需加载、按内存预算 LRU 卸载
+ *
+ * - 模型列表来自 MODELS（config.json 的 models 数组），每个条目有自己的 GGUF 路径与配置覆盖；
+ *   未配置时退回内置的 llama（LLAMA_MODEL_PATH）/ embedding（LLAMA_EMBEDDING_MODEL_PATH）/ dummy
+ * - 首次 Acquire 时加载；同一模型并发 Acquire 只加载一次，其余等待
+ * - 在线请求走 TryAcquire：模型未加载时交给后台线程加载（与预加载同一路径）并立即返回空，
+ *   调用方回 503（model_loading），不在共享的工作线程上同步加载或等待
+ * - 加载失败记在条目上（原因 + 时间）：MODEL_LOAD_RETRY_SEC 内不再重试，请求直接得到 load_failed 与原因，
+ *   /health、/v1/models 报 failed；过了退避时间的下一个请求再发起一次后台加载
+ * - Acquire 返回的引用即“租约”：存活期间该模型计入 in_flight，不会被卸载
+ * - MODEL_RAM_BUDGET_MB > 0 时，加载前按 GGUF 文件大小、加载后按实际常驻字节数，
+ *   卸载最久未用且空闲的模型直到不超预算；都在使用中时照常加载并告警
+ * - 卸载时引擎释放 session 持有的 context，这些 session 下次请求按 history 重放
+ * - StartPreload：DEFAULT_MODEL 与 preload=true 的模型在后台线程并行加载，不阻塞 HTTP 监听；
+ *   预加载完成前 Ready() 为 false（/health 报 loading，推理接口返回 503）；
+ *   运行中按需加载、或为预算卸载中的模型同样不算就绪
+ * - LoRA adapter 只登记名字 -> 基座模型 + GGUF 路径（LORA_ADAPTERS 或运行时 RegisterAdapter），
+ *   不单独加载模型：由基座模型的引擎按需加载、缓存与应用（LlamaLoraCache）
+ */
+class ModelRegistry
+{
+public:
+    struct Stats
+    {
+        bool loaded = false;
+        int in_flight = 0;
+        size_t resident_bytes = 0;
+        int64_t loads = 0;
+        int64_t unloads = 0;
+        int64_t load_failures = 0;
+        double last_load_ms = 0;
+        double last_unload_ms = 0;
+        double load_ms_total = 0;
+        double unload_ms_total = 0;
+        // ready / loading / unloaded / failed（failed：上次加载失败且仍在重试退避期内）
+        std::string state;
+        std::string load_error; // 最近一次加载失败的原因（成功加载后清空）
+    };
+
+    // LoRA adapter 条目（config.json 的 lora_adapters / POST /v1/lora_adapters）
+    struct AdapterSpec
+    {
+        std::string name;
+        std::string model; // 基座模型（llama 类型）
+        std::string path;  // adapter GGUF
+        float scale = 1.0f;
+    };
+
+    static ModelRegistry &Instance();
+
+    // 取模型引擎（未加载则在调用线程上加载）；未知模型或加载失败返回空。只用于可以阻塞的场景（预加载、离线批处理）
+    std::shared_ptr<ModelEngine> Acquire(const std::string &model);
+    // 不阻塞：已加载则返回租约；否则在后台开始加载（已在加载、或失败后仍在退避期内则不发起）并返回空。
+    // load_error 非空表示处于加载失败状态（值为失败原因），否则为加载中
+    std::shared_ptr<ModelEngine> TryAcquire(const std::string &model, std::string *load_error = nullptr);
+    // 模型已加载且可用；否则同 TryAcquire 在后台开始加载并返回 false（HTTP 入口据此回 503 / 加载失败）
+    bool EnsureLoaded(const std::string &model, std::string *load_error = nullptr);
+
+    bool Contains(const std::string &model) const;
+
+    // 注册 adapter，同名则替换（在途请求仍用旧的）；基座模型须为 llama 类型、name 不能与模型重名、path 须存在
+    bool RegisterAdapter(const AdapterSpec &spec, std::string &err);
+    bool FindAdapter(const std::string &name, AdapterSpec &out) const;
+    std::vector<AdapterSpec> ListAdapters() const;
+
+    // 请求的 model 字段 -> 基座模型名 + adapter 名（空表示不用 adapter）：
+    // 模型名本身 / adapter 名（用它的基座模型）/ "<模型>:<adapter>"；都不是时 model 原样返回（由 Contains 报 404）
+    void Resolve(const std::string &requested, std::string &model, std::string &adapter) const;
+
+    // 后台并行加载需要预加载的模型（只在启动时调用一次）
+    void StartPreload();
+    // 所有预加载都已结束（成功或失败）；model 非空时看该模型是否没有在（预）加载或卸载
+    bool Ready(const std::string &model = "") const;
+    // 从 StartPreload 到全部预加载结束的耗时，未结束时为 -1
+    double ready_ms() const;
+
+    // 已加载模型的引擎（均为只读租约，/metrics 用）：不刷新 LRU，归还时不触发预算卸载
+    std::map<std::string, std::shared_ptr<ModelEngine>> Loaded();
+
+    std::map<std::string, Stats> GetStats() const;
+    size_t budget_bytes() const { return budget_; }
+    size_t resident_bytes() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry
+    {
+        ModelSpec spec;
+        std::shared_ptr<ModelEngine> engine;
+        bool loading = false;
+        bool unloading = false;
+        bool preloading = false;
+        bool load_queued = false; // 后台加载线程已创建、尚未结束
+        Clock::time_point retry_at{}; // 加载失败后，此前不再重试（stats.load_error 非空时有效）
+        int in_flight = 0;
+        Clock::time_point last_used{};
+        Stats stats;
+    };
+
+    ModelRegistry();
+
+    // 在后台线程上 Acquire 一次（租约随即释放，模型保持常驻）；调用方持有 mu_ 并已置 load_queued
+    void LoadInBackgroundLocked(const std::string &name);
+    // 未加载且没有后台加载时发起一次；加载失败后的退避期内不发起（调用方持有 mu_）
+    void QueueLoadLocked(Entry &e);
+    // 处于加载失败退避期：返回 true 并写出原因（调用方持有 mu_）
+    bool FailedLocked(const Entry &e, std::string *load_error) const;
+
+    // observe：只读观察（指标采集），不算作使用
+    std::shared_ptr<ModelEngine> MakeLeaseLocked(Entry &e, bool observe = false);
+    void Release(Entry &e, bool observe);
+
+    size_t ResidentLocked() const;
+    // 选出需要卸载的空闲模型（最久未用优先），使常驻（含加载中模型的估算）不超预算；keep 不参与
+    void PickVictimsLocked(const Entry *keep, std::vector<Entry *> &victims);
+    // 锁外调用：析构 victims 的引擎并记录耗时
+    void Unload(std::vector<Entry *> &victims);
+
+private:
+    size_t budget_ = 0;
+    std::chrono::seconds retry_after_{30}; // MODEL_LOAD_RETRY_SEC
+    int preload_pending_ = 0;
+    Clock::time_point preload_start_{};
+    double ready_ms_ = -1;
+
+    mutable std::mutex mu_;
+    std::condition_variable cv_;
+    std::map<std::string, Entry> entries_; // 只在构造时插入，Entry 地址稳定
+    std::map<std::string, AdapterSpec> adapters_;
+};
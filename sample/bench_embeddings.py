@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+"""
+/v1/embeddings 吞吐对比：逐个请求（每次 1 个输入、串行） vs 并发请求（引擎内跨请求合批）。
+
+python3 sample/bench_embeddings.py --url http://127.0.0.1:8080 --inputs 256 --concurrency 16
+"""
+import argparse
+import json
+import random
+import time
+import urllib.request
+from concurrent.futures import ThreadPoolExecutor
+
+WORDS = "the quick brown fox jumps over lazy dog server batch token embedding vector model cache".split()
+
+
+def make_inputs(n, min_words, max_words, seed):
+    rnd = random.Random(seed)
+    return [" ".join(rnd.choice(WORDS) for _ in range(rnd.randint(min_words, max_words))) for _ in range(n)]
+
+
+def post(url, model, inputs, encoding):
+    body = json.dumps({"model": model, "input": inputs, "encoding_format": encoding}).encode("utf-8")
+    req = urllib.request.Request(url, data=body, headers={"Content-Type": "application/json"})
+    with urllib.request.urlopen(req, timeout=120) as resp:
+        out = json.loads(resp.read())
+    if len(out.get("data", [])) != len(inputs):
+        raise RuntimeError(f"unexpected response: {str(out)[:200]}")
+    return out["usage"]["prompt_tokens"]
+
+
+def run(name, url, model, batches, concurrency, encoding):
+    t0 = time.time()
+    n_inputs = sum(len(b) for b in batches)
+    with ThreadPoolExecutor(max_workers=concurrency) as ex:
+        tokens = sum(ex.map(lambda b: post(url, model, b, encoding), batches))
+    dt = time.time() - t0
+    print(f"{name:<28} inputs={n_inputs:<6} tokens={tokens:<8} time={dt:7.2f}s "
+          f"inputs/s={n_inputs / dt:8.1f} tokens/s={tokens / dt:9.1f}")
+    return n_inputs / dt
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--url", default="http://127.0.0.1:8080")
+    ap.add_argument("--model", default="embedding")
+    ap.add_argument("--inputs", type=int, default=256)
+    ap.add_argument("--concurrency", type=int, default=16)
+    ap.add_argument("--per-request", type=int, default=1, help="并发模式下每个请求携带的输入数")
+    ap.add_argument("--min-words", type=int, default=8)
+    ap.add_argument("--max-words", type=int, default=64)
+    ap.add_argument("--encoding", default="float", choices=["float", "base64"])
+    ap.add_argument("--seed", type=int, default=1)
+    args = ap.parse_args()
+
+    url = args.url.rstrip("/") + "/v1/embeddings"
+    inputs = make_inputs(args.inputs, args.min_words, args.max_words, args.seed)
+
+    # 预热：加载模型
+    post(url, args.model, inputs[:1], args.encoding)
+
+    serial = run("serial (1 req at a time)", url, args.model, [[x] for x in inputs], 1, args.encoding)
+    k = max(1, args.per_request)
+    batches = [inputs[i:i + k] for i in range(0, len(inputs), k)]
+    batched = run(f"concurrent x{args.concurrency}", url, args.model, batches, args.concurrency, args.encoding)
+    print(f"speedup: {batched / serial:.2f}x")
+
+    try:
+        with urllib.request.urlopen(args.url.rstrip("/") + "/metrics", timeout=10) as resp:
+            m = json.loads(resp.read()).get("engines", {}).get(args.model, {})
+        if m:
+            print(f"embedding_inputs_per_batch={m.get('embedding_inputs_per_batch', 0):.2f} "
+                  f"batches={int(m.get('embedding_batches_total', 0))}")
+    except Exception:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""
+KV cache 类型对比：同一个 GGUF 在 models 里注册多次，只有 llama_cache_type_k / llama_cache_type_v 不同，
+在自己的 prompt 上用 greedy 解码比较吞吐与输出（以第一个模型为基准）。
+
+config.json 示例：
+  "models": [
+    {"name": "qwen-f16",  "path": "/models/qwen.gguf"},
+    {"name": "qwen-q8",   "path": "/models/qwen.gguf", "llama_cache_type_k": "q8_0", "llama_cache_type_v": "q8_0"},
+    {"name": "qwen-q4",   "path": "/models/qwen.gguf", "llama_cache_type_k": "q4_0", "llama_cache_type_v": "q4_0"}
+  ]
+
+python3 sample/bench_kv_types.py --url http://127.0.0.1:8080 --models qwen-f16,qwen-q8,qwen-q4 --prompts prompts.txt
+prompts 文件每行一个 prompt（或 JSONL，每行 {"prompt": "..."}）
+"""
+import argparse
+import difflib
+import json
+import time
+import urllib.request
+from concurrent.futures import ThreadPoolExecutor
+
+
+def load_prompts(path, limit):
+    prompts = []
+    with open(path, encoding="utf-8") as f:
+        for line in f:
+            line = line.strip()
+            if not line:
+                continue
+            if line.startswith("{"):
+                line = json.loads(line).get("prompt", "")
+            prompts.append(line)
+            if limit and len(prompts) >= limit:
+                break
+    return prompts
+
+
+def chat(url, model, prompt, max_tokens):
+    body = json.dumps({
+        "model": model,
+        "messages": [{"role": "user", "content": prompt}],
+        "max_tokens": max_tokens,
+        "temperature": 0,
+    }).encode("utf-8")
+    req = urllib.request.Request(url, data=body, headers={"Content-Type": "application/json"})
+    with urllib.request.urlopen(req, timeout=600) as resp:
+        out = json.loads(resp.read())
+    return out["choices"][0]["message"]["content"], out["usage"]["completion_tokens"]
+
+
+def run(url, model, prompts, max_tokens, concurrency):
+    t0 = time.time()
+    with ThreadPoolExecutor(max_workers=concurrency) as ex:
+        results = list(ex.map(lambda p: chat(url, model, p, max_tokens), prompts))
+    dt = time.time() - t0
+    return [r[0] for r in results], sum(r[1] for r in results), dt
+
+
+def kv_bytes_per_token(base_url, model):
+    try:
+        with urllib.request.urlopen(base_url + "/metrics", timeout=10) as resp:
+            m = json.loads(resp.read())
+        return int(m.get("engines", {}).get(model, {}).get("kv_bytes_per_token", 0))
+    except Exception:
+        return 0
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--url", default="http://127.0.0.1:8080")
+    ap.add_argument("--models", required=True, help="逗号分隔，第一个为基准")
+    ap.add_argument("--prompts", required=True)
+    ap.add_argument("--limit", type=int, default=0)
+    ap.add_argument("--max-tokens", type=int, default=256)
+    ap.add_argument("--concurrency", type=int, default=1)
+    args = ap.parse_args()
+
+    base_url = args.url.rstrip("/")
+    url = base_url + "/v1/chat/completions"
+    models = [m for m in args.models.split(",") if m]
+    prompts = load_prompts(args.prompts, args.limit)
+    print(f"prompts={len(prompts)} max_tokens={args.max_tokens} concurrency={args.concurrency}")
+
+    baseline = None
+    for model in models:
+        chat(url, model, prompts[0], 8)  # 预热：加载模型
+        outputs, tokens, dt = run(url, model, prompts, args.max_tokens, args.concurrency)
+        bytes_per_token = kv_bytes_per_token(base_url, model)
+
+        line = (f"{model:<16} kv_bytes/token={bytes_per_token:<8} tokens={tokens:<7} "
+                f"time={dt:7.2f}s tokens/s={tokens / dt:8.1f}")
+        if baseline is None:
+            baseline = outputs
+        else:
+            # 与基准的一致性：完全相同的比例 + 平均字符相似度
+            same = sum(a == b for a, b in zip(baseline, outputs))
+            sim = sum(difflib.SequenceMatcher(None, a, b).ratio() for a, b in zip(baseline, outputs)) / len(outputs)
+            line += f" exact_match={same / len(outputs):6.1%} similarity={sim:6.3f}"
+        print(line)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,140 @@
+#include "serving/batch/BatchCheckpoint.h"
+#include "utils/json.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+using json = nlohmann::json;
+
+BatchCheckpoint::BatchCheckpoint(std::string input, std::string output, std::string path)
+    : input_(std::move(input)), output_(std::move(output)), path_(std::move(path))
+{
+}
+
+BatchCheckpoint::~BatchCheckpoint()
+{
+    if (out_)
+        fclose(out_);
+}
+
+bool BatchCheckpoint::Open(std::istream &in, std::string &err)
+{
+    std::ifstream ck_in(path_);
+    if (ck_in.is_open())
+    {
+        const json ck = json::parse(ck_in, nullptr, false);
+        if (ck.is_discarded() || !ck.is_object())
+        {
+            err = "invalid checkpoint: " + path_;
+            return false;
+        }
+        if (ck.value("input", "") != input_)
+        {
+            err = "checkpoint " + path_ + " belongs to input=" + ck.value("input", "") + ", remove it to start over";
+            return false;
+        }
+
+        next_line_ = ck.value("next_line", (int64_t)0);
+        input_offset_ = ck.value("input_offset", (uint64_t)0);
+        out_bytes_ = ck.value("output_bytes", (uint64_t)0);
+        if (ck.contains("done") && ck["done"].is_array())
+        {
+            for (const auto &d : ck["done"])
+                skip_.insert(d.get<int64_t>());
+        }
+        resumed_ = true;
+    }
+
+    if (resumed_)
+    {
+        // 最后一次 checkpoint 之后写入的结果截掉，对应的行重新执行
+        struct stat st{};
+        if (stat(output_.c_str(), &st) != 0 || static_cast<uint64_t>(st.st_size) < out_bytes_ ||
+            truncate(output_.c_str(), static_cast<off_t>(out_bytes_)) != 0)
+        {
+            err = "output " + output_ + " does not match checkpoint (output_bytes=" + std::to_string(out_bytes_) +
+                  "), remove the checkpoint to start over";
+            return false;
+        }
+        out_ = fopen(output_.c_str(), "ab");
+        in.seekg(static_cast<std::streamoff>(input_offset_));
+    }
+    else
+    {
+        out_ = fopen(output_.c_str(), "wb");
+    }
+    if (!out_)
+    {
+        err = "cannot open output: " + output_;
+        return false;
+    }
+
+    read_offset_ = input_offset_;
+    lines_read_ = next_line_;
+    return true;
+}
+
+int64_t BatchCheckpoint::Read(size_t bytes, bool &skip)
+{
+    const int64_t line = lines_read_++;
+    offsets_[line] = read_offset_;
+    read_offset_ += bytes + 1;
+    skip = skip_.erase(line) > 0;
+    return line;
+}
+
+bool BatchCheckpoint::Complete(int64_t line, const std::string *record)
+{
+    if (record)
+    {
+        // 输出先落盘，再记 checkpoint
+        fwrite(record->data(), 1, record->size(), out_);
+        fputc('\n', out_);
+        fflush(out_);
+        out_bytes_ += record->size() + 1;
+    }
+
+    done_.insert(line);
+    while (!done_.empty() && *done_.begin() == next_line_)
+    {
+        done_.erase(done_.begin());
+        offsets_.erase(next_line_);
+        ++next_line_;
+    }
+    auto it = offsets_.find(next_line_);
+    input_offset_ = it != offsets_.end() ? it->second : read_offset_;
+
+    // 空行 / 已完成的行不单独记：重启后会再次被跳过
+    return !record || Save();
+}
+
+bool BatchCheckpoint::Save() const
+{
+    json done = json::array();
+    std::vector<int64_t> lines(done_.begin(), done_.end());
+    lines.insert(lines.end(), skip_.begin(), skip_.end());
+    std::sort(lines.begin(), lines.end());
+    for (int64_t l : lines)
+        done.push_back(l);
+
+    const json ck = {{"input", input_},
+                     {"next_line", next_line_},
+                     {"input_offset", input_offset_},
+                     {"output_bytes", out_bytes_},
+                     {"done", done}};
+
+    // 先写临时文件再 rename：进程在任意时刻被杀，checkpoint 要么是旧的要么是新的
+    const std::string tmp = path_ + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << ck.dump();
+        if (!out.good())
+            return false;
+    }
+    return std::rename(tmp.c_str(), path_.c_str()) == 0;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <istream>
+#include <map>
+#include <set>
+#include <string>
+
+/**
+ * @brief 离线批处理的 checkpoint / 续跑记账（不含线程同步，调用方加锁）
+ *
+ * - 输入按行读取，行号从 0 开始；结果按完成顺序追加到输出
+ * - 完成前缀：line < next_line 的行都已写入输出，input_offset 为第 next_line 行的字节偏移
+ * - 每写一条结果原子更新一次 checkpoint（写临时文件再 rename）：记录完成前缀、前缀之后已完成的行（done）
+ *   与当时的输出字节数（output_bytes）
+ * - 续跑时输出截到 output_bytes（之后写入的结果对应的行重新执行），输入从 input_offset 继续，done 中的行跳过
+ */
+class BatchCheckpoint
+{
+public:
+    BatchCheckpoint(std::string input, std::string output, std::string path);
+    ~BatchCheckpoint();
+
+    BatchCheckpoint(const BatchCheckpoint &) = delete;
+    BatchCheckpoint &operator=(const BatchCheckpoint &) = delete;
+
+    // 读取 checkpoint（不存在时为新任务）、截断并打开输出、把 in 定位到续跑位置；失败时 err 说明原因
+    bool Open(std::istream &in, std::string &err);
+
+    // 读入一行（bytes 不含换行符），返回行号；该行在 checkpoint 中已完成时 skip 为 true，调用方应直接 Complete(line, nullptr)
+    int64_t Read(size_t bytes, bool &skip);
+
+    // 写一条结果（record 为空表示空行 / 已跳过的行）并推进完成前缀；写了结果时更新 checkpoint，写失败返回 false
+    bool Complete(int64_t line, const std::string *record);
+
+    // 把当前状态写入 checkpoint；失败返回 false
+    bool Save() const;
+
+    bool resumed() const { return resumed_; }
+    int64_t next_line() const { return next_line_; }
+    uint64_t input_offset() const { return input_offset_; }
+    uint64_t output_bytes() const { return out_bytes_; }
+    size_t skip_pending() const { return skip_.size(); }
+
+private:
+    std::string input_;
+    std::string output_;
+    std::string path_;
+    bool resumed_ = false;
+
+    int64_t next_line_ = 0;
+    uint64_t input_offset_ = 0;
+    std::set<int64_t> done_;              // >= next_line_ 的已完成行（都已读入）
+    std::set<int64_t> skip_;              // checkpoint 中已完成、本次尚未读到的行
+    std::map<int64_t, uint64_t> offsets_; // 已读入、尚未进入前缀的行的字节偏移
+    uint64_t read_offset_ = 0;            // 下一个未读行的字节偏移
+    int64_t lines_read_ = 0;
+
+    FILE *out_ = nullptr;
+    uint64_t out_bytes_ = 0;
+};
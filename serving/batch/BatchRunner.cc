@@ -0,0 +1,339 @@
+#include "serving/batch/BatchRunner.h"
+#include "serving/core/Session.h"
+#include "serving/http/ChatRequest.h"
+#include "utils/json.hpp"
+
+#include <glog/logging.h>
+
+#include <fstream>
+#include <utility>
+
+using json = nlohmann::json;
+
+namespace
+{
+const char *finish_reason_to_str(FinishReason r)
+{
+    switch (r)
+    {
+    case FinishReason::stop:
+        return "stop";
+    case FinishReason::length:
+        return "length";
+    case FinishReason::cancelled:
+        return "cancelled";
+    case FinishReason::error:
+    default:
+        return "error";
+    }
+}
+
+// overloaded（队列满 / 排队超时）的请求等这么久再重新投递
+constexpr auto kRetryDelay = std::chrono::milliseconds(100);
+
+// 每完成这么多条打一次进度
+constexpr int64_t kProgressEvery = 100;
+} // namespace
+
+BatchRunner::BatchRunner(Options opt)
+    : opt_(std::move(opt)),
+      pool_(opt_.worker_threads),
+      executor_(pool_, true), // 离线：模型未加载时就地加载并等待
+      ckpt_(opt_.input, opt_.output, opt_.checkpoint.empty() ? opt_.output + ".ckpt" : opt_.checkpoint)
+{
+    if (opt_.checkpoint.empty())
+        opt_.checkpoint = opt_.output + ".ckpt";
+}
+
+BatchRunner::~BatchRunner() = default;
+
+BatchRunner::Stats BatchRunner::stats() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return stats_;
+}
+
+void BatchRunner::CompleteLocked(int64_t line, const std::string *record)
+{
+    if (!ckpt_.Complete(line, record))
+        LOG(WARNING) << "[serving-batch] checkpoint write failed: " << opt_.checkpoint;
+}
+
+void BatchRunner::FinishLocked(int64_t line, const std::string &record, bool ok)
+{
+    --inflight_;
+    if (ok)
+        ++stats_.ok;
+    else
+        ++stats_.failed;
+    CompleteLocked(line, &record);
+
+    const int64_t n = stats_.ok + stats_.failed;
+    if (n % kProgressEvery == 0)
+    {
+        const double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start_).count();
+        LOG(INFO) << "[serving-batch] progress done=" << n
+                  << " failed=" << stats_.failed
+                  << " next_line=" << ckpt_.next_line()
+                  << " inflight=" << inflight_
+                  << " completion_tokens=" << stats_.completion_tokens
+                  << " tokens_per_s=" << (sec > 0 ? stats_.completion_tokens / sec : 0);
+    }
+    cv_.notify_all();
+}
+
+bool BatchRunner::Run()
+{
+    std::ifstream in(opt_.input, std::ios::binary);
+    if (!in.is_open())
+    {
+        LOG(ERROR) << "[serving-batch] input not found: " << opt_.input;
+        return false;
+    }
+    std::string err;
+    if (!ckpt_.Open(in, err))
+    {
+        LOG(ERROR) << "[serving-batch] " << err;
+        return false;
+    }
+
+    run_start_ = std::chrono::steady_clock::now();
+    LOG(INFO) << "[serving-batch] start input=" << opt_.input
+              << " output=" << opt_.output
+              << " resume_line=" << ckpt_.next_line()
+              << " done_ahead=" << ckpt_.skip_pending()
+              << " max_inflight=" << opt_.max_inflight;
+
+    bool eof = false;
+    std::string text;
+    while (true)
+    {
+        Item item;
+        bool retry = false;
+        {
+            // 到期的重试优先；未到期时照常读入新行，只在没有别的事可做时等到最早的重试到期
+            std::unique_lock<std::mutex> lk(mu_);
+            while (true)
+            {
+                if (eof && inflight_ == 0 && retry_.empty())
+                    break;
+                if (inflight_ < opt_.max_inflight)
+                {
+                    if (!retry_.empty() && retry_.front().ready_at <= std::chrono::steady_clock::now())
+                    {
+                        item = std::move(retry_.front().item);
+                        retry_.pop_front();
+                        ++inflight_;
+                        retry = true;
+                        break;
+                    }
+                    if (!eof)
+                        break;
+                }
+                if (inflight_ < opt_.max_inflight && !retry_.empty())
+                    cv_.wait_until(lk, retry_.front().ready_at);
+                else
+                    cv_.wait(lk);
+            }
+            if (!retry && eof)
+                break;
+        }
+
+        if (retry)
+        {
+            Dispatch(std::move(item));
+            continue;
+        }
+
+        // 只有本线程读输入；偏移在锁内登记，供完成回调推进 input_offset
+        if (!std::getline(in, text))
+        {
+            eof = true;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lk(mu_);
+        bool skip = false;
+        item.line = ckpt_.Read(text.size(), skip);
+
+        if (!text.empty() && text.back() == '\r')
+            text.pop_back();
+        if (skip)
+        {
+            ++stats_.skipped;
+            CompleteLocked(item.line, nullptr);
+            continue;
+        }
+        if (text.find_first_not_of(" \t") == std::string::npos)
+        {
+            CompleteLocked(item.line, nullptr);
+            continue;
+        }
+
+        item.text = std::move(text);
+        ++inflight_;
+        // Dispatch 可能同步触发完成回调（如模型不存在），不能持有 mu_
+        lk.unlock();
+        Dispatch(std::move(item));
+    }
+
+    std::lock_guard<std::mutex> lk(mu_);
+    if (!ckpt_.Save())
+        LOG(WARNING) << "[serving-batch] checkpoint write failed: " << opt_.checkpoint;
+    const double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start_).count();
+    LOG(INFO) << "[serving-batch] done ok=" << stats_.ok
+              << " failed=" << stats_.failed
+              << " skipped=" << stats_.skipped
+              << " retried=" << stats_.retried
+              << " prompt_tokens=" << stats_.prompt_tokens
+              << " completion_tokens=" << stats_.completion_tokens
+              << " sec=" << sec
+              << " tokens_per_s=" << (sec > 0 ? stats_.completion_tokens / sec : 0);
+    return true;
+}
+
+void BatchRunner::Dispatch(Item item)
+{
+    const auto start = std::chrono::steady_clock::now();
+
+    // 请求体：整行，或 OpenAI batch 格式的 body
+    json envelope = json::parse(item.text, nullptr, false);
+    const bool wrapped = envelope.is_object() && envelope.contains("body") && envelope["body"].is_object();
+    const json &body = wrapped ? envelope["body"] : envelope;
+    std::string custom_id;
+    if (envelope.is_object() && envelope.contains("custom_id") && envelope["custom_id"].is_string())
+        custom_id = envelope["custom_id"].get<std::string>();
+
+    auto reject = [&](const std::string &message)
+    {
+        json rec = {{"line", item.line},
+                    {"error", {{"message", message}, {"type", "invalid_request_error"}}}};
+        if (!custom_id.empty())
+            rec["custom_id"] = custom_id;
+        const std::string s = rec.dump(-1, ' ', false, json::error_handler_t::replace);
+        std::lock_guard<std::mutex> lk(mu_);
+        FinishLocked(item.line, s, false);
+    };
+
+    if (!body.is_object())
+    {
+        reject("invalid json");
+        return;
+    }
+    if (!body.contains("messages") || !body["messages"].is_array())
+    {
+        reject("messages must be array");
+        return;
+    }
+
+    auto ctx = std::make_shared<ServingContext>();
+    ctx->request_id = "batch-" + std::to_string(item.line);
+    ctx->stream = false;
+    ctx->is_chat = true;
+
+    // model 可带 LoRA adapter：ctx->model 为基座模型
+    std::string err;
+    if (!resolve_model_adapter(body, opt_.default_model, *ctx, err))
+    {
+        reject(err);
+        return;
+    }
+
+    // json_schema 需按声明顺序解析：包在 body 里时取出 body 的原文
+    const std::string raw = wrapped ? nlohmann::ordered_json::parse(item.text)["body"].dump() : item.text;
+    if (!forward_sampling_params(body, *ctx, err) || !forward_response_format(body, raw, *ctx, err) ||
+        !parse_chat_messages(body, *ctx, err))
+    {
+        reject(err);
+        return;
+    }
+    forward_generation_params(body, *ctx);
+
+    // 一次性 session：请求结束、ctx 释放时 session 与其 context 一起释放
+    ctx->session_id = ctx->request_id;
+    ctx->session = std::make_shared<Session>(ctx->session_id, ctx->model);
+    ctx->session->ephemeral = true;
+
+    // 回调里只持有弱引用，避免 ctx -> on_finish -> ctx 的循环引用让 session 无法释放
+    std::weak_ptr<ServingContext> weak = ctx;
+    ctx->on_finish = [this, weak, item, custom_id, start](FinishReason r)
+    {
+        auto c = weak.lock();
+        if (!c)
+            return;
+        const double latency_ms =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        OnFinish(item, custom_id, *c, r, latency_ms);
+    };
+
+    executor_.Execute(ctx);
+}
+
+void BatchRunner::OnFinish(const Item &item, const std::string &custom_id, ServingContext &ctx, FinishReason r,
+                           double latency_ms)
+{
+    const bool overloaded = r == FinishReason::error && ctx.params.count("error_code") &&
+                            ctx.params.at("error_code") == "overloaded";
+    if (overloaded)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        --inflight_;
+        ++stats_.retried;
+        retry_.push_back({std::chrono::steady_clock::now() + kRetryDelay, item});
+        cv_.notify_all();
+        return;
+    }
+
+    const bool ok = r == FinishReason::stop || r == FinishReason::length;
+    json rec = {{"line", item.line}, {"model", ctx.model}};
+    if (!ctx.lora.empty())
+        rec["lora"] = ctx.lora.name;
+    if (!custom_id.empty())
+        rec["custom_id"] = custom_id;
+
+    if (ok)
+    {
+        json choices = json::array();
+        if (ctx.choices.empty())
+        {
+            choices.push_back({{"index", 0},
+                               {"message", {{"role", "assistant"}, {"content", ctx.final_text}}},
+                               {"finish_reason", finish_reason_to_str(r)}});
+        }
+        for (size_t i = 0; i < ctx.choices.size(); ++i)
+        {
+            const auto &c = ctx.choices[i];
+            choices.push_back({{"index", static_cast<int>(i)},
+                               {"message", {{"role", "assistant"}, {"content", c.text}}},
+                               {"finish_reason", finish_reason_to_str(c.finished ? c.finish_reason : r)}});
+        }
+        rec["choices"] = choices;
+    }
+    else
+    {
+        rec["error"] = {{"message", ctx.error_message.empty() ? "engine error" : ctx.error_message},
+                        {"type", "internal_error"},
+                        {"finish_reason", finish_reason_to_str(r)}};
+    }
+
+    rec["usage"] = {{"prompt_tokens", ctx.usage.prompt_tokens},
+                    {"completion_tokens", ctx.usage.completion_tokens},
+                    {"total_tokens", ctx.usage.total_tokens},
+                    {"cached_tokens", ctx.usage.cached_tokens}};
+    rec["timings"] = {{"latency_ms", latency_ms},
+                      {"completion_tokens_per_s",
+                       latency_ms > 0 ? ctx.usage.completion_tokens * 1000.0 / latency_ms : 0.0}};
+    if (ctx.usage.images > 0)
+    {
+        rec["usage"]["image_tokens"] = ctx.usage.image_tokens;
+        rec["timings"]["images"] = ctx.usage.images;
+        rec["timings"]["image_cache_hits"] = ctx.usage.image_cache_hits;
+        rec["timings"]["image_encode_ms"] = ctx.usage.image_encode_ms;
+    }
+
+    const std::string s = rec.dump(-1, ' ', false, json::error_handler_t::replace);
+    std::lock_guard<std::mutex> lk(mu_);
+    stats_.prompt_tokens += ctx.usage.prompt_tokens;
+    stats_.completion_tokens += ctx.usage.completion_tokens;
+    FinishLocked(item.line, s, ok);
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include "serving/batch/BatchCheckpoint.h"
+#include "serving/core/EngineExecutor.h"
+#include "serving/core/ServingContext.h"
+#include "serving/core/ThreadPool.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/**
+ * @brief 离线批处理：JSONL 中的 chat 请求经与 HTTP 服务相同的 EngineExecutor / 引擎栈执行，结果写入 JSONL
+ *
+ * - 输入每行一个 /v1/chat/completions 请求体，或 OpenAI batch 格式 {"custom_id": ..., "body": {...}}
+ * - 始终保持 max_inflight 个请求在途：continuous 调度下 batch 的 slot 一空出来就有请求补上，
+ *   串行模式下模型队列不断档；每个请求一个一次性 session，不经过 HTTP / SessionManager
+ * - 结果按完成顺序追加到输出（带 line / custom_id），含 choices、usage 与耗时
+ * - checkpoint 见 BatchCheckpoint：每写一条结果原子更新一次，重启时从连续完成的前缀继续并跳过已完成的行
+ * - 队列满 / 排队超时（overloaded）的请求延迟一段时间后重新投递，不计为失败；等待期间读取线程照常投递新行
+ */
+class BatchRunner
+{
+public:
+    struct Options
+    {
+        std::string input;
+        std::string output;
+        std::string checkpoint; // 空表示 output + ".ckpt"
+        size_t max_inflight = 16;
+        size_t worker_threads = 4;
+        std::string default_model = "llama";
+    };
+
+    struct Stats
+    {
+        int64_t ok = 0;
+        int64_t failed = 0;
+        int64_t skipped = 0; // checkpoint 中已完成的行
+        int64_t retried = 0;
+        int64_t prompt_tokens = 0;
+        int64_t completion_tokens = 0;
+    };
+
+    explicit BatchRunner(Options opt);
+    ~BatchRunner();
+
+    BatchRunner(const BatchRunner &) = delete;
+    BatchRunner &operator=(const BatchRunner &) = delete;
+
+    // 处理到输入结束；文件无法打开 / checkpoint 与输入不匹配时返回 false
+    bool Run();
+
+    Stats stats() const;
+
+private:
+    struct Item
+    {
+        int64_t line = 0;
+        std::string text;
+    };
+
+    // 调用前 inflight_ 已计入该请求
+    void Dispatch(Item item);
+    void OnFinish(const Item &item, const std::string &custom_id, ServingContext &ctx, FinishReason r,
+                  double latency_ms);
+    // 写一条结果（record 为空表示空行 / 已完成的行）并推进完成前缀（持有 mu_）
+    void CompleteLocked(int64_t line, const std::string *record);
+    // 写入 record 并释放一个在途名额（持有 mu_）
+    void FinishLocked(int64_t line, const std::string &record, bool ok);
+
+private:
+    Options opt_;
+    ThreadPool pool_;
+    EngineExecutor executor_;
+
+    mutable std::mutex mu_;
+    std::condition_variable cv_;
+    size_t inflight_ = 0;
+
+    // overloaded 的请求到 ready_at 之后重新投递（延迟相同，按 ready_at 有序）
+    struct Retry
+    {
+        std::chrono::steady_clock::time_point ready_at;
+        Item item;
+    };
+    std::deque<Retry> retry_;
+
+    BatchCheckpoint ckpt_; // mu_
+
+    Stats stats_;
+    std::chrono::steady_clock::time_point run_start_{};
+};
@@ -0,0 +1,91 @@
+#include "serving/batch/BatchRunner.h"
+#include "serving/core/ServingConfig.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+/*
+    离线批处理入口：
+    serving_batch <input.jsonl> <output.jsonl> [--checkpoint PATH] [--max-inflight N]
+    退出码：0 全部成功；2 有失败的行（已写入输出）；1 无法运行
+*/
+
+namespace
+{
+    int env_int(const char *name, int def)
+    {
+        const char *env = std::getenv(name);
+        if (!env || !*env)
+            return def;
+        try
+        {
+            const int v = std::stoi(env);
+            return v > 0 ? v : def;
+        }
+        catch (...)
+        {
+            return def;
+        }
+    }
+
+    void usage()
+    {
+        std::cerr << "usage: serving_batch <input.jsonl> <output.jsonl> [--checkpoint PATH] [--max-inflight N]"
+                  << std::endl;
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+    load_config("serving-batch");
+
+    BatchRunner::Options opt;
+    int max_inflight = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--checkpoint" && i + 1 < argc)
+            opt.checkpoint = argv[++i];
+        else if (arg == "--max-inflight" && i + 1 < argc)
+            max_inflight = std::max(1, std::atoi(argv[++i]));
+        else if (opt.input.empty())
+            opt.input = arg;
+        else if (opt.output.empty())
+            opt.output = arg;
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if (opt.input.empty() || opt.output.empty())
+    {
+        usage();
+        return 1;
+    }
+
+    // 缺省在途数：continuous 调度下两倍 batch slot（slot 一空出来就有请求补上），不超过模型队列上限
+    if (max_inflight == 0)
+        max_inflight = std::min(env_int("MAX_MODEL_QUEUE", 64), 2 * env_int("LLAMA_BATCH_SLOTS", 8));
+    opt.max_inflight = static_cast<size_t>(max_inflight);
+    opt.worker_threads = static_cast<size_t>(env_int("WORKER_THREADS", 4));
+    if (const char *env = std::getenv("DEFAULT_MODEL"); env && *env)
+        opt.default_model = env;
+
+    // 在途数由批处理自己控制，排队再久也不应按超时失败
+    setenv("MAX_QUEUE_WAIT_MS", "86400000", 1);
+
+    BatchRunner runner(opt);
+    if (!runner.Run())
+        return 1;
+
+    const auto st = runner.stats();
+    std::cout << "[serving-batch] ok=" << st.ok
+              << " failed=" << st.failed
+              << " skipped=" << st.skipped
+              << " completion_tokens=" << st.completion_tokens
+              << std::endl;
+    return st.failed > 0 ? 2 : 0;
+}
@@ -1,7 +1,7 @@
 #include "serving/core/EngineExecutor.h"
 #include "serving/core/ServingContext.h"
 #include "serving/core/ModelEngine.h"
-#include "engine/EngineFactory.h"
+#include "engine/ModelRegistry.h"
 
 #include <algorithm>
 #include <chrono>
@@ -11,9 +11,19 @@
 
 // ================= EngineExecutor =================
 
-EngineExecutor::EngineExecutor(ThreadPool &pool)
-    : pool_(pool) 
+EngineExecutor::EngineExecutor(ThreadPool &pool, bool wait_for_load)
+    : pool_(pool), wait_for_load_(wait_for_load)
 {
+    if (const char *v = std::getenv("LORA_GROUP_MAX"); v && *v)
+    {
+        try
+        {
+            lora_group_max_ = std::max(0, std::stoi(v));
+        }
+        catch (...)
+        {
+        }
+    }
 }
 
 EngineExecutor::~EngineExecutor() = default;
@@ -49,9 +59,63 @@ bool EngineExecutor::Execute(std::shared_ptr<ServingContext> ctx)
     const int max_queue_wait_ms = get_env_int("MAX_QUEUE_WAIT_MS", 2000);
     const int max_model_queue = get_env_int("MAX_MODEL_QUEUE", 64);
 
+    // 模型引用（租约）：请求排队与执行期间该模型不会被 ModelRegistry 卸载
+    // 未加载时在线请求不在这里同步加载（会占住共享工作线程，其余请求也排在它后面）：交给后台加载，回 model_loading
+    auto &registry = ModelRegistry::Instance();
+    std::string load_error;
+    std::shared_ptr<ModelEngine> engine = wait_for_load_ ? registry.Acquire(model) : registry.TryAcquire(model, &load_error);
+    if (!engine)
+    {
+        if (!load_error.empty())
+        {
+            ctx->error_message = "EngineExecutor: " + load_error;
+            ctx->params["error_code"] = "load_failed";
+        }
+        else if (!wait_for_load_ && registry.Contains(model))
+        {
+            ctx->error_message = "EngineExecutor: model is loading, model=" + model;
+            ctx->params["error_code"] = "model_loading";
+        }
+        else
+        {
+            ctx->error_message = "EngineExecutor: model unavailable, model=" + model;
+        }
+        ctx->EmitFinish(FinishReason::error);
+        return false;
+    }
+
+    // 准备阶段（如图片编码）：完成后才入队，排队等待从那时算起；租约随回调存活
+    if (engine->Prepare(ctx, [this, ctx, engine, max_queue_wait_ms, max_model_queue]
+                        { Dispatch(ctx, engine, max_queue_wait_ms, max_model_queue); }))
+        return true;
+
+    return Dispatch(std::move(ctx), std::move(engine), max_queue_wait_ms, max_model_queue);
+}
+
+bool EngineExecutor::Dispatch(std::shared_ptr<ServingContext> ctx, std::shared_ptr<ModelEngine> engine,
+                              int max_queue_wait_ms, int max_model_queue)
+{
+    const std::string model = ctx->model;
     const auto enqueued_at = std::chrono::steady_clock::now();
 
-    bool ok = SubmitPerModel(model, [this, ctx, enqueued_at, max_queue_wait_ms]
+    // 自带调度的引擎（continuous batching）：直接交给引擎，不走 per-model 串行队列
+    // 引擎内部负责排队上限 / 等待超时 / EmitFinish；租约随 ctx 存活到请求结束
+    if (engine->IsAsync())
+    {
+        if (ctx->cancelled.load(std::memory_order_acquire))
+        {
+            ctx->EmitFinish(FinishReason::cancelled);
+            return false;
+        }
+        ctx->engine = engine;
+        engine->Run(ctx);
+        return true;
+    }
+
+    Task task;
+    task.group = ctx->lora.Key();
+    task.session = ctx->session.get();
+    task.run = [ctx, engine, enqueued_at, max_queue_wait_ms]
     {
         // 任务开始时再检查一次
         if (ctx->finished.load(std::memory_order_acquire))
@@ -75,25 +139,9 @@ bool EngineExecutor::Execute(std::shared_ptr<ServingContext> ctx)
 
         LOG(INFO) << "[execQ] start model=" << ctx->model
                   << " req=" << ctx->request_id
+                  << " lora=" << (ctx->lora.empty() ? "-" : ctx->lora.name)
                   << " wait_ms=" << wait_ms;
 
-        // 获取/复用 engine（你已有缓存逻辑就保留；这里示例直接 Create）
-        std::shared_ptr<ModelEngine> engine;
-        {
-            std::lock_guard<std::mutex> lk(map_mu_);
-            auto &slot = engines_[ctx->model];
-            if (!slot)
-                slot = EngineFactory::Create(ctx->model);
-            engine = slot;
-        }
-
-        if (!engine)
-        {
-            ctx->error_message = "EngineExecutor: EngineFactory::Create failed, model=" + ctx->model;
-            ctx->EmitFinish(FinishReason::error);
-            return;
-        }
-
         // 引擎执行（内部会轮询 ctx->cancelled 并 EmitDelta/EmitFinish）
         engine->Run(ctx);
 
@@ -105,7 +153,8 @@ bool EngineExecutor::Execute(std::shared_ptr<ServingContext> ctx)
             else
                 ctx->EmitFinish(FinishReason::stop);
         } 
-    }, static_cast<size_t>(max_model_queue));
+    };
+    bool ok = SubmitPerModel(model, std::move(task), static_cast<size_t>(max_model_queue));
 
     if (!ok)
     {
@@ -158,7 +207,7 @@ void EngineExecutor::ExecuteAndWait(std::shared_ptr<ServingContext> ctx)
     ctx->on_finish = user_on_finish;
 }
 
-bool EngineExecutor::SubmitPerModel(const std::string &model,  std::function<void()> task, size_t max_queue)
+bool EngineExecutor::SubmitPerModel(const std::string &model, Task task, size_t max_queue)
 {
     constexpr size_t MAX_QUEUE_FLOOR = 1;
 
@@ -201,9 +250,13 @@ bool EngineExecutor::SubmitPerModel(const std::string &model,  std::function<voi
 
 void EngineExecutor::RunModelQueue(std::string model, std::shared_ptr<ModelQueue> mq)
 {
+    // LoRA 分组：队首换了 adapter 时，先把队列里与上一个任务同 adapter 的任务提前（最多连续 lora_group_max_ 个），
+    // 减少 context 上的 adapter 切换与 KV 重写；不越过同一 session 更早的任务，保证对话顺序
+    std::string last_group;
+    int run_len = 0;
     while (true)
     {
-        std::function<void()> task;
+        Task task;
         {
             std::lock_guard<std::mutex> lk(mq->mu);
             if (mq->tasks.empty())
@@ -211,9 +264,26 @@ void EngineExecutor::RunModelQueue(std::string model, std::shared_ptr<ModelQueue
                 mq->running = false;
                 return;
             }
-            task = std::move(mq->tasks.front());
-            mq->tasks.pop_front();
+            auto pick = mq->tasks.begin();
+            if (run_len < lora_group_max_ && pick->group != last_group)
+            {
+                for (auto it = mq->tasks.begin(); it != mq->tasks.end(); ++it)
+                {
+                    if (it->group == last_group)
+                    {
+                        const bool blocked = std::any_of(mq->tasks.begin(), it, [&](const Task &t)
+                                                         { return t.session && t.session == it->session; });
+                        if (!blocked)
+                            pick = it;
+                        break;
+                    }
+                }
+            }
+            task = std::move(*pick);
+            mq->tasks.erase(pick);
         }
-        task();
+        run_len = (task.group == last_group) ? run_len + 1 : 1;
+        last_group = task.group;
+        task.run();
     }
 }
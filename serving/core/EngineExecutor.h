@@ -17,7 +17,9 @@ class ModelEngine;
 class EngineExecutor
 {
 public:
-    EngineExecutor(ThreadPool &pool);
+    // wait_for_load：模型未加载时在调用线程上加载并等待（离线批处理）；
+    // 否则交给注册表后台加载，请求立即以 model_loading 结束（HTTP，不占用共享工作线程）
+    explicit EngineExecutor(ThreadPool &pool, bool wait_for_load = false);
     ~EngineExecutor();
 
     // 异步：提交后立即返回（stream / non-stream 都走这条）
@@ -28,22 +30,32 @@ public:
 
 private:
     // ===== per-model queue =====
+    struct Task
+    {
+        std::function<void()> run;
+        std::string group;            // LoRA adapter（LoraSelection::Key），相同的连续执行以少切换
+        const void *session = nullptr; // 同一 session 的任务保持先后顺序
+    };
+
     struct ModelQueue
     {
         std::mutex mu;
-        std::deque<std::function<void()>> tasks;
+        std::deque<Task> tasks;
         bool running = false;
     };
 
-    bool SubmitPerModel(const std::string &model, std::function<void()> task, size_t max_queue);
+    // 交给引擎：自带调度的直接 Run，否则进入 per-model 串行队列（准备阶段之后调用）
+    bool Dispatch(std::shared_ptr<ServingContext> ctx, std::shared_ptr<ModelEngine> engine, int max_queue_wait_ms,
+                  int max_model_queue);
+
+    bool SubmitPerModel(const std::string &model, Task task, size_t max_queue);
     void RunModelQueue(std::string model, std::shared_ptr<ModelQueue> mq);
 
 private:
-    std::shared_ptr<ModelEngine> GetOrCreateEngineLocked(const std::string &model);
-
-    std::unordered_map<std::string, std::shared_ptr<ModelEngine>> engines_;
-
     ThreadPool& pool_;
+    bool wait_for_load_ = false;
     std::mutex map_mu_;
     std::unordered_map<std::string, std::shared_ptr<ModelQueue>> queues_;
+    // 同一 adapter 组最多连续执行的任务数（LORA_GROUP_MAX，0 为严格 FIFO）
+    int lora_group_max_ = 8;
 };
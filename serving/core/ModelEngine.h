@@ -1,6 +1,7 @@
 #pragma once
 
 #include <functional>
+#include <map>
 #include <string>
 #include "serving/core/ServingContext.h"
 #include <memory>
@@ -15,6 +16,26 @@ public:
     // 非流式：返回完整文本
     virtual void Run(std::shared_ptr<ServingContext> ctx) = 0;
 
+    // 引擎自带调度（如 continuous batching）：Run 只负责入队并立即返回，
+    // EmitFinish 由引擎内部线程完成；EngineExecutor 不再按模型串行排队
+    virtual bool IsAsync() const { return false; }
+
+    // 进入模型队列之前的准备阶段（如图片解码 + 视觉编码），在引擎自己的线程池上执行，不占模型队列。
+    // 需要准备时接管请求并返回 true：成功后调用 ready（请求此时才入队），失败 / 取消时由引擎 EmitFinish；
+    // 不需要准备返回 false，请求直接入队
+    virtual bool Prepare(const std::shared_ptr<ServingContext> &ctx, std::function<void()> ready)
+    {
+        (void)ctx;
+        (void)ready;
+        return false;
+    }
+
+    // 引擎内部指标（由 /metrics 按模型展示）
+    virtual void CollectMetrics(std::map<std::string, double> &out) const { (void)out; }
+
+    // 常驻内存估算（模型权重 + 预分配的 KV 等），ModelRegistry 按它执行内存预算
+    virtual size_t ResidentBytes() const { return 0; }
+
     // // 流式：按 token 回调输出
     // virtual void RunStream(const ServingContext &ctx,
     //                        const std::function<void(const std::string &)> &on_delta,
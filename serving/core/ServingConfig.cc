@@ -0,0 +1,121 @@
+#include "serving/core/ServingConfig.h"
+#include "utils/json.hpp"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+using json = nlohmann::json;
+
+namespace
+{
+    void set_env_from_json(const json &cfg, const char *key, const char *env)
+    {
+        if (!cfg.contains(key))
+            return;
+
+        std::string v;
+        if (cfg[key].is_string())
+            v = cfg[key].get<std::string>();
+        else if (cfg[key].is_number_integer())
+            v = std::to_string(cfg[key].get<int>());
+        else if (cfg[key].is_array() || cfg[key].is_object())
+            v = cfg[key].dump(); // 结构化配置（如 models）原样以 JSON 传给引擎侧
+        else
+            return;
+
+        setenv(env, v.c_str(), 1); // config 作为主配置
+    }
+} // namespace
+
+void load_config(const char *tag)
+{
+    const char *cfg_path = std::getenv("CONFIG_PATH");
+    if (!cfg_path || !*cfg_path)
+        cfg_path = "config.json";
+
+    std::ifstream in(cfg_path);
+    if (!in.is_open())
+    {
+        std::cerr << "[" << tag << "] config not found: " << cfg_path << std::endl;
+        return;
+    }
+
+    try
+    {
+        json cfg = json::parse(in);
+        set_env_from_json(cfg, "http_port", "HTTP_PORT");
+        set_env_from_json(cfg, "http_max_body_mb", "HTTP_MAX_BODY_MB");
+        set_env_from_json(cfg, "default_model", "DEFAULT_MODEL");
+        set_env_from_json(cfg, "worker_threads", "WORKER_THREADS");
+        set_env_from_json(cfg, "max_model_queue", "MAX_MODEL_QUEUE");
+        set_env_from_json(cfg, "max_session_pending", "MAX_SESSION_PENDING");
+        set_env_from_json(cfg, "max_queue_wait_ms", "MAX_QUEUE_WAIT_MS");
+        set_env_from_json(cfg, "llama_model_path", "LLAMA_MODEL_PATH");
+        set_env_from_json(cfg, "llama_n_ctx", "LLAMA_N_CTX");
+        set_env_from_json(cfg, "llama_n_threads", "LLAMA_N_THREADS");
+        set_env_from_json(cfg, "llama_n_threads_batch", "LLAMA_N_THREADS_BATCH");
+        set_env_from_json(cfg, "llama_thread_budget", "LLAMA_THREAD_BUDGET");
+        set_env_from_json(cfg, "llama_cpu_set", "LLAMA_CPU_SET");
+        set_env_from_json(cfg, "llama_min_threads", "LLAMA_MIN_THREADS");
+        set_env_from_json(cfg, "llama_threadpool_poll", "LLAMA_THREADPOOL_POLL");
+        set_env_from_json(cfg, "kv_reset_margin", "KV_RESET_MARGIN");
+        set_env_from_json(cfg, "default_max_tokens", "DEFAULT_MAX_TOKENS");
+        set_env_from_json(cfg, "llama_scheduler", "LLAMA_SCHEDULER");
+        set_env_from_json(cfg, "llama_batch_slots", "LLAMA_BATCH_SLOTS");
+        set_env_from_json(cfg, "llama_prefill_chunk", "LLAMA_PREFILL_CHUNK");
+        set_env_from_json(cfg, "llama_max_n", "LLAMA_MAX_N");
+        set_env_from_json(cfg, "llama_context_pool", "LLAMA_CONTEXT_POOL");
+        set_env_from_json(cfg, "llama_draft_model_path", "LLAMA_DRAFT_MODEL_PATH");
+        set_env_from_json(cfg, "llama_draft_n_min", "LLAMA_DRAFT_N_MIN");
+        set_env_from_json(cfg, "llama_draft_n_max", "LLAMA_DRAFT_N_MAX");
+        set_env_from_json(cfg, "llama_lookup_n_draft", "LLAMA_LOOKUP_N_DRAFT");
+        set_env_from_json(cfg, "llama_lookup_ngram_min", "LLAMA_LOOKUP_NGRAM_MIN");
+        set_env_from_json(cfg, "llama_lookup_ngram_max", "LLAMA_LOOKUP_NGRAM_MAX");
+        set_env_from_json(cfg, "llama_mmproj_path", "LLAMA_MMPROJ_PATH");
+        set_env_from_json(cfg, "llama_mmproj_threads", "LLAMA_MMPROJ_THREADS");
+        set_env_from_json(cfg, "llama_image_cache_mb", "LLAMA_IMAGE_CACHE_MB");
+        set_env_from_json(cfg, "llama_image_workers", "LLAMA_IMAGE_WORKERS");
+        set_env_from_json(cfg, "llama_image_queue", "LLAMA_IMAGE_QUEUE");
+        set_env_from_json(cfg, "image_file_root", "IMAGE_FILE_ROOT");
+        set_env_from_json(cfg, "llama_lora_cache_mb", "LLAMA_LORA_CACHE_MB");
+        set_env_from_json(cfg, "llama_lora_switch_steps", "LLAMA_LORA_SWITCH_STEPS");
+        set_env_from_json(cfg, "lora_group_max", "LORA_GROUP_MAX");
+        set_env_from_json(cfg, "lora_adapter_root", "LORA_ADAPTER_ROOT");
+        set_env_from_json(cfg, "lora_adapters", "LORA_ADAPTERS");
+        set_env_from_json(cfg, "llama_sampler_cache_size", "LLAMA_SAMPLER_CACHE_SIZE");
+        set_env_from_json(cfg, "llama_grammar_cache_size", "LLAMA_GRAMMAR_CACHE_SIZE");
+        set_env_from_json(cfg, "llama_kv_overflow", "LLAMA_KV_OVERFLOW");
+        set_env_from_json(cfg, "llama_shift_keep_tokens", "LLAMA_SHIFT_KEEP_TOKENS");
+        set_env_from_json(cfg, "embedding_model", "EMBEDDING_MODEL");
+        set_env_from_json(cfg, "llama_embedding_model_path", "LLAMA_EMBEDDING_MODEL_PATH");
+        set_env_from_json(cfg, "llama_embedding_n_batch", "LLAMA_EMBEDDING_N_BATCH");
+        set_env_from_json(cfg, "llama_embedding_batch_seqs", "LLAMA_EMBEDDING_BATCH_SEQS");
+        set_env_from_json(cfg, "llama_embedding_pooling", "LLAMA_EMBEDDING_POOLING");
+        set_env_from_json(cfg, "llama_kv_mode", "LLAMA_KV_MODE");
+        set_env_from_json(cfg, "llama_shared_contexts", "LLAMA_SHARED_CONTEXTS");
+        set_env_from_json(cfg, "llama_shared_slots", "LLAMA_SHARED_SLOTS");
+        set_env_from_json(cfg, "llama_shared_n_ctx", "LLAMA_SHARED_N_CTX");
+        set_env_from_json(cfg, "llama_prefix_cache_tokens", "LLAMA_PREFIX_CACHE_TOKENS");
+        set_env_from_json(cfg, "llama_prefix_cache_seqs", "LLAMA_PREFIX_CACHE_SEQS");
+        set_env_from_json(cfg, "llama_prefix_cache_min_tokens", "LLAMA_PREFIX_CACHE_MIN_TOKENS");
+        set_env_from_json(cfg, "llama_kv_swap_ram_mb", "LLAMA_KV_SWAP_RAM_MB");
+        set_env_from_json(cfg, "llama_kv_swap_dir", "LLAMA_KV_SWAP_DIR");
+        set_env_from_json(cfg, "llama_kv_swap_disk_mb", "LLAMA_KV_SWAP_DISK_MB");
+        set_env_from_json(cfg, "llama_kv_swap_min_tokens", "LLAMA_KV_SWAP_MIN_TOKENS");
+        set_env_from_json(cfg, "models", "MODELS");
+        set_env_from_json(cfg, "model_ram_budget_mb", "MODEL_RAM_BUDGET_MB");
+        set_env_from_json(cfg, "model_load_retry_sec", "MODEL_LOAD_RETRY_SEC");
+        set_env_from_json(cfg, "llama_mmap_prefetch", "LLAMA_MMAP_PREFETCH");
+        set_env_from_json(cfg, "llama_no_mmap", "LLAMA_NO_MMAP");
+        set_env_from_json(cfg, "llama_mlock", "LLAMA_MLOCK");
+        set_env_from_json(cfg, "llama_no_warmup", "LLAMA_NO_WARMUP");
+        set_env_from_json(cfg, "llama_cache_type_k", "LLAMA_CACHE_TYPE_K");
+        set_env_from_json(cfg, "llama_cache_type_v", "LLAMA_CACHE_TYPE_V");
+        set_env_from_json(cfg, "session_kv_budget_mb", "SESSION_KV_BUDGET_MB");
+        std::cerr << "[" << tag << "] config loaded: " << cfg_path << std::endl;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "[" << tag << "] config parse failed: " << e.what() << std::endl;
+    }
+}
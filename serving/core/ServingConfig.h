@@ -0,0 +1,5 @@
+#pragma once
+
+// 读取 config.json（CONFIG_PATH 指定，缺省为当前目录下的 config.json），把各配置项写成环境变量。
+// HTTP 服务与离线批处理共用同一份配置；tag 为日志前缀（如 serving-http）
+void load_config(const char *tag);
@@ -20,10 +20,37 @@ enum class FinishReason
     error
 };
 
+// 消息 content 中图片所在的位置（与 llama.cpp mtmd 的缺省 media marker 相同）
+constexpr const char *kMediaMarker = "<__media__>";
+
+// 消息中的一张图片（OpenAI content 数组的 image_url 部分）
+struct ImageInput
+{
+    std::string id;                          // 内容哈希（SHA-256）+ 字节数，图片 embedding 缓存的键
+    std::shared_ptr<const std::string> data; // 原始文件字节（png / jpeg / ...）所在的缓冲，同一请求的图片可能共用
+    size_t offset = 0;
+    size_t size = 0;
+
+    const char *bytes() const { return data->data() + offset; }
+};
+
 struct Message
 {
     std::string role;
-    std::string content;
+    std::string content;              // 图片处为 kMediaMarker
+    std::vector<ImageInput> images;   // 按在 content 中出现的顺序
+};
+
+// 请求选用的 LoRA adapter（Gateway 按 model 后缀 / lora 字段从 ModelRegistry 解析）；name 为空表示只用基座模型
+struct LoraSelection
+{
+    std::string name;
+    std::string path;   // adapter GGUF
+    float scale = 1.0f;
+
+    bool empty() const { return path.empty(); }
+    // 同一个键的请求可以共用 context 上已应用的 adapter，KV 也只在同一个键下复用
+    std::string Key() const { return path.empty() ? std::string() : path + "@" + std::to_string(scale); }
 };
 
 struct StreamChunk
@@ -31,6 +58,8 @@ struct StreamChunk
     std::string delta;
     bool is_finished = false; // 是否为“最后一个 chunk”
     FinishReason finish_reason = FinishReason::stop;
+    int index = 0;                // 所属候选（OpenAI choices[].index）
+    bool choice_finished = false; // n > 1：该候选结束，请求仍在继续
 };
 
 struct ServingContext
@@ -56,6 +85,15 @@ struct ServingContext
 
     // ChatCompletion
     std::vector<Message> messages;
+    // Gateway 设置：history 被截到与客户端 messages 的公共前缀（编辑 / 重新生成），KV 需按 token 对齐
+    bool kv_rewind = false;
+    // 进入模型队列之前由引擎的准备阶段填入（如按 ImageInput::id 编码好的图片），值的类型由引擎定义
+    std::unordered_map<std::string, std::shared_ptr<const void>> prepared_images;
+
+    // LoRA adapter：model 为基座模型名，lora 为选中的 adapter；
+    // lora_adapter 由引擎在准备阶段加载（类型由引擎定义），进入模型队列 / batch 时只需应用到 context
+    LoraSelection lora;
+    std::shared_ptr<const void> lora_adapter;
     
     // ===== Session =====
     std::shared_ptr<Session> session; //
@@ -63,6 +101,13 @@ struct ServingContext
     // Completion
     std::string prompt;
 
+    // Embeddings（/v1/embeddings）：结果与 inputs 一一对应
+    std::vector<std::string> inputs;
+    std::vector<std::vector<float>> embeddings;
+
+    // OpenAI stop：生成文本中出现任一字符串即结束（不输出该字符串）
+    std::vector<std::string> stop;
+
     // ===== Generation Params (extensible) =====
     std::unordered_map<std::string, std::string> params;
 
@@ -81,16 +126,39 @@ struct ServingContext
     FinishReason finish_reason = FinishReason::stop;
     std::string error_message;
 
+    // ===== Multiple Choices (OpenAI n) =====
+    // n：请求的候选数；引擎按 n 生成时填 choices（choice 0 的文本同时写入 final_text，history 用它）
+    // choices 为空表示引擎只生成了一个候选（final_text / finish_reason）
+    int n = 1;
+    struct Choice
+    {
+        std::string text;
+        FinishReason finish_reason = FinishReason::stop;
+        bool finished = false;
+    };
+    std::vector<Choice> choices;
+
     // ===== Usage (OpenAI-compatible) =====
     struct Usage
     {
         int prompt_tokens = 0;
         int completion_tokens = 0;
         int total_tokens = 0;
+        // 投机解码：草拟 / 被接受的 token 数（草稿模型或 n-gram lookup）
+        int speculative_proposed = 0;
+        int speculative_accepted = 0;
+        // prompt_tokens 中直接复用 KV、没有重新 prefill 的部分
+        int cached_tokens = 0;
+        // 多模态：prompt 中的图片数 / 图片占用的 token 数 / 命中 embedding 缓存的图片数 / 编码耗时
+        int images = 0;
+        int image_tokens = 0;
+        int image_cache_hits = 0;
+        double image_encode_ms = 0;
     };
 
     Usage usage;
 
+    // 异步引擎的请求：持有 ModelRegistry 租约直到 ctx 释放，期间模型不会被卸载
     std::shared_ptr<ModelEngine> engine;
 
     // ===== Finish Wait (non-stream) =====
@@ -113,6 +181,43 @@ struct ServingContext
 
     }
 
+    void EmitChoiceDelta(int index, const std::string &text)
+    {
+        if (finished.load())
+            return;
+
+        choices[index].text += text;
+        if (index == 0)
+            final_text += text;
+
+        if (stream && on_chunk)
+        {
+            StreamChunk c;
+            c.delta = text;
+            c.index = index;
+            on_chunk(c);
+        }
+    }
+
+    // 单个候选结束（EmitFinish 仍需在所有候选结束后调用一次）
+    void EmitChoiceFinish(int index, FinishReason reason)
+    {
+        if (finished.load() || choices[index].finished)
+            return;
+
+        choices[index].finished = true;
+        choices[index].finish_reason = reason;
+
+        if (stream && on_chunk)
+        {
+            StreamChunk c;
+            c.index = index;
+            c.choice_finished = true;
+            c.finish_reason = reason;
+            on_chunk(c);
+        }
+    }
+
     void EmitFinish(FinishReason reason)
     {
         // 只触发一次
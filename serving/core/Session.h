@@ -20,16 +20,33 @@ struct  Session
     {
     }
 
+    ~Session()
+    {
+        if (on_destroy)
+            on_destroy(*this);
+    }
+
     std::string session_id;
     std::string model;
 
     // runtime state
     std::shared_ptr<ModelContext> model_ctx;    // kv chae / llm ctx
-    std::vector<Message> history;               // 多轮对话历史
+    std::vector<Message> history;               // 多轮对话历史（与 KV 一致）
+    // 上下文平移丢弃的消息：客户端 messages 的 [shift_head, shift_head + n_shifted) 不在 history / KV 中
+    size_t shift_head{0};
+    size_t n_shifted{0};
 
     Clock::time_point created_at{Clock::now()};
     Clock::time_point last_active{Clock::now()};
     bool closed{false};
+    // 未携带 session_id 的一次性请求（session_id 即 request_id），不会再回来
+    bool ephemeral{false};
+
+    // 析构前回调：引擎用来把 KV 换出到 RAM/磁盘（在释放最后一个引用的线程上执行）
+    std::function<void(Session &)> on_destroy;
+
+    // 引擎设置：本 session 当前占用的 KV 字节数（持有 mu 时调用）；SessionManager 据此统计与按字节预算淘汰
+    std::function<size_t(const Session &)> kv_bytes;
 
     static constexpr size_t kMaxPending = 64; // 64/128
     std::deque<std::function<void()>> pending;
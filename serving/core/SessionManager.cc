@@ -2,6 +2,8 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
+
 SessionManager::SessionManager(const Options &op)
     : opt_(op)
 {
@@ -11,6 +13,7 @@ SessionManager::SessionManager(const Options &op)
 
 std::shared_ptr<Session> SessionManager::getOrCreate(const std::string &session_id, const std::string &model)
 {
+    std::vector<std::shared_ptr<Session>> dropped; // 先于锁声明：锁释放后才析构
     std::lock_guard<std::mutex> lk(mu_);
 
     auto it = map_.find(session_id);
@@ -18,6 +21,8 @@ std::shared_ptr<Session> SessionManager::getOrCreate(const std::string &session_
     {
         it->second.session->touch();
         moveToFront_(it->second);
+        // KV 随上一轮请求增长：每次访问时检查字节预算
+        evictKvBudget_(session_id, dropped);
         return it->second.session;
     }
 
@@ -31,7 +36,8 @@ std::shared_ptr<Session> SessionManager::getOrCreate(const std::string &session_
     map_.emplace(session_id, std::move(e));
 
     // 超过上限，触发 LRU 回收
-    evictIfNeeded_(Clock::now());
+    evictIfNeeded_(Clock::now(), dropped);
+    evictKvBudget_(session_id, dropped);
 
     return s;
 }
@@ -52,8 +58,12 @@ std::shared_ptr<Session> SessionManager::get(const std::string &session_id)
 
 bool SessionManager::close(const std::string &session_id)
 {
+    std::vector<std::shared_ptr<Session>> dropped;
     std::lock_guard<std::mutex> lk(mu_);
-    return eraseUnlocked_(session_id);
+    auto it = map_.find(session_id);
+    if (it != map_.end())
+        it->second.session->closed = true; // 显式关闭：不再保留 KV
+    return eraseUnlocked_(session_id, dropped);
 }
 
 void SessionManager::touch(const std::string &session_id)
@@ -71,6 +81,7 @@ void SessionManager::touch(const std::string &session_id)
 
 size_t SessionManager::gc()
 {
+    std::vector<std::shared_ptr<Session>> dropped;
     std::lock_guard<std::mutex> lk(mu_);
 
     const auto now = Clock::now();
@@ -93,7 +104,7 @@ size_t SessionManager::gc()
         {
             LOG(INFO) << "[session-gc] remove session=" << sid;
             it++; // rbegin 擦除前先走一步
-            eraseUnlocked_(sid);
+            eraseUnlocked_(sid, dropped);
             removed++;
         }
         else
@@ -103,6 +114,7 @@ size_t SessionManager::gc()
         }
     }
 
+    removed += evictKvBudget_("", dropped);
     return removed;
 }
 
@@ -112,6 +124,33 @@ size_t SessionManager::size() const
     return map_.size();
 }
 
+SessionManager::Stats SessionManager::stats(size_t top_n) const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    Stats st;
+    st.sessions = map_.size();
+    st.evicted_kv_budget = evicted_kv_budget_;
+
+    std::vector<std::pair<std::string, size_t>> all;
+    for (const auto &kv : map_)
+    {
+        const size_t bytes = kvBytesOf_(*kv.second.session);
+        if (bytes == 0)
+            continue;
+        st.kv_bytes += bytes;
+        st.kv_bytes_max = std::max(st.kv_bytes_max, bytes);
+        st.kv_sessions++;
+        all.emplace_back(kv.first, bytes);
+    }
+
+    const size_t n = std::min(top_n, all.size());
+    std::partial_sort(all.begin(), all.begin() + n, all.end(),
+                      [](const auto &a, const auto &b) { return a.second > b.second; });
+    all.resize(n);
+    st.top = std::move(all);
+    return st;
+}
+
 // ======================== private helpers ========================
 
 void SessionManager::moveToFront_(Entry &e)
@@ -127,20 +166,68 @@ bool SessionManager::shouldExpire_(const Session &s,
     return (now - s.last_active) > opt_.idle_ttl;
 }
 
-size_t SessionManager::evictIfNeeded_(Clock::time_point now)
+size_t SessionManager::evictIfNeeded_(Clock::time_point now, std::vector<std::shared_ptr<Session>> &dropped)
 {
     size_t removed = 0;
     while (map_.size() > opt_.max_sessions && !lru_.empty())
     {
         const std::string &sid = lru_.back();
         LOG(INFO) << "[session-gc] evict LRU session=" << sid;
-        eraseUnlocked_(sid);
+        eraseUnlocked_(sid, dropped);
+        removed++;
+    }
+    return removed;
+}
+
+size_t SessionManager::kvBytesOf_(const Session &s)
+{
+    std::lock_guard<std::mutex> lk(s.mu);
+    return s.kv_bytes ? s.kv_bytes(s) : 0;
+}
+
+size_t SessionManager::evictKvBudget_(const std::string &keep, std::vector<std::shared_ptr<Session>> &dropped)
+{
+    if (opt_.max_kv_bytes == 0)
+        return 0;
+
+    size_t total = 0;
+    for (const auto &kv : map_)
+        total += kvBytesOf_(*kv.second.session);
+
+    // 从最久未用的开始：跳过没有 KV 的、本次访问的、以及还有请求在执行 / 排队的 session
+    // 按 LRU 顺序的快照遍历：擦除会使 lru_ 上的迭代器失效
+    const std::vector<std::string> order(lru_.rbegin(), lru_.rend());
+    size_t removed = 0;
+    for (const auto &sid : order)
+    {
+        if (total <= opt_.max_kv_bytes)
+            break;
+        auto mit = map_.find(sid);
+        if (sid == keep || mit == map_.end())
+            continue;
+
+        const Session &s = *mit->second.session;
+        size_t bytes = 0;
+        {
+            std::lock_guard<std::mutex> lk(s.mu);
+            if (s.running || !s.pending.empty() || !s.kv_bytes)
+                continue;
+            bytes = s.kv_bytes(s);
+        }
+        if (bytes == 0)
+            continue;
+
+        LOG(INFO) << "[session-gc] evict session=" << sid << " kv_bytes=" << bytes
+                  << " total_kv_bytes=" << total << " budget=" << opt_.max_kv_bytes;
+        total -= bytes;
+        eraseUnlocked_(sid, dropped);
         removed++;
+        evicted_kv_budget_++;
     }
     return removed;
 }
 
-bool SessionManager::eraseUnlocked_(const std::string &session_id)
+bool SessionManager::eraseUnlocked_(const std::string &session_id, std::vector<std::shared_ptr<Session>> &dropped)
 {
     auto it = map_.find(session_id);
     if (it == map_.end())
@@ -149,6 +236,8 @@ bool SessionManager::eraseUnlocked_(const std::string &session_id)
     }
 
     lru_.erase(it->second.lru_it);
-    map_.erase(it); // shared_ptr 析构 → ModelContext 析构 → KV cache free
+    // 最后一个引用释放时：Session 析构（可能换出 KV）→ ModelContext 析构 → KV cache free
+    dropped.push_back(std::move(it->second.session));
+    map_.erase(it);
     return true;
 }
@@ -1,12 +1,15 @@
 #pragma once
 #include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <list>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "serving/core/Session.h"
 
@@ -24,10 +27,24 @@ public:
         // 每次gc最多回收多少个（避免一次gc卡太久）
         size_t gc_batch{64};
 
+        // 所有 session 的 KV 字节数上限：超过则按 LRU 淘汰（跳过正在执行的），0 表示不限制
+        size_t max_kv_bytes{0};
+
         Options()
             : idle_ttl(std::chrono::minutes(30)),
               max_sessions(1024),
-              gc_batch(64) {}
+              gc_batch(64),
+              max_kv_bytes(0) {}
+    };
+
+    struct Stats
+    {
+        size_t sessions = 0;
+        size_t kv_bytes = 0;      // 所有 session 的 KV 字节数
+        size_t kv_bytes_max = 0;  // 单个 session 的最大值
+        size_t kv_sessions = 0;   // 持有 KV 的 session 数
+        int64_t evicted_kv_budget = 0; // 因字节预算被淘汰的 session 数（累计）
+        std::vector<std::pair<std::string, size_t>> top; // KV 最大的若干 session（session_id, bytes）
     };
 
     explicit SessionManager(const Options &op);
@@ -49,6 +66,8 @@ public:
 
     // 统计信息
     size_t size() const;
+    // KV 占用统计；top_n 为按字节数列出的 session 个数
+    Stats stats(size_t top_n) const;
 
 private:
     // LRU: list front = most recent, back = least recent
@@ -63,8 +82,12 @@ private:
 private:
     void moveToFront_(Entry &e);
     bool shouldExpire_(const Session &s, Clock::time_point now) const;
-    size_t evictIfNeeded_(Clock::time_point now);
-    bool eraseUnlocked_(const std::string &session_id);
+    // 被移除的 session 放进 dropped，由调用方在锁外释放（析构可能触发 KV 换出）
+    size_t evictIfNeeded_(Clock::time_point now, std::vector<std::shared_ptr<Session>> &dropped);
+    bool eraseUnlocked_(const std::string &session_id, std::vector<std::shared_ptr<Session>> &dropped);
+    // KV 总量超过 max_kv_bytes 时从 LRU 尾部淘汰；keep 为本次访问的 session，不淘汰
+    size_t evictKvBudget_(const std::string &keep, std::vector<std::shared_ptr<Session>> &dropped);
+    static size_t kvBytesOf_(const Session &s);
 
 private:
     Options opt_;
@@ -72,6 +95,7 @@ private:
     mutable std::mutex mu_;
     std::unordered_map<std::string, Entry> map_;
     LruList lru_; // only store session_id
+    int64_t evicted_kv_budget_{0};
 };
 
 
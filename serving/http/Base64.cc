@@ -0,0 +1,203 @@
+#include "Base64.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BASE64_AVX2 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define BASE64_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace
+{
+    // 字符 -> 6 bit 值；0x40 表示空白（跳过），0x80 表示非法
+    struct DecodeTable
+    {
+        uint8_t v[256];
+        DecodeTable()
+        {
+            for (auto &x : v)
+                x = 0x80;
+            const char *abc = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            for (uint8_t i = 0; i < 64; ++i)
+                v[static_cast<uint8_t>(abc[i])] = i;
+            v[static_cast<uint8_t>(' ')] = v[static_cast<uint8_t>('\n')] = 0x40;
+            v[static_cast<uint8_t>('\r')] = v[static_cast<uint8_t>('\t')] = 0x40;
+        }
+    };
+    const DecodeTable kTable;
+
+    // 逐字节处理的最小跨度：不小于一个 SIMD 块，保证越过让 SIMD 块失败的那个字符
+    constexpr size_t kScalarSpan = 64;
+
+    // 校验 / 映射用的查找表（按字符的高、低 4 bit 查表，W. Muła / D. Lemire 的 base64 SIMD 解码）：
+    // lo[低 4 bit] & hi[高 4 bit] 非 0 即非 base64 字符；roll[高 4 bit（'/' 为 1）] 加到字符上得到 6 bit 值
+#define BASE64_LUT_LO 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A
+#define BASE64_LUT_HI 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+#define BASE64_LUT_ROLL 0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+
+#if defined(BASE64_AVX2)
+    // 每块 32 个字符 -> 24 字节（写 32 字节，多出的 8 字节落在本块已读过的输入 / 下一块的输出上）；
+    // 遇到含非 base64 字符的块停止。返回消费的字符数
+    __attribute__((target("avx2"))) size_t decode_blocks_avx2(const char *in, size_t n, char *out)
+    {
+        const __m256i lut_lo = _mm256_setr_epi8(BASE64_LUT_LO, BASE64_LUT_LO);
+        const __m256i lut_hi = _mm256_setr_epi8(BASE64_LUT_HI, BASE64_LUT_HI);
+        const __m256i lut_roll = _mm256_setr_epi8(BASE64_LUT_ROLL, BASE64_LUT_ROLL);
+        const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+        const __m256i pack_ab = _mm256_set1_epi32(0x01400140);
+        const __m256i pack_abc = _mm256_set1_epi32(0x00011000);
+        const __m256i order = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                               2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+        const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+        size_t i = 0;
+        size_t o = 0;
+        while (n - i >= 32)
+        {
+            __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+            const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(s, 4), mask_2f);
+            const __m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(s, mask_2f));
+            const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+            if (!_mm256_testz_si256(lo, hi))
+                break;
+            const __m256i eq_2f = _mm256_cmpeq_epi8(s, mask_2f);
+            s = _mm256_add_epi8(s, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles)));
+
+            // 每 4 个 6 bit 值拼成 24 bit，再按字节序重排、把两个 128 位 lane 的 12 字节拼到一起
+            s = _mm256_madd_epi16(_mm256_maddubs_epi16(s, pack_ab), pack_abc);
+            s = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(s, order), lanes);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + o), s);
+            i += 32;
+            o += 24;
+        }
+        return i;
+    }
+
+    const bool kHasAvx2 = []
+    {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+    }();
+#endif
+
+#if defined(BASE64_NEON)
+    inline uint8x16_t neon_translate(uint8x16_t s, uint8x16_t &bad)
+    {
+        static const uint8_t kLo[16] = {BASE64_LUT_LO};
+        static const uint8_t kHi[16] = {BASE64_LUT_HI};
+        static const int8_t kRoll[16] = {BASE64_LUT_ROLL};
+        const uint8x16_t hi_nibbles = vshrq_n_u8(s, 4);
+        const uint8x16_t lo = vqtbl1q_u8(vld1q_u8(kLo), vandq_u8(s, vdupq_n_u8(0x0f)));
+        const uint8x16_t hi = vqtbl1q_u8(vld1q_u8(kHi), hi_nibbles);
+        bad = vorrq_u8(bad, vandq_u8(lo, hi));
+        const uint8x16_t eq_2f = vceqq_u8(s, vdupq_n_u8(0x2f));
+        const uint8x16_t roll = vqtbl1q_u8(vreinterpretq_u8_s8(vld1q_s8(kRoll)), vaddq_u8(eq_2f, hi_nibbles));
+        return vaddq_u8(s, roll);
+    }
+
+    // 每块 64 个字符（按 4 路交错读入）-> 48 字节；遇到含非 base64 字符的块停止。返回消费的字符数
+    size_t decode_blocks_neon(const char *in, size_t n, char *out)
+    {
+        size_t i = 0;
+        size_t o = 0;
+        while (n - i >= 64)
+        {
+            uint8x16x4_t s = vld4q_u8(reinterpret_cast<const uint8_t *>(in + i));
+            uint8x16_t bad = vdupq_n_u8(0);
+            const uint8x16_t a = neon_translate(s.val[0], bad);
+            const uint8x16_t b = neon_translate(s.val[1], bad);
+            const uint8x16_t c = neon_translate(s.val[2], bad);
+            const uint8x16_t d = neon_translate(s.val[3], bad);
+            if (vmaxvq_u8(bad) != 0)
+                break;
+
+            uint8x16x3_t r;
+            r.val[0] = vorrq_u8(vshlq_n_u8(a, 2), vshrq_n_u8(b, 4));
+            r.val[1] = vorrq_u8(vshlq_n_u8(b, 4), vshrq_n_u8(c, 2));
+            r.val[2] = vorrq_u8(vshlq_n_u8(c, 6), d);
+            vst3q_u8(reinterpret_cast<uint8_t *>(out + o), r);
+            i += 64;
+            o += 48;
+        }
+        return i;
+    }
+#endif
+
+    // 从 4 字符边界开始成块解码连续的 base64 字符，返回消费的字符数（4 的倍数，写出其 3/4 字节）
+    size_t decode_blocks(const char *in, size_t n, char *out)
+    {
+#if defined(BASE64_AVX2)
+        if (kHasAvx2)
+            return decode_blocks_avx2(in, n, out);
+#elif defined(BASE64_NEON)
+        return decode_blocks_neon(in, n, out);
+#endif
+        (void)in;
+        (void)n;
+        (void)out;
+        return 0;
+    }
+} // namespace
+
+bool base64_decode_to(const char *in, size_t n, char *out, size_t &out_len)
+{
+    size_t i = 0;
+    size_t o = 0;
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t pad = 0;
+    while (i < n)
+    {
+        // 处在 4 字符边界且还没遇到填充：连续的合法字符成块解码
+        if (bits == 0 && pad == 0)
+        {
+            const size_t used = decode_blocks(in + i, n - i, out + o);
+            i += used;
+            o += used / 4 * 3;
+            if (i >= n)
+                break;
+        }
+
+        // 逐字节处理至少 kScalarSpan 个字符（空白 / 填充 / 尾部不足一块），并回到 4 字符边界
+        const size_t stop = std::min(n, i + kScalarSpan);
+        for (; i < n && (i < stop || bits != 0); ++i)
+        {
+            const uint8_t c = static_cast<uint8_t>(in[i]);
+            if (c == '=')
+            {
+                ++pad;
+                continue;
+            }
+            const uint8_t v = kTable.v[c];
+            if (v == 0x40)
+                continue;
+            // 填充之后不能再有数据
+            if (v == 0x80 || pad > 0)
+                return false;
+            acc = (acc << 6) | v;
+            bits += 6;
+            if (bits >= 8)
+            {
+                bits -= 8;
+                out[o++] = static_cast<char>((acc >> bits) & 0xFF);
+            }
+        }
+    }
+    out_len = o;
+    // 剩余不足一个字节的位必须是填充产生的 0；单个孤立字符（6 bit）不合法
+    return pad <= 2 && bits < 6 && (acc & ((1u << bits) - 1)) == 0;
+}
+
+bool base64_decode(const char *in, size_t n, std::string &out)
+{
+    // SIMD 块的整块写出最多越过实际输出 8 字节
+    out.resize(n / 4 * 3 + 16);
+    size_t len = 0;
+    const bool ok = base64_decode_to(in, n, &out[0], len);
+    out.resize(ok ? len : 0);
+    return ok;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// 标准 base64（RFC 4648，可带 '=' 填充）解码，忽略空白；非法字符返回 false
+bool base64_decode(const char *in, size_t n, std::string &out);
+
+// 同上，解码到 out：out 至少有 n / 4 * 3 + 16 字节可写，或 out <= in 且与 in 同一缓冲（就地解码，写入位置始终落后于读取位置）。
+// 成功时 out_len 为解码后的字节数。连续的 base64 字符按 32 / 64 字节一块走 SIMD（AVX2 运行时检测 / NEON），
+// 遇到空白、填充或非法字符的块退回逐字节处理
+bool base64_decode_to(const char *in, size_t n, char *out, size_t &out_len);
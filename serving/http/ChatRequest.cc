@@ -0,0 +1,389 @@
+#include "ChatRequest.h"
+#include "Base64.h"
+#include "RequestBody.h"
+#include "Sha256.h"
+#include "JsonSchemaGrammar.h"
+#include "engine/ModelRegistry.h"
+
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+using json = nlohmann::json;
+
+bool resolve_model_adapter(const json &body, const std::string &default_model, ServingContext &ctx, std::string &err)
+{
+    auto &registry = ModelRegistry::Instance();
+    std::string adapter;
+    registry.Resolve(body.value("model", default_model), ctx.model, adapter);
+    if (body.contains("lora") && body["lora"].is_string() && !body["lora"].get<std::string>().empty())
+        adapter = body["lora"].get<std::string>();
+    if (adapter.empty())
+        return true;
+
+    ModelRegistry::AdapterSpec spec;
+    if (!registry.FindAdapter(adapter, spec) || spec.model != ctx.model)
+    {
+        err = "lora adapter not found: " + adapter + " (model " + ctx.model + ")";
+        return false;
+    }
+    ctx.lora.name = spec.name;
+    ctx.lora.path = spec.path;
+    ctx.lora.scale = spec.scale;
+    return true;
+}
+
+// OpenAI 采样参数：校验类型/范围后写入 ctx.params（引擎侧由 parse_sampling_params 解析）
+// logit_bias {"token_id": bias} 序列化为 "id:bias,id:bias"
+bool forward_sampling_params(const json &body, ServingContext &ctx, std::string &err)
+{
+    struct Range
+    {
+        const char *name;
+        double lo;
+        double hi;
+    };
+    static const Range kFloats[] = {
+        {"temperature", 0.0, 2.0},
+        {"top_p", 0.0, 1.0},
+        {"min_p", 0.0, 1.0},
+        {"repeat_penalty", 0.0, 10.0},
+        {"presence_penalty", -2.0, 2.0},
+        {"frequency_penalty", -2.0, 2.0},
+    };
+    for (const auto &r : kFloats)
+    {
+        if (!body.contains(r.name) || body[r.name].is_null())
+            continue;
+        const auto &v = body[r.name];
+        if (!v.is_number() || v.get<double>() < r.lo || v.get<double>() > r.hi)
+        {
+            err = std::string(r.name) + " must be a number in [" + std::to_string(r.lo) + ", " + std::to_string(r.hi) + "]";
+            return false;
+        }
+        ctx.params[r.name] = std::to_string(v.get<double>());
+    }
+
+    if (body.contains("top_k") && !body["top_k"].is_null())
+    {
+        if (!body["top_k"].is_number_integer() || body["top_k"].get<int64_t>() < 0)
+        {
+            err = "top_k must be a non-negative integer";
+            return false;
+        }
+        ctx.params["top_k"] = std::to_string(body["top_k"].get<int64_t>());
+    }
+
+    if (body.contains("seed") && !body["seed"].is_null())
+    {
+        if (!body["seed"].is_number_integer())
+        {
+            err = "seed must be an integer";
+            return false;
+        }
+        ctx.params["seed"] = std::to_string(static_cast<uint32_t>(body["seed"].get<int64_t>()));
+    }
+
+    // n：同一 prompt 生成多个候选（引擎上限 LLAMA_MAX_N，超出时返回 400）
+    if (body.contains("n") && !body["n"].is_null())
+    {
+        if (!body["n"].is_number_integer() || body["n"].get<int64_t>() < 1 || body["n"].get<int64_t>() > 128)
+        {
+            err = "n must be an integer between 1 and 128";
+            return false;
+        }
+        ctx.n = body["n"].get<int>();
+    }
+
+    if (body.contains("logit_bias") && !body["logit_bias"].is_null())
+    {
+        const auto &lb = body["logit_bias"];
+        if (!lb.is_object() || lb.size() > 1024)
+        {
+            err = "logit_bias must be an object with at most 1024 entries";
+            return false;
+        }
+        std::string out;
+        for (auto it = lb.begin(); it != lb.end(); ++it)
+        {
+            int id = -1;
+            try
+            {
+                size_t pos = 0;
+                id = std::stoi(it.key(), &pos);
+                if (pos != it.key().size())
+                    id = -1;
+            }
+            catch (...)
+            {
+            }
+            if (id < 0 || !it.value().is_number() || it.value().get<double>() < -100.0 || it.value().get<double>() > 100.0)
+            {
+                err = "invalid logit_bias entry: " + it.key();
+                return false;
+            }
+            if (!out.empty())
+                out += ",";
+            out += std::to_string(id) + ":" + std::to_string(it.value().get<double>());
+        }
+        ctx.params["logit_bias"] = out;
+    }
+
+    if (body.contains("stop") && !body["stop"].is_null())
+    {
+        const auto &st = body["stop"];
+        const json arr = st.is_string() ? json::array({st}) : st;
+        bool ok = arr.is_array() && arr.size() <= 4;
+        for (size_t i = 0; ok && i < arr.size(); ++i)
+            ok = arr[i].is_string() && !arr[i].get<std::string>().empty() && arr[i].get<std::string>().size() <= 256;
+        if (!ok)
+        {
+            err = "stop must be a non-empty string or an array of at most 4 strings (<= 256 bytes each)";
+            return false;
+        }
+        for (const auto &s : arr)
+            ctx.stop.push_back(s.get<std::string>());
+    }
+    return true;
+}
+
+// response_format（json_object / json_schema）或 llama.cpp 扩展 grammar（GBNF 文本）-> ctx.params["grammar"]
+// json_schema 从原始 body 按 ordered_json 重新解析，保持属性声明顺序
+bool forward_response_format(const json &body, const std::string &raw_body, ServingContext &ctx, std::string &err)
+{
+    if (body.contains("grammar") && !body["grammar"].is_null())
+    {
+        if (!body["grammar"].is_string() || body["grammar"].get<std::string>().empty())
+        {
+            err = "grammar must be a non-empty string";
+            return false;
+        }
+        ctx.params["grammar"] = body["grammar"].get<std::string>();
+    }
+
+    if (!body.contains("response_format") || body["response_format"].is_null())
+        return true;
+    const auto &rf = body["response_format"];
+    const std::string type = rf.is_object() ? rf.value("type", "") : "";
+    if (type == "text")
+        return true;
+    if (type == "json_object")
+    {
+        ctx.params["grammar"] = json_object_gbnf();
+        return true;
+    }
+    if (type != "json_schema")
+    {
+        err = "response_format.type must be text, json_object or json_schema";
+        return false;
+    }
+
+    const auto ordered = nlohmann::ordered_json::parse(raw_body, nullptr, false);
+    if (ordered.is_discarded() || !ordered["response_format"].contains("json_schema") ||
+        !ordered["response_format"]["json_schema"].is_object() ||
+        !ordered["response_format"]["json_schema"].contains("schema"))
+    {
+        err = "response_format.json_schema.schema is required";
+        return false;
+    }
+
+    std::string gbnf;
+    if (!json_schema_to_gbnf(ordered["response_format"]["json_schema"]["schema"], gbnf, err))
+        return false;
+    ctx.params["grammar"] = gbnf;
+    return true;
+}
+
+void forward_generation_params(const json &body, ServingContext &ctx)
+{
+    if (body.contains("max_tokens") && body["max_tokens"].is_number_integer())
+    {
+        const int max_tokens = body["max_tokens"].get<int>();
+        if (max_tokens > 0)
+            ctx.params["max_tokens"] = std::to_string(max_tokens);
+    }
+    if (body.contains("speculative") && body["speculative"].is_boolean())
+        ctx.params["speculative"] = body["speculative"].get<bool>() ? "true" : "false";
+}
+
+namespace
+{
+    // 图片 id：SHA-256 + 字节数（同一张图片在多轮对话 / 不同请求中得到同一个 id）。
+    // id 是进程内所有 session / 客户端共享的图片缓存的键，必须抗碰撞：否则可构造与常见图片同 id 的图片污染缓存
+    std::string image_id(const char *data, size_t n)
+    {
+        return sha256_hex(data, n) + "-" + std::to_string(n);
+    }
+
+    // IMAGE_FILE_ROOT 下的文件（realpath 之后仍需在根目录内）；未配置时不允许读本地文件
+    bool read_image_file(const std::string &path, std::string &out, std::string &err)
+    {
+        const char *root_env = std::getenv("IMAGE_FILE_ROOT");
+        char root[PATH_MAX];
+        char real[PATH_MAX];
+        if (!root_env || !*root_env || !realpath(root_env, root))
+        {
+            err = "image file input is disabled (IMAGE_FILE_ROOT not set)";
+            return false;
+        }
+        const std::string prefix = std::string(root) + "/";
+        if (!realpath(path.c_str(), real) || std::string(real).compare(0, prefix.size(), prefix) != 0)
+        {
+            err = "image file not found under IMAGE_FILE_ROOT: " + path;
+            return false;
+        }
+        std::ifstream in(real, std::ios::binary);
+        if (!in)
+        {
+            err = "cannot read image file: " + path;
+            return false;
+        }
+        out.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    bool load_image(const json &part, const InlineImages *inline_images, ImageInput &img, std::string &err)
+    {
+        const json *url = nullptr;
+        if (part.contains("image_url"))
+        {
+            const auto &iu = part["image_url"];
+            url = iu.is_object() && iu.contains("url") ? &iu["url"] : &iu;
+        }
+        if (!url || !url->is_string())
+        {
+            err = "image_url.url must be a string";
+            return false;
+        }
+
+        const std::string &u = url->get_ref<const std::string &>();
+        const size_t scheme_len = std::strlen(kInlineImageScheme);
+        if (inline_images && u.compare(0, scheme_len, kInlineImageScheme) == 0)
+        {
+            // 接收请求体时已就地解码的 data: URL（见 RequestBody.h）
+            char *end = nullptr;
+            const unsigned long k = std::strtoul(u.c_str() + scheme_len, &end, 10);
+            if (end == u.c_str() + scheme_len || *end != '\0' || k >= inline_images->spans.size())
+            {
+                err = "unsupported image url: " + u;
+                return false;
+            }
+            img.data = inline_images->buf;
+            img.offset = inline_images->spans[k].first;
+            img.size = inline_images->spans[k].second;
+            if (img.size == 0)
+            {
+                err = "empty image";
+                return false;
+            }
+            img.id = image_id(img.bytes(), img.size);
+            return true;
+        }
+
+        auto data = std::make_shared<std::string>();
+        if (u.compare(0, 5, "data:") == 0)
+        {
+            const size_t comma = u.find(',');
+            if (comma == std::string::npos || u.rfind(";base64", comma) == std::string::npos)
+            {
+                err = "image data URL must be base64 encoded";
+                return false;
+            }
+            if (!base64_decode(u.data() + comma + 1, u.size() - comma - 1, *data))
+            {
+                err = "invalid base64 in image data URL";
+                return false;
+            }
+        }
+        else if (u.compare(0, 7, "file://") == 0 || (!u.empty() && u[0] == '/'))
+        {
+            if (!read_image_file(u.compare(0, 7, "file://") == 0 ? u.substr(7) : u, *data, err))
+                return false;
+        }
+        else
+        {
+            err = "unsupported image url (expected data: URL or file under IMAGE_FILE_ROOT)";
+            return false;
+        }
+        if (data->empty())
+        {
+            err = "empty image";
+            return false;
+        }
+
+        img.id = image_id(data->data(), data->size());
+        img.size = data->size();
+        img.data = std::move(data);
+        return true;
+    }
+
+    // 图片标记只能由 image_url 部件产生：文本里的字面标记会让 prompt 中的标记与图片错位
+    bool check_text(const std::string &text, std::string &err)
+    {
+        if (text.find(kMediaMarker) == std::string::npos)
+            return true;
+        err = std::string("message content must not contain the reserved image marker ") + kMediaMarker;
+        return false;
+    }
+} // namespace
+
+bool parse_chat_messages(const json &body, ServingContext &ctx, std::string &err, const InlineImages *inline_images)
+{
+    ctx.messages.clear();
+    for (const auto &m : body["messages"])
+    {
+        if (!m.is_object())
+        {
+            err = "each message must be an object";
+            return false;
+        }
+
+        Message msg;
+        msg.role = m.contains("role") && m["role"].is_string() ? m["role"].get<std::string>() : "";
+        const json &content = m.contains("content") ? m["content"] : json();
+        if (content.is_string())
+        {
+            msg.content = content.get<std::string>();
+            if (!check_text(msg.content, err))
+                return false;
+        }
+        else if (content.is_array())
+        {
+            for (const auto &part : content)
+            {
+                const std::string type = part.is_object() ? part.value("type", "") : "";
+                if (type == "text" && part.contains("text") && part["text"].is_string())
+                {
+                    const std::string &text = part["text"].get_ref<const std::string &>();
+                    if (!check_text(text, err))
+                        return false;
+                    msg.content += text;
+                }
+                else if (type == "image_url")
+                {
+                    ImageInput img;
+                    if (!load_image(part, inline_images, img, err))
+                        return false;
+                    msg.content += kMediaMarker;
+                    msg.images.push_back(std::move(img));
+                }
+                else
+                {
+                    err = "unsupported content part type: " + (type.empty() ? std::string("(none)") : type);
+                    return false;
+                }
+            }
+        }
+        else if (!content.is_null())
+        {
+            err = "message content must be a string or an array of content parts";
+            return false;
+        }
+        ctx.messages.push_back(std::move(msg));
+    }
+    return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "../../utils/json.hpp"
+#include "serving/core/ServingContext.h"
+
+#include <string>
+
+struct InlineImages;
+
+/**
+ * @brief chat 请求体 -> ServingContext 的参数转换（HTTP 网关与离线批处理共用）
+ *
+ * 只做校验与格式转换，结果写入 ctx.params / ctx.stop / ctx.n，由引擎解析；非法时返回 false 与错误信息。
+ */
+
+// model -> ctx.model（基座模型）与 ctx.lora：model 可以是模型名、adapter 名或 "<模型>:<adapter>"，
+// 请求体 lora 字段（adapter 名）优先；adapter 未注册或不属于该模型时返回 false。模型本身是否存在由调用方检查
+bool resolve_model_adapter(const nlohmann::json &body, const std::string &default_model, ServingContext &ctx,
+                           std::string &err);
+
+// OpenAI 采样参数（temperature / top_p / ... / seed / logit_bias / stop / n）
+bool forward_sampling_params(const nlohmann::json &body, ServingContext &ctx, std::string &err);
+
+// response_format（json_object / json_schema）或 grammar -> ctx.params["grammar"]；raw_body 用于按声明顺序解析 schema
+bool forward_response_format(const nlohmann::json &body, const std::string &raw_body, ServingContext &ctx,
+                             std::string &err);
+
+// max_tokens / speculative（非法值忽略，按缺省处理）
+void forward_generation_params(const nlohmann::json &body, ServingContext &ctx);
+
+// messages -> ctx.messages；content 可以是字符串，或 OpenAI content 数组（text / image_url）：
+// 文本拼接，图片处写入 kMediaMarker，图片字节放进 Message::images；文本中含字面 kMediaMarker 时报错。
+// image_url 支持 data:<mime>;base64,... 与 IMAGE_FILE_ROOT 下的文件（file://<path> 或绝对路径）；
+// inline_images 非空时还接受接收阶段已抽出的图片（inline-image:<i>，见 RequestBody.h）
+bool parse_chat_messages(const nlohmann::json &body, ServingContext &ctx, std::string &err,
+                         const InlineImages *inline_images = nullptr);
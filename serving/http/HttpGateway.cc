@@ -5,11 +5,17 @@
 #include "serving/core/ServingContext.h"
 #include "serving/core/SessionManager.h"
 #include "OpenAIStreamWriter.h"
+#include "ChatRequest.h"
+#include "RequestBody.h"
+#include "serving/core/ModelEngine.h"
+#include "engine/ModelRegistry.h"
+#include "engine/LlamaThreadBudget.h"
 
 #include "../../utils/json.hpp"
 #include <glog/logging.h>
 
 #include <atomic>
+#include <climits>
 #include <cstdlib>
 #include <chrono>
 #include <condition_variable>
@@ -41,6 +47,23 @@ namespace
         }
     }
 
+    // SESSION_KV_BUDGET_MB：所有 session 的 KV 字节预算，0 / 缺省为不限制
+    size_t get_session_kv_budget()
+    {
+        const char *env = std::getenv("SESSION_KV_BUDGET_MB");
+        if (!env || !*env)
+            return 0;
+        try
+        {
+            const long v = std::stol(env);
+            return v > 0 ? static_cast<size_t>(v) << 20 : 0;
+        }
+        catch (...)
+        {
+            return 0;
+        }
+    }
+
     std::string get_default_model()
     {
         const char *env = std::getenv("DEFAULT_MODEL");
@@ -57,30 +80,53 @@ namespace
 
     bool msg_equal(const Message &a, const Message &b)
     {
-        return a.role == b.role && a.content == b.content;
-    }
-
-    bool is_prefix(const std::vector<Message> &history,
-                   const std::vector<Message> &incoming)
-    {
-        if (history.size() > incoming.size())
+        if (a.role != b.role || a.content != b.content || a.images.size() != b.images.size())
             return false;
-        for (size_t i = 0; i < history.size(); ++i)
+        for (size_t i = 0; i < a.images.size(); ++i)
         {
-            if (!msg_equal(history[i], incoming[i]))
+            if (a.images[i].id != b.images[i].id)
                 return false;
         }
         return true;
     }
 
-    std::vector<Message> diff_messages(const std::vector<Message> &history,
-                                       const std::vector<Message> &incoming)
+    // 客户端全量 messages 与 session history 比对（调用方持有 session.mu），ctx.messages 改为需要写入 KV 的消息：
+    // - history 是前缀：只留其后的新消息
+    // - 中途分歧（编辑 / 重新生成）：history 截到公共前缀，留分歧点之后的消息，并标记 kv_rewind，
+    //   由引擎按 token 找 KV 与新 prompt 的最长公共前缀，只 prefill 分歧之后的部分
+    // - 没有公共前缀：清空 history 与 KV
+    // 上下文平移过的 session 跳过客户端 messages 中被丢弃的区间 [shift_head, shift_head + n_shifted)，
+    // 分歧落在保留的开头（system prompt）里时按没有公共前缀处理。原地比较，不复制 history
+    void diff_session_messages(Session &session, ServingContext &ctx)
     {
-        if (!is_prefix(history, incoming))
+        auto &history = session.history;
+        const auto &messages = ctx.messages;
+        const size_t head = session.shift_head;
+        const size_t gap = session.n_shifted;
+
+        size_t n = 0;
+        if (gap == 0 || (history.size() >= head && messages.size() >= head + gap))
         {
-            return incoming;
+            for (; n < history.size(); ++n)
+            {
+                const size_t j = n < head ? n : n + gap;
+                if (j >= messages.size() || !msg_equal(history[n], messages[j]))
+                    break;
+            }
         }
-        return std::vector<Message>(incoming.begin() + history.size(), incoming.end());
+
+        if (n == 0 || (gap > 0 && n < head))
+        {
+            history.clear();
+            session.shift_head = 0;
+            session.n_shifted = 0;
+            session.model_ctx.reset();
+            return;
+        }
+
+        ctx.kv_rewind = n < history.size();
+        history.resize(n);
+        ctx.messages.erase(ctx.messages.begin(), ctx.messages.begin() + (n < head ? n : n + gap));
     }
 
     // FinishReason -> openai finish_reaso
@@ -100,6 +146,69 @@ namespace
         }
     }
 
+    std::string get_embedding_model()
+    {
+        const char *env = std::getenv("EMBEDDING_MODEL");
+        if (env && *env)
+            return std::string(env);
+        return "embedding";
+    }
+
+    json adapter_to_json(const ModelRegistry::AdapterSpec &a)
+    {
+        return {{"name", a.name}, {"model", a.model}, {"path", a.path}, {"scale", a.scale}};
+    }
+
+    // 运行时注册只接受 LORA_ADAPTER_ROOT 下的文件（realpath 之后仍需在根目录内），未配置时不开放
+    bool resolve_adapter_path(const std::string &path, std::string &out, std::string &err)
+    {
+        const char *root_env = std::getenv("LORA_ADAPTER_ROOT");
+        char root[PATH_MAX];
+        char real[PATH_MAX];
+        if (!root_env || !*root_env || !realpath(root_env, root))
+        {
+            err = "runtime adapter registration is disabled (LORA_ADAPTER_ROOT not set)";
+            return false;
+        }
+        const std::string prefix = std::string(root) + "/";
+        if (!realpath(path.c_str(), real) || std::string(real).compare(0, prefix.size(), prefix) != 0)
+        {
+            err = "adapter file not found under LORA_ADAPTER_ROOT: " + path;
+            return false;
+        }
+        out = real;
+        return true;
+    }
+
+    // float32 数组按小端字节序做 base64（OpenAI encoding_format=base64）
+    std::string base64_floats(const std::vector<float> &v)
+    {
+        static const char kTable[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        const auto *p = reinterpret_cast<const unsigned char *>(v.data());
+        const size_t n = v.size() * sizeof(float);
+
+        std::string out;
+        out.reserve((n + 2) / 3 * 4);
+        size_t i = 0;
+        for (; i + 3 <= n; i += 3)
+        {
+            const uint32_t x = (p[i] << 16) | (p[i + 1] << 8) | p[i + 2];
+            out += kTable[(x >> 18) & 63];
+            out += kTable[(x >> 12) & 63];
+            out += kTable[(x >> 6) & 63];
+            out += kTable[x & 63];
+        }
+        if (i < n)
+        {
+            const uint32_t x = (p[i] << 16) | (i + 1 < n ? p[i + 1] << 8 : 0);
+            out += kTable[(x >> 18) & 63];
+            out += kTable[(x >> 12) & 63];
+            out += i + 1 < n ? kTable[(x >> 6) & 63] : '=';
+            out += '=';
+        }
+        return out;
+    }
+
 } // namespace
 
 HttpGateway::HttpGateway()
@@ -112,6 +221,7 @@ HttpGateway::HttpGateway()
     opt.idle_ttl = std::chrono::minutes(30);
     opt.max_sessions = 1024;
     opt.gc_batch = 64;
+    opt.max_kv_bytes = get_session_kv_budget();
 
     session_mgr_ = std::make_unique<SessionManager>(opt);
 
@@ -164,6 +274,31 @@ void HttpGateway::RecordFinish(FinishReason reason, int64_t dur_ms)
         cancelled_requests_.fetch_add(1, std::memory_order_relaxed);
 }
 
+bool HttpGateway::CheckModelAvailable(HttpResponse &res, const std::string &model)
+{
+    auto &registry = ModelRegistry::Instance();
+    if (!registry.Contains(model))
+    {
+        WriteError(res, 404, "model not found: " + model, "invalid_request_error", "model_not_found");
+        return false;
+    }
+    // 预加载中、按需加载中或为预算卸载中：在后台加载（EnsureLoaded 发起），不在请求线程上等待
+    std::string load_error;
+    if (!registry.Ready(model) || !registry.EnsureLoaded(model, &load_error))
+    {
+        // 上次加载失败、仍在重试退避期内：直接报原因，而不是让客户端一直重试 model_loading
+        if (!load_error.empty())
+        {
+            WriteError(res, 500, load_error, "server_error", "load_failed");
+            return false;
+        }
+        res.SetHeader("Retry-After", "5");
+        WriteError(res, 503, "model is loading: " + model, "server_error", "model_loading");
+        return false;
+    }
+    return true;
+}
+
 void HttpGateway::HandleHealth(const HttpRequest &req, HttpResponse &res)
 {
     (void)req;
@@ -172,11 +307,33 @@ void HttpGateway::HandleHealth(const HttpRequest &req, HttpResponse &res)
             std::chrono::steady_clock::now() - start_time_)
             .count();
 
-    json out = {
-        {"status", "ok"},
-        {"uptime_ms", uptime_ms}};
+    // 启动预加载未结束时报 loading（503），便于负载均衡 / k8s readiness 探针在就绪前不转发流量；
+    // 模型加载失败报 failed：缺省模型失败时整体 503（failed），其它模型失败为 degraded（200）
+    auto &registry = ModelRegistry::Instance();
+    const bool ready = registry.Ready();
+    json models = json::object();
+    json failed = json::object();
+    bool default_failed = false;
+    for (const auto &kv : registry.GetStats())
+    {
+        models[kv.first] = kv.second.state;
+        if (kv.second.state != "failed")
+            continue;
+        failed[kv.first] = kv.second.load_error;
+        default_failed = default_failed || kv.first == get_default_model();
+    }
 
-    res.SetStatus(200, "OK");
+    const char *status = !ready ? "loading" : default_failed ? "failed" : failed.empty() ? "ready" : "degraded";
+    json out = {
+        {"status", status},
+        {"uptime_ms", uptime_ms},
+        {"models", models}};
+    if (!failed.empty())
+        out["load_errors"] = failed;
+    if (ready)
+        out["ready_ms"] = registry.ready_ms();
+
+    res.SetStatus(ready && !default_failed ? 200 : 503);
     res.SetHeader("Content-Type", "application/json");
     res.SetHeader("Connection", "close");
     res.Write(out.dump());
@@ -198,6 +355,96 @@ void HttpGateway::HandleMetrics(const HttpRequest &req, HttpResponse &res)
         {"requests_cancelled_total", cancelled_requests_.load(std::memory_order_relaxed)},
         {"avg_latency_ms", avg_latency_ms}};
 
+    // 引擎内部指标（按已加载的模型）
+    auto &registry = ModelRegistry::Instance();
+    json engines = json::object();
+    for (const auto &kv : registry.Loaded())
+    {
+        std::map<std::string, double> m;
+        kv.second->CollectMetrics(m);
+        if (!m.empty())
+            engines[kv.first] = m;
+    }
+    out["engines"] = engines;
+
+    // 模型注册表：加载 / 卸载耗时与常驻内存
+    json models = json::object();
+    for (const auto &kv : registry.GetStats())
+    {
+        const auto &st = kv.second;
+        models[kv.first] = {
+            {"state", st.state},
+            {"loaded", st.loaded},
+            {"in_flight", st.in_flight},
+            {"resident_bytes", st.resident_bytes},
+            {"loads_total", st.loads},
+            {"unloads_total", st.unloads},
+            {"load_failures_total", st.load_failures},
+            {"last_load_ms", st.last_load_ms},
+            {"last_unload_ms", st.last_unload_ms},
+            {"load_ms_total", st.load_ms_total},
+            {"unload_ms_total", st.unload_ms_total}};
+    }
+    out["models"] = models;
+    out["model_resident_bytes"] = registry.resident_bytes();
+    out["model_ram_budget_bytes"] = registry.budget_bytes();
+    out["startup_ready_ms"] = registry.ready_ms();
+
+    // 进程级 CPU 线程预算：核占用率与各阶段实际使用的线程数
+    const auto tst = LlamaThreadBudget::Instance().GetStats();
+    if (tst.enabled)
+    {
+        json phases = json::object();
+        for (int i = 0; i < static_cast<int>(LlamaThreadBudget::Phase::count); ++i)
+        {
+            const auto &ps = tst.phases[i];
+            if (ps.calls == 0)
+                continue;
+            phases[LlamaThreadBudget::PhaseName(static_cast<LlamaThreadBudget::Phase>(i))] = {
+                {"calls_total", ps.calls},
+                {"avg_threads", static_cast<double>(ps.threads_total) / ps.calls},
+                {"min_threads", ps.min_threads},
+                {"max_threads", ps.max_threads},
+                {"busy_ms_total", ps.busy_ms},
+                {"wait_ms_total", ps.wait_ms}};
+        }
+        out["threads"] = {
+            {"budget", tst.budget},
+            {"cpu_set", tst.cpu_set},
+            {"pools", tst.pools},
+            {"cores_busy", tst.cores_busy},
+            {"active_contexts", tst.active},
+            {"waits_total", tst.waits},
+            {"utilization", tst.utilization},
+            {"phases", phases}};
+    }
+
+    // 请求体接收：大小、超限拒绝与就地抽出的图片
+    const auto bst = request_body_stats();
+    out["http_body"] = {
+        {"bodies_total", bst.bodies},
+        {"body_bytes_total", bst.body_bytes},
+        {"body_bytes_max", bst.body_bytes_max},
+        {"max_body_bytes", http_max_body_bytes()},
+        {"rejected_total", bst.rejected},
+        {"inline_images_total", bst.inline_images},
+        {"inline_image_bytes_total", bst.inline_image_bytes},
+        {"inline_decode_ms_total", bst.inline_decode_ms}};
+
+    // session 的 KV 占用（独占 context 为预分配大小，共享 slot 为已写入部分）
+    const auto sst = session_mgr_->stats(10);
+    json top = json::array();
+    for (const auto &kv : sst.top)
+        top.push_back({{"session_id", kv.first}, {"kv_bytes", kv.second}});
+    out["sessions"] = {
+        {"count", sst.sessions},
+        {"with_kv", sst.kv_sessions},
+        {"kv_bytes", sst.kv_bytes},
+        {"kv_bytes_max", sst.kv_bytes_max},
+        {"kv_budget_bytes", get_session_kv_budget()},
+        {"evicted_kv_budget_total", sst.evicted_kv_budget},
+        {"top_kv", top}};
+
     res.SetStatus(200, "OK");
     res.SetHeader("Content-Type", "application/json");
     res.SetHeader("Connection", "close");
@@ -205,6 +452,242 @@ void HttpGateway::HandleMetrics(const HttpRequest &req, HttpResponse &res)
     res.End();
 }
 
+void HttpGateway::HandleListModels(const HttpRequest &req, HttpResponse &res)
+{
+    (void)req;
+    json data = json::array();
+    for (const auto &kv : ModelRegistry::Instance().GetStats())
+    {
+        json m = {{"id", kv.first}, {"object", "model"}, {"owned_by", "local"}, {"status", kv.second.state}};
+        if (kv.second.state == "failed")
+            m["load_error"] = kv.second.load_error;
+        data.push_back(m);
+    }
+
+    res.SetStatus(200, "OK");
+    res.SetHeader("Content-Type", "application/json");
+    res.SetHeader("Connection", "close");
+    res.Write(json{{"object", "list"}, {"data", data}}.dump(-1, ' ', false, json::error_handler_t::replace));
+    res.End();
+}
+
+void HttpGateway::HandleListLoraAdapters(const HttpRequest &req, HttpResponse &res)
+{
+    (void)req;
+    json data = json::array();
+    for (const auto &a : ModelRegistry::Instance().ListAdapters())
+        data.push_back(adapter_to_json(a));
+
+    res.SetStatus(200, "OK");
+    res.SetHeader("Content-Type", "application/json");
+    res.SetHeader("Connection", "close");
+    res.Write(json{{"object", "list"}, {"data", data}}.dump(-1, ' ', false, json::error_handler_t::replace));
+    res.End();
+}
+
+void HttpGateway::HandleRegisterLoraAdapter(const HttpRequest &req, HttpResponse &res)
+{
+    json body;
+    try
+    {
+        body = json::parse(req.body);
+    }
+    catch (...)
+    {
+        WriteError(res, 400, "invalid json", "invalid_request_error", "invalid_json");
+        return;
+    }
+    if (!body.is_object() || !body.contains("name") || !body["name"].is_string() ||
+        !body.contains("path") || !body["path"].is_string())
+    {
+        WriteError(res, 400, "name and path must be strings", "invalid_request_error", "invalid_lora_adapter");
+        return;
+    }
+    if (body.contains("scale") && !body["scale"].is_number())
+    {
+        WriteError(res, 400, "scale must be a number", "invalid_request_error", "invalid_lora_adapter", "scale");
+        return;
+    }
+
+    ModelRegistry::AdapterSpec spec;
+    spec.name = body["name"].get<std::string>();
+    spec.model = body.contains("model") && body["model"].is_string() ? body["model"].get<std::string>()
+                                                                      : get_default_model();
+    spec.scale = body.value("scale", 1.0f);
+
+    std::string err;
+    if (!resolve_adapter_path(body["path"].get<std::string>(), spec.path, err))
+    {
+        WriteError(res, 403, err, "invalid_request_error", "invalid_lora_adapter", "path");
+        return;
+    }
+    // 只登记：文件在第一个使用它的请求到来时由基座模型的引擎加载
+    if (!ModelRegistry::Instance().RegisterAdapter(spec, err))
+    {
+        WriteError(res, 400, err, "invalid_request_error", "invalid_lora_adapter");
+        return;
+    }
+
+    res.SetStatus(200, "OK");
+    res.SetHeader("Content-Type", "application/json");
+    res.SetHeader("Connection", "close");
+    res.Write(adapter_to_json(spec).dump(-1, ' ', false, json::error_handler_t::replace));
+    res.End();
+}
+
+void HttpGateway::HandleEmbeddings(const HttpRequest &req, HttpResponse &res)
+{
+    const auto start_time = std::chrono::steady_clock::now();
+    total_requests_.fetch_add(1, std::memory_order_relaxed);
+    in_flight_.fetch_add(1, std::memory_order_relaxed);
+
+    auto fail = [&](int status, const std::string &message, const std::string &type, const std::string &code)
+    {
+        WriteError(res, status, message, type, code);
+        const auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                std::chrono::steady_clock::now() - start_time)
+                                .count();
+        RecordFinish(FinishReason::error, dur_ms);
+    };
+
+    json body;
+    try
+    {
+        body = json::parse(req.body);
+    }
+    catch (...)
+    {
+        fail(400, "invalid json", "invalid_request_error", "invalid_json");
+        return;
+    }
+
+    auto ctx = std::make_shared<ServingContext>();
+    ctx->request_id = gen_request_id();
+    ctx->model = body.value("model", get_embedding_model());
+    ctx->stream = false;
+    if (!CheckModelAvailable(res, ctx->model))
+    {
+        const auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                std::chrono::steady_clock::now() - start_time)
+                                .count();
+        RecordFinish(FinishReason::error, dur_ms);
+        return;
+    }
+
+    // input：字符串或字符串数组
+    const json &input = body.contains("input") ? body["input"] : json();
+    if (input.is_string())
+    {
+        ctx->inputs.push_back(input.get<std::string>());
+    }
+    else if (input.is_array() && !input.empty())
+    {
+        for (const auto &v : input)
+        {
+            if (!v.is_string())
+            {
+                fail(400, "input must be a string or an array of strings", "invalid_request_error", "invalid_input");
+                return;
+            }
+            ctx->inputs.push_back(v.get<std::string>());
+        }
+    }
+    else
+    {
+        fail(400, "input must be a string or an array of strings", "invalid_request_error", "invalid_input");
+        return;
+    }
+
+    const std::string encoding = body.value("encoding_format", "float");
+    if (encoding != "float" && encoding != "base64")
+    {
+        fail(400, "encoding_format must be float or base64", "invalid_request_error", "invalid_encoding_format");
+        return;
+    }
+
+    res.SetOnClose([ctx]
+                   {
+                       ctx->cancelled.store(true, std::memory_order_release);
+                       ctx->EmitFinish(FinishReason::cancelled); });
+
+    // embedding 引擎自带合批（IsAsync），Execute 直接交给引擎
+    if (!executor_.Execute(ctx) && !ctx->finished.load(std::memory_order_acquire))
+    {
+        ctx->error_message = "model not found: " + ctx->model;
+        ctx->EmitFinish(FinishReason::error);
+    }
+
+    ctx->WaitFinishOrCancel([&res]
+                            { return res.IsAlive(); }, std::chrono::milliseconds(100));
+
+    const auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - start_time)
+                            .count();
+    RecordFinish(ctx->finish_reason, dur_ms);
+    LOG(INFO) << "[embd] done req=" << ctx->request_id
+              << " model=" << ctx->model
+              << " inputs=" << ctx->inputs.size()
+              << " prompt_tokens=" << ctx->usage.prompt_tokens
+              << " dur_ms=" << dur_ms
+              << " reason=" << finish_reason_to_str(ctx->finish_reason);
+
+    if (!res.IsAlive())
+        return;
+
+    if (!ctx->error_message.empty() || ctx->finish_reason != FinishReason::stop)
+    {
+        if (ctx->params.count("error_code") && ctx->params["error_code"] == "model_loading")
+        {
+            res.SetHeader("Retry-After", "5");
+            WriteError(res, 503, ctx->error_message, "server_error", "model_loading");
+            return;
+        }
+        if (ctx->params.count("error_code") && ctx->params["error_code"] == "load_failed")
+        {
+            WriteError(res, 500, ctx->error_message, "server_error", "load_failed");
+            return;
+        }
+        const bool overloaded = ctx->params.count("error_code") && ctx->params["error_code"] == "overloaded";
+        WriteError(res,
+                   overloaded ? 429 : 500,
+                   ctx->error_message.empty() ? "engine error" : ctx->error_message,
+                   overloaded ? "rate_limit_error" : "internal_error",
+                   overloaded ? "queue_full" : "internal_error");
+        return;
+    }
+
+    // 非 embedding 引擎不会填充 embeddings
+    if (ctx->embeddings.size() != ctx->inputs.size())
+    {
+        WriteError(res, 400, "model does not support embeddings: " + ctx->model, "invalid_request_error", "model_not_supported");
+        return;
+    }
+
+    json data = json::array();
+    for (size_t i = 0; i < ctx->embeddings.size(); ++i)
+    {
+        json item = {{"object", "embedding"}, {"index", i}};
+        if (encoding == "base64")
+            item["embedding"] = base64_floats(ctx->embeddings[i]);
+        else
+            item["embedding"] = ctx->embeddings[i];
+        data.push_back(std::move(item));
+    }
+
+    json out = {
+        {"object", "list"},
+        {"data", std::move(data)},
+        {"model", ctx->model},
+        {"usage",
+         {{"prompt_tokens", ctx->usage.prompt_tokens},
+          {"total_tokens", ctx->usage.prompt_tokens}}}};
+
+    res.SetHeader("Content-Type", "application/json");
+    res.SetHeader("Connection", "close");
+    res.Write(out.dump(-1, ' ', false, json::error_handler_t::replace));
+    res.End();
+}
+
 void HttpGateway::HandleCompletion(const HttpRequest &req, HttpResponse &res)
 {
     (void)req;
@@ -243,7 +726,20 @@ void HttpGateway::HandleChatCompletion(const HttpRequest &req, HttpResponse &res
         return;
     }
 
-    const std::string model = body.value("model", get_default_model());
+    // model 可带 LoRA adapter（见 5.11）：ctx->model 为基座模型，响应里回显请求的名字
+    auto ctx = std::make_shared<ServingContext>();
+    const std::string requested_model = body.value("model", get_default_model());
+    std::string lora_err;
+    if (!resolve_model_adapter(body, get_default_model(), *ctx, lora_err))
+    {
+        WriteError(res, 404, lora_err, "invalid_request_error", "model_not_found");
+        const auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                std::chrono::steady_clock::now() - start_time)
+                                .count();
+        RecordFinish(FinishReason::error, dur_ms);
+        return;
+    }
+    const std::string model = ctx->model;
     if (!body.contains("messages") || !body["messages"].is_array())
     {
         WriteError(res, 400, "messages must be array", "invalid_request_error", "invalid_messages");
@@ -253,13 +749,50 @@ void HttpGateway::HandleChatCompletion(const HttpRequest &req, HttpResponse &res
         RecordFinish(FinishReason::error, dur_ms);
         return;
     }
+    if (!CheckModelAvailable(res, model))
+    {
+        const auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                std::chrono::steady_clock::now() - start_time)
+                                .count();
+        RecordFinish(FinishReason::error, dur_ms);
+        return;
+    }
 
-    auto ctx = std::make_shared<ServingContext>();
     ctx->request_id = gen_request_id();
-    ctx->model = model;
     ctx->stream = false;
     ctx->is_chat = true;
 
+    std::string sampling_err;
+    if (!forward_sampling_params(body, *ctx, sampling_err))
+    {
+        WriteError(res, 400, sampling_err, "invalid_request_error", "invalid_sampling_params");
+        const auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                std::chrono::steady_clock::now() - start_time)
+                                .count();
+        RecordFinish(FinishReason::error, dur_ms);
+        return;
+    }
+    if (!forward_response_format(body, req.body, *ctx, sampling_err))
+    {
+        WriteError(res, 400, sampling_err, "invalid_request_error", "invalid_response_format");
+        const auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                std::chrono::steady_clock::now() - start_time)
+                                .count();
+        RecordFinish(FinishReason::error, dur_ms);
+        return;
+    }
+
+    // messages（content 数组中的图片在这里解码 / 读取）
+    if (!parse_chat_messages(body, *ctx, sampling_err, req.inline_images.get()))
+    {
+        WriteError(res, 400, sampling_err, "invalid_request_error", "invalid_messages");
+        const auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                std::chrono::steady_clock::now() - start_time)
+                                .count();
+        RecordFinish(FinishReason::error, dur_ms);
+        return;
+    }
+
     // session_id
     std::string session_id;
     if (body.contains("session_id") && body["session_id"].is_string())
@@ -269,63 +802,39 @@ void HttpGateway::HandleChatCompletion(const HttpRequest &req, HttpResponse &res
 
     ctx->session_id = session_id;
     ctx->session = session_mgr_->getOrCreate(session_id, model);
+    if (session_id == ctx->request_id)
+        ctx->session->ephemeral = true;
 
     // generation params
-    if (body.contains("max_tokens") && body["max_tokens"].is_number_integer())
-    {
-        const int max_tokens = body["max_tokens"].get<int>();
-        if (max_tokens > 0)
-            ctx->params["max_tokens"] = std::to_string(max_tokens);
-    }
+    forward_generation_params(body, *ctx);
 
-    // parse messages
-    ctx->messages.clear();
-    for (const auto &m : body["messages"])
-    {
-        ctx->messages.push_back({m.value("role", ""), m.value("content", "")});
-    }
-
-    // 备份客户端全量 messages（用于更新 history）
-    const std::vector<Message> client_messages = ctx->messages;
-
-    // auto-diff（只在锁内读写 session）
+    // auto-diff（只在锁内读写 session）：ctx->messages 变为本轮新增的消息
     auto session = ctx->session;
     {
         std::lock_guard<std::mutex> lk(session->mu);
 
-        const std::vector<Message> &incoming = ctx->messages;
+        const size_t n_incoming = ctx->messages.size();
         if (!session->history.empty())
-        {
-            if (is_prefix(session->history, incoming))
-            {
-                ctx->messages = diff_messages(session->history, incoming);
-            }
-            else
-            {
-                session->history.clear();
-                session->model_ctx.reset();
-                ctx->messages = incoming;
-            }
-        }
-        else
-        {
-            ctx->messages = incoming;
-        }
+            diff_session_messages(*session, *ctx);
 
         LOG(INFO) << "[auto-diff] session=" << session->session_id
-                  << " incoming=" << incoming.size()
+                  << " incoming=" << n_incoming
                   << " delta=" << ctx->messages.size()
-                  << " hist=" << session->history.size();
+                  << " hist=" << session->history.size()
+                  << " rewind=" << (ctx->kv_rewind ? 1 : 0);
     }
 
-    // on_finish：仅 stop/length 更新 history，避免 cancelled/error 污染 session
-    ctx->on_finish = [this, session, ctx, client_messages, start_time](FinishReason r)
+    // on_finish：仅 stop/length 更新 history，避免 cancelled/error 污染 session；一次性 session 结束即移除
+    // 回调只在 ctx 自己的 EmitFinish 里执行，捕获裸指针：捕获 shared_ptr 会形成环，ctx / session / KV 永远不释放
+    ServingContext *self = ctx.get();
+    ctx->on_finish = [this, session, self, start_time](FinishReason r)
     {
-        if (r == FinishReason::stop || r == FinishReason::length)
+        if ((r == FinishReason::stop || r == FinishReason::length) && !session->ephemeral)
         {
             std::lock_guard<std::mutex> lk(session->mu);
-            session->history = client_messages;
-            session->history.push_back({"assistant", ctx->final_text});
+            // history 与 KV 一致：追加本轮新增的消息与回复（引擎换入恢复时已把 history 补齐、ctx->messages 裁掉）
+            session->history.insert(session->history.end(), self->messages.begin(), self->messages.end());
+            session->history.push_back({"assistant", self->final_text});
             session->touch();
         }
 
@@ -333,11 +842,20 @@ void HttpGateway::HandleChatCompletion(const HttpRequest &req, HttpResponse &res
                                 std::chrono::steady_clock::now() - start_time)
                                 .count();
         RecordFinish(r, dur_ms);
-        LOG(INFO) << "[chat] done req=" << ctx->request_id
-                  << " model=" << ctx->model
+        if (session->ephemeral)
+            session_mgr_->close(session->session_id);
+        LOG(INFO) << "[chat] done req=" << self->request_id
+                  << " model=" << self->model
+                  << " lora=" << self->lora.name
                   << " dur_ms=" << dur_ms
-                  << " prompt_tokens=" << ctx->usage.prompt_tokens
-                  << " completion_tokens=" << ctx->usage.completion_tokens
+                  << " prompt_tokens=" << self->usage.prompt_tokens
+                  << " cached_tokens=" << self->usage.cached_tokens
+                  << " completion_tokens=" << self->usage.completion_tokens
+                  << " spec_proposed=" << self->usage.speculative_proposed
+                  << " spec_accepted=" << self->usage.speculative_accepted
+                  << " images=" << self->usage.images
+                  << " image_cache_hits=" << self->usage.image_cache_hits
+                  << " image_encode_ms=" << self->usage.image_encode_ms
                   << " reason=" << finish_reason_to_str(r);
     };
 
@@ -373,6 +891,25 @@ void HttpGateway::HandleChatCompletion(const HttpRequest &req, HttpResponse &res
     // 错误返回（包含 overloaded）
     if (!ctx->error_message.empty() || final_reason == FinishReason::error)
     {
+        // 引擎判定的请求参数错误（如 n 超过 LLAMA_MAX_N）
+        if (ctx->params.count("error_code") && ctx->params["error_code"] == "invalid_request")
+        {
+            WriteError(res, 400, ctx->error_message, "invalid_request_error", "invalid_request");
+            return;
+        }
+        // 检查可用之后模型被卸载（预算）：后台已在重新加载
+        if (ctx->params.count("error_code") && ctx->params["error_code"] == "model_loading")
+        {
+            res.SetHeader("Retry-After", "5");
+            WriteError(res, 503, ctx->error_message, "server_error", "model_loading");
+            return;
+        }
+        if (ctx->params.count("error_code") && ctx->params["error_code"] == "load_failed")
+        {
+            WriteError(res, 500, ctx->error_message, "server_error", "load_failed");
+            return;
+        }
+
         const bool overloaded =
             (ctx->params.count("error_code") && ctx->params["error_code"] == "overloaded") ||
             (ctx->error_message.find("queue full") != std::string::npos);
@@ -385,17 +922,30 @@ void HttpGateway::HandleChatCompletion(const HttpRequest &req, HttpResponse &res
         return;
     }
 
-    // 正常返回
+    // 正常返回：n > 1 时每个候选带自己的结束原因，usage.completion_tokens 为所有候选之和
+    json choices = json::array();
+    if (ctx->choices.empty())
+    {
+        choices.push_back({{"index", 0},
+                           {"message", {{"role", "assistant"}, {"content", ctx->final_text}}},
+                           {"logprobs", nullptr},
+                           {"finish_reason", finish_reason_to_str(final_reason)}});
+    }
+    for (size_t i = 0; i < ctx->choices.size(); ++i)
+    {
+        const auto &c = ctx->choices[i];
+        choices.push_back({{"index", static_cast<int>(i)},
+                           {"message", {{"role", "assistant"}, {"content", c.text}}},
+                           {"logprobs", nullptr},
+                           {"finish_reason", finish_reason_to_str(c.finished ? c.finish_reason : final_reason)}});
+    }
+
     json out = {
         {"id", "chatcmpl-" + ctx->request_id},
         {"object", "chat.completion"},
         {"created", static_cast<int>(std::time(nullptr))},
-        {"model", model},
-        {"choices",
-         {{{"index", 0},
-           {"message", {{"role", "assistant"}, {"content", ctx->final_text}}},
-           {"logprobs", nullptr},
-           {"finish_reason", finish_reason_to_str(final_reason)}}}},
+        {"model", requested_model},
+        {"choices", choices},
         {"usage",
          {{"prompt_tokens", ctx->usage.prompt_tokens},
           {"completion_tokens", ctx->usage.completion_tokens},
@@ -404,6 +954,29 @@ void HttpGateway::HandleChatCompletion(const HttpRequest &req, HttpResponse &res
         }
     };
 
+    // 直接复用 KV 的 prompt token（编辑 / 重新生成时的公共前缀、前缀缓存命中）
+    if (ctx->usage.cached_tokens > 0)
+        out["usage"]["prompt_tokens_details"] = {{"cached_tokens", ctx->usage.cached_tokens}};
+
+    // 多模态：图片 token 数，以及本请求的图片编码耗时与 embedding 缓存命中
+    if (ctx->usage.images > 0)
+    {
+        out["usage"]["prompt_tokens_details"]["image_tokens"] = ctx->usage.image_tokens;
+        out["usage"]["image_details"] = {
+            {"images", ctx->usage.images},
+            {"cache_hits", ctx->usage.image_cache_hits},
+            {"cache_hit_rate", static_cast<double>(ctx->usage.image_cache_hits) / ctx->usage.images},
+            {"encode_ms", ctx->usage.image_encode_ms}};
+    }
+
+    // 投机解码的草稿统计（沿用 OpenAI predicted outputs 的字段名）
+    if (ctx->usage.speculative_proposed > 0)
+    {
+        out["usage"]["completion_tokens_details"] = {
+            {"accepted_prediction_tokens", ctx->usage.speculative_accepted},
+            {"rejected_prediction_tokens", ctx->usage.speculative_proposed - ctx->usage.speculative_accepted}};
+    }
+
     res.SetHeader("Content-Type", "application/json");
     res.SetHeader("Connection", "close");
     res.Write(out.dump(-1, ' ', false, json::error_handler_t::replace));
@@ -444,14 +1017,63 @@ void HttpGateway::HandleChatCompletionStream(const HttpRequest &req, std::shared
         return;
     }
 
-    const std::string model = body.value("model", get_default_model());
-
     auto ctx = std::make_shared<ServingContext>();
+    const std::string requested_model = body.value("model", get_default_model());
+    std::string lora_err;
+    if (!resolve_model_adapter(body, get_default_model(), *ctx, lora_err))
+    {
+        WriteError(*res_ptr, 404, lora_err, "invalid_request_error", "model_not_found");
+        const auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                std::chrono::steady_clock::now() - start_time)
+                                .count();
+        RecordFinish(FinishReason::error, dur_ms);
+        return;
+    }
+    const std::string model = ctx->model;
+    if (!CheckModelAvailable(*res_ptr, model))
+    {
+        const auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                std::chrono::steady_clock::now() - start_time)
+                                .count();
+        RecordFinish(FinishReason::error, dur_ms);
+        return;
+    }
+
     ctx->request_id = gen_request_id();
-    ctx->model = model;
     ctx->stream = true;
     ctx->is_chat = true;
 
+    std::string sampling_err;
+    if (!forward_sampling_params(body, *ctx, sampling_err))
+    {
+        WriteError(*res_ptr, 400, sampling_err, "invalid_request_error", "invalid_sampling_params");
+        const auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                std::chrono::steady_clock::now() - start_time)
+                                .count();
+        RecordFinish(FinishReason::error, dur_ms);
+        return;
+    }
+    if (!forward_response_format(body, req.body, *ctx, sampling_err))
+    {
+        WriteError(*res_ptr, 400, sampling_err, "invalid_request_error", "invalid_response_format");
+        const auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                std::chrono::steady_clock::now() - start_time)
+                                .count();
+        RecordFinish(FinishReason::error, dur_ms);
+        return;
+    }
+
+    // messages（content 数组中的图片在这里解码 / 读取）
+    if (!parse_chat_messages(body, *ctx, sampling_err, req.inline_images.get()))
+    {
+        WriteError(*res_ptr, 400, sampling_err, "invalid_request_error", "invalid_messages");
+        const auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                std::chrono::steady_clock::now() - start_time)
+                                .count();
+        RecordFinish(FinishReason::error, dur_ms);
+        return;
+    }
+
     std::string session_id;
     if (body.contains("session_id") && body["session_id"].is_string())
         session_id = body["session_id"].get<std::string>();
@@ -460,53 +1082,26 @@ void HttpGateway::HandleChatCompletionStream(const HttpRequest &req, std::shared
 
     ctx->session_id = session_id;
     ctx->session = session_mgr_->getOrCreate(session_id, model);
+    if (session_id == ctx->request_id)
+        ctx->session->ephemeral = true;
 
     // generation params
-    if (body.contains("max_tokens") && body["max_tokens"].is_number_integer())
-    {
-        const int max_tokens = body["max_tokens"].get<int>();
-        if (max_tokens > 0)
-            ctx->params["max_tokens"] = std::to_string(max_tokens);
-    }
-
-    // parse messages
-    ctx->messages.clear();
-    for (const auto &m : body["messages"])
-    {
-        ctx->messages.push_back({m.value("role", ""), m.value("content", "")});
-    }
-
-    // 备份客户端全量 messages（用于更新 history）
-    const std::vector<Message> client_messages = ctx->messages;
+    forward_generation_params(body, *ctx);
 
-    // auto-diff（锁内只处理 session 状态，锁外执行 engine）
+    // auto-diff（锁内只处理 session 状态，锁外执行 engine）：ctx->messages 变为本轮新增的消息
     auto session = ctx->session;
     {
         std::lock_guard<std::mutex> lk(session->mu);
 
-        const std::vector<Message> incoming = ctx->messages;
+        const size_t n_incoming = ctx->messages.size();
         if (!session->history.empty())
-        {
-            if (is_prefix(session->history, incoming))
-            {
-                ctx->messages = diff_messages(session->history, incoming);
-            }
-            else
-            {
-                session->history.clear();
-                session->model_ctx.reset();
-                ctx->messages = incoming;
-            }
-        }
-        else
-        {
-            ctx->messages = incoming;
-        }
+            diff_session_messages(*session, *ctx);
 
         LOG(INFO) << "[auto-diff] session=" << session->session_id
-                  << " incoming=" << incoming.size()
+                  << " incoming=" << n_incoming
                   << " delta=" << ctx->messages.size()
-                  << " hist=" << session->history.size();
+                  << " hist=" << session->history.size()
+                  << " rewind=" << (ctx->kv_rewind ? 1 : 0);
     }
 
     // 绑定 HttpStreamSession 生命周期（先不 Start）
@@ -517,14 +1112,17 @@ void HttpGateway::HandleChatCompletionStream(const HttpRequest &req, std::shared
                             http_session->Close();
                         });
 
+    // writer / on_chunk / on_finish 都由 ctx 持有、只在它的 Emit* 里执行：捕获裸指针，避免 shared_ptr 环
+    ServingContext *self = ctx.get();
+
     // writer：将 OpenAI chunk -> SSE string -> session->Write
     auto writer = std::make_shared<OpenAIStreamWriter>(
-        ctx->request_id, ctx->model,
-        [http_session, ctx](const std::string &s)
+        ctx->request_id, requested_model,
+        [http_session, self](const std::string &s)
         {
             if (!http_session->IsAlive())
             {
-                ctx->cancelled.store(true);
+                self->cancelled.store(true);
                 return;
             }
 
@@ -532,28 +1130,29 @@ void HttpGateway::HandleChatCompletionStream(const HttpRequest &req, std::shared
 
             if (!http_session->IsAlive())
             {
-                ctx->cancelled.store(true);
+                self->cancelled.store(true);
             }
         });
 
-    // on_chunk：拼接 final_text + 喂给 writer
-    ctx->on_chunk = [writer, ctx](const StreamChunk &chunk)
+    // on_chunk：拼接 final_text（只取 choice 0，history 用它）+ 喂给 writer
+    ctx->on_chunk = [writer, self](const StreamChunk &chunk)
     {
-        if (!chunk.is_finished)
+        if (!chunk.is_finished && !chunk.choice_finished && chunk.index == 0)
         {
-            ctx->final_text += chunk.delta;
+            self->final_text += chunk.delta;
         }
         writer->OnChunk(chunk);
     };
 
-    // on_finish：仅 stop/length 更新 history；然后关闭 SSE
-    ctx->on_finish = [this, session, ctx, client_messages, http_session, start_time](FinishReason r)
+    // on_finish：仅 stop/length 更新 history；然后关闭 SSE，一次性 session 结束即移除
+    ctx->on_finish = [this, session, self, http_session, start_time](FinishReason r)
     {
-        if (r == FinishReason::stop || r == FinishReason::length)
+        if ((r == FinishReason::stop || r == FinishReason::length) && !session->ephemeral)
         {
             std::lock_guard<std::mutex> lk(session->mu);
-            session->history = client_messages;
-            session->history.push_back({"assistant", ctx->final_text});
+            // history 与 KV 一致：追加本轮新增的消息与回复（引擎换入恢复时已把 history 补齐、ctx->messages 裁掉）
+            session->history.insert(session->history.end(), self->messages.begin(), self->messages.end());
+            session->history.push_back({"assistant", self->final_text});
             session->touch();
         }
         http_session->Close();
@@ -562,11 +1161,20 @@ void HttpGateway::HandleChatCompletionStream(const HttpRequest &req, std::shared
                                 std::chrono::steady_clock::now() - start_time)
                                 .count();
         RecordFinish(r, dur_ms);
-        LOG(INFO) << "[chat-stream] done req=" << ctx->request_id
-                  << " model=" << ctx->model
+        if (session->ephemeral)
+            session_mgr_->close(session->session_id);
+        LOG(INFO) << "[chat-stream] done req=" << self->request_id
+                  << " model=" << self->model
+                  << " lora=" << self->lora.name
                   << " dur_ms=" << dur_ms
-                  << " prompt_tokens=" << ctx->usage.prompt_tokens
-                  << " completion_tokens=" << ctx->usage.completion_tokens
+                  << " prompt_tokens=" << self->usage.prompt_tokens
+                  << " cached_tokens=" << self->usage.cached_tokens
+                  << " completion_tokens=" << self->usage.completion_tokens
+                  << " spec_proposed=" << self->usage.speculative_proposed
+                  << " spec_accepted=" << self->usage.speculative_accepted
+                  << " images=" << self->usage.images
+                  << " image_cache_hits=" << self->usage.image_cache_hits
+                  << " image_encode_ms=" << self->usage.image_encode_ms
                   << " reason=" << finish_reason_to_str(r);
     };
 
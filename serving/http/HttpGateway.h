@@ -41,6 +41,16 @@ public:
     void HandleChatCompletion(const HttpRequest &req, HttpResponse &res);
     void HandleChatCompletionStream(const HttpRequest &req, std::shared_ptr<HttpResponse> res_ptr);
 
+    // Embeddings（embedding 模式引擎）
+    void HandleEmbeddings(const HttpRequest &req, HttpResponse &res);
+
+    // 模型列表（OpenAI /v1/models）：含加载状态，加载失败时带原因
+    void HandleListModels(const HttpRequest &req, HttpResponse &res);
+
+    // LoRA adapter：列出已注册的 / 运行时注册（LORA_ADAPTER_ROOT 下的文件）
+    void HandleListLoraAdapters(const HttpRequest &req, HttpResponse &res);
+    void HandleRegisterLoraAdapter(const HttpRequest &req, HttpResponse &res);
+
     // 健康检查 / 指标
     void HandleHealth(const HttpRequest &req, HttpResponse &res);
     void HandleMetrics(const HttpRequest &req, HttpResponse &res);
@@ -50,6 +60,8 @@ private:
                     const std::string &type, const std::string &code = "",
                     const std::string &param = "");
     void RecordFinish(FinishReason reason, int64_t dur_ms);
+    // 请求的模型不存在（404）或仍在启动预加载（503）时写出错误并返回 false
+    bool CheckModelAvailable(HttpResponse &res, const std::string &model);
 
     ThreadPool pool_;                        // 线程池
     StackFlowsClient *sf_client_{nullptr};   // 不持有所有权
@@ -0,0 +1,456 @@
+#include "JsonSchemaGrammar.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <vector>
+
+// 有序 json：object 属性按 schema 中的声明顺序输出
+using json = nlohmann::ordered_json;
+
+namespace
+{
+    // 与 llama.cpp json-schema-to-grammar 的基础规则一致
+    const char *kSpaceRule = R"(| " " | "\n" [ \t]{0,20})";
+
+    struct Primitive
+    {
+        const char *name;
+        const char *body;
+        std::vector<const char *> deps;
+    };
+
+    const std::vector<Primitive> &primitives()
+    {
+        static const std::vector<Primitive> kPrimitives = {
+            {"boolean", R"(("true" | "false") space)", {}},
+            {"decimal-part", "[0-9]{1,16}", {}},
+            {"integral-part", "[0] | [1-9] [0-9]{0,15}", {}},
+            {"number", R"(("-"? integral-part) ("." decimal-part)? ([eE] [-+]? integral-part)? space)", {"integral-part", "decimal-part"}},
+            {"integer", R"(("-"? integral-part) space)", {"integral-part"}},
+            {"char", R"([^"\\\x7F\x00-\x1F] | [\\] (["\\bfnrt] | "u" [0-9a-fA-F]{4}))", {}},
+            {"string", R"("\"" char* "\"" space)", {"char"}},
+            {"null", R"("null" space)", {}},
+            {"value", "object | array | string | number | boolean | null", {"object", "array", "string", "number", "boolean", "null"}},
+            {"object", R"("{" space ( string ":" space value ("," space string ":" space value)* )? "}" space)", {"string", "value"}},
+            {"array", R"("[" space ( value ("," space value)* )? "]" space)", {"value"}},
+        };
+        return kPrimitives;
+    }
+
+    std::string gbnf_literal(const std::string &s)
+    {
+        std::string out = "\"";
+        for (char c : s)
+        {
+            switch (c)
+            {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                out += c;
+            }
+        }
+        return out + "\"";
+    }
+
+    std::string sanitize(const std::string &name)
+    {
+        std::string out;
+        for (char c : name)
+        {
+            const bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-';
+            out += ok ? c : '-';
+        }
+        return out.empty() ? "x" : out;
+    }
+
+    // minLength / maxItems 等计数的上限：{m,n} 展开后的文法规模与之成正比
+    constexpr long long kMaxRepeat = 10000;
+
+    // {m,n} 重复后缀；n < 0 表示无上限
+    std::string repeat(int m, int n)
+    {
+        if (m == 0 && n < 0)
+            return "*";
+        if (n < 0)
+            return "{" + std::to_string(m) + ",}";
+        return "{" + std::to_string(m) + "," + std::to_string(n) + "}";
+    }
+
+    class Converter
+    {
+    public:
+        explicit Converter(const json &root) : root_(root) {}
+
+        // 返回 schema 对应的 GBNF 表达式；出错时返回空串并设置 err
+        std::string Visit(const json &s, const std::string &name, int depth = 0)
+        {
+            if (depth > 64)
+                return Fail("schema nested too deep");
+            if (s.is_boolean() && s.get<bool>())
+                return UsePrimitive("value");
+            if (!s.is_object())
+                return Fail("schema must be an object");
+
+            if (s.contains("$ref"))
+                return VisitRef(s["$ref"], depth);
+            if (s.contains("const"))
+                return gbnf_literal(s["const"].dump()) + " space";
+            if (s.contains("enum"))
+            {
+                if (!s["enum"].is_array() || s["enum"].empty())
+                    return Fail("enum must be a non-empty array");
+                std::string alt;
+                for (const auto &v : s["enum"])
+                    alt += (alt.empty() ? "" : " | ") + gbnf_literal(v.dump());
+                return "(" + alt + ") space";
+            }
+            for (const char *key : {"anyOf", "oneOf"})
+            {
+                if (!s.contains(key))
+                    continue;
+                if (!s[key].is_array() || s[key].empty())
+                    return Fail(std::string(key) + " must be a non-empty array");
+                std::string alt;
+                for (size_t i = 0; i < s[key].size(); ++i)
+                {
+                    const std::string e = Visit(s[key][i], name + "-" + std::to_string(i), depth + 1);
+                    if (e.empty())
+                        return e;
+                    alt += (alt.empty() ? "" : " | ") + e;
+                }
+                return "(" + alt + ")";
+            }
+            if (s.contains("allOf"))
+            {
+                if (!s["allOf"].is_array() || s["allOf"].size() != 1)
+                    return Fail("allOf is only supported with a single schema");
+                return Visit(s["allOf"][0], name, depth + 1);
+            }
+
+            json type = s.value("type", json());
+            if (type.is_array())
+            {
+                std::string alt;
+                for (const auto &t : type)
+                {
+                    json sub = s;
+                    sub["type"] = t;
+                    const std::string e = Visit(sub, name, depth + 1);
+                    if (e.empty())
+                        return e;
+                    alt += (alt.empty() ? "" : " | ") + e;
+                }
+                return "(" + alt + ")";
+            }
+            if (type.is_null())
+            {
+                if (s.contains("properties"))
+                    type = "object";
+                else if (s.contains("items"))
+                    type = "array";
+                else
+                    return UsePrimitive("value");
+            }
+            if (!type.is_string())
+                return Fail("type must be a string or an array");
+
+            const std::string t = type.get<std::string>();
+            if (t == "object")
+                return VisitObject(s, name, depth);
+            if (t == "array")
+                return VisitArray(s, name, depth);
+            if (t == "string")
+            {
+                int min_len = 0, max_len = -1;
+                if (!Bounds(s, "minLength", "maxLength", min_len, max_len))
+                    return std::string();
+                if (min_len == 0 && max_len < 0)
+                    return UsePrimitive("string");
+                UsePrimitive("char");
+                return "\"\\\"\" char" + repeat(min_len, max_len) + " \"\\\"\" space";
+            }
+            if (t == "number" || t == "integer" || t == "boolean" || t == "null")
+                return UsePrimitive(t);
+            return Fail("unsupported type: " + t);
+        }
+
+        std::string Format(const std::string &root_expr) const
+        {
+            std::string out = "root ::= " + root_expr + "\n";
+            out += "space ::= " + std::string(kSpaceRule) + "\n";
+            for (const auto &name : order_)
+                out += name + " ::= " + rules_.at(name) + "\n";
+            return out;
+        }
+
+        std::string err;
+
+    private:
+        std::string Fail(const std::string &msg)
+        {
+            if (err.empty())
+                err = msg;
+            return std::string();
+        }
+
+        // 读取一对计数约束：须为 [0, kMaxRepeat] 内的整数且 max >= min；缺省时 min 为 0、max 为 -1（无上限）
+        bool Bounds(const json &s, const char *min_key, const char *max_key, int &min_v, int &max_v)
+        {
+            auto read = [&](const char *key, int &out)
+            {
+                if (!s.contains(key))
+                    return true;
+                const json &v = s[key];
+                const double d = v.is_number() ? v.get<double>() : -1;
+                if (d < 0 || d != std::floor(d))
+                {
+                    Fail(std::string(key) + " must be a non-negative integer");
+                    return false;
+                }
+                if (d > kMaxRepeat)
+                {
+                    Fail(std::string(key) + " must not exceed " + std::to_string(kMaxRepeat));
+                    return false;
+                }
+                out = static_cast<int>(d);
+                return true;
+            };
+            if (!read(min_key, min_v) || !read(max_key, max_v))
+                return false;
+            if (max_v >= 0 && max_v < min_v)
+            {
+                Fail(std::string(max_key) + " must not be less than " + min_key);
+                return false;
+            }
+            return true;
+        }
+
+        std::string AddRule(const std::string &name, const std::string &body)
+        {
+            std::string key = sanitize(name);
+            for (int i = 1; rules_.count(key) && rules_[key] != body; ++i)
+                key = sanitize(name) + "-" + std::to_string(i);
+            if (!rules_.count(key))
+            {
+                rules_[key] = body;
+                order_.push_back(key);
+            }
+            return key;
+        }
+
+        std::string UsePrimitive(const std::string &name)
+        {
+            if (rules_.count(name))
+                return name;
+            for (const auto &p : primitives())
+            {
+                if (name != p.name)
+                    continue;
+                rules_[name] = p.body;
+                order_.push_back(name);
+                for (const char *dep : p.deps)
+                    UsePrimitive(dep);
+                return name;
+            }
+            return Fail("unknown primitive: " + name);
+        }
+
+        std::string VisitRef(const json &ref, int depth)
+        {
+            if (!ref.is_string())
+                return Fail("$ref must be a string");
+            const std::string path = ref.get<std::string>();
+            auto it = refs_.find(path);
+            if (it != refs_.end())
+                return it->second;
+
+            std::string key;
+            const json *defs = nullptr;
+            for (const char *prefix : {"#/$defs/", "#/definitions/"})
+            {
+                const std::string p(prefix);
+                if (path.compare(0, p.size(), p) == 0)
+                {
+                    key = path.substr(p.size());
+                    const std::string section = p.substr(2, p.size() - 3);
+                    if (root_.contains(section))
+                        defs = &root_[section];
+                }
+            }
+            if (!defs || !defs->contains(key))
+                return Fail("unresolved $ref: " + path);
+
+            // 先占位再展开，支持递归引用
+            const std::string rule = AddRule("ref-" + key, "pending " + path);
+            refs_[path] = rule;
+            const std::string body = Visit((*defs)[key], rule, depth + 1);
+            if (body.empty())
+                return body;
+            rules_[rule] = body;
+            return rule;
+        }
+
+        std::string VisitObject(const json &s, const std::string &name, int depth)
+        {
+            if (!s.contains("properties"))
+            {
+                const auto addl = s.value("additionalProperties", json());
+                if (!addl.is_object())
+                    return UsePrimitive("object");
+                UsePrimitive("string");
+                const std::string v = Visit(addl, name + "-value", depth + 1);
+                if (v.empty())
+                    return v;
+                const std::string kv = "string \":\" space " + v;
+                return AddRule(name, "\"{\" space ( " + kv + " (\",\" space " + kv + ")* )? \"}\" space");
+            }
+            if (!s["properties"].is_object())
+                return Fail("properties must be an object");
+
+            std::vector<std::string> required_names;
+            if (s.contains("required") && s["required"].is_array())
+            {
+                for (const auto &r : s["required"])
+                {
+                    if (r.is_string())
+                        required_names.push_back(r.get<std::string>());
+                }
+            }
+            auto is_required = [&](const std::string &k)
+            {
+                for (const auto &r : required_names)
+                {
+                    if (r == k)
+                        return true;
+                }
+                return false;
+            };
+
+            // 属性按声明顺序输出，可选属性在自己的位置上可以缺省。
+            // 已输出过属性之后，后续每个属性都带前导逗号：必选为 "," kv，可选为 ( "," kv )?；
+            // 第一个输出的属性只能是第一个必选属性或它之前的某个可选属性
+            std::vector<std::string> kvs;
+            std::vector<bool> required;
+            for (auto it = s["properties"].begin(); it != s["properties"].end(); ++it)
+            {
+                const std::string v = Visit(it.value(), name + "-" + it.key(), depth + 1);
+                if (v.empty())
+                    return v;
+                kvs.push_back(gbnf_literal(json(it.key()).dump()) + " space \":\" space " + v);
+                required.push_back(is_required(it.key()));
+            }
+
+            // 第 i 个之后的属性（此前已有属性输出）
+            auto rest_after = [&](size_t i)
+            {
+                std::string out;
+                for (size_t j = i + 1; j < kvs.size(); ++j)
+                    out += required[j] ? "\",\" space " + kvs[j] + " " : "( \",\" space " + kvs[j] + " )? ";
+                return out;
+            };
+
+            std::vector<std::string> firsts; // 以第 i 个属性开头的各种写法
+            bool has_required = false;
+            for (size_t i = 0; i < kvs.size(); ++i)
+            {
+                std::string seq = kvs[i] + " " + rest_after(i);
+                seq.pop_back();
+                if (required[i])
+                {
+                    firsts.push_back(seq);
+                    has_required = true;
+                    break;
+                }
+                firsts.push_back(AddRule(name + "-opt-" + std::to_string(i), seq));
+            }
+
+            std::string body = "\"{\" space ";
+            if (firsts.size() == 1 && has_required)
+            {
+                body += firsts[0] + " ";
+            }
+            else if (!firsts.empty())
+            {
+                std::string all;
+                for (const auto &f : firsts)
+                    all += (all.empty() ? "" : " | ") + f;
+                body += "( " + all + " )" + (has_required ? " " : "? ");
+            }
+            body += "\"}\" space";
+            return AddRule(name, body);
+        }
+
+        std::string VisitArray(const json &s, const std::string &name, int depth)
+        {
+            if (!s.contains("items"))
+                return UsePrimitive("array");
+
+            const std::string item = Visit(s["items"], name + "-item", depth + 1);
+            if (item.empty())
+                return item;
+
+            int min_items = 0, max_items = -1;
+            if (!Bounds(s, "minItems", "maxItems", min_items, max_items))
+                return std::string();
+            if (max_items == 0)
+                return "\"[\" space \"]\" space";
+
+            const std::string rest = "(\",\" space " + item + ")" +
+                                     repeat(std::max(0, min_items - 1), max_items < 0 ? -1 : max_items - 1);
+            const std::string list = item + " " + rest;
+            return AddRule(name, "\"[\" space " + (min_items > 0 ? list : "( " + list + " )?") + " \"]\" space");
+        }
+
+    private:
+        const json &root_;
+        std::map<std::string, std::string> rules_;
+        std::vector<std::string> order_;
+        std::map<std::string, std::string> refs_;
+    };
+} // namespace
+
+bool json_schema_to_gbnf(const json &schema, std::string &gbnf, std::string &err)
+{
+    Converter conv(schema);
+    std::string root;
+    try
+    {
+        root = conv.Visit(schema, "root-object");
+    }
+    catch (const std::exception &e)
+    {
+        // minItems 等字段类型不对时 json::value 会抛异常
+        err = std::string("invalid json schema: ") + e.what();
+        return false;
+    }
+    if (root.empty())
+    {
+        err = conv.err.empty() ? "invalid json schema" : conv.err;
+        return false;
+    }
+    gbnf = conv.Format(root);
+    return true;
+}
+
+std::string json_object_gbnf()
+{
+    std::string gbnf;
+    std::string err;
+    json_schema_to_gbnf(json{{"type", "object"}}, gbnf, err);
+    return gbnf;
+}
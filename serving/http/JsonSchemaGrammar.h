@@ -0,0 +1,24 @@
+#pragma once
+#include "../../utils/json.hpp"
+
+#include <string>
+
+/**
+ * @brief JSON Schema -> GBNF（llama.cpp grammar）转换，供 response_format 使用
+ *
+ * 支持的子集：
+ * - type：object / array / string / number / integer / boolean / null，以及 type 数组
+ * - object：properties（按声明顺序输出）、required、无 properties 时的 additionalProperties
+ * - array：items、minItems / maxItems
+ * - string：minLength / maxLength（pattern / format 不约束，按普通字符串处理）
+ * - 计数约束须为 0..10000 的整数且 max >= min，否则拒绝（err 说明原因）
+ * - enum / const / anyOf / oneOf / allOf（仅单个元素）
+ * - $ref：#/$defs/... 与 #/definitions/...（可递归）
+ *
+ * 纯文本转换，不依赖模型；生成的 GBNF 由引擎编译并按文本哈希缓存。
+ * schema 需用 ordered_json 解析，才能保持属性的声明顺序。
+ */
+bool json_schema_to_gbnf(const nlohmann::ordered_json &schema, std::string &gbnf, std::string &err);
+
+// response_format: {type: json_object} 使用的通用 JSON 对象文法
+std::string json_object_gbnf();
@@ -2,6 +2,7 @@
 #include "NetworkHttpServer.h"
 #include "HttpGateway.h"
 #include "http_types.h"
+#include "RequestBody.h"
 
 #include "network/TcpServer.h"
 #include "network/EventLoop.h"
@@ -11,6 +12,7 @@
 #include <string_view>
 #include <algorithm>
 #include <cctype>
+#include <cstdint>
 #include <functional>
 #include <boost/any.hpp>
 #include <glog/logging.h>
@@ -20,7 +22,7 @@ using namespace network;
 using json = nlohmann::json;
 
 // 只在本 .cc 文件使用的话，建议 static
-static size_t parse_content_length(const std::string &header)
+static bool parse_content_length(const std::string &header, size_t &len)
 {
     // 逐行扫描 header
     std::istringstream iss(header);
@@ -59,22 +61,30 @@ static size_t parse_content_length(const std::string &header)
                     ++p;
                 }
 
-                // 解析数字
-                size_t len = 0;
+                // 解析数字（溢出按无穷大处理，交给上限检查）
+                len = 0;
                 while (p < line.size() && std::isdigit(static_cast<unsigned char>(line[p])))
                 {
+                    if (len > (SIZE_MAX - 9) / 10)
+                    {
+                        len = SIZE_MAX;
+                        break;
+                    }
                     len = len * 10 + (line[p] - '0');
                     ++p;
                 }
-                return len;
+                return true;
             }
         }
     }
 
-    // 没有 Content-Length：按 0 处理
-    return 0;
+    // 没有 Content-Length
+    return false;
 }
 
+// 请求头上限：超过仍未见空行直接 431
+static constexpr size_t kMaxHeaderBytes = 64 * 1024;
+
 static void write_json_error(const std::shared_ptr<NetworkHttpResponse> &res_ptr,
                              int status,
                              const std::string &message,
@@ -95,7 +105,8 @@ NetworkHttpServer::NetworkHttpServer(EventLoop *loop,
                                      const InetAddress &listen_addr,
                                      HttpGateway *gateway)
     : server_(loop, listen_addr, "HttpServer"),
-      gateway_(gateway)
+      gateway_(gateway),
+      max_body_bytes_(http_max_body_bytes())
 {
     server_.setConnectionCallback(
         std::bind(&NetworkHttpServer::onConnection, this, std::placeholders::_1));
@@ -115,6 +126,8 @@ void NetworkHttpServer::onConnection(const TcpConnectionPtr &conn)
 {
     if (!conn->connected())
     {
+        pending_.erase(conn);
+
         const auto &ctx = conn->getContext();
         if (!ctx.empty())
         {
@@ -131,56 +144,114 @@ void NetworkHttpServer::onMessage(
     const TcpConnectionPtr &conn,
     network::Buffer *buf)
 {
-    std::string &cache = http_buffers_[conn];
-    cache.append(buf->retrieveAllAsString());
+    while (true)
+    {
+        // 路由中可能断开连接：每轮重新取
+        PendingRequest &pending = pending_[conn];
+        if (pending.discard)
+        {
+            buf->retrieveAll();
+            return;
+        }
+
+        // 1. 请求头：空行可能跨两次读，带上已收部分末尾 3 字节一起找；只从 socket 缓冲中取走请求头本身
+        if (!pending.header_done)
+        {
+            const size_t old_size = pending.header.size();
+            const size_t room = kMaxHeaderBytes + 4 - std::min(old_size, kMaxHeaderBytes);
+            pending.header.append(buf->peek(), std::min(buf->readableBytes(), room));
+            const size_t pos = pending.header.find("\r\n\r\n", old_size >= 3 ? old_size - 3 : 0);
+            if (pos == std::string::npos)
+            {
+                buf->retrieve(pending.header.size() - old_size);
+                if (pending.header.size() > kMaxHeaderBytes)
+                {
+                    auto res_ptr = std::make_shared<NetworkHttpResponse>(conn, false);
+                    write_json_error(res_ptr, 431, "request header too large", "invalid_request_error", "header_too_large");
+                    pending.discard = true;
+                    buf->retrieveAll();
+                }
+                return;
+            }
+            buf->retrieve(pos + 4 - old_size);
+            pending.header.resize(pos);
+            pending.header_done = true;
+            if (!onHeaderComplete(conn, pending, buf->readableBytes()))
+            {
+                buf->retrieveAll();
+                return;
+            }
+        }
 
-    handleHttpRequest(conn, cache);
+        // 2. body：直接从 socket 缓冲追加到预分配好的 body，不再经过连接级字符串与 substr
+        const size_t take = std::min(pending.content_length - pending.body.size(), buf->readableBytes());
+        pending.body.append(buf->peek(), take);
+        buf->retrieve(take);
+        if (pending.body.size() < pending.content_length)
+            return; // body 还没收全
+
+        PendingRequest done = std::move(pending);
+        pending = PendingRequest();
+        record_request_body(done.body.size());
+        handleHttpRequest(conn, done);
+
+        if (buf->readableBytes() == 0 || pending_.find(conn) == pending_.end())
+            return;
+    }
 }
 
-void NetworkHttpServer::handleHttpRequest(
+bool NetworkHttpServer::onHeaderComplete(
     const TcpConnectionPtr &conn,
-    std::string &buffer)
+    PendingRequest &pending,
+    size_t available)
 {
-    // 1. 拆 header
-    auto pos = buffer.find("\r\n\r\n");
-    if (pos == std::string::npos)
-        return;
-
-    std::string header = buffer.substr(0, pos);
-    size_t content_length = parse_content_length(header);
-
+    size_t content_length = 0;
     // 若未带 Content-Length，则退回到已有数据长度推断
-    if (content_length == 0 && buffer.size() >= pos + 4)
-    {
-        content_length = buffer.size() - (pos + 4);
-    }
+    if (!parse_content_length(pending.header, content_length))
+        content_length = available;
 
-    LOG(INFO) << "[http] header_len=" << header.size()
+    LOG(INFO) << "[http] header_len=" << pending.header.size()
               << ", content_length=" << content_length
-              << ", buffer_size=" << buffer.size();
-    LOG(INFO) << "[http] raw header >>>" << header << "<<<";
-
-    size_t total_len = pos + 4 + content_length;
-    if (buffer.size() < total_len)
-        return; // body 还没收全
+              << ", buffered=" << available;
+    LOG(INFO) << "[http] raw header >>>" << pending.header << "<<<";
 
-    std::string body = buffer.substr(pos + 4, content_length);
+    if (content_length > max_body_bytes_)
+    {
+        LOG(WARNING) << "[http] body too large content_length=" << content_length
+                     << " limit=" << max_body_bytes_;
+        record_request_body_rejected();
+        auto res_ptr = std::make_shared<NetworkHttpResponse>(conn, false);
+        write_json_error(res_ptr, 413,
+                         "request body too large: " + std::to_string(content_length) +
+                             " bytes, limit " + std::to_string(max_body_bytes_),
+                         "invalid_request_error", "body_too_large");
+        pending.discard = true;
+        return false;
+    }
 
-    // 🔥 消费掉已处理的数据
-    buffer.erase(0, total_len);
+    // 按 Content-Length 一次性分配，接收过程中不再扩容
+    pending.content_length = content_length;
+    pending.body.reserve(content_length);
+    return true;
+}
 
-    LOG(INFO) << "[http] body_len=" << body.size() << " raw body >>>" << body << "<<<";
+void NetworkHttpServer::handleHttpRequest(
+    const TcpConnectionPtr &conn,
+    PendingRequest &pending)
+{
+    const std::string &header = pending.header;
+    LOG(INFO) << "[http] body_len=" << pending.body.size();
 
-    // 2. 解析请求行
+    // 1. 解析请求行
     std::istringstream iss(header);
     std::string method, url, version;
     iss >> method >> url >> version;
 
-    // 3. 构造 Request
+    // 2. 构造 Request（body 移入，不再拷贝）
     NetworkHttpRequest req;
-    req.body = body;
+    req.body = std::move(pending.body);
 
-    // 4. 解析 query
+    // 3. 解析 query
     bool is_stream = false;
     auto qpos = url.find('?');
     if (qpos != std::string::npos)
@@ -194,11 +265,11 @@ void NetworkHttpServer::handleHttpRequest(
         url = url.substr(0, qpos);
     }
 
-    // 5. Response
+    // 4. Response
     // NetworkHttpResponse res(conn, is_stream);
     auto res_ptr = std::make_shared<NetworkHttpResponse>(conn, is_stream);
 
-    // 6. 路由（先处理 CORS 预检）
+    // 5. 路由（先处理 CORS 预检）
     if (method == "OPTIONS")
     {
         res_ptr->SetStatus(204, "No Content");
@@ -224,6 +295,18 @@ void NetworkHttpServer::handleHttpRequest(
         return;
     }
 
+    if (method == "GET" && url == "/v1/models")
+    {
+        gateway_->HandleListModels(req, *res_ptr);
+        return;
+    }
+
+    if (method == "GET" && url == "/v1/lora_adapters")
+    {
+        gateway_->HandleListLoraAdapters(req, *res_ptr);
+        return;
+    }
+
     if (method != "POST")
     {
         write_json_error(res_ptr, 405, "Method Not Allowed", "invalid_request_error", "method_not_allowed");
@@ -238,6 +321,13 @@ void NetworkHttpServer::handleHttpRequest(
             gateway_->HandleCompletion(req, *res_ptr);
     }else if(method == "POST" && url == "/v1/chat/completions")
     {
+        // 图片 data: URL 在 JSON 解析前就地解码移出，DOM 中不再有 base64 长串
+        std::string image_err;
+        if (!extract_inline_images(req.body, req.inline_images, image_err))
+        {
+            write_json_error(res_ptr, 400, image_err, "invalid_request_error", "invalid_messages");
+            return;
+        }
         if(is_stream){
             gateway_->HandleChatCompletionStream(req, res_ptr);
         }else{
@@ -245,6 +335,14 @@ void NetworkHttpServer::handleHttpRequest(
         }
 
     }
+    else if (url == "/v1/embeddings")
+    {
+        gateway_->HandleEmbeddings(req, *res_ptr);
+    }
+    else if (url == "/v1/lora_adapters")
+    {
+        gateway_->HandleRegisterLoraAdapter(req, *res_ptr);
+    }
     else
     {
         write_json_error(res_ptr, 404, "Not Found", "invalid_request_error", "not_found");
@@ -20,7 +20,7 @@ struct HttpResponse;
  * @brief 基于 network::TcpServer 的最小 HTTP Server
  *
  * 只负责：
- * - HTTP 解析
+ * - HTTP 解析（请求体按 Content-Length 预分配、流式追加，上限 HTTP_MAX_BODY_MB）
  * - HttpRequest / HttpResponse 适配
  * - 调用 HttpGateway
  */
@@ -34,15 +34,31 @@ public:
     void Start();
 
 private:
+    // 连接上正在接收的请求：请求头收全后按 Content-Length 预分配 body，socket 缓冲中的数据直接追加进去
+    struct PendingRequest
+    {
+        std::string header;        // 请求行 + 请求头（不含结尾空行）
+        bool header_done = false;
+        bool discard = false;      // 已回 413 / 431，丢弃该连接后续数据
+        size_t content_length = 0;
+        std::string body;
+    };
+
     void onConnection(const network::TcpConnectionPtr &conn);
     void onMessage(const network::TcpConnectionPtr &conn,
                    network::Buffer *buf);
 
+    // 请求头收全：解析 Content-Length、检查上限并预分配 body；超限时回错误并返回 false
+    bool onHeaderComplete(const network::TcpConnectionPtr &conn,
+                          PendingRequest &pending,
+                          size_t available);
+
     void handleHttpRequest(const network::TcpConnectionPtr &conn,
-                           std::string &buffer);
+                           PendingRequest &pending);
 
 private:
     network::TcpServer server_;
     HttpGateway *gateway_;
-    std::unordered_map<network::TcpConnectionPtr, std::string> http_buffers_;
+    size_t max_body_bytes_;
+    std::unordered_map<network::TcpConnectionPtr, PendingRequest> pending_;
 };
@@ -1,7 +1,6 @@
 #include "OpenAIStreamWriter.h"
 #include "utils/json.hpp"
 
-#include <utility>
 
 using json = nlohmann::json;
 
@@ -26,97 +25,8 @@ static const char *finish_reason_to_str(FinishReason r)
     }
 }
 
-namespace {
-constexpr const char *kUtf8Replacement = "\xEF\xBF\xBD";
-
-bool is_utf8_continuation(unsigned char c)
-{
-    return (c & 0xC0) == 0x80;
-}
-
-std::pair<std::string, std::string> split_utf8_prefix(const std::string &input, bool flush_incomplete)
-{
-    std::string out;
-    out.reserve(input.size());
-    const size_t n = input.size();
-    size_t i = 0;
-    while (i < n)
-    {
-        const unsigned char c = static_cast<unsigned char>(input[i]);
-        if (c < 0x80)
-        {
-            out.push_back(static_cast<char>(c));
-            ++i;
-            continue;
-        }
-
-        size_t need = 0;
-        if (c >= 0xC2 && c <= 0xDF)
-            need = 2;
-        else if (c >= 0xE0 && c <= 0xEF)
-            need = 3;
-        else if (c >= 0xF0 && c <= 0xF4)
-            need = 4;
-        else
-        {
-            out.append(kUtf8Replacement);
-            ++i;
-            continue;
-        }
-
-        if (i + need > n)
-        {
-            if (flush_incomplete)
-            {
-                out.append(kUtf8Replacement);
-                break;
-            }
-            return {out, input.substr(i)};
-        }
-
-        bool valid = true;
-        for (size_t k = 1; k < need; ++k)
-        {
-            if (!is_utf8_continuation(static_cast<unsigned char>(input[i + k])))
-            {
-                valid = false;
-                break;
-            }
-        }
-
-        if (!valid)
-        {
-            out.append(kUtf8Replacement);
-            ++i;
-            continue;
-        }
-
-        out.append(input, i, need);
-        i += need;
-    }
-
-    return {out, std::string()};
-}
-} // namespace
-
-void OpenAIStreamWriter::OnChunk(const StreamChunk &chunk)
+void OpenAIStreamWriter::WriteChoice(int index, const std::string *delta, FinishReason reason)
 {
-    std::string safe_delta;
-    if (!chunk.delta.empty())
-    {
-        const std::string combined = pending_bytes_ + chunk.delta;
-        auto [prefix, pending] = split_utf8_prefix(combined, false);
-        safe_delta = std::move(prefix);
-        pending_bytes_ = std::move(pending);
-    }
-
-    if (chunk.is_finished && !pending_bytes_.empty())
-    {
-        auto [flushed, _] = split_utf8_prefix(pending_bytes_, true);
-        safe_delta.append(flushed);
-        pending_bytes_.clear();
-    }
-
     json j;
     j["id"] = "chatcmpl-" + request_id_;
     j["object"] = "chat.completion.chunk";
@@ -124,27 +34,56 @@ void OpenAIStreamWriter::OnChunk(const StreamChunk &chunk)
     j["model"] = model_;
 
     json choice;
-    choice["index"] = 0;
+    choice["index"] = index;
 
-    if (!chunk.is_finished)
+    if (delta)
     {
-        // 正常增量
-        choice["delta"] = {{"content", safe_delta}};
+        // 正常增量（引擎侧 detokenizer 只输出完整的 UTF-8 序列，可直接下发）
+        choice["delta"] = {{"content", *delta}};
         choice["finish_reason"] = nullptr;
     }
     else
     {
         // 结束 chunk：delta 为空对象
         choice["delta"] = json::object();
-        choice["finish_reason"] = finish_reason_to_str(chunk.finish_reason);
+        choice["finish_reason"] = finish_reason_to_str(reason);
     }
 
     j["choices"] = json::array({choice});
 
     write_("data: " + j.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n");
+}
+
+void OpenAIStreamWriter::OnChunk(const StreamChunk &chunk)
+{
+    if (chunk.index >= static_cast<int>(choice_state_.size()))
+        choice_state_.resize(chunk.index + 1, 0);
+
+    if (!chunk.is_finished)
+    {
+        if (choice_state_[chunk.index] == 2)
+            return;
+        if (chunk.choice_finished)
+        {
+            choice_state_[chunk.index] = 2;
+            WriteChoice(chunk.index, nullptr, chunk.finish_reason);
+            return;
+        }
+        choice_state_[chunk.index] = 1;
+        WriteChoice(chunk.index, &chunk.delta, chunk.finish_reason);
+        return;
+    }
 
-    if (chunk.is_finished)
+    // 请求结束：未单独结束的候选以请求的结束原因收尾（至少有 choice 0）
+    if (choice_state_.empty())
+        choice_state_.push_back(0);
+    for (size_t i = 0; i < choice_state_.size(); ++i)
     {
-        write_("data: [DONE]\n\n");
+        if (choice_state_[i] == 2 || (choice_state_[i] == 0 && i > 0))
+            continue;
+        choice_state_[i] = 2;
+        WriteChoice(static_cast<int>(i), nullptr, chunk.finish_reason);
     }
+
+    write_("data: [DONE]\n\n");
 }
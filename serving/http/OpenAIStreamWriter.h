@@ -1,6 +1,7 @@
 #pragma once
 #include <string>
 #include <functional>
+#include <vector>
 #include "serving/core/ServingContext.h"
 
 class OpenAIStreamWriter {
@@ -9,13 +10,18 @@ public:
 
     OpenAIStreamWriter(const std::string& request_id, const std::string& model, WriteFn write);
 
-    // streaming
+    // streaming：n > 1 时各候选的 chunk 按 index 交错输出；
+    // 最后一个 chunk 为出现过、尚未单独结束的候选补发结束 chunk，再写 [DONE]
     void OnChunk(const StreamChunk& chunk);
 
 private:
+    void WriteChoice(int index, const std::string *delta, FinishReason reason);
+
     std::string request_id_;
     std::string model_;
     WriteFn write_;
-    std::string pending_bytes_;
+
+    // 0：未出现，1：输出中，2：已结束
+    std::vector<char> choice_state_;
 
 };
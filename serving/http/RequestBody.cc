@@ -0,0 +1,325 @@
+#include "RequestBody.h"
+#include "Base64.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+namespace
+{
+    std::mutex g_stats_mu;
+    RequestBodyStats g_stats; // g_stats_mu
+
+    // base64 串里允许出现的 JSON 转义：\/ 与换行类（解码时按空白跳过）
+    bool simple_escape(char c)
+    {
+        return c == '/' || c == 'n' || c == 'r' || c == 't';
+    }
+
+    // 从 s（开引号之后）找字符串的闭引号：前面连续的反斜杠为偶数个才是闭引号
+    size_t string_end(const char *p, size_t n, size_t s)
+    {
+        size_t j = s;
+        while (j < n)
+        {
+            const char *q = static_cast<const char *>(std::memchr(p + j, '"', n - j));
+            if (!q)
+                return std::string::npos;
+            const size_t e = static_cast<size_t>(q - p);
+            size_t slashes = 0;
+            while (e - slashes > s && p[e - slashes - 1] == '\\')
+                ++slashes;
+            if (slashes % 2 == 0)
+                return e;
+            j = e + 1;
+        }
+        return std::string::npos;
+    }
+
+    bool is_space(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    // 原始 JSON 字符串 [b, e) 是否与 lit 逐字节相等（带转义的键不匹配，按普通字段处理）
+    bool raw_equals(const char *p, size_t b, size_t e, const char *lit)
+    {
+        const size_t len = std::strlen(lit);
+        return e - b == len && std::memcmp(p + b, lit, len) == 0;
+    }
+
+    // 扫描时容器在请求中的位置：只有 messages[*].content[*] 中 type 为 image_url 的部件才抽取图片
+    enum class Level
+    {
+        Other,
+        Root,     // 请求体顶层对象
+        Messages, // "messages" 数组
+        Message,  // messages 的元素
+        Content,  // 消息的 "content" 数组
+        Part,     // content 的元素
+        ImageUrl, // 部件的 "image_url" 对象
+    };
+
+    struct Frame
+    {
+        Level level;
+        bool object;
+        bool expect_key = true;   // 仅对象：下一个字符串是键
+        size_t key_begin = 0;     // 仅对象：当前键（原始字节区间）
+        size_t key_end = 0;
+        size_t first_run = 0;     // 仅 Part：本部件的候选图片在 runs 中的起点
+        bool is_image = false;    // 仅 Part：type == "image_url"
+    };
+
+    Level child_level(const char *p, const Frame *parent, bool object)
+    {
+        if (!parent)
+            return object ? Level::Root : Level::Other;
+        auto key_is = [&](const char *k) { return parent->object && raw_equals(p, parent->key_begin, parent->key_end, k); };
+        switch (parent->level)
+        {
+        case Level::Root:
+            return !object && key_is("messages") ? Level::Messages : Level::Other;
+        case Level::Messages:
+            return object ? Level::Message : Level::Other;
+        case Level::Message:
+            return !object && key_is("content") ? Level::Content : Level::Other;
+        case Level::Content:
+            return object ? Level::Part : Level::Other;
+        case Level::Part:
+            return object && key_is("image_url") ? Level::ImageUrl : Level::Other;
+        default:
+            return Level::Other;
+        }
+    }
+    // 转义就地还原：\/ -> '/'，\n \r \t -> 对应的空白；返回新长度
+    size_t unescape_in_place(char *p, size_t n)
+    {
+        size_t w = 0;
+        for (size_t r = 0; r < n; ++r)
+        {
+            if (p[r] != '\\' || r + 1 == n)
+            {
+                p[w++] = p[r];
+                continue;
+            }
+            const char c = p[++r];
+            p[w++] = c == 'n' ? '\n' : c == 'r' ? '\r' : c == 't' ? '\t' : c;
+        }
+        return w;
+    }
+} // namespace
+
+size_t http_max_body_bytes()
+{
+    const char *env = std::getenv("HTTP_MAX_BODY_MB");
+    if (!env || !*env)
+        return static_cast<size_t>(64) << 20;
+    try
+    {
+        const long v = std::stol(env);
+        return v > 0 ? static_cast<size_t>(v) << 20 : static_cast<size_t>(64) << 20;
+    }
+    catch (...)
+    {
+        return static_cast<size_t>(64) << 20;
+    }
+}
+
+bool extract_inline_images(std::string &body, std::shared_ptr<const InlineImages> &images, std::string &err)
+{
+    images.reset();
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // 1. 只读扫描：按 JSON 结构找出 messages[*].content[*] 里 type 为 image_url 的部件，
+    //    取其 image_url（字符串或 {"url": ...}）中的 data:...;base64, 字符串；其它位置的同名字段一律不动。
+    //    字符串整体用 memchr 跳过，base64 长串不逐字节扫描；结构不合法时放弃抽取，留给 JSON 解析报错
+    struct Run
+    {
+        size_t str_begin; // 开引号之后
+        size_t b64_begin; // ";base64," 之后
+        size_t str_end;   // 闭引号
+        bool escaped;
+    };
+    std::vector<Run> runs;
+    const char *p = body.data();
+    const size_t n = body.size();
+
+    // 字符串 [s, e) 是 data:...;base64, 且只含简单转义时记为候选
+    auto add_run = [&](size_t s, size_t e)
+    {
+        if (e - s < 5 || std::memcmp(p + s, "data:", 5) != 0)
+            return;
+        // 媒体类型部分很短，只在开头找 ";base64,"
+        const size_t head = std::min<size_t>(e - s, 256);
+        const char *tag = static_cast<const char *>(std::memchr(p + s, ',', head));
+        if (!tag || tag - (p + s) < 7 || std::memcmp(tag - 7, ";base64", 7) != 0)
+            return;
+        Run run{s, static_cast<size_t>(tag - p) + 1, e, false};
+
+        // 含其它转义（\uXXXX 等）的留给 JSON 解析后按原路径解码
+        for (const char *b = p + run.b64_begin;
+             (b = static_cast<const char *>(std::memchr(b, '\\', p + e - b))) != nullptr; b += 2)
+        {
+            run.escaped = true;
+            if (b + 1 >= p + e || !simple_escape(b[1]))
+                return;
+        }
+        runs.push_back(run);
+    };
+
+    std::vector<Frame> stack;
+    bool malformed = false;
+    size_t i = 0;
+    while (i < n && !malformed)
+    {
+        const char c = p[i];
+        if (is_space(c))
+        {
+            ++i;
+            continue;
+        }
+        Frame *top = stack.empty() ? nullptr : &stack.back();
+        switch (c)
+        {
+        case '{':
+        case '[':
+        {
+            Frame f{child_level(p, top, c == '{'), c == '{'};
+            f.first_run = runs.size();
+            stack.push_back(f);
+            ++i;
+            break;
+        }
+        case '}':
+        case ']':
+            if (!top || top->object != (c == '}'))
+            {
+                malformed = true;
+                break;
+            }
+            // 不是图片部件：丢弃它的候选
+            if (top->level == Level::Part && !top->is_image)
+                runs.resize(top->first_run);
+            stack.pop_back();
+            ++i;
+            break;
+        case ',':
+            if (top && top->object)
+                top->expect_key = true;
+            ++i;
+            break;
+        case ':':
+            if (top && top->object)
+                top->expect_key = false;
+            ++i;
+            break;
+        case '"':
+        {
+            const size_t s = i + 1;
+            const size_t e = string_end(p, n, s);
+            if (e == std::string::npos)
+            {
+                malformed = true;
+                break;
+            }
+            i = e + 1;
+            if (!top)
+                break;
+            if (top->object && top->expect_key)
+            {
+                top->key_begin = s;
+                top->key_end = e;
+                break;
+            }
+            if (top->level == Level::Part && raw_equals(p, top->key_begin, top->key_end, "type"))
+                top->is_image = raw_equals(p, s, e, "image_url");
+            else if ((top->level == Level::Part && raw_equals(p, top->key_begin, top->key_end, "image_url")) ||
+                     (top->level == Level::ImageUrl && raw_equals(p, top->key_begin, top->key_end, "url")))
+                add_run(s, e);
+            break;
+        }
+        default:
+            // 数字 / true / false / null
+            while (i < n && !is_space(p[i]) && p[i] != ',' && p[i] != '}' && p[i] != ']')
+                ++i;
+        }
+    }
+    if (malformed || !stack.empty())
+        return true;
+    size_t removed = 0;
+    for (const Run &r : runs)
+        removed += r.str_end - r.str_begin;
+    if (runs.empty())
+        return true;
+
+    // 2. 按顺序：先把上一张图片之后的 JSON 文本拷出，再把本张图片就地解码到 w（w 始终不超过已读过的位置，
+    //    后面还没拷出的 JSON 文本不会被覆盖）
+    std::string json;
+    json.reserve(n - removed + runs.size() * 24);
+    auto out = std::make_shared<InlineImages>();
+    out->spans.reserve(runs.size());
+    char *d = &body[0];
+    size_t prev = 0;
+    size_t w = 0;
+    for (size_t k = 0; k < runs.size(); ++k)
+    {
+        const Run &r = runs[k];
+        json.append(d + prev, r.str_begin - prev);
+        json += kInlineImageScheme;
+        json += std::to_string(k);
+        prev = r.str_end;
+
+        size_t len = r.str_end - r.b64_begin;
+        if (r.escaped)
+            len = unescape_in_place(d + r.b64_begin, len);
+        size_t out_len = 0;
+        if (!base64_decode_to(d + r.b64_begin, len, d + w, out_len))
+        {
+            err = "invalid base64 in image data URL";
+            return false;
+        }
+        out->spans.emplace_back(w, out_len);
+        w += out_len;
+    }
+    json.append(d + prev, n - prev);
+
+    // 图片只占缓冲的一小部分（文本为主的请求）时收缩，避免 history 长期持有整个请求体大小的缓冲
+    body.resize(w);
+    if (w * 2 < body.capacity())
+        body.shrink_to_fit();
+    out->buf = std::make_shared<const std::string>(std::move(body));
+    body = std::move(json);
+    images = std::move(out);
+
+    const double ms =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    std::lock_guard<std::mutex> lk(g_stats_mu);
+    g_stats.inline_images += static_cast<int64_t>(runs.size());
+    g_stats.inline_image_bytes += static_cast<int64_t>(w);
+    g_stats.inline_decode_ms += ms;
+    return true;
+}
+
+void record_request_body(size_t bytes)
+{
+    std::lock_guard<std::mutex> lk(g_stats_mu);
+    g_stats.bodies++;
+    g_stats.body_bytes += static_cast<int64_t>(bytes);
+    g_stats.body_bytes_max = std::max(g_stats.body_bytes_max, bytes);
+}
+
+void record_request_body_rejected()
+{
+    std::lock_guard<std::mutex> lk(g_stats_mu);
+    g_stats.rejected++;
+}
+
+RequestBodyStats request_body_stats()
+{
+    std::lock_guard<std::mutex> lk(g_stats_mu);
+    return g_stats;
+}
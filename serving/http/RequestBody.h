@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief 大请求体：大小上限、图片 data: URL 的就地抽取与接收统计
+ *
+ * - NetworkHttpServer 按 Content-Length 一次性预分配请求体，socket 缓冲中的数据直接追加进去，超过上限直接 413
+ * - chat 请求体中图片部件 image_url 的 data:<mime>;base64,... 在 JSON 解析之前就地解码并移出：
+ *   图片字节按出现顺序紧挨着写回请求体缓冲的开头（解码输出始终落后于读取位置），该缓冲随后整个交给 InlineImages；
+ *   剩下的 JSON（图片字符串换成 "inline-image:<i>"）另存一份，JSON DOM 里不再有 base64 长串。
+ *   一次上传的峰值内存约为请求体大小，不再是 请求体 + 子串 + DOM 字符串 + 解码结果 的几份拷贝
+ */
+
+// 抽取后 image_url 的取值前缀，后接图片序号
+constexpr const char *kInlineImageScheme = "inline-image:";
+
+struct InlineImages
+{
+    std::shared_ptr<const std::string> buf;       // 所有图片的字节（接管请求体缓冲）
+    std::vector<std::pair<size_t, size_t>> spans; // 第 i 张图片在 buf 中的 offset / size
+};
+
+// HTTP_MAX_BODY_MB：请求体上限（默认 64 MB）
+size_t http_max_body_bytes();
+
+// 抽取 body 中 messages[*].content[*] 里 type 为 "image_url" 的部件的 image_url（字符串或 {"url": ...}）
+// 中的 data:...;base64,... 字符串，其它位置一律不动（含 JSON 转义的按原样留给 DOM 解析，结构不完整时不抽取）。
+// 返回 true：抽到图片时 body 换成剩下的 JSON、images 指向图片；没有时 body 不变、images 为空。
+// 返回 false：某张图片的 base64 非法（body 已被部分改写，只能整体报错），err 说明原因
+bool extract_inline_images(std::string &body, std::shared_ptr<const InlineImages> &images, std::string &err);
+
+struct RequestBodyStats
+{
+    int64_t bodies = 0;        // 收齐的请求体
+    int64_t body_bytes = 0;
+    size_t body_bytes_max = 0;
+    int64_t rejected = 0;      // 超过上限（413）
+    int64_t inline_images = 0; // 就地抽出的图片
+    int64_t inline_image_bytes = 0;
+    double inline_decode_ms = 0;
+};
+
+void record_request_body(size_t bytes);
+void record_request_body_rejected();
+RequestBodyStats request_body_stats();
@@ -0,0 +1,6 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// SHA-256（FIPS 180-4），返回 64 位小写十六进制；用作跨请求共享缓存的内容键（抗碰撞，客户端无法构造同 id 的图片）
+std::string sha256_hex(const void *data, size_t n);
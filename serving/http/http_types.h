@@ -1,11 +1,16 @@
 // http_types.h
 #pragma once
 #include <functional>
+#include <memory>
 #include <string>
 
+struct InlineImages;
+
 struct HttpRequest
 {
     std::string body;
+    // 接收阶段已从 body 中就地解码移出的图片（body 中对应的 url 换成了 inline-image:<i>），见 RequestBody.h
+    std::shared_ptr<const InlineImages> inline_images;
     virtual bool HasQuery(const std::string &key) const = 0;
     virtual std::string Query(const std::string &key) const = 0;
     virtual ~HttpRequest() = default;
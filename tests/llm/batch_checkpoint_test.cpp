@@ -0,0 +1,226 @@
+// BatchCheckpoint 断言测试（不需要模型）：子进程乱序完成一部分行后被杀（最后一条结果只写了一半、没记 checkpoint），
+// 父进程续跑：输出截到 output_bytes、前缀之后乱序完成的行记入 done 并在续跑时跳过、未完成的行重新执行，
+// 最终每行结果恰好一条；checkpoint 与输入 / 输出不匹配时拒绝续跑
+//
+// 用法：batch_checkpoint_test（全部通过返回 0）
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "serving/batch/BatchCheckpoint.h"
+#include "utils/json.hpp"
+
+using json = nlohmann::json;
+
+namespace
+{
+int g_failed = 0;
+
+#define CHECK(cond)                                                                 \
+    do                                                                              \
+    {                                                                               \
+        if (!(cond))                                                                \
+        {                                                                           \
+            std::fprintf(stderr, "%s:%d: CHECK(%s)\n", __FILE__, __LINE__, #cond); \
+            ++g_failed;                                                             \
+        }                                                                           \
+    } while (0)
+
+std::string read_file(const std::string &path)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+void write_file(const std::string &path, const std::string &data)
+{
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << data;
+}
+
+std::string record(int64_t line) { return "{\"line\":" + std::to_string(line) + "}"; }
+
+// 读到输入结束，返回 行号 -> 是否跳过
+std::map<int64_t, bool> read_all(BatchCheckpoint &ck, std::istream &in)
+{
+    std::map<int64_t, bool> lines;
+    std::string text;
+    while (std::getline(in, text))
+    {
+        bool skip = false;
+        const int64_t line = ck.Read(text.size(), skip);
+        lines[line] = skip || text.empty();
+    }
+    return lines;
+}
+
+struct Paths
+{
+    std::string dir, input, output, ckpt;
+};
+
+void remove_paths(const Paths &p)
+{
+    for (const std::string &f : {p.input, p.output, p.ckpt, p.ckpt + ".tmp"})
+        std::remove(f.c_str());
+    rmdir(p.dir.c_str());
+}
+
+Paths make_paths(const char *name)
+{
+    char tmpl[] = "/tmp/batch_ckpt_XXXXXX";
+    const std::string dir = mkdtemp(tmpl);
+    return {dir, dir + "/" + name + ".jsonl", dir + "/out.jsonl", dir + "/out.jsonl.ckpt"};
+}
+
+void test_kill_and_resume()
+{
+    const Paths p = make_paths("input");
+    // 第 3 行为空行；第 6 行带 \r
+    write_file(p.input, "{\"a\":0}\n{\"a\":1}\n{\"a\":2}\n\n{\"a\":4}\n{\"a\":5}\n{\"a\":6}\r\n{\"a\":7}\n");
+    const std::string input = read_file(p.input);
+
+    // 第一次运行（子进程）：读完 0..5，乱序完成 4、2、0，第 1 行的结果只写了一半时被杀
+    const pid_t pid = fork();
+    if (pid == 0)
+    {
+        BatchCheckpoint ck(p.input, p.output, p.ckpt);
+        std::ifstream in(p.input, std::ios::binary);
+        std::string err;
+        if (!ck.Open(in, err) || ck.resumed())
+            _exit(3);
+        std::string text;
+        for (int i = 0; i < 6 && std::getline(in, text); ++i)
+        {
+            bool skip = false;
+            const int64_t line = ck.Read(text.size(), skip);
+            if (text.empty())
+                ck.Complete(line, nullptr);
+        }
+        for (int64_t line : {4, 2, 0})
+        {
+            const std::string r = record(line);
+            ck.Complete(line, &r);
+        }
+        FILE *f = fopen(p.output.c_str(), "ab");
+        fputs("{\"line\":1,\"cho", f);
+        fflush(f);
+        _exit(0); // 不析构、不做最终 Save
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    const json saved = json::parse(read_file(p.ckpt));
+    const uint64_t line1_offset = std::string("{\"a\":0}\n").size();
+    const uint64_t kept = record(4).size() + record(2).size() + record(0).size() + 3;
+    CHECK(saved["next_line"] == 1);
+    CHECK(saved["input_offset"] == line1_offset);
+    CHECK(saved["output_bytes"] == kept);
+    CHECK(saved["done"] == json::array({2, 3, 4}));
+    CHECK(read_file(p.output).size() > kept);
+
+    // 续跑：输出截掉半条结果，从第 1 行继续，2 / 3 / 4 跳过
+    {
+        BatchCheckpoint ck(p.input, p.output, p.ckpt);
+        std::ifstream in(p.input, std::ios::binary);
+        std::string err;
+        CHECK(ck.Open(in, err));
+        CHECK(ck.resumed());
+        CHECK(ck.next_line() == 1);
+        CHECK(ck.skip_pending() == 3);
+        CHECK(read_file(p.output) == record(4) + "\n" + record(2) + "\n" + record(0) + "\n");
+
+        const auto lines = read_all(ck, in);
+        CHECK(lines.size() == 7 && lines.begin()->first == 1 && lines.rbegin()->first == 7);
+        CHECK(!lines.at(1) && lines.at(2) && lines.at(3) && lines.at(4) && !lines.at(5) && !lines.at(6));
+        CHECK(ck.skip_pending() == 0);
+
+        // 乱序完成：前缀在 7 完成前停在 5，checkpoint 中 done 为前缀之后完成的行
+        for (int64_t line : {7, 2, 3, 4, 1})
+        {
+            const std::string r = record(line);
+            ck.Complete(line, lines.at(line) ? nullptr : &r);
+        }
+        CHECK(ck.next_line() == 5);
+        CHECK(json::parse(read_file(p.ckpt))["done"] == json::array({7}));
+        for (int64_t line : {6, 5})
+        {
+            const std::string r = record(line);
+            ck.Complete(line, &r);
+        }
+        CHECK(ck.next_line() == 8);
+        CHECK(ck.input_offset() == input.size());
+        CHECK(ck.Save());
+    }
+
+    // 每行结果恰好一条
+    std::map<int64_t, int> seen;
+    std::istringstream out(read_file(p.output));
+    std::string text;
+    while (std::getline(out, text))
+        ++seen[json::parse(text)["line"].get<int64_t>()];
+    CHECK((seen == std::map<int64_t, int>{{0, 1}, {1, 1}, {2, 1}, {4, 1}, {5, 1}, {6, 1}, {7, 1}}));
+
+    const json final_ck = json::parse(read_file(p.ckpt));
+    CHECK(final_ck["next_line"] == 8 && final_ck["done"].empty());
+
+    // 已全部完成的任务再跑一次：什么都不做
+    {
+        BatchCheckpoint ck(p.input, p.output, p.ckpt);
+        std::ifstream in(p.input, std::ios::binary);
+        std::string err;
+        CHECK(ck.Open(in, err));
+        CHECK(read_all(ck, in).empty());
+    }
+    remove_paths(p);
+}
+
+void test_mismatch_rejected()
+{
+    const Paths p = make_paths("input");
+    write_file(p.input, "{\"a\":0}\n");
+
+    // checkpoint 属于别的输入
+    write_file(p.ckpt, json{{"input", "/other.jsonl"}, {"next_line", 0}, {"input_offset", 0}, {"output_bytes", 0}}.dump());
+    {
+        BatchCheckpoint ck(p.input, p.output, p.ckpt);
+        std::ifstream in(p.input, std::ios::binary);
+        std::string err;
+        CHECK(!ck.Open(in, err) && !err.empty());
+    }
+
+    // 输出比 checkpoint 记录的短
+    write_file(p.ckpt, json{{"input", p.input}, {"next_line", 1}, {"input_offset", 8}, {"output_bytes", 100}}.dump());
+    write_file(p.output, "short\n");
+    {
+        BatchCheckpoint ck(p.input, p.output, p.ckpt);
+        std::ifstream in(p.input, std::ios::binary);
+        std::string err;
+        CHECK(!ck.Open(in, err) && !err.empty());
+        CHECK(read_file(p.output) == "short\n");
+    }
+    remove_paths(p);
+}
+} // namespace
+
+int main()
+{
+    test_kill_and_resume();
+    test_mismatch_rejected();
+    if (g_failed)
+    {
+        std::fprintf(stderr, "%d check(s) failed\n", g_failed);
+        return 1;
+    }
+    std::printf("batch_checkpoint_test: all passed\n");
+    return 0;
+}
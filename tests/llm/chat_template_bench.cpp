@@ -0,0 +1,91 @@
+// chat 模板化 microbenchmark：不加载模型，模拟 50 轮对话，
+// 对比每轮“history 与 history + 新消息各展开一次再取差”（旧做法）与 LlamaChatTemplate 增量展开的耗时，
+// 以及两者产出的增量 prompt 是否一致
+//
+// 用法：chat_template_bench [template=chatml] [turns=50] [reps=200]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "engine/LlamaChatTemplate.h"
+
+namespace
+{
+double now_us()
+{
+    return std::chrono::duration<double, std::micro>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+std::string text(size_t n, int turn)
+{
+    std::string s = "turn " + std::to_string(turn) + ": ";
+    while (s.size() < n)
+        s += "lorem ipsum dolor sit amet ";
+    s.resize(n);
+    return s;
+}
+
+// 旧做法：对 history 与 history + incoming 各展开一次，按长度截取
+bool full_delta(const std::string &tmpl, const std::vector<Message> &history, const std::vector<Message> &incoming,
+                std::string &out)
+{
+    std::string prev;
+    if (!history.empty() && !format_chat(tmpl, history, false, prev))
+        return false;
+    std::vector<Message> all = history;
+    all.insert(all.end(), incoming.begin(), incoming.end());
+    std::string full;
+    if (!format_chat(tmpl, all, true, full))
+        return false;
+    out = full.substr(prev.size() <= full.size() ? prev.size() : 0);
+    return true;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const std::string tmpl = argc > 1 ? argv[1] : "chatml";
+    const int turns = argc > 2 ? std::atoi(argv[2]) : 50;
+    const int reps = argc > 3 ? std::atoi(argv[3]) : 200;
+
+    LlamaChatTemplate chat(tmpl);
+    std::printf("template=%s incremental=%s turns=%d reps=%d\n", tmpl.c_str(),
+                chat.incremental() ? "yes" : "no", turns, reps);
+    std::printf("%6s %10s %12s %12s %8s\n", "turn", "hist_msgs", "full_us", "incr_us", "same");
+
+    std::vector<Message> history = {{"system", "You are a helpful assistant."}};
+    double sum_full = 0, sum_incr = 0;
+    for (int t = 1; t <= turns; ++t)
+    {
+        const std::vector<Message> incoming = {{"user", text(200, t)}};
+
+        std::string a, b, err;
+        double t0 = now_us();
+        for (int r = 0; r < reps; ++r)
+            full_delta(tmpl, history, incoming, a);
+        const double full_us = (now_us() - t0) / reps;
+
+        t0 = now_us();
+        for (int r = 0; r < reps; ++r)
+            chat.Delta(history.size(), history, incoming, b, err);
+        const double incr_us = (now_us() - t0) / reps;
+
+        sum_full += full_us;
+        sum_incr += incr_us;
+        if (t == 1 || t % 10 == 0)
+        {
+            std::printf("%6d %10zu %12.2f %12.2f %8s\n", t, history.size(), full_us, incr_us,
+                        a == b ? "yes" : "NO");
+        }
+
+        history.insert(history.end(), incoming.begin(), incoming.end());
+        history.push_back({"assistant", text(600, t)});
+    }
+    std::printf("avg per turn: full=%.2fus incremental=%.2fus\n", sum_full / turns, sum_incr / turns);
+    return 0;
+}
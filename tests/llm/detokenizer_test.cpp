@@ -0,0 +1,150 @@
+// LlamaDetokenizer / LlamaStopMatcher 断言测试（不需要模型，piece 表直接给定）：
+// stop 跨 token、重叠的 stop、UTF-8 序列跨 token、EOS 时扣留的非 stop 文本 Flush 输出
+//
+// 用法：detokenizer_test（全部通过返回 0）
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "engine/LlamaDetokenizer.h"
+
+namespace
+{
+int g_failed = 0;
+
+#define CHECK(cond)                                                                 \
+    do                                                                              \
+    {                                                                               \
+        if (!(cond))                                                                \
+        {                                                                           \
+            std::fprintf(stderr, "%s:%d: CHECK(%s)\n", __FILE__, __LINE__, #cond); \
+            ++g_failed;                                                             \
+        }                                                                           \
+    } while (0)
+
+struct Run
+{
+    std::vector<std::string> steps; // 每个 Push 的输出
+    std::string text;               // 全部输出（含 Flush）
+    std::string flushed;            // Flush 的输出
+    bool stopped = false;
+    int stop_step = -1;             // 命中 stop 的 Push 序号
+};
+
+// token i 的 piece 为 pieces[i]，依次 Push 全部 token；flush 为 true 时模拟 EOS
+Run run(const std::vector<std::string> &pieces, const std::vector<std::string> &stops, bool flush = true)
+{
+    LlamaPieceTable table(pieces);
+    LlamaDetokenizer detok(&table, stops);
+    Run r;
+    for (int32_t tok = 0; tok < static_cast<int32_t>(pieces.size()); ++tok)
+    {
+        const bool hit = detok.Push(tok);
+        r.steps.push_back(detok.text());
+        r.text += detok.text();
+        if (hit && r.stop_step < 0)
+            r.stop_step = tok;
+    }
+    if (flush)
+    {
+        detok.Flush();
+        r.flushed = detok.text();
+        r.text += r.flushed;
+    }
+    r.stopped = detok.stopped();
+    return r;
+}
+
+void test_stop_split_across_pieces()
+{
+    const Run r = run({"Hello", " wor", "ld<", "/", "s>", " tail"}, {"</s>"});
+    CHECK(r.stopped);
+    CHECK(r.stop_step == 4);
+    CHECK(r.text == "Hello world");
+    CHECK(r.steps[2] == "ld"); // "<" 可能是 stop 的开头，扣住
+    CHECK(r.steps[3].empty());
+    CHECK(r.flushed.empty());  // 命中 stop 之后不再输出
+
+    // stop 整个落在一个 piece 中间
+    const Run m = run({"ab</s>cd"}, {"</s>"});
+    CHECK(m.stopped && m.text == "ab");
+}
+
+void test_overlapping_stops()
+{
+    // 一个 stop 是另一个的中间部分：先结束的先命中
+    Run r = run({"xab", "ce"}, {"abcd", "bc"});
+    CHECK(r.stopped && r.text == "xa");
+
+    // 同一位置结束的两个 stop：按更长（起点更早）的那个截断
+    r = run({"a", "a", "a", "b"}, {"aab", "ab"});
+    CHECK(r.stopped && r.text == "a");
+
+    // 前缀失配后从中间重新匹配
+    r = run({"ab", "ab", "c"}, {"abc"});
+    CHECK(r.stopped && r.text == "ab");
+
+    // 一个 stop 的后缀是另一个的前缀
+    r = run({"hello wor", "ld!"}, {"hello world", "world!"});
+    CHECK(r.stopped && r.text.empty());
+}
+
+void test_utf8_split_across_pieces()
+{
+    // é = C3 A9，中 = E4 B8 AD：不完整的序列等下一个 token 补齐
+    Run r = run({"caf\xC3", "\xA9!", "\xE4", "\xB8", "\xAD"}, {});
+    CHECK(r.steps[0] == "caf");
+    CHECK(r.steps[1] == "\xC3\xA9!");
+    CHECK(r.steps[2].empty() && r.steps[3].empty());
+    CHECK(r.steps[4] == "\xE4\xB8\xAD");
+    CHECK(!r.stopped && r.text == "caf\xC3\xA9!\xE4\xB8\xAD");
+
+    // 有 stop 时同样只输出完整序列
+    r = run({"\xE4\xB8", "\xAD", "END"}, {"END"});
+    CHECK(r.steps[0].empty() && r.steps[1] == "\xE4\xB8\xAD");
+    CHECK(r.stopped && r.text == "\xE4\xB8\xAD");
+
+    // stop 本身是多字节字符，且跨 token
+    r = run({"x\xC3", "\xA9y"}, {"\xC3\xA9"});
+    CHECK(r.stopped && r.text == "x");
+
+    // 非法字节替换为 U+FFFD
+    r = run({"a\xFF" "b"}, {});
+    CHECK(r.text == "a\xEF\xBF\xBD" "b");
+}
+
+void test_flush_held_text()
+{
+    // EOS 时扣留的 "</" 最终不是 stop：Flush 原样输出
+    Run r = run({"a<", "/"}, {"</s>"});
+    CHECK(!r.stopped);
+    CHECK(r.steps[0] == "a" && r.steps[1].empty());
+    CHECK(r.flushed == "</");
+    CHECK(r.text == "a</");
+
+    // 扣留之后失配：在下一个 Push 里输出
+    r = run({"a<", "/x"}, {"</s>"}, false);
+    CHECK(r.steps[1] == "</x");
+
+    // EOS 时 UTF-8 尾部不完整：替换为 U+FFFD
+    r = run({"ok\xE4\xB8"}, {"</s>"});
+    CHECK(r.steps[0] == "ok");
+    CHECK(r.flushed == "\xEF\xBF\xBD");
+}
+} // namespace
+
+int main()
+{
+    test_stop_split_across_pieces();
+    test_overlapping_stops();
+    test_utf8_split_across_pieces();
+    test_flush_held_text();
+    if (g_failed)
+    {
+        std::fprintf(stderr, "%d check(s) failed\n", g_failed);
+        return 1;
+    }
+    std::printf("detokenizer_test: all passed\n");
+    return 0;
+}
@@ -0,0 +1,245 @@
+// 图片准备阶段 benchmark：不加载模型、不走网络，用合成图片对比
+//   inline：图片在模型线程上处理（解码后的缩放 / 归一化 + 视觉编码），期间该模型所有文本流停止出字
+//   stage ：图片交给 LlamaImageStage 的独立线程池处理，准备好后才进入模型线程，模型线程只做 decode
+// 模型线程按固定步长模拟 decode（sleep，不占核），报告相邻两步的间隔（出字卡顿）与图片请求的延迟；
+// 视觉编码用真实计算模拟（缩放到 448x448、归一化、14x14 patch 的线性投影）
+//
+// 用法：image_stage_bench [images=16] [workers=2] [interval_ms=50] [step_ms=15]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "engine/LlamaImageStage.h"
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+double ms_since(Clock::time_point t0)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+}
+
+struct Image
+{
+    int w = 0;
+    int h = 0;
+    std::vector<unsigned char> rgb;
+};
+
+Image synthetic_image(int w, int h, unsigned seed)
+{
+    Image img;
+    img.w = w;
+    img.h = h;
+    img.rgb.resize(static_cast<size_t>(w) * h * 3);
+    std::mt19937 rng(seed);
+    for (auto &c : img.rgb)
+        c = static_cast<unsigned char>(rng() & 0xff);
+    return img;
+}
+
+// 双线性缩放到 side x side + 按通道归一化（CHW float），再做 patch 线性投影得到 n_patch x dim 的 embedding
+std::vector<float> encode(const Image &img, int side, int patch, int dim, const std::vector<float> &proj)
+{
+    static const float mean[3] = {0.481f, 0.458f, 0.408f};
+    static const float stdv[3] = {0.269f, 0.261f, 0.276f};
+
+    std::vector<float> chw(static_cast<size_t>(3) * side * side);
+    for (int y = 0; y < side; ++y)
+    {
+        const float sy = (y + 0.5f) * img.h / side - 0.5f;
+        const int y0 = std::max(0, static_cast<int>(sy));
+        const int y1 = std::min(img.h - 1, y0 + 1);
+        const float fy = std::max(0.0f, sy - y0);
+        for (int x = 0; x < side; ++x)
+        {
+            const float sx = (x + 0.5f) * img.w / side - 0.5f;
+            const int x0 = std::max(0, static_cast<int>(sx));
+            const int x1 = std::min(img.w - 1, x0 + 1);
+            const float fx = std::max(0.0f, sx - x0);
+            for (int c = 0; c < 3; ++c)
+            {
+                auto px = [&](int yy, int xx) { return img.rgb[(static_cast<size_t>(yy) * img.w + xx) * 3 + c] / 255.0f; };
+                const float v = (px(y0, x0) * (1 - fx) + px(y0, x1) * fx) * (1 - fy) +
+                                (px(y1, x0) * (1 - fx) + px(y1, x1) * fx) * fy;
+                chw[(static_cast<size_t>(c) * side + y) * side + x] = (v - mean[c]) / stdv[c];
+            }
+        }
+    }
+
+    const int grid = side / patch;
+    const int k = 3 * patch * patch;
+    std::vector<float> in(k);
+    std::vector<float> out(static_cast<size_t>(grid) * grid * dim);
+    for (int py = 0; py < grid; ++py)
+    {
+        for (int px = 0; px < grid; ++px)
+        {
+            int j = 0;
+            for (int c = 0; c < 3; ++c)
+                for (int y = 0; y < patch; ++y)
+                    for (int x = 0; x < patch; ++x)
+                        in[j++] = chw[(static_cast<size_t>(c) * side + py * patch + y) * side + px * patch + x];
+            float *o = &out[(static_cast<size_t>(py) * grid + px) * dim];
+            for (int d = 0; d < dim; ++d)
+            {
+                const float *wrow = &proj[static_cast<size_t>(d) * k];
+                float acc = 0;
+                for (int i = 0; i < k; ++i)
+                    acc += wrow[i] * in[i];
+                o[d] = acc;
+            }
+        }
+    }
+    return out;
+}
+
+struct Result
+{
+    std::vector<double> gaps_ms;   // 模型线程相邻两步 decode 的间隔
+    std::vector<double> latency_ms; // 图片请求从到达到写入模型线程
+};
+
+double pct(std::vector<double> v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, static_cast<size_t>(p * (v.size() - 1) + 0.5))];
+}
+
+// 模型线程：每步 sleep step_ms 模拟一次 decode；队列里有就绪的图片请求时在步间取出执行
+Result run(bool staged, int n_images, int workers, int interval_ms, int step_ms, const std::vector<Image> &images,
+           const std::vector<float> &proj, LlamaImageStage::Stats &stage_stats)
+{
+    std::mutex mu;
+    std::deque<std::function<void()>> model_q;
+    int done = 0;
+    Result res;
+    std::vector<double> latency(n_images);
+
+    auto enc = [&](int i) { return encode(images[i % images.size()], 448, 14, 256, proj); };
+
+    std::thread model([&]
+    {
+        auto last = Clock::now();
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::lock_guard<std::mutex> lk(mu);
+                if (done == n_images && model_q.empty())
+                    break;
+                if (!model_q.empty())
+                {
+                    task = std::move(model_q.front());
+                    model_q.pop_front();
+                }
+            }
+            if (task)
+                task();
+            std::this_thread::sleep_for(std::chrono::milliseconds(step_ms));
+            res.gaps_ms.push_back(ms_since(last));
+            last = Clock::now();
+        }
+    });
+
+    {
+        LlamaImageStage::Options opt;
+        opt.n_workers = workers;
+        opt.max_queue = static_cast<size_t>(n_images);
+        LlamaImageStage stage(opt);
+
+        for (int i = 0; i < n_images; ++i)
+        {
+            const auto arrived = Clock::now();
+            auto finish = [&, i, arrived]
+            {
+                std::lock_guard<std::mutex> lk(mu);
+                latency[i] = ms_since(arrived);
+                done++;
+            };
+            if (staged)
+            {
+                stage.Submit([&, i, finish]
+                {
+                    auto embd = std::make_shared<std::vector<float>>(enc(i));
+                    std::lock_guard<std::mutex> lk(mu);
+                    model_q.push_back([embd, finish] { finish(); }); // 模型线程只写入 embedding
+                });
+            }
+            else
+            {
+                std::lock_guard<std::mutex> lk(mu);
+                model_q.push_back([&, i, finish]
+                {
+                    volatile float sink = enc(i)[0];
+                    (void)sink;
+                    finish();
+                });
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+        }
+
+        while (true)
+        {
+            {
+                std::lock_guard<std::mutex> lk(mu);
+                if (done == n_images)
+                    break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        stage_stats = stage.GetStats();
+    }
+    model.join();
+    res.latency_ms = latency;
+    return res;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const int n_images = argc > 1 ? std::atoi(argv[1]) : 16;
+    const int workers = argc > 2 ? std::atoi(argv[2]) : 2;
+    const int interval_ms = argc > 3 ? std::atoi(argv[3]) : 50;
+    const int step_ms = argc > 4 ? std::atoi(argv[4]) : 15;
+
+    std::vector<Image> images;
+    for (int i = 0; i < 4; ++i)
+        images.push_back(synthetic_image(1280 - 160 * i, 720 + 90 * i, 1234 + i));
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> nd(0.0f, 0.02f);
+    std::vector<float> proj(static_cast<size_t>(256) * 3 * 14 * 14);
+    for (auto &v : proj)
+        v = nd(rng);
+
+    const auto t0 = Clock::now();
+    encode(images[0], 448, 14, 256, proj);
+    std::printf("images=%d workers=%d interval_ms=%d step_ms=%d encode_ms=%.1f\n", n_images, workers, interval_ms,
+                step_ms, ms_since(t0));
+    std::printf("%8s %10s %10s %10s %12s %12s %10s %12s\n", "mode", "gap_p50", "gap_p99", "gap_max", "img_lat_p50",
+                "img_lat_max", "queue_max", "stage_wait");
+
+    for (bool staged : {false, true})
+    {
+        LlamaImageStage::Stats st;
+        const Result r = run(staged, n_images, workers, interval_ms, step_ms, images, proj, st);
+        std::printf("%8s %10.1f %10.1f %10.1f %12.1f %12.1f %10zu %12.1f\n", staged ? "stage" : "inline",
+                    pct(r.gaps_ms, 0.5), pct(r.gaps_ms, 0.99), pct(r.gaps_ms, 1.0), pct(r.latency_ms, 0.5),
+                    pct(r.latency_ms, 1.0), staged ? st.queued_max : 0,
+                    staged && st.completed > 0 ? st.wait_ms_total / st.completed : 0.0);
+    }
+    return 0;
+}
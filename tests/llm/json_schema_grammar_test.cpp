@@ -0,0 +1,116 @@
+// json_schema_to_gbnf 断言测试（不需要模型）：属性按声明顺序输出，
+// minLength / maxLength / minItems / maxItems 非法（负数、非整数、max < min、超过上限）时拒绝
+//
+// 用法：json_schema_grammar_test（全部通过返回 0）
+
+#include <cstdio>
+#include <string>
+
+#include "serving/http/JsonSchemaGrammar.h"
+#include "utils/json.hpp"
+
+using json = nlohmann::ordered_json;
+
+namespace
+{
+int g_failed = 0;
+
+#define CHECK(cond)                                                                 \
+    do                                                                              \
+    {                                                                               \
+        if (!(cond))                                                                \
+        {                                                                           \
+            std::fprintf(stderr, "%s:%d: CHECK(%s)\n", __FILE__, __LINE__, #cond); \
+            ++g_failed;                                                             \
+        }                                                                           \
+    } while (0)
+
+bool convert(const std::string &schema, std::string &gbnf, std::string &err)
+{
+    gbnf.clear();
+    err.clear();
+    return json_schema_to_gbnf(json::parse(schema), gbnf, err);
+}
+
+bool contains(const std::string &s, const std::string &sub) { return s.find(sub) != std::string::npos; }
+
+void test_valid_bounds()
+{
+    std::string gbnf, err;
+    CHECK(convert(R"({"type":"string","minLength":2,"maxLength":5})", gbnf, err));
+    CHECK(contains(gbnf, "char{2,5}"));
+
+    CHECK(convert(R"({"type":"string","minLength":3})", gbnf, err));
+    CHECK(contains(gbnf, "char{3,}"));
+
+    // 整数值的浮点数也接受
+    CHECK(convert(R"({"type":"string","maxLength":4.0})", gbnf, err));
+    CHECK(contains(gbnf, "char{0,4}"));
+
+    CHECK(convert(R"({"type":"array","items":{"type":"integer"},"minItems":1,"maxItems":3})", gbnf, err));
+    CHECK(contains(gbnf, "{0,2}"));
+
+    CHECK(convert(R"({"type":"array","items":{"type":"integer"},"maxItems":0})", gbnf, err));
+    CHECK(contains(gbnf, R"(root ::= "[" space "]" space)"));
+
+    // 上限本身允许
+    CHECK(convert(R"({"type":"array","items":{"type":"null"},"maxItems":10000})", gbnf, err));
+}
+
+void test_invalid_bounds()
+{
+    const char *bad[] = {
+        R"({"type":"string","minLength":5,"maxLength":2})",
+        R"({"type":"string","minLength":-1})",
+        R"({"type":"string","maxLength":2.5})",
+        R"({"type":"string","maxLength":"3"})",
+        R"({"type":"string","maxLength":100000})",
+        R"({"type":"array","items":{"type":"string"},"minItems":3,"maxItems":1})",
+        R"({"type":"array","items":{"type":"string"},"maxItems":1e9})",
+        R"({"type":"array","items":{"type":"string"},"minItems":-2})",
+        R"({"type":"array","items":{"type":"string"},"minItems":true})",
+        // 嵌套在属性里的非法约束同样拒绝
+        R"({"type":"object","properties":{"tags":{"type":"array","items":{"type":"string"},"maxItems":-1}}})",
+    };
+    for (const char *schema : bad)
+    {
+        std::string gbnf, err;
+        const bool ok = convert(schema, gbnf, err);
+        if (ok || err.empty())
+            std::fprintf(stderr, "accepted: %s\n", schema);
+        CHECK(!ok);
+        CHECK(!err.empty());
+    }
+
+    std::string gbnf, err;
+    convert(R"({"type":"string","minLength":5,"maxLength":2})", gbnf, err);
+    CHECK(contains(err, "maxLength"));
+    convert(R"({"type":"array","items":{"type":"string"},"maxItems":1e9})", gbnf, err);
+    CHECK(contains(err, "maxItems"));
+}
+
+void test_property_order()
+{
+    std::string gbnf, err;
+    CHECK(convert(R"({"type":"object","properties":{"zeta":{"type":"string"},"alpha":{"type":"integer"}},)"
+                  R"("required":["zeta","alpha"]})",
+                  gbnf, err));
+    const auto z = gbnf.find("zeta");
+    const auto a = gbnf.find("alpha");
+    CHECK(z != std::string::npos && a != std::string::npos && z < a);
+}
+} // namespace
+
+int main()
+{
+    test_valid_bounds();
+    test_invalid_bounds();
+    test_property_order();
+    if (g_failed)
+    {
+        std::fprintf(stderr, "%d check(s) failed\n", g_failed);
+        return 1;
+    }
+    std::printf("json_schema_grammar_test: all passed\n");
+    return 0;
+}
@@ -0,0 +1,313 @@
+// LlamaPrefixCache 断言测试（不需要模型）：用假的 seq 操作记录每个 seq 上的 token，
+// 校验边中间拆分、共享前缀的 LRU 淘汰与剪枝（被淘汰的 seq 覆盖的共享节点改挂到仍在的前缀）、
+// 预算 / seq 数不足时的淘汰，以及随机插入 / 命中 / 淘汰下与朴素模型（逐条比较最长公共前缀）一致
+//
+// 用法：prefix_cache_test（全部通过返回 0）
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "engine/LlamaPrefixCache.h"
+
+using Tokens = std::vector<int32_t>;
+
+namespace
+{
+int g_failed = 0;
+
+#define CHECK(cond)                                                                 \
+    do                                                                              \
+    {                                                                               \
+        if (!(cond))                                                                \
+        {                                                                           \
+            std::fprintf(stderr, "%s:%d: CHECK(%s)\n", __FILE__, __LINE__, #cond); \
+            ++g_failed;                                                             \
+        }                                                                           \
+    } while (0)
+
+constexpr int kFirstSeq = 16; // 缓存 seq 区间起点；session seq 用 0..15
+constexpr int kSrcSeq = 0;
+constexpr int kDstSeq = 1;
+
+// 假 KV：每个 seq 上依次存放的 token
+struct FakeKv
+{
+    std::map<int, Tokens> seqs;
+    bool bad_copy = false;
+
+    LlamaPrefixCache::SeqOps ops()
+    {
+        return {[this](int src, int dst, int n)
+                {
+                    const Tokens &s = seqs[src];
+                    if (n > (int)s.size())
+                    {
+                        bad_copy = true;
+                        n = (int)s.size();
+                    }
+                    seqs[dst].assign(s.begin(), s.begin() + n);
+                },
+                [this](int seq) { seqs.erase(seq); }};
+    }
+
+    // 当前缓存中的前缀（缓存专用 seq 上的内容）
+    std::vector<Tokens> cached(int n_seqs) const
+    {
+        std::vector<Tokens> out;
+        for (const auto &kv : seqs)
+        {
+            if (kv.first >= kFirstSeq && kv.first < kFirstSeq + n_seqs)
+                out.push_back(kv.second);
+        }
+        return out;
+    }
+};
+
+Tokens range(int32_t from, int32_t to)
+{
+    Tokens t;
+    for (int32_t v = from; v < to; ++v)
+        t.push_back(v);
+    return t;
+}
+
+Tokens cat(Tokens a, const Tokens &b)
+{
+    a.insert(a.end(), b.begin(), b.end());
+    return a;
+}
+
+// 模拟 prefill 完成后收录：src seq 上就是 toks
+void insert(LlamaPrefixCache &cache, FakeKv &kv, const Tokens &toks)
+{
+    kv.seqs[kSrcSeq] = toks;
+    cache.Insert(toks, kSrcSeq);
+}
+
+// 命中时 dst seq 上的 token 必须正好是 toks 的前 n 个
+int restore(LlamaPrefixCache &cache, FakeKv &kv, const Tokens &toks)
+{
+    kv.seqs.erase(kDstSeq);
+    const int n = cache.Restore(toks, kDstSeq);
+    if (n > 0)
+    {
+        const Tokens &got = kv.seqs[kDstSeq];
+        CHECK((int)got.size() == n && std::equal(got.begin(), got.end(), toks.begin()));
+    }
+    return n;
+}
+
+// LRU 依赖 steady_clock 时间戳：相邻操作之间留出间隔
+void tick() { std::this_thread::sleep_for(std::chrono::milliseconds(1)); }
+
+LlamaPrefixCache::Options options(int n_seqs, int max_tokens, int min_tokens)
+{
+    LlamaPrefixCache::Options opt;
+    opt.first_seq = kFirstSeq;
+    opt.n_seqs = n_seqs;
+    opt.max_tokens = max_tokens;
+    opt.min_tokens = min_tokens;
+    return opt;
+}
+
+void test_split_mid_edge()
+{
+    FakeKv kv;
+    LlamaPrefixCache cache(kv.ops(), options(4, 1000, 2));
+
+    const Tokens a = range(1, 11);                  // 1..10
+    const Tokens b = cat(range(1, 6), range(50, 55)); // 1..5 50..54：在 a 的边中间分叉
+    insert(cache, kv, a);
+    insert(cache, kv, b);
+    auto st = cache.GetStats();
+    CHECK(st.entries == 2);
+    CHECK(st.tokens == 15); // 共享的 1..5 只算一次
+
+    CHECK(restore(cache, kv, cat(a, {99})) == 10);
+    CHECK(restore(cache, kv, cat(b, {99})) == 10);
+    CHECK(restore(cache, kv, cat(range(1, 6), {77, 78})) == 5); // 停在拆分点
+    CHECK(restore(cache, kv, cat(range(1, 8), {77})) == 7);     // 停在 a 的下半段边中间
+    CHECK(restore(cache, kv, a) == 9);                          // 至少留 1 个 token 给 prefill
+    CHECK(restore(cache, kv, {1}) == 0);                        // 短于 min_tokens
+    CHECK(restore(cache, kv, range(2, 20)) == 0);
+
+    // 已被覆盖的前缀（a 的前 4 个）不再收录
+    insert(cache, kv, range(1, 5));
+    CHECK(cache.GetStats().entries == 2);
+
+    // 在拆分出的中间节点处再分叉
+    insert(cache, kv, cat(range(1, 6), range(60, 63)));
+    st = cache.GetStats();
+    CHECK(st.entries == 3 && st.tokens == 18);
+    CHECK(restore(cache, kv, cat(range(1, 6), {60, 61, 62, 0})) == 8);
+    CHECK(!kv.bad_copy);
+}
+
+void test_lru_prune_shared_prefix()
+{
+    FakeKv kv;
+    LlamaPrefixCache cache(kv.ops(), options(4, 1000, 2));
+
+    const Tokens a = range(1, 11);
+    const Tokens b = cat(range(1, 6), range(50, 55));
+    insert(cache, kv, a); // 拆分后共享节点 1..5 挂在 a 的 seq 上
+    tick();
+    insert(cache, kv, b);
+    tick();
+
+    // a 最久未用：淘汰后共享的 1..5 改挂到 b，b 的整条路径仍可命中
+    CHECK(cache.EvictOne());
+    auto st = cache.GetStats();
+    CHECK(st.entries == 1 && st.evictions == 1);
+    CHECK(st.tokens == 10);
+    CHECK(restore(cache, kv, cat(range(1, 6), {77})) == 5);
+    CHECK(restore(cache, kv, cat(b, {0})) == 10);
+    CHECK(restore(cache, kv, cat(a, {0})) == 5); // a 独有的 6..10 已剪掉
+    tick();
+
+    // 命中会刷新 LRU：c 收录后先淘汰 c 以外最久未用的那条
+    const Tokens c = cat(range(1, 3), range(80, 84));
+    insert(cache, kv, c);
+    tick();
+    CHECK(restore(cache, kv, cat(b, {0})) == 10);
+    tick();
+    CHECK(cache.EvictOne()); // 淘汰 c（b 刚被命中）
+    CHECK(restore(cache, kv, cat(c, {0})) == 2);
+    CHECK(restore(cache, kv, cat(b, {0})) == 10);
+    CHECK(cache.GetStats().tokens == 10);
+
+    CHECK(cache.EvictOne());
+    st = cache.GetStats();
+    CHECK(st.entries == 0 && st.tokens == 0);
+    CHECK(!cache.EvictOne());
+    CHECK(restore(cache, kv, cat(b, {0})) == 0);
+    CHECK(kv.cached(4).empty());
+    CHECK(!kv.bad_copy);
+}
+
+void test_budget_and_seq_limits()
+{
+    // token 预算：收录超出时按 LRU 淘汰，直到放得下
+    {
+        FakeKv kv;
+        LlamaPrefixCache cache(kv.ops(), options(8, 20, 2));
+        insert(cache, kv, range(100, 108)); // 8
+        tick();
+        insert(cache, kv, range(200, 208)); // 16
+        tick();
+        insert(cache, kv, range(300, 308)); // 24 > 20：淘汰 100..
+        auto st = cache.GetStats();
+        CHECK(st.tokens == 16 && st.entries == 2 && st.evictions == 1);
+        CHECK(restore(cache, kv, range(100, 109)) == 0);
+        CHECK(restore(cache, kv, range(300, 309)) == 8);
+
+        insert(cache, kv, range(400, 430)); // 超过 max_tokens 的不收录
+        CHECK(cache.GetStats().entries == 2);
+    }
+
+    // seq 数：专用 seq 用完时淘汰最久未用的一条，其 seq 给新前缀
+    {
+        FakeKv kv;
+        LlamaPrefixCache cache(kv.ops(), options(2, 1000, 2));
+        insert(cache, kv, range(1, 6));
+        tick();
+        insert(cache, kv, range(10, 16));
+        tick();
+        insert(cache, kv, range(20, 26));
+        auto st = cache.GetStats();
+        CHECK(st.entries == 2 && st.evictions == 1);
+        CHECK(restore(cache, kv, range(1, 7)) == 0);
+        CHECK(restore(cache, kv, range(20, 27)) == 6);
+        CHECK(kv.cached(2).size() == 2);
+    }
+}
+
+// 与朴素模型比较：命中长度 = 与任一缓存前缀的最长公共前缀（至少留 1 个、短于 min 记 0），
+// 树上 token 数 = 所有缓存前缀的不同前缀个数
+void test_randomized()
+{
+    const int n_seqs = 6, max_tokens = 120, min_tokens = 3;
+    FakeKv kv;
+    LlamaPrefixCache cache(kv.ops(), options(n_seqs, max_tokens, min_tokens));
+    std::mt19937 rng(7);
+
+    auto random_toks = [&]
+    {
+        // 小字母表 + 公共开头，制造大量共享前缀与边中间分叉
+        Tokens t = {1, 2};
+        const int len = 2 + (int)(rng() % 30);
+        for (int i = 0; i < len; ++i)
+            t.push_back((int32_t)(rng() % 3));
+        return t;
+    };
+
+    std::vector<Tokens> history;
+    for (int step = 0; step < 3000; ++step)
+    {
+        const int op = (int)(rng() % 10);
+        if (op < 4)
+        {
+            history.push_back(random_toks());
+            insert(cache, kv, history.back());
+        }
+        else if (op < 9)
+        {
+            Tokens q = history.empty() || rng() % 2 ? random_toks() : history[rng() % history.size()];
+            if (rng() % 2)
+                q.push_back((int32_t)(rng() % 3));
+
+            size_t best = 0;
+            for (const Tokens &c : kv.cached(n_seqs))
+            {
+                size_t k = 0;
+                while (k < c.size() && k < q.size() && c[k] == q[k])
+                    ++k;
+                best = std::max(best, k);
+            }
+            const int expect = std::min<int>((int)best, (int)q.size() - 1);
+            const int got = restore(cache, kv, q);
+            CHECK(got == (expect >= min_tokens ? expect : 0));
+        }
+        else
+        {
+            cache.EvictOne();
+        }
+
+        std::set<Tokens> prefixes;
+        const auto cached = kv.cached(n_seqs);
+        for (const Tokens &c : cached)
+        {
+            for (size_t k = 1; k <= c.size(); ++k)
+                prefixes.insert(Tokens(c.begin(), c.begin() + k));
+        }
+        const auto st = cache.GetStats();
+        CHECK(st.tokens == (int64_t)prefixes.size());
+        CHECK(st.tokens <= max_tokens);
+        CHECK(st.entries == (int64_t)cached.size());
+        if (g_failed)
+            break;
+    }
+    CHECK(!kv.bad_copy);
+}
+} // namespace
+
+int main()
+{
+    test_split_mid_edge();
+    test_lru_prune_shared_prefix();
+    test_budget_and_seq_limits();
+    test_randomized();
+    if (g_failed)
+    {
+        std::fprintf(stderr, "%d check(s) failed\n", g_failed);
+        return 1;
+    }
+    std::printf("prefix_cache_test: all passed\n");
+    return 0;
+}
@@ -0,0 +1,456 @@
+// 大请求体 benchmark：不走网络，按 64 KB 一块模拟 socket 读，对比一个带大图的 chat 请求从收包到拿到图片字节
+//   old：连接级字符串累积 → substr 出 body → 拷进请求 → JSON DOM（含 base64 长串）→ 逐字节 base64 解码
+//   new：按 Content-Length 预分配 body 直接追加 → 就地解码抽出图片（SIMD base64）→ 只剩文本的 JSON DOM
+// 通过替换全局 operator new 统计堆内存峰值，报告峰值 / 请求体大小与耗时
+// 计时之前先做解码结果校验（SIMD 解码直接处理不可信的请求体）：与逐字节参考实现逐字节比对，
+// 覆盖随机长度、夹杂空白、\/ 与 \n 转义、\uXXXX（留给 DOM）、一个 body 多张图片、非法字符与就地解码，
+// 以及只改写 messages[*].content[*] 中的图片部件
+//
+// 用法：request_body_bench [image_mb=10] [rounds=5] [verify_iters=300]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "serving/http/Base64.h"
+#include "serving/http/RequestBody.h"
+#include "utils/json.hpp"
+
+namespace
+{
+std::atomic<size_t> g_live{0};
+std::atomic<size_t> g_peak{0};
+
+void *counted_alloc(size_t n)
+{
+    void *p = std::malloc(n + 16);
+    if (!p)
+        throw std::bad_alloc();
+    *static_cast<size_t *>(p) = n;
+    const size_t live = g_live.fetch_add(n) + n;
+    size_t peak = g_peak.load();
+    while (live > peak && !g_peak.compare_exchange_weak(peak, live))
+    {
+    }
+    return static_cast<char *>(p) + 16;
+}
+
+void counted_free(void *p)
+{
+    if (!p)
+        return;
+    char *base = static_cast<char *>(p) - 16;
+    g_live.fetch_sub(*reinterpret_cast<size_t *>(base));
+    std::free(base);
+}
+} // namespace
+
+void *operator new(size_t n) { return counted_alloc(n); }
+void *operator new[](size_t n) { return counted_alloc(n); }
+void operator delete(void *p) noexcept { counted_free(p); }
+void operator delete[](void *p) noexcept { counted_free(p); }
+void operator delete(void *p, size_t) noexcept { counted_free(p); }
+void operator delete[](void *p, size_t) noexcept { counted_free(p); }
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+using json = nlohmann::json;
+
+constexpr size_t kReadChunk = 64 * 1024;
+
+std::string encode_base64(const std::string &s)
+{
+    static const char *abc = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((s.size() + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 3 <= s.size(); i += 3)
+    {
+        const unsigned v = static_cast<unsigned char>(s[i]) << 16 | static_cast<unsigned char>(s[i + 1]) << 8 |
+                           static_cast<unsigned char>(s[i + 2]);
+        out += abc[v >> 18];
+        out += abc[(v >> 12) & 63];
+        out += abc[(v >> 6) & 63];
+        out += abc[v & 63];
+    }
+    if (i < s.size())
+    {
+        const unsigned v = static_cast<unsigned char>(s[i]) << 16 |
+                           (i + 1 < s.size() ? static_cast<unsigned char>(s[i + 1]) << 8 : 0);
+        out += abc[v >> 18];
+        out += abc[(v >> 12) & 63];
+        out += i + 1 < s.size() ? abc[(v >> 6) & 63] : '=';
+        out += '=';
+    }
+    return out;
+}
+
+// 改动前的逐字节解码（对照用）
+bool decode_scalar(const std::string &in, std::string &out)
+{
+    static int8_t table[256];
+    static bool init = false;
+    if (!init)
+    {
+        std::fill(table, table + 256, -1);
+        const char *abc = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        for (int i = 0; i < 64; ++i)
+            table[static_cast<uint8_t>(abc[i])] = static_cast<int8_t>(i);
+        init = true;
+    }
+    out.clear();
+    out.reserve(in.size() / 4 * 3);
+    uint32_t acc = 0;
+    int bits = 0;
+    for (unsigned char c : in)
+    {
+        if (c == '=')
+            break;
+        if (table[c] < 0)
+            return false;
+        acc = (acc << 6) | static_cast<uint32_t>(table[c]);
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            out.push_back(static_cast<char>((acc >> bits) & 0xFF));
+        }
+    }
+    return true;
+}
+
+// 参考解码：去掉空白后逐字节解码
+bool decode_reference(const std::string &in, std::string &out)
+{
+    std::string s;
+    s.reserve(in.size());
+    for (char c : in)
+    {
+        if (c != ' ' && c != '\n' && c != '\r' && c != '\t')
+            s += c;
+    }
+    return decode_scalar(s, out);
+}
+
+std::string random_bytes(std::mt19937 &rng, size_t n)
+{
+    std::string s(n, '\0');
+    for (auto &c : s)
+        c = static_cast<char>(rng() & 0xff);
+    return s;
+}
+
+// 长度偏向 SIMD 块（32 / 64 字符）边界附近，偶尔取大块
+size_t random_length(std::mt19937 &rng)
+{
+    switch (rng() % 4)
+    {
+    case 0:
+        return rng() % 64;
+    case 1:
+        return 48 * (1 + rng() % 8) + rng() % 5 - 2; // 64 个 base64 字符 = 48 字节
+    case 2:
+        return rng() % 4096;
+    default:
+        return rng() % (256 * 1024);
+    }
+}
+
+// 在 b64 中随机位置插入空白（含按 76 列换行），返回插入后的串
+std::string sprinkle_spaces(std::mt19937 &rng, const std::string &b64, const char *ws)
+{
+    std::string out;
+    out.reserve(b64.size() + b64.size() / 16 + 8);
+    const size_t every = rng() % 2 ? 76 : 1 + rng() % 100;
+    for (size_t i = 0; i < b64.size(); ++i)
+    {
+        if (i && (i % every == 0 || rng() % 97 == 0))
+            out += ws[rng() % std::strlen(ws)];
+        out += b64[i];
+    }
+    return out;
+}
+
+int g_failures = 0;
+
+void check(bool ok, const char *what, size_t detail)
+{
+    if (ok)
+        return;
+    if (++g_failures <= 10)
+        std::fprintf(stderr, "verify failed: %s (%zu)\n", what, detail);
+}
+
+// base64_decode / base64_decode_to（含就地解码）与参考实现比对
+void verify_decoder(std::mt19937 &rng)
+{
+    const std::string raw = random_bytes(rng, random_length(rng));
+    std::string b64 = encode_base64(raw);
+    if (rng() % 2)
+        b64 = sprinkle_spaces(rng, b64, " \n\r\t");
+
+    std::string ref;
+    check(decode_reference(b64, ref) && ref == raw, "reference", raw.size());
+
+    std::string out;
+    check(base64_decode(b64.data(), b64.size(), out) && out == raw, "base64_decode", raw.size());
+
+    std::string dst(b64.size() / 4 * 3 + 16, '\0');
+    size_t len = 0;
+    check(base64_decode_to(b64.data(), b64.size(), &dst[0], len) && dst.compare(0, len, raw) == 0 && len == raw.size(),
+          "base64_decode_to", raw.size());
+
+    std::string inplace = b64;
+    len = 0;
+    check(base64_decode_to(inplace.data(), inplace.size(), &inplace[0], len) && len == raw.size() &&
+              inplace.compare(0, len, raw) == 0,
+          "in-place", raw.size());
+
+    // 非法字符（落在 SIMD 块内或块尾）必须报错
+    if (!b64.empty())
+    {
+        std::string bad = b64;
+        bad[rng() % bad.size()] = "!*-_.\"\x80"[rng() % 7];
+        check(!base64_decode(bad.data(), bad.size(), out), "invalid char accepted", bad.size());
+    }
+}
+
+// 一个 chat 请求体带 1~4 张图片，随机使用 空格 / \n 转义 / \/ 转义 / \u002F 转义，抽取后逐张比对
+void verify_body(std::mt19937 &rng)
+{
+    const size_t count = 1 + rng() % 4;
+    std::vector<std::string> raws;
+    std::string body = R"({"model":"llama","messages":[{"role":"user","content":[{"type":"text","text":"a\/b \"c\""})";
+    for (size_t k = 0; k < count; ++k)
+    {
+        raws.push_back(random_bytes(rng, random_length(rng) % 65536));
+        std::string b64 = encode_base64(raws.back());
+        std::string lit;
+        switch (rng() % 5)
+        {
+        case 0:
+            lit = b64;
+            break;
+        case 1:
+            lit = sprinkle_spaces(rng, b64, " "); // JSON 字符串里只有空格可以原样出现
+            break;
+        case 2:
+            for (size_t i = 0; i < b64.size(); ++i)
+                lit += (i && i % 76 == 0 ? "\\n" : "") + std::string(1, b64[i]);
+            break;
+        case 3:
+            for (char c : b64)
+                lit += c == '/' ? std::string("\\/") : std::string(1, c);
+            break;
+        default:
+            for (char c : b64)
+                lit += c == '/' && rng() % 2 ? std::string("\\u002F") : std::string(1, c);
+            break;
+        }
+        body += R"(,{"type":"image_url","image_url":{"url":"data:image/png;base64,)" + lit + R"("}})";
+    }
+    body += "]}]}";
+
+    std::shared_ptr<const InlineImages> images;
+    std::string err;
+    if (!extract_inline_images(body, images, err))
+    {
+        check(false, "extract", count);
+        return;
+    }
+    const json doc = json::parse(body);
+    const auto &content = doc["messages"][0]["content"];
+    check(content[0]["text"] == "a/b \"c\"", "text part", count);
+    for (size_t k = 0; k < count; ++k)
+    {
+        const std::string url = content[k + 1]["image_url"]["url"].get<std::string>();
+        std::string got;
+        if (url.rfind(kInlineImageScheme, 0) == 0)
+        {
+            const size_t idx = std::stoul(url.substr(std::strlen(kInlineImageScheme)));
+            check(images && idx < images->spans.size(), "inline index", idx);
+            if (!images || idx >= images->spans.size())
+                continue;
+            got.assign(*images->buf, images->spans[idx].first, images->spans[idx].second);
+        }
+        else
+        {
+            // 含 \uXXXX 的留给 DOM，按原路径解码
+            check(decode_reference(url.substr(url.find(',') + 1), got), "dom decode", k);
+        }
+        check(got == raws[k], "image bytes", raws[k].size());
+    }
+}
+
+// 只抽取 messages[*].content[*] 中 type 为 image_url 的部件；其它位置的 "url" / "image_url" data: 串原样保留
+void verify_scope()
+{
+    const std::string b64 = encode_base64("\x89PNG-scope");
+    const std::string data = "data:image/png;base64," + b64;
+    std::string body = R"({"model":"llama","url":")" + data + R"(","metadata":{"image_url":")" + data +
+                       R"("},"messages":[{"role":"user","url":")" + data + R"(","content":[)"
+                       R"({"type":"text","text":"x","image_url":{"url":")" + data + R"("}},)"
+                       R"({"image_url":{"url":")" + data + R"("},"type":"image_url"},)"
+                       R"({"type":"input_audio","image_url":")" + data + R"("}]}]})";
+    const std::string original = body;
+
+    std::shared_ptr<const InlineImages> images;
+    std::string err;
+    if (!extract_inline_images(body, images, err))
+    {
+        check(false, "scope extract", 0);
+        return;
+    }
+    check(images && images->spans.size() == 1, "scope image count", images ? images->spans.size() : 0);
+    const json doc = json::parse(body);
+    const json orig = json::parse(original);
+    check(doc["url"] == orig["url"], "top-level url", 0);
+    check(doc["metadata"] == orig["metadata"], "metadata image_url", 0);
+    const auto &msg = doc["messages"][0];
+    check(msg["url"] == orig["messages"][0]["url"], "message url", 0);
+    check(msg["content"][0] == orig["messages"][0]["content"][0], "text part", 0);
+    check(msg["content"][1]["image_url"]["url"] == std::string(kInlineImageScheme) + "0", "image part", 0);
+    check(msg["content"][2] == orig["messages"][0]["content"][2], "non-image part", 0);
+
+    // 结构不完整：不改写，留给 JSON 解析报错
+    std::string broken = R"({"messages":[{"content":[{"type":"image_url","image_url":{"url":")" + data + R"("}})";
+    const std::string broken_orig = broken;
+    check(extract_inline_images(broken, images, err) && !images && broken == broken_orig, "malformed body", 0);
+}
+
+int verify(int iters)
+{
+    verify_scope();
+
+    std::mt19937 rng(12345);
+    for (int i = 0; i < iters; ++i)
+    {
+        verify_decoder(rng);
+        verify_body(rng);
+    }
+    return g_failures;
+}
+
+struct Result
+{
+    double ms = 0;
+    size_t peak = 0;
+    size_t image_bytes = 0;
+};
+
+// 改动前：retrieveAllAsString + 连接级累积、substr、拷进请求、DOM、解码
+Result run_old(const std::string &wire, size_t header_len)
+{
+    Result r;
+    const size_t base = g_live.load();
+    g_peak = base;
+    const auto t0 = Clock::now();
+    {
+        std::string cache;
+        std::string req_body;
+        for (size_t off = 0; off < wire.size(); off += kReadChunk)
+        {
+            cache.append(std::string(wire, off, std::min(kReadChunk, wire.size() - off)));
+            if (cache.size() < wire.size())
+                continue;
+            std::string body = cache.substr(header_len, wire.size() - header_len);
+            cache.erase(0, wire.size());
+            req_body = body;
+        }
+        const json doc = json::parse(req_body);
+        const std::string &url = doc["messages"][0]["content"][1]["image_url"]["url"].get_ref<const std::string &>();
+        std::string image;
+        decode_scalar(url.substr(url.find(',') + 1), image);
+        r.image_bytes = image.size();
+    }
+    r.ms = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+    r.peak = g_peak.load() - base;
+    return r;
+}
+
+// 改动后：预分配 body 直接追加、就地抽出图片、只剩文本的 DOM
+Result run_new(const std::string &wire, size_t header_len)
+{
+    Result r;
+    const size_t base = g_live.load();
+    g_peak = base;
+    const auto t0 = Clock::now();
+    {
+        std::string body;
+        body.reserve(wire.size() - header_len);
+        for (size_t off = header_len; off < wire.size(); off += kReadChunk)
+            body.append(wire, off, std::min(kReadChunk, wire.size() - off));
+
+        std::shared_ptr<const InlineImages> images;
+        std::string err;
+        if (!extract_inline_images(body, images, err) || !images)
+        {
+            std::fprintf(stderr, "extract failed: %s\n", err.c_str());
+            std::exit(1);
+        }
+        const json doc = json::parse(body);
+        (void)doc;
+        r.image_bytes = images->spans[0].second;
+    }
+    r.ms = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+    r.peak = g_peak.load() - base;
+    return r;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const int image_mb = argc > 1 ? std::atoi(argv[1]) : 10;
+    const int rounds = argc > 2 ? std::atoi(argv[2]) : 5;
+    const int verify_iters = argc > 3 ? std::atoi(argv[3]) : 300;
+
+    if (verify(verify_iters) != 0)
+    {
+        std::fprintf(stderr, "decode verification failed: %d mismatches\n", g_failures);
+        return 1;
+    }
+    std::printf("verify ok: iters=%d (decoder + body extraction vs scalar reference)\n", verify_iters);
+
+    std::string image(static_cast<size_t>(image_mb) << 20, '\0');
+    std::mt19937 rng(7);
+    for (auto &c : image)
+        c = static_cast<char>(rng() & 0xff);
+
+    std::string body = R"({"model":"llama","messages":[{"role":"user","content":[{"type":"text","text":"图里有什么？"},)"
+                       R"({"type":"image_url","image_url":{"url":"data:image/jpeg;base64,)" +
+                       encode_base64(image) + R"("}}]}]})";
+    const std::string header = "POST /v1/chat/completions HTTP/1.1\r\nContent-Type: application/json\r\nContent-Length: " +
+                               std::to_string(body.size()) + "\r\n\r\n";
+    const std::string wire = header + body;
+    std::string().swap(body);
+
+    std::printf("image_mb=%d body_bytes=%zu rounds=%d\n", image_mb, wire.size() - header.size(), rounds);
+    std::printf("%6s %10s %12s %14s\n", "mode", "ms_avg", "peak_mb", "peak/body");
+    for (bool fresh : {false, true})
+    {
+        Result sum;
+        for (int i = 0; i < rounds; ++i)
+        {
+            const Result r = fresh ? run_new(wire, header.size()) : run_old(wire, header.size());
+            if (r.image_bytes != image.size())
+            {
+                std::fprintf(stderr, "image size mismatch\n");
+                return 1;
+            }
+            sum.ms += r.ms;
+            sum.peak = std::max(sum.peak, r.peak);
+        }
+        const double body_bytes = static_cast<double>(wire.size() - header.size());
+        std::printf("%6s %10.1f %12.1f %14.2f\n", fresh ? "new" : "old", sum.ms / rounds,
+                    sum.peak / 1048576.0, sum.peak / body_bytes);
+    }
+    return 0;
+}